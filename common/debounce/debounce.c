@@ -0,0 +1,135 @@
+/*
+ * debounce.c
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <debounce.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <logging.h>
+
+int debounce_init(struct debounce *db, unsigned int count, debounce_cb cb, void *obj)
+{
+	int ret = 0;
+	unsigned int i;
+
+	memset(db, 0, sizeof(*db));
+
+	db->lines = calloc(count, sizeof(*db->lines));
+	if (!db->lines) {
+		log_err("allocation for %u debounce lines failed", count);
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < count; ++i)
+		db->lines[i].stable = -1;
+
+	db->count = count;
+	db->cb = cb;
+	db->obj = obj;
+out:
+	return ret;
+}
+
+void debounce_destroy(struct debounce *db)
+{
+	free(db->lines);
+	db->lines = NULL;
+	db->count = 0;
+}
+
+int debounce_line_setup(struct debounce *db, unsigned int line, unsigned int settle_ms)
+{
+	if (line >= db->count)
+		return -EINVAL;
+
+	db->lines[line].settle_ns = settle_ms * 1000000ULL;
+
+	return 0;
+}
+
+int debounce_line_seed(struct debounce *db, unsigned int line, int level)
+{
+	struct debounce_line *l;
+
+	if (line >= db->count)
+		return -EINVAL;
+
+	l = &db->lines[line];
+	l->stable = !!level;
+	/* a level pending since before is measured against the seed */
+	l->armed = l->armed && l->pending != l->stable;
+
+	return 0;
+}
+
+int debounce_input(struct debounce *db, unsigned int line, int level,
+		   uint64_t timestamp_ns)
+{
+	struct debounce_line *l;
+
+	if (line >= db->count)
+		return -EINVAL;
+
+	l = &db->lines[line];
+	level = !!level;
+
+	/* each change restarts the settle time, back to stable was a glitch */
+	if (l->armed && level == l->pending)
+		return 0;
+
+	l->pending = level;
+	l->since_ns = timestamp_ns;
+	l->armed = level != l->stable;
+
+	return 0;
+}
+
+int64_t debounce_poll(struct debounce *db, uint64_t now_ns)
+{
+	int64_t next = -1;
+	unsigned int i;
+
+	for (i = 0; i < db->count; ++i) {
+		struct debounce_line *l = &db->lines[i];
+		uint64_t deadline;
+		int prev;
+
+		if (!l->armed)
+			continue;
+
+		deadline = l->since_ns + l->settle_ns;
+		if (deadline > now_ns) {
+			if (next < 0 || (int64_t)(deadline - now_ns) < next)
+				next = deadline - now_ns;
+			continue;
+		}
+
+		prev = l->stable;
+		l->stable = l->pending;
+		l->armed = 0;
+
+		if (db->cb)
+			db->cb(i, prev, l->stable, l->since_ns, db->obj);
+	}
+
+	return next;
+}
@@ -0,0 +1,425 @@
+/*
+ * gpio.c
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <gpio.h>
+#include <hw.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <linux/gpio.h>
+#include <logging.h>
+
+int gpio_export(int gpio)
+{
+	int ret = 0;
+	int fd = 0;
+	int len = 0;
+	char buf[20] = { 0 };
+	char path[100] = { 0 };
+	struct stat st;
+
+	snprintf(path, sizeof(path), "/sys/class/gpio/gpio%d", gpio);
+	ret = lstat(path, &st);
+
+	if (ret && errno == ENOENT) {
+		ret = open("/sys/class/gpio/export", O_WRONLY);
+		if (ret < 0) {
+			ret = -errno;
+			log_err("open gpio export failed (%d) %s", ret, strerror(-ret));
+			goto out;
+		}
+
+		fd = ret;
+
+		len = snprintf(buf, sizeof(buf), "%d", gpio);
+		if (len <= 0) {
+			ret = -EINVAL;
+			log_err("create gpio number string failed (%d) %s", ret, strerror(-ret));
+			close(fd);
+			goto out;
+		}
+
+		ret = write(fd, buf, len);
+		if (ret < 0) {
+			ret = -errno;
+			log_err("write to gpio export failed (%d) %s", ret, strerror(-ret));
+		}
+
+		close(fd);
+	} else if (ret) {
+		ret = -errno;
+		log_err("check link %s failed (%d) %s", path, ret, strerror(-ret));
+	} else{
+		log_dbg("gpio %s aleady exported", path);
+	}
+out:
+	return ret < 0 ? ret : 0;
+
+}
+
+static int gpio_write_attr(int gpio, const char *attr, const char *value)
+{
+	int ret = 0;
+	int fd = 0;
+	char path[100] = { 0 };
+
+	snprintf(path, sizeof(path), "/sys/class/gpio/gpio%d/%s", gpio, attr);
+
+	ret = open(path, O_WRONLY);
+	if (ret < 0) {
+		ret = -errno;
+		log_err("open gpio %s failed (%d) %s", attr, ret, strerror(-ret));
+		goto out;
+	}
+
+	fd = ret;
+
+	ret = write(fd, value, strlen(value));
+	if (ret < 0) {
+		ret = -errno;
+		log_err("write to gpio %s failed (%d) %s", attr, ret, strerror(-ret));
+	}
+
+	close(fd);
+
+	log_dbg("set gpio %s \"%s\" to %s", attr, value, path);
+out:
+	return ret < 0 ? ret : 0;
+}
+
+int gpio_set_direction(int gpio, const char *direction)
+{
+	return gpio_write_attr(gpio, "direction", direction);
+}
+
+int gpio_set_edge(int gpio, const char *edge)
+{
+	return gpio_write_attr(gpio, "edge", edge);
+}
+
+int gpio_read(int fd, char *value)
+{
+	int ret = 0;
+
+	lseek(fd, 0, SEEK_SET);
+	ret = read(fd, value, 1);
+	if (ret < 0) {
+		ret = -errno;
+		log_err("read gpio value failed (%d) %s", ret, strerror(-ret));
+	} else if (!ret) {
+		ret = -ENOENT;
+	}
+
+	return ret;
+}
+
+int gpio_open_input(int gpio, const char *edge)
+{
+	int ret = 0;
+	char path[100] = { 0 };
+	char value;
+
+	ret = gpio_export(gpio);
+	if (ret)
+		goto out;
+
+	ret = gpio_set_direction(gpio, "in");
+	if (ret)
+		goto out;
+
+	ret = gpio_set_edge(gpio, edge);
+	if (ret)
+		goto out;
+
+	snprintf(path, sizeof(path), "/sys/class/gpio/gpio%d/value", gpio);
+
+	ret = open(path, O_RDONLY | O_CLOEXEC);
+	if (ret < 0) {
+		ret = -errno;
+		log_err("open gpio value failed (%d) %s", ret, strerror(-ret));
+		goto out;
+	}
+
+	/* clear the pending edge before it is watched */
+	gpio_read(ret, &value);
+out:
+	return ret;
+}
+
+static uint64_t gpio_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#ifdef GPIO_V2_GET_LINE_IOCTL
+static int gpio_cdev_request(unsigned int chip, unsigned int line,
+			     enum gpio_edge edge, unsigned int debounce_us)
+{
+	int ret = 0;
+	int fd;
+	char path[32];
+	struct gpio_v2_line_request req;
+
+	snprintf(path, sizeof(path), "/dev/gpiochip%u", chip);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.offsets[0] = line;
+	req.num_lines = 1;
+	strncpy(req.consumer, "gardenctl", sizeof(req.consumer) - 1);
+
+	req.config.flags = GPIO_V2_LINE_FLAG_INPUT;
+	if (edge & GPIO_EDGE_RISING)
+		req.config.flags |= GPIO_V2_LINE_FLAG_EDGE_RISING;
+	if (edge & GPIO_EDGE_FALLING)
+		req.config.flags |= GPIO_V2_LINE_FLAG_EDGE_FALLING;
+
+	if (debounce_us) {
+		req.config.num_attrs = 1;
+		req.config.attrs[0].mask = 1;
+		req.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_DEBOUNCE;
+		req.config.attrs[0].attr.debounce_period_us = debounce_us;
+	}
+
+	ret = ioctl(fd, GPIO_V2_GET_LINE_IOCTL, &req);
+	if (ret < 0) {
+		ret = -errno;
+		log_err("request line %u of %s failed (%d) %s", line, path, ret,
+			strerror(-ret));
+	} else {
+		ret = req.fd;
+	}
+
+	close(fd);
+out:
+	return ret;
+}
+
+static int gpio_cdev_get(int fd)
+{
+	struct gpio_v2_line_values values;
+	int ret;
+
+	memset(&values, 0, sizeof(values));
+	values.mask = 1;
+
+	if (ioctl(fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values) < 0) {
+		ret = -errno;
+		log_err("read gpio line value failed (%d) %s", ret, strerror(-ret));
+		return ret;
+	}
+
+	return values.bits & 1;
+}
+
+static int gpio_cdev_read(struct gpio_input *in, struct gpio_event *evs,
+			  size_t count)
+{
+	struct gpio_v2_line_event buf[16];
+	ssize_t len;
+	size_t i, n;
+	int ret;
+
+	if (count > sizeof(buf) / sizeof(buf[0]))
+		count = sizeof(buf) / sizeof(buf[0]);
+
+	len = read(in->fd, buf, count * sizeof(buf[0]));
+	if (len < 0) {
+		ret = -errno;
+		if (ret == -EAGAIN)
+			return 0;
+		log_err("read gpio line events failed (%d) %s", ret, strerror(-ret));
+		return ret;
+	}
+
+	n = len / sizeof(buf[0]);
+	for (i = 0; i < n; ++i) {
+		evs[i].value = buf[i].id == GPIO_V2_LINE_EVENT_RISING_EDGE;
+		evs[i].timestamp_ns = buf[i].timestamp_ns;
+	}
+
+	return n;
+}
+#else
+static int gpio_cdev_request(unsigned int chip, unsigned int line,
+			     enum gpio_edge edge, unsigned int debounce_us)
+{
+	return -ENOTSUP;
+}
+
+static int gpio_cdev_get(int fd)
+{
+	return -ENOTSUP;
+}
+
+static int gpio_cdev_read(struct gpio_input *in, struct gpio_event *evs,
+			  size_t count)
+{
+	return -ENOTSUP;
+}
+#endif
+
+static void gpio_fd_close(struct gpio_input *in)
+{
+	close(in->fd);
+}
+
+static int gpio_cdev_open(struct gpio_input *in, unsigned int chip,
+			  unsigned int line, enum gpio_edge edge,
+			  unsigned int debounce_us)
+{
+	int ret = 0;
+
+	ret = gpio_cdev_request(chip, line, edge, debounce_us);
+	if (ret < 0)
+		goto out;
+
+	in->fd = ret;
+	in->events = EPOLLIN;
+	in->debounced = debounce_us > 0;
+	/* edges come after the request, the level before them is read */
+	ret = gpio_cdev_get(in->fd);
+	in->level = ret < 0 ? -1 : ret;
+	ret = 0;
+out:
+	return ret;
+}
+
+const struct hw_gpio_ops hw_gpio_cdev_ops = {
+	.name = "cdev",
+	.open = gpio_cdev_open,
+	.read = gpio_cdev_read,
+	.close = gpio_fd_close,
+};
+
+static const char *gpio_edge_name(enum gpio_edge edge)
+{
+	switch (edge) {
+	case GPIO_EDGE_RISING:
+		return "rising";
+	case GPIO_EDGE_FALLING:
+		return "falling";
+	default:
+		return "both";
+	}
+}
+
+/* the line of the first gpiochip is the sysfs gpio of the same number */
+static int gpio_sysfs_open(struct gpio_input *in, unsigned int chip,
+			   unsigned int line, enum gpio_edge edge,
+			   unsigned int debounce_us)
+{
+	int ret = 0;
+	char value;
+
+	ret = gpio_open_input(line, gpio_edge_name(edge));
+	if (ret < 0)
+		goto out;
+
+	in->fd = ret;
+	in->events = EPOLLPRI | EPOLLERR;
+	in->debounced = false;
+	in->level = gpio_read(in->fd, &value) < 0 ? -1 : value == '1';
+	ret = 0;
+out:
+	return ret;
+}
+
+static int gpio_sysfs_read(struct gpio_input *in, struct gpio_event *evs,
+			   size_t count)
+{
+	int ret = 0;
+	char value;
+
+	ret = gpio_read(in->fd, &value);
+	if (ret < 0)
+		goto out;
+
+	evs[0].value = value == '1';
+	evs[0].timestamp_ns = gpio_now_ns();
+	ret = 1;
+out:
+	return ret;
+}
+
+const struct hw_gpio_ops hw_gpio_sysfs_ops = {
+	.name = "sysfs",
+	.open = gpio_sysfs_open,
+	.read = gpio_sysfs_read,
+	.close = gpio_fd_close,
+};
+
+int gpio_input_open(struct gpio_input *in, unsigned int chip, unsigned int line,
+		    enum gpio_edge edge, unsigned int debounce_us)
+{
+	int ret = -ENODEV;
+	const struct hw_backend *backend = hw_get_backend();
+	int i;
+
+	in->fd = -1;
+	in->level = -1;
+	in->ops = NULL;
+
+	for (i = 0; i < HW_GPIO_OPS_MAX && backend->gpio[i]; ++i) {
+		ret = backend->gpio[i]->open(in, chip, line, edge, debounce_us);
+		if (!ret) {
+			in->ops = backend->gpio[i];
+			break;
+		}
+
+		log_dbg("gpio %u: no %s line events (%d)", line,
+			backend->gpio[i]->name, ret);
+	}
+
+	return ret;
+}
+
+void gpio_input_close(struct gpio_input *in)
+{
+	if (in->fd >= 0 && in->ops)
+		in->ops->close(in);
+	in->fd = -1;
+	in->ops = NULL;
+}
+
+int gpio_input_read(struct gpio_input *in, struct gpio_event *evs, size_t count)
+{
+	if (!count)
+		return 0;
+
+	return in->ops->read(in, evs, count);
+}
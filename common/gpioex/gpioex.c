@@ -28,91 +28,133 @@
 #include <pthread.h>
 #include <logging.h>
 #include <string.h>
-#include <linux/i2c-dev.h>
-#include <sys/ioctl.h>
+#include <hw.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <time.h>
 
-static pthread_mutex_t lock;
+/* guards the output map and shadows, taken before a bus lock */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
 #define GPIOEX_BUS_1			0x01
 #define GPIOEX_ADDR_BARREL_LVL		0x20
-#define GPIOEX_ADDR_230V		0x21
-#define GPIOEX_ADDR_24V			0x22
-#define GPIOEX_ADDR_12V			0x23
 
-/* 24V relays */
-#define GPIOEX_BIT_TAP			0x08
-#define GPIOEX_BIT_BARREL		0x04
-#define GPIOEX_BIT_YARD_LEFT		0x10
-#define GPIOEX_BIT_YARD_RIGHT		0x20
-#define GPIOEX_BIT_YARD_FRONT		0x40
-#define GPIOEX_BIT_YARD_BACK		0x80
+/*
+ * bus fds stay open, the slave address is only switched when it changes.
+ * Expanders of a bus share fd and address, so a transfer locks its bus.
+ */
+struct gpioex_bus {
+	pthread_mutex_t lock;
+	int fd;
+	int addr;
+};
 
-#define GPIOEX_BIT_YARD	(GPIOEX_BIT_YARD_LEFT | GPIOEX_BIT_YARD_RIGHT | \
-			 GPIOEX_BIT_YARD_FRONT | GPIOEX_BIT_YARD_BACK)
+static struct gpioex_bus buses[GPIOEX_BUS_COUNT] = {
+	{ .lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1, .addr = -1 },
+	{ .lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1, .addr = -1 },
+};
 
-#define GPIOEX_BIT_PUMP_VALVES	(GPIOEX_BIT_YARD | GPIOEX_BIT_TAP | \
-				 GPIOEX_BIT_BARREL)
+/* updated under different bus locks */
+static struct gpioex_stats stats;
 
-/* 230V relays */
-#define GPIOEX_BIT_PUMP			0x80
-#define GPIOEX_BIT_LIGHT_TREE		0x08
-#define GPIOEX_BIT_LIGHT_HOUSE		0x04
+#define gpioex_stat_add(__field, __n) \
+	__atomic_fetch_add(&stats.__field, __n, __ATOMIC_RELAXED)
 
-/* 12V relays */
-#define GPIOEX_BIT_DROPPIPE_PUMP	0x80
-#define GPIOEX_BIT_LIGHT_TAP		0x20
+/* last valid barrel level, read without a lock */
+static uint64_t barrel_snapshot;
 
-static int gpioex_set_gpio(uint8_t bus, uint8_t addr, uint8_t value)
-{
-	int ret = 0;
-	int fd;
-	char filename[20];
+/* outputs switched on by the last write, read without a lock */
+static gpioex_mask_t state_snapshot;
 
-	memset(filename, 0, sizeof(filename));
+/* gpio wired to the INT line of the barrel expander, outputs raise no INT */
+static int barrel_irq = -1;
 
-	sprintf(filename, "/dev/i2c-%d", bus);
+#define GPIOEX_SNAPSHOT_VALID		0x100
+#define GPIOEX_SNAPSHOT_TIME_SHIFT	16
 
-	ret = open(filename, O_RDWR);
-	if (ret < 0) {
-		log_err("open %s failed (%d) %s", filename, ret, strerror(ret));
-		goto out;
+static void gpioex_bus_close(struct gpioex_bus *bus)
+{
+	if (bus->fd >= 0) {
+		hw_i2c_close(bus->fd);
+		gpioex_stat_add(syscalls, 1);
+		gpioex_stat_add(closes, 1);
 	}
 
-	fd = ret;
+	bus->fd = -1;
+	bus->addr = -1;
+}
 
-	ret = ioctl(fd, I2C_SLAVE, addr);
-	if (ret < 0) {
-		log_err("set address to %s failed (%d) %s", filename, ret,
-			strerror(ret));
-		goto out_close;
+static int gpioex_bus_lock(uint8_t busnr, struct gpioex_bus **bus)
+{
+	if (busnr >= GPIOEX_BUS_COUNT) {
+		log_err("invalid i2c bus %d", busnr);
+		return -EINVAL;
 	}
 
-	ret = write(fd, &value, 1);
-	if (ret < 0) {
-		log_err("write to %s failed (%d) %s", filename, ret,
-			strerror(ret));
-		goto out_close;
-	} else if (!ret) {
-		log_err("write to %s failed (0 bytes written)", filename);
-		ret = -EIO;
-		goto out_close;
+	pthread_mutex_lock(&buses[busnr].lock);
+	*bus = &buses[busnr];
+
+	return 0;
+}
+
+/* the bus is locked by the caller */
+static int gpioex_bus_open(uint8_t busnr, struct gpioex_bus **bus)
+{
+	int ret = 0;
+	struct gpioex_bus *b = &buses[busnr];
+
+	if (b->fd < 0) {
+		gpioex_stat_add(syscalls, 1);
+		ret = hw_i2c_open(busnr);
+		if (ret < 0) {
+			log_err("open /dev/i2c-%d failed (%d) %s", busnr, ret, strerror(-ret));
+			goto out;
+		}
+
+		b->fd = ret;
+		b->addr = -1;
+		gpioex_stat_add(opens, 1);
 	}
 
-	log_dbg("i2c write: addr: %d val: %02X", addr, value);
+	*bus = b;
 	ret = 0;
+out:
+	return ret;
+}
+
+static int gpioex_bus_get(uint8_t busnr, uint8_t addr, struct gpioex_bus **bus)
+{
+	int ret = 0;
+	struct gpioex_bus *b;
+
+	ret = gpioex_bus_open(busnr, &b);
+	if (ret)
+		goto out;
+
+	if (b->addr != addr) {
+		gpioex_stat_add(syscalls, 1);
+		ret = hw_i2c_set_addr(b->fd, addr);
+		if (ret < 0) {
+			log_err("set address to /dev/i2c-%d failed (%d) %s", busnr,
+				ret, strerror(-ret));
+			b->addr = -1;
+			goto out;
+		}
 
-out_close:
-	close(fd);
+		b->addr = addr;
+		gpioex_stat_add(addr_switches, 1);
+	}
+
+	*bus = b;
+	ret = 0;
 out:
 	return ret;
 }
 
-static int gpioex_get_gpio(uint8_t bus, uint8_t addr, uint8_t *value)
+static int gpioex_get_gpio(uint8_t busnr, uint8_t addr, uint8_t *value)
 {
 	int ret = 0;
-	int fd;
-	char filename[20];
+	struct gpioex_bus *bus;
 
 	if (!value) {
 		log_err("value points to NULL");
@@ -120,211 +162,761 @@ static int gpioex_get_gpio(uint8_t bus, uint8_t addr, uint8_t *value)
 		goto out;
 	}
 
-	memset(filename, 0, sizeof(filename));
-	sprintf(filename, "/dev/i2c-%d", bus);
-
-	ret = open(filename, O_RDWR);
-	if (ret < 0) {
-		log_err("open %s failed (%d) %s", filename, ret, strerror(ret));
+	ret = gpioex_bus_lock(busnr, &bus);
+	if (ret)
 		goto out;
-	}
 
-	fd = ret;
+	ret = gpioex_bus_get(busnr, addr, &bus);
+	if (ret)
+		goto out_unlock;
 
-	ret = ioctl(fd, I2C_SLAVE, addr);
-	if (ret < 0) {
-		log_err("set address to %s failed (%d) %s", filename, ret,
-			strerror(ret));
-		goto out_close;
-	}
+	gpioex_stat_add(transfers, 1);
+	gpioex_stat_add(syscalls, 1);
 
-	ret = read(fd, value, 1);
+	ret = hw_i2c_read(bus->fd, value);
 	if (ret < 0) {
-		log_err("read from %s failed (%d) %s", filename, ret,
-			strerror(ret));
-		goto out_close;
+		log_err("read from /dev/i2c-%d failed (%d) %s", busnr, ret,
+			strerror(-ret));
+		goto out_reset;
 	} else if (!ret) {
-		log_err("read from %s failed (0 bytes read)", filename);
+		log_err("read from /dev/i2c-%d failed (0 bytes read)", busnr);
 		ret = -EIO;
-		goto out_close;
+		goto out_reset;
 	}
 
 	log_dbg("i2c read addr: %d: %02X", addr, *value);
 
 	ret = 0;
+	goto out_unlock;
 
-out_close:
-	close(fd);
+out_reset:
+	bus->addr = -1;
+out_unlock:
+	pthread_mutex_unlock(&bus->lock);
 out:
 	return ret;
 }
 
-static int gpioex_disable_all(void)
+#define GPIOEX_MAX_REGS			16
+#define GPIOEX_MAX_GROUPS		8
+
+/* the garden as wired before outputs became configurable, ids follow the array */
+static const struct gpioex_output default_outputs[] = {
+	[GPIOEX_ID_TAP]		  = { "tap",		GPIOEX_BUS_1, 0x22, 3, true, "pump" },
+	[GPIOEX_ID_YARD_LEFT]	  = { "yard_left",	GPIOEX_BUS_1, 0x22, 4, true, "pump" },
+	[GPIOEX_ID_YARD_RIGHT]	  = { "yard_right",	GPIOEX_BUS_1, 0x22, 5, true, "pump" },
+	[GPIOEX_ID_YARD_FRONT]	  = { "yard_front",	GPIOEX_BUS_1, 0x22, 6, true, "pump" },
+	[GPIOEX_ID_YARD_BACK]	  = { "yard_back",	GPIOEX_BUS_1, 0x22, 7, true, "pump" },
+	[GPIOEX_ID_DROPPIPE_PUMP] = { "droppipe_pump",	GPIOEX_BUS_1, 0x23, 7, true, NULL },
+	[GPIOEX_ID_BARREL]	  = { "barrel",		GPIOEX_BUS_1, 0x22, 2, true, "pump" },
+	[GPIOEX_ID_LIGHT_TREE]	  = { "light_tree",	GPIOEX_BUS_1, 0x21, 3, true, NULL },
+	[GPIOEX_ID_LIGHT_HOUSE]	  = { "light_house",	GPIOEX_BUS_1, 0x21, 2, true, NULL },
+	[GPIOEX_ID_LIGHT_TAP]	  = { "light_tap",	GPIOEX_BUS_1, 0x23, 5, true, NULL },
+	[GPIOEX_ID_PUMP]	  = { "pump",		GPIOEX_BUS_1, 0x21, 7, true, NULL },
+};
+
+#define GPIOEX_DEFAULT_OUTPUTS (sizeof(default_outputs) / sizeof(default_outputs[0]))
+
+/*
+ * Write-through copy of an output expander. The outputs are only written
+ * by gpioex, so bits are changed on the copy and written with one transfer.
+ */
+struct gpioex_shadow {
+	uint8_t bus;
+	uint8_t addr;
+	uint8_t value;
+	/* all outputs off, pins without an output stay high */
+	uint8_t idle;
+	uint8_t mapped;
+	int valid;
+};
+
+/*
+ * The output map flattened to tables indexed by output id, switching an
+ * output is a lookup whatever the size of the map.
+ */
+struct gpioex_map {
+	char names[GPIOEX_MAX_OUTPUTS][GPIOEX_NAME_MAX];
+	uint8_t reg[GPIOEX_MAX_OUTPUTS];
+	uint8_t mask[GPIOEX_MAX_OUTPUTS];
+	bool active_low[GPIOEX_MAX_OUTPUTS];
+	gpioex_mask_t outputs;
+
+	/* an interlock output runs while any of its members is on */
+	int group_count;
+	uint8_t group_driver[GPIOEX_MAX_GROUPS];
+	gpioex_mask_t group_members[GPIOEX_MAX_GROUPS];
+	gpioex_mask_t drivers;
+
+	int reg_count;
+	struct gpioex_shadow regs[GPIOEX_MAX_REGS];
+};
+
+static struct gpioex_map map;
+
+#define gpioex_for_each_id(__id, __mask, __tmp) \
+	for (__tmp = (__mask); \
+	     __tmp && ((__id = __builtin_ctzll(__tmp)), 1); \
+	     __tmp &= __tmp - 1)
+
+static int gpioex_map_find(const char *name)
+{
+	gpioex_mask_t tmp;
+	int id;
+
+	gpioex_for_each_id(id, map.outputs, tmp) {
+		if (!strcmp(map.names[id], name))
+			return id;
+	}
+
+	return -ENOENT;
+}
+
+static int gpioex_map_add_reg(uint8_t bus, uint8_t addr)
+{
+	int i;
+
+	for (i = 0; i < map.reg_count; ++i) {
+		if (map.regs[i].bus == bus && map.regs[i].addr == addr)
+			return i;
+	}
+
+	if (map.reg_count >= GPIOEX_MAX_REGS) {
+		log_err("too many output expanders (max %d)", GPIOEX_MAX_REGS);
+		return -ENOSPC;
+	}
+
+	/* sorted by bus and address, that's the order of a full write */
+	for (i = map.reg_count; i > 0; --i) {
+		struct gpioex_shadow *prev = &map.regs[i - 1];
+
+		if (prev->bus < bus || (prev->bus == bus && prev->addr < addr))
+			break;
+
+		map.regs[i] = *prev;
+	}
+
+	memset(&map.regs[i], 0, sizeof(map.regs[i]));
+	map.regs[i].bus = bus;
+	map.regs[i].addr = addr;
+	map.regs[i].idle = 0xFF;
+	++map.reg_count;
+
+	return i;
+}
+
+static int gpioex_map_add_output(const struct gpioex_output *output, int id)
 {
 	int ret = 0;
+	int reg;
 
-	ret = gpioex_set_gpio(GPIOEX_BUS_1, GPIOEX_ADDR_230V, 0xFF);
-	if (ret)
+	if (!output->name || !output->name[0] ||
+	    strlen(output->name) >= GPIOEX_NAME_MAX) {
+		log_err("invalid output name");
+		ret = -EINVAL;
 		goto out;
+	}
 
-	ret = gpioex_set_gpio(GPIOEX_BUS_1, GPIOEX_ADDR_24V, 0xFF);
-	if (ret)
+	if (gpioex_map_find(output->name) >= 0) {
+		log_err("output %s defined twice", output->name);
+		ret = -EINVAL;
 		goto out;
+	}
 
-	ret = gpioex_set_gpio(GPIOEX_BUS_1, GPIOEX_ADDR_12V, 0xFF);
-	if (ret)
+	if (output->bus >= GPIOEX_BUS_COUNT || output->addr < 0x03 ||
+	    output->addr > 0x77 || output->bit > 7) {
+		log_err("output %s: invalid bus %d address 0x%02X bit %d",
+			output->name, output->bus, output->addr, output->bit);
+		ret = -EINVAL;
 		goto out;
+	}
 
-	return 0;
+	reg = gpioex_map_add_reg(output->bus, output->addr);
+	if (reg < 0) {
+		ret = reg;
+		goto out;
+	}
+
+	strcpy(map.names[id], output->name);
+	map.mask[id] = 1 << output->bit;
+	map.active_low[id] = output->active_low;
+	map.outputs |= GPIOEX_OUTPUT(id);
 out:
 	return ret;
 }
 
-int gpioex_init(void)
+static int gpioex_map_add_interlock(const struct gpioex_output *output, int id)
 {
-	int ret = 0;
+	int driver;
+	int i;
+
+	driver = gpioex_map_find(output->interlock);
+	if (driver < 0 || driver == id) {
+		log_err("output %s: invalid interlock %s", output->name,
+			output->interlock);
+		return -EINVAL;
+	}
 
-	ret = pthread_mutex_init(&lock, NULL);
-	if (ret) {
-		log_err("initiate mutex failed (%d) %s", ret, strerror(ret));
-		goto out;
+	for (i = 0; i < map.group_count; ++i) {
+		if (map.group_driver[i] == driver)
+			break;
 	}
 
-	ret = gpioex_disable_all();
+	if (i == map.group_count) {
+		if (map.group_count >= GPIOEX_MAX_GROUPS) {
+			log_err("too many interlocks (max %d)", GPIOEX_MAX_GROUPS);
+			return -ENOSPC;
+		}
 
-out:
-	return ret;
+		map.group_driver[i] = driver;
+		map.group_members[i] = 0;
+		++map.group_count;
+	}
+
+	map.group_members[i] |= GPIOEX_OUTPUT(id);
+	map.drivers |= GPIOEX_OUTPUT(driver);
+
+	return 0;
 }
 
-static int gpioex_set_valves_and_pump(uint8_t valves_value)
+static int gpioex_map_next_id(void)
+{
+	int i;
+
+	/* ids of the built-in outputs go last */
+	for (i = 0; i < GPIOEX_MAX_OUTPUTS; ++i) {
+		int id = (i + GPIOEX_ID_COUNT) % GPIOEX_MAX_OUTPUTS;
+
+		if (!(map.outputs & GPIOEX_OUTPUT(id)))
+			return id;
+	}
+
+	return -ENOSPC;
+}
+
+static int gpioex_map_build(const struct gpioex_output *outputs, size_t count)
 {
 	int ret = 0;
+	int ids[GPIOEX_MAX_OUTPUTS];
+	gpioex_mask_t members = 0;
+	size_t i;
+	int id;
 
-	if ((valves_value & GPIOEX_BIT_PUMP_VALVES) == GPIOEX_BIT_PUMP_VALVES) {
-		uint8_t val230v;
+	memset(&map, 0, sizeof(map));
 
-		ret = gpioex_get_gpio(GPIOEX_BUS_1, GPIOEX_ADDR_230V, &val230v);
-		if (ret)
-			goto out;
+	if (count > GPIOEX_MAX_OUTPUTS) {
+		log_err("too many outputs (max %d)", GPIOEX_MAX_OUTPUTS);
+		ret = -EINVAL;
+		goto out;
+	}
 
-		val230v |= GPIOEX_BIT_PUMP;
+	/* outputs of the built-in map keep their id */
+	for (i = 0; i < count; ++i) {
+		ids[i] = -1;
 
-		ret = gpioex_set_gpio(GPIOEX_BUS_1, GPIOEX_ADDR_230V, val230v);
-		if (ret)
-			goto out;
+		for (id = 0; id < GPIOEX_ID_COUNT; ++id) {
+			if (outputs[i].name &&
+			    !strcmp(outputs[i].name, default_outputs[id].name))
+				break;
+		}
 
-		log_dbg("pump disabled");
+		if (id == GPIOEX_ID_COUNT || gpioex_map_find(outputs[i].name) >= 0)
+			continue;
 
-		ret = gpioex_set_gpio(GPIOEX_BUS_1, GPIOEX_ADDR_24V,
-				      valves_value);
+		ret = gpioex_map_add_output(&outputs[i], id);
 		if (ret)
 			goto out;
-	} else {
-		uint8_t val230v;
 
-		ret = gpioex_set_gpio(GPIOEX_BUS_1, GPIOEX_ADDR_24V,
-				      valves_value);
+		ids[i] = id;
+	}
+
+	for (i = 0; i < count; ++i) {
+		if (ids[i] >= 0)
+			continue;
+
+		id = gpioex_map_next_id();
+		ret = gpioex_map_add_output(&outputs[i], id);
 		if (ret)
 			goto out;
 
-		ret = gpioex_get_gpio(GPIOEX_BUS_1, GPIOEX_ADDR_230V, &val230v);
+		ids[i] = id;
+	}
+
+	for (i = 0; i < count; ++i) {
+		if (!outputs[i].interlock || !outputs[i].interlock[0])
+			continue;
+
+		ret = gpioex_map_add_interlock(&outputs[i], ids[i]);
 		if (ret)
 			goto out;
 
-		val230v &= ~GPIOEX_BIT_PUMP;
+		members |= GPIOEX_OUTPUT(ids[i]);
+	}
 
-		ret = gpioex_set_gpio(GPIOEX_BUS_1, GPIOEX_ADDR_230V, val230v);
-		if (ret)
+	if (members & map.drivers) {
+		log_err("interlock outputs can't have an interlock");
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* the registers are final, resolve the outputs to them */
+	for (i = 0; i < count; ++i) {
+		struct gpioex_shadow *shadow;
+
+		id = ids[i];
+		map.reg[id] = gpioex_map_add_reg(outputs[i].bus, outputs[i].addr);
+		shadow = &map.regs[map.reg[id]];
+
+		if (shadow->mapped & map.mask[id]) {
+			log_err("output %s: bit %d of 0x%02X already in use",
+				outputs[i].name, outputs[i].bit, outputs[i].addr);
+			ret = -EINVAL;
 			goto out;
-		log_dbg("pump enabled");
+		}
+
+		shadow->mapped |= map.mask[id];
+		if (!map.active_low[id])
+			shadow->idle &= ~map.mask[id];
+	}
+out:
+	if (ret)
+		memset(&map, 0, sizeof(map));
+	return ret;
+}
+
+static int gpioex_get_output(int reg, uint8_t *value)
+{
+	int ret = 0;
+	struct gpioex_shadow *shadow = &map.regs[reg];
+
+	if (shadow->valid) {
+		*value = shadow->value;
+		goto out;
 	}
 
+	/* unknown after a failed write, take the state of the expander */
+	ret = gpioex_get_gpio(shadow->bus, shadow->addr, value);
+	if (!ret) {
+		shadow->value = *value;
+		shadow->valid = 1;
+	}
 out:
 	return ret;
 }
 
-#define GPIOEX_SET_BIT(__addr, __bit, __val, __ret, __out) do { \
-		uint8_t val; \
-		__ret = gpioex_get_gpio(GPIOEX_BUS_1, __addr, &val); \
-		if (__ret) \
-			goto __out; \
-		if (!__val) \
-			val |= GPIOEX_BIT_ ## __bit; \
-		else \
-			val &= ~GPIOEX_BIT_ ## __bit; \
-		__ret = gpioex_set_gpio(GPIOEX_BUS_1, __addr, val); \
-		if (__ret) \
-			goto __out; \
-} while (0)
+#define GPIOEX_TX_MAX_MSGS		(2 * GPIOEX_MAX_REGS)
 
-int gpioex_set(uint32_t gpio, int value)
+/*
+ * Writes to several expanders, submitted with one I2C_RDWR per bus.
+ * The messages go out in the order they were added.
+ */
+struct gpioex_tx {
+	int count;
+	uint8_t regs[GPIOEX_TX_MAX_MSGS];
+	struct i2c_msg msgs[GPIOEX_TX_MAX_MSGS];
+	uint8_t values[GPIOEX_TX_MAX_MSGS];
+};
+
+static void gpioex_tx_init(struct gpioex_tx *tx)
+{
+	memset(tx, 0, sizeof(*tx));
+}
+
+static int gpioex_tx_write(struct gpioex_tx *tx, int reg, uint8_t value)
+{
+	struct i2c_msg *msg;
+
+	if (tx->count >= GPIOEX_TX_MAX_MSGS) {
+		log_err("too many writes in i2c transaction");
+		return -ENOSPC;
+	}
+
+	tx->regs[tx->count] = reg;
+	tx->values[tx->count] = value;
+
+	msg = &tx->msgs[tx->count];
+	msg->addr = map.regs[reg].addr;
+	msg->flags = 0;
+	msg->len = 1;
+	msg->buf = &tx->values[tx->count];
+
+	++tx->count;
+
+	return 0;
+}
+
+static int gpioex_tx_submit(uint8_t busnr, struct i2c_msg *msgs, int count)
+{
+	int ret = 0;
+	struct gpioex_bus *bus;
+
+	ret = gpioex_bus_lock(busnr, &bus);
+	if (ret)
+		goto out;
+
+	ret = gpioex_bus_open(busnr, &bus);
+	if (ret)
+		goto out_unlock;
+
+	gpioex_stat_add(transfers, count);
+	gpioex_stat_add(syscalls, 1);
+
+	ret = hw_i2c_rdwr(bus->fd, msgs, count);
+	if (ret < 0) {
+		log_err("write to /dev/i2c-%d failed (%d) %s", busnr, ret,
+			strerror(-ret));
+	} else if (ret != count) {
+		log_err("write to /dev/i2c-%d failed (%d of %d messages written)",
+			busnr, ret, count);
+		ret = -EIO;
+	} else {
+		ret = 0;
+	}
+out_unlock:
+	pthread_mutex_unlock(&bus->lock);
+out:
+	return ret;
+}
+
+static int gpioex_tx_commit(struct gpioex_tx *tx)
 {
 	int ret = 0;
-	int set_valves = 0;
-	uint8_t valves_value;
+	int first, last;
+	int i;
+
+	for (first = 0; first < tx->count; first = last) {
+		uint8_t busnr = map.regs[tx->regs[first]].bus;
+
+		for (last = first + 1; last < tx->count; ++last) {
+			if (map.regs[tx->regs[last]].bus != busnr)
+				break;
+		}
+
+		ret = gpioex_tx_submit(busnr, &tx->msgs[first], last - first);
+
+		/* the bus stops at the first failing message, which one is unknown */
+		if (ret)
+			last = tx->count;
+
+		for (i = first; i < last; ++i) {
+			struct gpioex_shadow *shadow = &map.regs[tx->regs[i]];
 
-	log_dbg("gpioex set: gpio: %08X val: %d", gpio, value);
+			if (!ret)
+				log_dbg("i2c write: addr: %d val: %02X",
+					shadow->addr, tx->values[i]);
+
+			shadow->value = tx->values[i];
+			shadow->valid = !ret;
+		}
+	}
+
+	return ret;
+}
+
+static int gpioex_set_output(int reg, uint8_t value)
+{
+	struct gpioex_tx tx;
+
+	gpioex_tx_init(&tx);
+	gpioex_tx_write(&tx, reg, value);
+
+	return gpioex_tx_commit(&tx);
+}
+
+static int gpioex_disable_all(void)
+{
+	struct gpioex_tx tx;
+	int i;
+
+	gpioex_tx_init(&tx);
+	for (i = 0; i < map.reg_count; ++i)
+		gpioex_tx_write(&tx, i, map.regs[i].idle);
+
+	return gpioex_tx_commit(&tx);
+}
+
+int gpioex_init(const struct gpioex_output *outputs, size_t count)
+{
+	int ret = 0;
+	int i;
 
 	pthread_mutex_lock(&lock);
 
-	ret = gpioex_get_gpio(GPIOEX_BUS_1, GPIOEX_ADDR_24V, &valves_value);
-	if (ret < 0)
+	/* a new init starts from closed buses and unknown outputs */
+	for (i = 0; i < GPIOEX_BUS_COUNT; ++i) {
+		pthread_mutex_lock(&buses[i].lock);
+		gpioex_bus_close(&buses[i]);
+		pthread_mutex_unlock(&buses[i].lock);
+	}
+
+	__atomic_store_n(&barrel_snapshot, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&state_snapshot, 0, __ATOMIC_RELEASE);
+
+	if (!outputs) {
+		outputs = default_outputs;
+		count = GPIOEX_DEFAULT_OUTPUTS;
+	}
+
+	ret = gpioex_map_build(outputs, count);
+	if (ret)
 		goto out;
 
-	if (gpio & GPIOEX_TAP) {
-		if (!value)
-			valves_value |= GPIOEX_BIT_TAP;
-		else
-			valves_value &= ~GPIOEX_BIT_TAP;
-		set_valves = 1;
+	log_dbg("gpioex: %zu outputs on %d expanders", count, map.reg_count);
+
+	ret = gpioex_disable_all();
+
+out:
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+int gpioex_output_id(const char *name)
+{
+	if (!name)
+		return -EINVAL;
+
+	return gpioex_map_find(name);
+}
+
+const char *gpioex_output_name(int id)
+{
+	if (id < 0 || id >= GPIOEX_MAX_OUTPUTS || !(map.outputs & GPIOEX_OUTPUT(id)))
+		return NULL;
+
+	return map.names[id];
+}
+
+static int gpioex_get_regs(uint8_t *regs)
+{
+	int ret = 0;
+	int i;
+
+	for (i = 0; i < map.reg_count; ++i) {
+		ret = gpioex_get_output(i, &regs[i]);
+		if (ret)
+			break;
+	}
+
+	return ret;
+}
+
+static gpioex_mask_t gpioex_regs_to_state(const uint8_t *regs)
+{
+	gpioex_mask_t state = 0;
+	gpioex_mask_t tmp;
+	int id;
+
+	gpioex_for_each_id(id, map.outputs, tmp) {
+		bool high = regs[map.reg[id]] & map.mask[id];
+
+		if (high != map.active_low[id])
+			state |= GPIOEX_OUTPUT(id);
 	}
 
-	if (gpio & GPIOEX_BARREL) {
-		if (!value)
-			valves_value |= GPIOEX_BIT_BARREL;
+	return state;
+}
+
+static void gpioex_state_to_regs(gpioex_mask_t state, uint8_t *regs)
+{
+	gpioex_mask_t tmp;
+	int id;
+
+	gpioex_for_each_id(id, map.outputs, tmp) {
+		bool on = state & GPIOEX_OUTPUT(id);
+
+		if (on != map.active_low[id])
+			regs[map.reg[id]] |= map.mask[id];
 		else
-			valves_value &= ~GPIOEX_BIT_BARREL;
-		set_valves = 1;
-	}
-
-	if (gpio & GPIOEX_YARD) {
-		valves_value |= GPIOEX_BIT_YARD;
-		if (value) {
-			if (gpio & GPIOEX_YARD_LEFT)
-				valves_value &= ~GPIOEX_BIT_YARD_LEFT;
-			if (gpio & GPIOEX_YARD_RIGHT)
-				valves_value &= ~GPIOEX_BIT_YARD_RIGHT;
-			if (gpio & GPIOEX_YARD_FRONT)
-				valves_value &= ~GPIOEX_BIT_YARD_FRONT;
-			if (gpio & GPIOEX_YARD_BACK)
-				valves_value &= ~GPIOEX_BIT_YARD_BACK;
-		}
+			regs[map.reg[id]] &= ~map.mask[id];
+	}
+}
+
+/* an interlock output runs whenever one of its members is on */
+static gpioex_mask_t gpioex_interlock(gpioex_mask_t state)
+{
+	int i;
+
+	state &= ~map.drivers;
 
-		set_valves = 1;
+	for (i = 0; i < map.group_count; ++i) {
+		if (state & map.group_members[i])
+			state |= GPIOEX_OUTPUT(map.group_driver[i]);
 	}
 
-	if (set_valves) {
-		ret = gpioex_set_valves_and_pump(valves_value);
-		if (ret)
-			goto out;
+	return state;
+}
+
+static uint32_t gpioex_state_regs(gpioex_mask_t state)
+{
+	uint32_t regs = 0;
+	gpioex_mask_t tmp;
+	int id;
+
+	gpioex_for_each_id(id, state, tmp)
+		regs |= 1U << map.reg[id];
+
+	return regs;
+}
+
+static gpioex_mask_t gpioex_group_members(gpioex_mask_t drivers)
+{
+	gpioex_mask_t members = 0;
+	int i;
+
+	for (i = 0; i < map.group_count; ++i) {
+		if (drivers & GPIOEX_OUTPUT(map.group_driver[i]))
+			members |= map.group_members[i];
 	}
 
-	if (gpio & GPIOEX_DROPPIPE_PUMP)
-		GPIOEX_SET_BIT(GPIOEX_ADDR_12V, DROPPIPE_PUMP, value, ret, out);
+	return members;
+}
 
-	if (gpio & GPIOEX_LIGHT_TREE)
-		GPIOEX_SET_BIT(GPIOEX_ADDR_230V, LIGHT_TREE, value, ret, out);
+static int gpioex_tx_reg(struct gpioex_tx *tx, int reg, uint8_t *last,
+			 uint8_t value)
+{
+	int ret = 0;
 
-	if (gpio & GPIOEX_LIGHT_HOUSE)
-		GPIOEX_SET_BIT(GPIOEX_ADDR_230V, LIGHT_HOUSE, value, ret, out);
+	if (last[reg] == value)
+		goto out;
 
-	if (gpio & GPIOEX_LIGHT_TAP)
-		GPIOEX_SET_BIT(GPIOEX_ADDR_12V, LIGHT_TAP, value, ret, out);
+	ret = gpioex_tx_write(tx, reg, value);
+	if (!ret)
+		last[reg] = value;
+out:
+	return ret;
+}
+
+static int gpioex_apply_locked(gpioex_mask_t state, gpioex_mask_t *changed)
+{
+	int ret = 0;
+	uint8_t last[GPIOEX_MAX_REGS];
+	uint8_t mid[GPIOEX_MAX_REGS];
+	uint8_t next[GPIOEX_MAX_REGS];
+	gpioex_mask_t old, starting, stopping;
+	uint32_t stop_regs, start_regs, member_regs;
+	struct gpioex_tx tx;
+	int i;
+
+	if (state & ~map.outputs) {
+		log_err("invalid gpioex state %016" PRIX64, state);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ret = gpioex_get_regs(last);
+	if (ret)
+		goto out;
+
+	old = gpioex_regs_to_state(last);
+	state = gpioex_interlock(state);
+
+	starting = state & ~old & map.drivers;
+	stopping = old & ~state & map.drivers;
+
+	/* everything switched but the interlock outputs about to start */
+	memcpy(mid, last, sizeof(mid));
+	gpioex_state_to_regs(state & ~starting, mid);
+
+	memcpy(next, last, sizeof(next));
+	gpioex_state_to_regs(state, next);
+
+	stop_regs = gpioex_state_regs(stopping);
+	start_regs = gpioex_state_regs(starting);
+	member_regs = gpioex_state_regs((old ^ state) &
+					gpioex_group_members(starting));
+
+	gpioex_tx_init(&tx);
+
+	/* interlock outputs stop before their members turn off ... */
+	for (i = 0; i < map.reg_count && !ret; ++i) {
+		if (stop_regs & (1U << i))
+			ret = gpioex_tx_reg(&tx, i, last, mid[i]);
+	}
+
+	/* ... expanders only carrying a starting one are written once below ... */
+	for (i = 0; i < map.reg_count && !ret; ++i) {
+		if ((start_regs & ~member_regs) & (1U << i))
+			continue;
+		ret = gpioex_tx_reg(&tx, i, last, mid[i]);
+	}
+
+	/* ... and start after them */
+	for (i = 0; i < map.reg_count && !ret; ++i)
+		ret = gpioex_tx_reg(&tx, i, last, next[i]);
+
+	if (ret)
+		goto out;
+
+	ret = gpioex_tx_commit(&tx);
+	if (ret)
+		goto out;
+
+	__atomic_store_n(&state_snapshot, state, __ATOMIC_RELEASE);
+
+	if (changed)
+		*changed = old ^ state;
+out:
+	return ret;
+}
+
+int gpioex_apply(gpioex_mask_t state, gpioex_mask_t *changed)
+{
+	int ret = 0;
+
+	log_dbg("gpioex apply: state: %016" PRIX64, state);
+
+	pthread_mutex_lock(&lock);
+	ret = gpioex_apply_locked(state, changed);
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
+
+int gpioex_get(gpioex_mask_t *state)
+{
+	int ret = 0;
+	uint8_t regs[GPIOEX_MAX_REGS];
+
+	pthread_mutex_lock(&lock);
+
+	ret = gpioex_get_regs(regs);
+	if (!ret)
+		*state = gpioex_regs_to_state(regs);
+
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
+
+int gpioex_update(gpioex_mask_t clear, gpioex_mask_t set, gpioex_mask_t *changed)
+{
+	int ret = 0;
+	uint8_t regs[GPIOEX_MAX_REGS];
+	gpioex_mask_t state;
+
+	log_dbg("gpioex update: clear: %016" PRIX64 " set: %016" PRIX64, clear, set);
+
+	pthread_mutex_lock(&lock);
+
+	ret = gpioex_get_regs(regs);
+	if (ret)
+		goto out;
+
+	state = gpioex_regs_to_state(regs);
+	state &= ~(clear & map.outputs);
+	state |= set;
+
+	ret = gpioex_apply_locked(state, changed);
 out:
 	pthread_mutex_unlock(&lock);
 	return ret;
 }
 
+int gpioex_set(gpioex_mask_t gpio, int value)
+{
+	return gpioex_update(GPIOEX_SET_CLEAR(gpio), value ? gpio : 0, NULL);
+}
+
 static int gpioex_is_valid_barrel_level(uint8_t lvl)
 {
 	if (lvl == 0xFF || lvl == 0xFE ||
@@ -337,24 +929,122 @@ static int gpioex_is_valid_barrel_level(uint8_t lvl)
 		return 0;
 }
 
+static uint64_t gpioex_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/* the sensor expander shares only the bus with the outputs */
 int gpioex_get_barrel_level(void)
 {
 	int ret = 0;
 	uint8_t lvl;
+	uint64_t snapshot;
+
+	ret = gpioex_get_gpio(GPIOEX_BUS_1, GPIOEX_ADDR_BARREL_LVL, &lvl);
+	if (ret)
+		goto out;
+
+	if (!gpioex_is_valid_barrel_level(lvl)) {
+		log_err("invalid barrel level value (0x%02X)", lvl);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	snapshot = gpioex_now_ms() << GPIOEX_SNAPSHOT_TIME_SHIFT;
+	snapshot |= GPIOEX_SNAPSHOT_VALID | lvl;
+	__atomic_store_n(&barrel_snapshot, snapshot, __ATOMIC_RELEASE);
+
+	ret = lvl;
+out:
+	return ret;
+}
+
+void gpioex_set_barrel_irq(int gpio)
+{
+	__atomic_store_n(&barrel_irq, gpio, __ATOMIC_RELAXED);
+}
+
+int gpioex_get_barrel_irq(void)
+{
+	return __atomic_load_n(&barrel_irq, __ATOMIC_RELAXED);
+}
+
+int gpioex_get_barrel_snapshot(struct gpioex_sample *sample)
+{
+	uint64_t snapshot = __atomic_load_n(&barrel_snapshot, __ATOMIC_ACQUIRE);
+
+	if (!(snapshot & GPIOEX_SNAPSHOT_VALID))
+		return -ENODATA;
+
+	sample->value = snapshot & 0xFF;
+	sample->time_ms = snapshot >> GPIOEX_SNAPSHOT_TIME_SHIFT;
+
+	return 0;
+}
+
+gpioex_mask_t gpioex_get_state_snapshot(void)
+{
+	return __atomic_load_n(&state_snapshot, __ATOMIC_ACQUIRE);
+}
+
+int gpioex_verify(void)
+{
+	int ret = 0;
+	int mismatches = 0;
+	int i;
 
 	pthread_mutex_lock(&lock);
 
-	ret = gpioex_get_gpio(GPIOEX_BUS_1, GPIOEX_ADDR_BARREL_LVL, &lvl);
-	if (!ret) {
-		if (gpioex_is_valid_barrel_level(lvl)) {
-			ret = lvl;
-		} else {
-			log_err("invalid barrel level value (0x%02X)", lvl);
-			ret = -EINVAL;
-		}
+	for (i = 0; i < map.reg_count; ++i) {
+		struct gpioex_shadow *shadow = &map.regs[i];
+		uint8_t value;
+
+		if (!shadow->valid)
+			continue;
+
+		ret = gpioex_get_gpio(shadow->bus, shadow->addr, &value);
+		if (ret)
+			goto out;
+
+		if (value == shadow->value)
+			continue;
+
+		log_err("expander 0x%02X drifted to %02X (expected %02X)",
+			shadow->addr, value, shadow->value);
+		++mismatches;
+		gpioex_stat_add(verify_mismatches, 1);
+
+		/* restore the commanded state */
+		ret = gpioex_set_output(i, shadow->value);
+		if (ret)
+			goto out;
 	}
 
+	ret = mismatches;
+out:
 	pthread_mutex_unlock(&lock);
-
 	return ret;
 }
+
+void gpioex_get_stats(struct gpioex_stats *st)
+{
+	uint64_t used;
+
+	st->transfers = __atomic_load_n(&stats.transfers, __ATOMIC_RELAXED);
+	st->syscalls = __atomic_load_n(&stats.syscalls, __ATOMIC_RELAXED);
+	st->opens = __atomic_load_n(&stats.opens, __ATOMIC_RELAXED);
+	st->closes = __atomic_load_n(&stats.closes, __ATOMIC_RELAXED);
+	st->addr_switches = __atomic_load_n(&stats.addr_switches, __ATOMIC_RELAXED);
+	st->verify_mismatches = __atomic_load_n(&stats.verify_mismatches,
+						__ATOMIC_RELAXED);
+
+	/* uncached and unbatched every transfer costs open, ioctl, transfer and close */
+	used = st->syscalls;
+	st->syscalls_saved = 4 * st->transfers > used ?
+			     4 * st->transfers - used : 0;
+}
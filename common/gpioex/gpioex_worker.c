@@ -0,0 +1,242 @@
+/*
+ * gpioex_worker.c
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <gpioex.h>
+#include <mpsc.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <logging.h>
+
+enum gpioex_req_type {
+	GPIOEX_REQ_UPDATE = 0,
+	GPIOEX_REQ_BARREL_LEVEL,
+	GPIOEX_REQ_VERIFY,
+};
+
+struct gpioex_req {
+	struct mpsc_node node;
+	enum gpioex_req_type type;
+	gpioex_mask_t clear;
+	gpioex_mask_t set;
+	gpioex_mask_t changed;
+	int ret;
+	gpioex_done_cb cb;
+	void *obj;
+};
+
+/*
+ * Requests are pushed by the main loop and done by the worker thread,
+ * finished ones go back through the done queue.
+ */
+static struct {
+	pthread_t thread;
+	int running;
+	int quit;
+	int req_fd;
+	int done_fd;
+	struct mpsc_queue reqs;
+	struct mpsc_queue done;
+} worker = {
+	.req_fd = -1,
+	.done_fd = -1,
+};
+
+static void gpioex_req_exec(struct gpioex_req *req)
+{
+	switch (req->type) {
+	case GPIOEX_REQ_UPDATE:
+		req->ret = gpioex_update(req->clear, req->set, &req->changed);
+		break;
+	case GPIOEX_REQ_BARREL_LEVEL:
+		req->ret = gpioex_get_barrel_level();
+		break;
+	case GPIOEX_REQ_VERIFY:
+		req->ret = gpioex_verify();
+		break;
+	default:
+		req->ret = -EINVAL;
+		break;
+	}
+}
+
+static void gpioex_req_done(struct gpioex_req *req)
+{
+	if (req->cb)
+		req->cb(req->ret, req->changed, req->obj);
+
+	free(req);
+}
+
+static void *gpioex_worker_run(void *arg)
+{
+	struct mpsc_node *node;
+	eventfd_t count;
+
+	for (;;) {
+		while ((node = mpsc_pop(&worker.reqs))) {
+			gpioex_req_exec((struct gpioex_req*)node);
+			mpsc_push(&worker.done, node);
+			eventfd_write(worker.done_fd, 1);
+		}
+
+		if (__atomic_load_n(&worker.quit, __ATOMIC_ACQUIRE))
+			break;
+
+		eventfd_read(worker.req_fd, &count);
+	}
+
+	return NULL;
+}
+
+int gpioex_worker_start(void)
+{
+	int ret = 0;
+
+	if (worker.running)
+		goto out;
+
+	worker.req_fd = eventfd(0, EFD_CLOEXEC);
+	if (worker.req_fd < 0) {
+		ret = -errno;
+		log_err("create gpioex request event failed (%d) %s", ret, strerror(-ret));
+		goto out;
+	}
+
+	worker.done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (worker.done_fd < 0) {
+		ret = -errno;
+		log_err("create gpioex done event failed (%d) %s", ret, strerror(-ret));
+		goto out_req_fd;
+	}
+
+	mpsc_init(&worker.reqs);
+	mpsc_init(&worker.done);
+	worker.quit = 0;
+
+	ret = pthread_create(&worker.thread, NULL, gpioex_worker_run, NULL);
+	if (ret) {
+		log_err("create gpioex worker failed (%d) %s", ret, strerror(ret));
+		ret = -ret;
+		goto out_done_fd;
+	}
+
+	worker.running = 1;
+	goto out;
+
+out_done_fd:
+	close(worker.done_fd);
+	worker.done_fd = -1;
+out_req_fd:
+	close(worker.req_fd);
+	worker.req_fd = -1;
+out:
+	return ret;
+}
+
+/* queued requests are still done and their callbacks run */
+void gpioex_worker_stop(void)
+{
+	if (!worker.running)
+		return;
+
+	__atomic_store_n(&worker.quit, 1, __ATOMIC_RELEASE);
+	eventfd_write(worker.req_fd, 1);
+	pthread_join(worker.thread, NULL);
+	worker.running = 0;
+
+	gpioex_worker_complete();
+
+	close(worker.req_fd);
+	close(worker.done_fd);
+	worker.req_fd = -1;
+	worker.done_fd = -1;
+}
+
+int gpioex_worker_fd(void)
+{
+	return worker.done_fd;
+}
+
+void gpioex_worker_complete(void)
+{
+	struct mpsc_node *node;
+	eventfd_t count;
+
+	eventfd_read(worker.done_fd, &count);
+
+	while ((node = mpsc_pop(&worker.done)))
+		gpioex_req_done((struct gpioex_req*)node);
+}
+
+static int gpioex_submit(enum gpioex_req_type type, gpioex_mask_t clear,
+			 gpioex_mask_t set, gpioex_done_cb cb, void *obj)
+{
+	int ret = 0;
+	struct gpioex_req *req = calloc(1, sizeof(*req));
+
+	if (!req) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	req->type = type;
+	req->clear = clear;
+	req->set = set;
+	req->cb = cb;
+	req->obj = obj;
+
+	if (!worker.running) {
+		gpioex_req_exec(req);
+		gpioex_req_done(req);
+		goto out;
+	}
+
+	mpsc_push(&worker.reqs, &req->node);
+	eventfd_write(worker.req_fd, 1);
+out:
+	return ret;
+}
+
+int gpioex_submit_update(gpioex_mask_t clear, gpioex_mask_t set,
+			 gpioex_done_cb cb, void *obj)
+{
+	return gpioex_submit(GPIOEX_REQ_UPDATE, clear, set, cb, obj);
+}
+
+int gpioex_submit_set(gpioex_mask_t gpio, int value, gpioex_done_cb cb, void *obj)
+{
+	return gpioex_submit(GPIOEX_REQ_UPDATE, GPIOEX_SET_CLEAR(gpio),
+			     value ? gpio : 0, cb, obj);
+}
+
+int gpioex_submit_barrel_level(gpioex_done_cb cb, void *obj)
+{
+	return gpioex_submit(GPIOEX_REQ_BARREL_LEVEL, 0, 0, cb, obj);
+}
+
+int gpioex_submit_verify(gpioex_done_cb cb, void *obj)
+{
+	return gpioex_submit(GPIOEX_REQ_VERIFY, 0, 0, cb, obj);
+}
@@ -0,0 +1,232 @@
+/*
+ * hw.c
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <hw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/i2c-dev.h>
+#include <logging.h>
+
+static const struct hw_backend *backend = &hw_linux_backend;
+
+/* the i2c ops return negative errno values like the rest of hw */
+static int hw_i2c_dev_open(unsigned int bus)
+{
+	char filename[20];
+	int fd;
+
+	snprintf(filename, sizeof(filename), "/dev/i2c-%u", bus);
+
+	fd = open(filename, O_RDWR);
+
+	return fd < 0 ? -errno : fd;
+}
+
+static void hw_i2c_dev_close(int handle)
+{
+	close(handle);
+}
+
+static int hw_i2c_dev_set_addr(int handle, uint8_t addr)
+{
+	return ioctl(handle, I2C_SLAVE, addr) < 0 ? -errno : 0;
+}
+
+static int hw_i2c_dev_read(int handle, uint8_t *value)
+{
+	ssize_t ret = read(handle, value, 1);
+
+	return ret < 0 ? -errno : (int)ret;
+}
+
+static int hw_i2c_dev_rdwr(int handle, struct i2c_msg *msgs, int count)
+{
+	struct i2c_rdwr_ioctl_data data;
+	int ret;
+
+	data.msgs = msgs;
+	data.nmsgs = count;
+
+	ret = ioctl(handle, I2C_RDWR, &data);
+
+	return ret < 0 ? -errno : ret;
+}
+
+const struct hw_i2c_ops hw_i2c_dev_ops = {
+	.open = hw_i2c_dev_open,
+	.close = hw_i2c_dev_close,
+	.set_addr = hw_i2c_dev_set_addr,
+	.read = hw_i2c_dev_read,
+	.rdwr = hw_i2c_dev_rdwr,
+};
+
+const struct hw_backend hw_linux_backend = {
+	.name = "linux",
+	.i2c = &hw_i2c_dev_ops,
+	.gpio = { &hw_gpio_cdev_ops, &hw_gpio_sysfs_ops },
+	.iio = &hw_iio_sysfs_ops,
+};
+
+const struct hw_backend *hw_backend_by_name(const char *name)
+{
+	if (!name || !strcmp(name, hw_linux_backend.name))
+		return &hw_linux_backend;
+	if (!strcmp(name, hw_sim_backend.name))
+		return &hw_sim_backend;
+
+	return NULL;
+}
+
+void hw_set_backend(const struct hw_backend *b)
+{
+	log_dbg("hardware backend: %s", b->name);
+	backend = b;
+}
+
+const struct hw_backend *hw_get_backend(void)
+{
+	return backend;
+}
+
+int hw_i2c_open(unsigned int bus)
+{
+	return backend->i2c->open(bus);
+}
+
+void hw_i2c_close(int handle)
+{
+	backend->i2c->close(handle);
+}
+
+int hw_i2c_set_addr(int handle, uint8_t addr)
+{
+	return backend->i2c->set_addr(handle, addr);
+}
+
+int hw_i2c_read(int handle, uint8_t *value)
+{
+	return backend->i2c->read(handle, value);
+}
+
+int hw_i2c_rdwr(int handle, struct i2c_msg *msgs, int count)
+{
+	return backend->i2c->rdwr(handle, msgs, count);
+}
+
+int hw_iio_open(struct hw_iio_channel *ch, unsigned int device,
+		const char *channel)
+{
+	ch->fd = -1;
+	ch->scale = HW_FIXED_ONE;
+	ch->offset = 0;
+
+	return backend->iio->open(ch, device, channel);
+}
+
+/* micro times micro, the raw value keeps three decimals */
+static int hw_iio_process(int64_t raw, int64_t offset, int64_t scale)
+{
+	return (raw + offset) / 1000 * scale / (HW_FIXED_ONE * 1000);
+}
+
+int hw_iio_read(struct hw_iio_channel *ch, int *value)
+{
+	int ret = 0;
+	int64_t raw;
+
+	if (ch->fd < 0)
+		return -EBADF;
+
+	ret = backend->iio->read(ch, &raw);
+	if (ret)
+		return ret;
+
+	*value = hw_iio_process(raw, ch->offset, ch->scale);
+
+	return 0;
+}
+
+void hw_iio_close(struct hw_iio_channel *ch)
+{
+	if (ch->fd >= 0)
+		backend->iio->close(ch);
+	ch->fd = -1;
+}
+
+int hw_iio_buffer_open(struct hw_iio_buffer *buf, unsigned int device,
+		       const char *const *channels, unsigned int count,
+		       unsigned int hz)
+{
+	unsigned int i;
+
+	memset(buf, 0, sizeof(*buf));
+	buf->fd = -1;
+	buf->device = device;
+	buf->count = count;
+
+	if (!count || count > HW_IIO_BUFFER_CHANNELS || !hz)
+		return -EINVAL;
+
+	if (!backend->iio->buffer_open)
+		return -ENOTSUP;
+
+	for (i = 0; i < count; ++i)
+		buf->channels[i].scale = HW_FIXED_ONE;
+
+	return backend->iio->buffer_open(buf, channels, hz);
+}
+
+int hw_iio_buffer_read(struct hw_iio_buffer *buf, int *values, size_t scans)
+{
+	int ret = 0;
+	int64_t raw[HW_IIO_BUFFER_SCANS * HW_IIO_BUFFER_CHANNELS];
+	int i;
+
+	if (buf->fd < 0)
+		return -EBADF;
+
+	if (scans > HW_IIO_BUFFER_SCANS)
+		scans = HW_IIO_BUFFER_SCANS;
+
+	ret = backend->iio->buffer_read(buf, raw, scans);
+
+	for (i = 0; i < ret * (int)buf->count; ++i) {
+		struct hw_iio_scan_channel *ch = &buf->channels[i % buf->count];
+
+		values[i] = hw_iio_process(raw[i], ch->offset_raw, ch->scale);
+	}
+
+	return ret;
+}
+
+void hw_iio_buffer_close(struct hw_iio_buffer *buf)
+{
+	if (buf->fd >= 0)
+		backend->iio->buffer_close(buf);
+	buf->fd = -1;
+}
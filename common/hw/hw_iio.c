@@ -0,0 +1,533 @@
+/*
+ * hw_iio.c
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <hw.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+#include <logging.h>
+
+#define HW_IIO_DEVICE_DIR	"/sys/bus/iio/devices/iio:device%u"
+#define HW_IIO_DEVICES_DIR	"/sys/bus/iio/devices"
+#define HW_IIO_HRTIMER_DIR	"/sys/kernel/config/iio/triggers/hrtimer"
+#define HW_IIO_TRIGGER_NAME	"gardenctl"
+#define HW_IIO_BUFFER_LENGTH	"64"
+/* storage of a channel is up to 64 bits */
+#define HW_IIO_SCAN_MAX		(HW_IIO_BUFFER_CHANNELS * 8)
+
+/* largest integer part, with room for one more digit */
+#define HW_FIXED_INT_MAX ((INT64_MAX / HW_FIXED_ONE - 9) / 10)
+
+int hw_parse_fixed(const char *buf, size_t len, int64_t *micro)
+{
+	int64_t value = 0;
+	int64_t unit = HW_FIXED_ONE / 10;
+	bool negative = false;
+	int digits = 0;
+	size_t i = 0;
+
+	if (i < len && (buf[i] == '-' || buf[i] == '+'))
+		negative = buf[i++] == '-';
+
+	for (; i < len && buf[i] >= '0' && buf[i] <= '9'; ++i, ++digits) {
+		if (value > HW_FIXED_INT_MAX)
+			return -ERANGE;
+		value = value * 10 + (buf[i] - '0');
+	}
+
+	value *= HW_FIXED_ONE;
+
+	if (i < len && buf[i] == '.') {
+		for (++i; i < len && buf[i] >= '0' && buf[i] <= '9'; ++i, ++digits) {
+			value += (buf[i] - '0') * unit;
+			unit /= 10;
+		}
+	}
+
+	if (!digits)
+		return -EINVAL;
+
+	*micro = negative ? -value : value;
+
+	return 0;
+}
+
+static int hw_iio_sysfs_open_attr(unsigned int device, const char *channel,
+				  const char *attr)
+{
+	char path[100];
+	int fd;
+
+	snprintf(path, sizeof(path), "/sys/bus/iio/devices/iio:device%u/in_%s_%s",
+		 device, channel, attr);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	return fd < 0 ? -errno : fd;
+}
+
+/* sysfs attributes are read from their start, no seek or reopen needed */
+static int hw_iio_sysfs_pread(int fd, int64_t *micro)
+{
+	char buf[32];
+	ssize_t len;
+
+	len = pread(fd, buf, sizeof(buf), 0);
+	if (len < 0)
+		return -errno;
+
+	return hw_parse_fixed(buf, len, micro);
+}
+
+/* a missing attribute keeps the default */
+static int hw_iio_sysfs_read_attr(unsigned int device, const char *channel,
+				  const char *attr, int64_t *micro)
+{
+	int ret = 0;
+	int fd;
+
+	fd = hw_iio_sysfs_open_attr(device, channel, attr);
+	if (fd == -ENOENT)
+		goto out;
+	if (fd < 0) {
+		ret = fd;
+		goto out;
+	}
+
+	ret = hw_iio_sysfs_pread(fd, micro);
+	close(fd);
+out:
+	return ret;
+}
+
+/* processed input attributes come in milli units, raw ones are scaled */
+static int hw_iio_sysfs_open(struct hw_iio_channel *ch, unsigned int device,
+			     const char *channel)
+{
+	int ret = 0;
+
+	ret = hw_iio_sysfs_open_attr(device, channel, "input");
+	if (ret >= 0) {
+		ch->fd = ret;
+		ret = 0;
+		goto out;
+	}
+
+	ret = hw_iio_sysfs_open_attr(device, channel, "raw");
+	if (ret < 0)
+		goto out;
+
+	ch->fd = ret;
+
+	ret = hw_iio_sysfs_read_attr(device, channel, "scale", &ch->scale);
+	if (!ret)
+		ret = hw_iio_sysfs_read_attr(device, channel, "offset", &ch->offset);
+	if (ret) {
+		close(ch->fd);
+		ch->fd = -1;
+	}
+out:
+	return ret;
+}
+
+static int hw_iio_sysfs_read(struct hw_iio_channel *ch, int64_t *raw)
+{
+	return hw_iio_sysfs_pread(ch->fd, raw);
+}
+
+static void hw_iio_sysfs_close(struct hw_iio_channel *ch)
+{
+	close(ch->fd);
+}
+
+static int hw_sysfs_write(const char *path, const char *value)
+{
+	int ret = 0;
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (write(fd, value, strlen(value)) < 0)
+		ret = -errno;
+
+	close(fd);
+
+	return ret;
+}
+
+/* reads a short attribute as string without its newline */
+static int hw_sysfs_read(const char *path, char *buf, size_t len)
+{
+	int ret = 0;
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	n = read(fd, buf, len - 1);
+	if (n < 0) {
+		ret = -errno;
+		n = 0;
+	}
+
+	buf[n] = '\0';
+	if (n && buf[n - 1] == '\n')
+		buf[n - 1] = '\0';
+
+	close(fd);
+
+	return ret;
+}
+
+static bool hw_iio_is_channel(const char *name, const char *const *channels,
+			      unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; ++i) {
+		if (!strcmp(name, channels[i]))
+			return true;
+	}
+
+	return false;
+}
+
+/* only the channels asked for are in the scans */
+static int hw_iio_scan_elements(struct hw_iio_buffer *buf,
+				const char *const *channels)
+{
+	int ret = 0;
+	char dir[100];
+	char path[PATH_MAX];
+	struct dirent *entry;
+	DIR *d;
+
+	snprintf(dir, sizeof(dir), HW_IIO_DEVICE_DIR "/scan_elements", buf->device);
+
+	d = opendir(dir);
+	if (!d)
+		return -errno;
+
+	while ((entry = readdir(d))) {
+		char name[64];
+		size_t len = strlen(entry->d_name);
+
+		if (len < 6 || len - 6 >= sizeof(name) ||
+		    strncmp(entry->d_name, "in_", 3) ||
+		    strcmp(entry->d_name + len - 3, "_en"))
+			continue;
+
+		memcpy(name, entry->d_name + 3, len - 6);
+		name[len - 6] = '\0';
+
+		snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+		ret = hw_sysfs_write(path, hw_iio_is_channel(name, channels, buf->count) ?
+				     "1" : "0");
+		if (ret)
+			break;
+	}
+
+	closedir(d);
+
+	return ret;
+}
+
+/* type is like le:s12/16>>4, bits of storage shifted right by 4 */
+int hw_iio_scan_type(struct hw_iio_scan_channel *ch, const char *type)
+{
+	char endian, sign;
+	unsigned int storage;
+	const char *shift;
+
+	if (sscanf(type, "%ce:%c%u/%u", &endian, &sign, &ch->bits, &storage) != 4 ||
+	    !storage || storage > 64 || storage % 8 || !ch->bits ||
+	    ch->bits > storage)
+		return -EINVAL;
+
+	ch->big_endian = endian == 'b';
+	ch->is_signed = sign == 's';
+	ch->bytes = storage / 8;
+
+	shift = strstr(type, ">>");
+	ch->shift = shift ? (unsigned int)atoi(shift + 2) : 0;
+
+	return 0;
+}
+
+static int hw_iio_scan_channel(struct hw_iio_buffer *buf, unsigned int i,
+			       const char *channel)
+{
+	int ret = 0;
+	struct hw_iio_scan_channel *ch = &buf->channels[i];
+	char path[200];
+	char value[32];
+
+	snprintf(path, sizeof(path), HW_IIO_DEVICE_DIR "/scan_elements/in_%s_index",
+		 buf->device, channel);
+	ret = hw_sysfs_read(path, value, sizeof(value));
+	if (ret)
+		goto out;
+
+	ch->index = atoi(value);
+
+	snprintf(path, sizeof(path), HW_IIO_DEVICE_DIR "/scan_elements/in_%s_type",
+		 buf->device, channel);
+	ret = hw_sysfs_read(path, value, sizeof(value));
+	if (ret)
+		goto out;
+
+	ret = hw_iio_scan_type(ch, value);
+	if (ret)
+		goto out;
+
+	ret = hw_iio_sysfs_read_attr(buf->device, channel, "scale", &ch->scale);
+	if (!ret)
+		ret = hw_iio_sysfs_read_attr(buf->device, channel, "offset",
+					     &ch->offset_raw);
+out:
+	return ret;
+}
+
+/* channels are stored by index, each aligned to its own size */
+int hw_iio_scan_layout(struct hw_iio_buffer *buf)
+{
+	struct hw_iio_scan_channel *order[HW_IIO_BUFFER_CHANNELS];
+	unsigned int offset = 0;
+	unsigned int align = 1;
+	unsigned int i, j;
+
+	for (i = 0; i < buf->count; ++i) {
+		for (j = i; j > 0 && order[j - 1]->index > buf->channels[i].index; --j)
+			order[j] = order[j - 1];
+		order[j] = &buf->channels[i];
+	}
+
+	for (i = 0; i < buf->count; ++i) {
+		struct hw_iio_scan_channel *ch = order[i];
+
+		offset = (offset + ch->bytes - 1) / ch->bytes * ch->bytes;
+		ch->offset = offset;
+		offset += ch->bytes;
+		if (ch->bytes > align)
+			align = ch->bytes;
+	}
+
+	buf->scan_bytes = (offset + align - 1) / align * align;
+
+	return buf->scan_bytes > HW_IIO_SCAN_MAX ? -ENOTSUP : 0;
+}
+
+/*
+ * Samples the device by the hrtimer trigger of gardenctl, created in
+ * configfs when needed. A device without one keeps its current trigger.
+ */
+static int hw_iio_trigger(struct hw_iio_buffer *buf, unsigned int hz)
+{
+	int ret = 0;
+	char path[PATH_MAX];
+	char value[32];
+	struct dirent *entry;
+	bool found = false;
+	DIR *d;
+
+	snprintf(path, sizeof(path), HW_IIO_DEVICE_DIR "/trigger/current_trigger",
+		 buf->device);
+	ret = hw_sysfs_read(path, value, sizeof(value));
+	/* devices with a fifo of their own have no trigger */
+	if (ret == -ENOENT)
+		return 0;
+	if (ret)
+		return ret;
+
+	if (mkdir(HW_IIO_HRTIMER_DIR "/" HW_IIO_TRIGGER_NAME, 0755) && errno != EEXIST)
+		log_dbg("iio: no hrtimer trigger (%d) %s", -errno, strerror(errno));
+
+	d = opendir(HW_IIO_DEVICES_DIR);
+	if (!d)
+		return -errno;
+
+	while (!found && (entry = readdir(d))) {
+		char name[32];
+
+		if (strncmp(entry->d_name, "trigger", 7))
+			continue;
+
+		snprintf(path, sizeof(path), HW_IIO_DEVICES_DIR "/%s/name", entry->d_name);
+		if (hw_sysfs_read(path, name, sizeof(name)) ||
+		    strcmp(name, HW_IIO_TRIGGER_NAME))
+			continue;
+
+		snprintf(path, sizeof(path), HW_IIO_DEVICES_DIR "/%s/sampling_frequency",
+			 entry->d_name);
+		snprintf(name, sizeof(name), "%u", hz);
+		ret = hw_sysfs_write(path, name);
+		found = true;
+	}
+
+	closedir(d);
+
+	if (ret)
+		return ret;
+
+	if (!found)
+		return value[0] ? 0 : -ENOTSUP;
+
+	snprintf(path, sizeof(path), HW_IIO_DEVICE_DIR "/trigger/current_trigger",
+		 buf->device);
+
+	return hw_sysfs_write(path, HW_IIO_TRIGGER_NAME);
+}
+
+static int hw_iio_buffer_enable(struct hw_iio_buffer *buf, const char *value)
+{
+	char path[100];
+
+	snprintf(path, sizeof(path), HW_IIO_DEVICE_DIR "/buffer/enable", buf->device);
+
+	return hw_sysfs_write(path, value);
+}
+
+static int hw_iio_sysfs_buffer_open(struct hw_iio_buffer *buf,
+				    const char *const *channels, unsigned int hz)
+{
+	int ret = 0;
+	char path[100];
+	struct stat st;
+	unsigned int i;
+
+	snprintf(path, sizeof(path), HW_IIO_DEVICE_DIR "/buffer", buf->device);
+	if (stat(path, &st))
+		return errno == ENOENT ? -ENOTSUP : -errno;
+
+	/* scan elements are fixed while the buffer runs */
+	hw_iio_buffer_enable(buf, "0");
+
+	for (i = 0; i < buf->count; ++i) {
+		ret = hw_iio_scan_channel(buf, i, channels[i]);
+		if (ret)
+			goto out;
+	}
+
+	ret = hw_iio_scan_layout(buf);
+	if (ret)
+		goto out;
+
+	ret = hw_iio_scan_elements(buf, channels);
+	if (ret)
+		goto out;
+
+	ret = hw_iio_trigger(buf, hz);
+	if (ret)
+		goto out;
+
+	snprintf(path, sizeof(path), HW_IIO_DEVICE_DIR "/buffer/length", buf->device);
+	ret = hw_sysfs_write(path, HW_IIO_BUFFER_LENGTH);
+	if (ret)
+		goto out;
+
+	ret = hw_iio_buffer_enable(buf, "1");
+	if (ret)
+		goto out;
+
+	snprintf(path, sizeof(path), "/dev/iio:device%u", buf->device);
+	buf->fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (buf->fd < 0) {
+		ret = -errno;
+		hw_iio_buffer_enable(buf, "0");
+	}
+out:
+	/* a channel without scan element is no buffer to use */
+	return ret == -ENOENT ? -ENOTSUP : ret;
+}
+
+int64_t hw_iio_scan_value(const struct hw_iio_scan_channel *ch,
+			  const uint8_t *scan)
+{
+	const uint8_t *p = scan + ch->offset;
+	uint64_t mask;
+	uint64_t v = 0;
+	unsigned int i;
+
+	for (i = 0; i < ch->bytes; ++i)
+		v = (v << 8) | p[ch->big_endian ? i : ch->bytes - 1 - i];
+
+	v >>= ch->shift;
+
+	if (ch->bits < 64) {
+		mask = ((uint64_t)1 << ch->bits) - 1;
+		v &= mask;
+		if (ch->is_signed && (v & ((uint64_t)1 << (ch->bits - 1))))
+			v |= ~mask;
+	}
+
+	return (int64_t)v;
+}
+
+static int hw_iio_sysfs_buffer_read(struct hw_iio_buffer *buf, int64_t *raw,
+				    size_t scans)
+{
+	uint8_t data[HW_IIO_BUFFER_SCANS * HW_IIO_SCAN_MAX];
+	ssize_t len;
+	size_t n, s;
+	unsigned int c;
+
+	len = read(buf->fd, data, scans * buf->scan_bytes);
+	if (len < 0)
+		return errno == EAGAIN ? 0 : -errno;
+
+	n = len / buf->scan_bytes;
+	for (s = 0; s < n; ++s) {
+		for (c = 0; c < buf->count; ++c)
+			raw[s * buf->count + c] = HW_FIXED_ONE *
+				hw_iio_scan_value(&buf->channels[c],
+						  data + s * buf->scan_bytes);
+	}
+
+	return n;
+}
+
+static void hw_iio_sysfs_buffer_close(struct hw_iio_buffer *buf)
+{
+	close(buf->fd);
+	hw_iio_buffer_enable(buf, "0");
+}
+
+const struct hw_iio_ops hw_iio_sysfs_ops = {
+	.open = hw_iio_sysfs_open,
+	.read = hw_iio_sysfs_read,
+	.close = hw_iio_sysfs_close,
+	.buffer_open = hw_iio_sysfs_buffer_open,
+	.buffer_read = hw_iio_sysfs_buffer_read,
+	.buffer_close = hw_iio_sysfs_buffer_close,
+};
+
@@ -0,0 +1,742 @@
+/*
+ * hw_sim.c
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <hw_sim.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <logging.h>
+
+#define HW_SIM_I2C_BUSES	4
+#define HW_SIM_I2C_ADDRS	128
+#define HW_SIM_GPIO_LINES	32
+#define HW_SIM_GPIO_QUEUE	16
+#define HW_SIM_IIO_CHANNELS	16
+#define HW_SIM_IIO_NAME_MAX	32
+
+/* quasi-bidirectional pins read low when driven or pulled low */
+struct hw_sim_expander {
+	uint8_t output;
+	uint8_t input;
+	bool written;
+};
+
+struct hw_sim_bus {
+	int addr;
+	struct hw_sim_expander expanders[HW_SIM_I2C_ADDRS];
+};
+
+/* a line has an eventfd while it is open, its events wait in queue */
+struct hw_sim_line {
+	bool used;
+	unsigned int chip;
+	unsigned int line;
+	int level;
+	int fd;
+	enum gpio_edge edge;
+	unsigned int head;
+	unsigned int count;
+	struct gpio_event queue[HW_SIM_GPIO_QUEUE];
+};
+
+struct hw_sim_channel {
+	bool used;
+	unsigned int device;
+	char name[HW_SIM_IIO_NAME_MAX];
+	int value;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hw_sim_conf conf;
+static struct hw_sim_stats stats;
+static unsigned int fail_next;
+static struct hw_sim_bus buses[HW_SIM_I2C_BUSES];
+static struct hw_sim_line lines[HW_SIM_GPIO_LINES];
+static struct hw_sim_channel channels[HW_SIM_IIO_CHANNELS];
+
+static uint64_t hw_sim_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* called without the lock, devices stay usable while one is busy */
+static void hw_sim_delay(unsigned int us)
+{
+	struct timespec ts;
+
+	if (!us)
+		return;
+
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+}
+
+/* the lock is held by the caller */
+static bool hw_sim_fails(void)
+{
+	bool fail = false;
+
+	if (fail_next) {
+		--fail_next;
+		fail = true;
+	} else if (conf.fail_ppm) {
+		fail = (unsigned int)rand_r(&conf.seed) % 1000000 < conf.fail_ppm;
+	}
+
+	if (fail)
+		++stats.failures;
+
+	return fail;
+}
+
+static int hw_sim_error(void)
+{
+	return conf.fail_errno ? -conf.fail_errno : -EIO;
+}
+
+/* a byte is 8 bits and the ack, a message is its address and its data */
+static unsigned int hw_sim_i2c_msg_us(unsigned int len)
+{
+	if (!conf.i2c_khz)
+		return 0;
+
+	return ((1 + len) * 9 * 1000 + conf.i2c_khz - 1) / conf.i2c_khz;
+}
+
+static void hw_sim_i2c_reset(void)
+{
+	int i, j;
+
+	for (i = 0; i < HW_SIM_I2C_BUSES; ++i) {
+		buses[i].addr = -1;
+		for (j = 0; j < HW_SIM_I2C_ADDRS; ++j) {
+			buses[i].expanders[j].output = 0xFF;
+			buses[i].expanders[j].input = 0xFF;
+			buses[i].expanders[j].written = false;
+		}
+	}
+}
+
+static int hw_sim_i2c_open(unsigned int bus)
+{
+	if (bus >= HW_SIM_I2C_BUSES)
+		return -ENODEV;
+
+	pthread_mutex_lock(&lock);
+	buses[bus].addr = -1;
+	pthread_mutex_unlock(&lock);
+
+	return bus;
+}
+
+static void hw_sim_i2c_close(int handle)
+{
+}
+
+static int hw_sim_i2c_set_addr(int handle, uint8_t addr)
+{
+	int ret = 0;
+	unsigned int us;
+
+	if (addr >= HW_SIM_I2C_ADDRS)
+		return -EINVAL;
+
+	pthread_mutex_lock(&lock);
+	us = conf.i2c_latency_us;
+	if (hw_sim_fails())
+		ret = hw_sim_error();
+	else
+		buses[handle].addr = addr;
+	stats.delay_us += us;
+	pthread_mutex_unlock(&lock);
+
+	hw_sim_delay(us);
+
+	return ret;
+}
+
+static int hw_sim_i2c_read(int handle, uint8_t *value)
+{
+	int ret = 0;
+	struct hw_sim_bus *bus = &buses[handle];
+	unsigned int us;
+
+	pthread_mutex_lock(&lock);
+
+	us = conf.i2c_latency_us + hw_sim_i2c_msg_us(1);
+	if (bus->addr < 0) {
+		ret = -EINVAL;
+	} else if (hw_sim_fails()) {
+		ret = hw_sim_error();
+	} else {
+		struct hw_sim_expander *ex = &bus->expanders[bus->addr];
+
+		*value = ex->output & ex->input;
+		++stats.i2c_msgs;
+		++stats.i2c_bytes;
+		ret = 1;
+	}
+	stats.delay_us += us;
+
+	pthread_mutex_unlock(&lock);
+
+	hw_sim_delay(us);
+
+	return ret;
+}
+
+static int hw_sim_i2c_rdwr(int handle, struct i2c_msg *msgs, int count)
+{
+	int ret = 0;
+	struct hw_sim_bus *bus = &buses[handle];
+	unsigned int us;
+	int i, j;
+
+	pthread_mutex_lock(&lock);
+
+	us = conf.i2c_latency_us;
+	for (i = 0; i < count; ++i) {
+		struct hw_sim_expander *ex;
+
+		if (msgs[i].addr >= HW_SIM_I2C_ADDRS || !msgs[i].len) {
+			ret = -EINVAL;
+			break;
+		}
+
+		us += hw_sim_i2c_msg_us(msgs[i].len);
+
+		/* the messages before a nack are done */
+		if (hw_sim_fails()) {
+			ret = hw_sim_error();
+			break;
+		}
+
+		ex = &bus->expanders[msgs[i].addr];
+		if (msgs[i].flags & I2C_M_RD) {
+			for (j = 0; j < msgs[i].len; ++j)
+				msgs[i].buf[j] = ex->output & ex->input;
+		} else {
+			ex->output = msgs[i].buf[msgs[i].len - 1];
+			ex->written = true;
+		}
+
+		++stats.i2c_msgs;
+		stats.i2c_bytes += msgs[i].len;
+	}
+	stats.delay_us += us;
+
+	pthread_mutex_unlock(&lock);
+
+	hw_sim_delay(us);
+
+	return ret ? ret : count;
+}
+
+static const struct hw_i2c_ops hw_sim_i2c_ops = {
+	.open = hw_sim_i2c_open,
+	.close = hw_sim_i2c_close,
+	.set_addr = hw_sim_i2c_set_addr,
+	.read = hw_sim_i2c_read,
+	.rdwr = hw_sim_i2c_rdwr,
+};
+
+void hw_sim_i2c_set_input(unsigned int bus, uint8_t addr, uint8_t value)
+{
+	if (bus >= HW_SIM_I2C_BUSES || addr >= HW_SIM_I2C_ADDRS)
+		return;
+
+	pthread_mutex_lock(&lock);
+	buses[bus].expanders[addr].input = value;
+	pthread_mutex_unlock(&lock);
+}
+
+int hw_sim_i2c_get_output(unsigned int bus, uint8_t addr)
+{
+	int ret = 0;
+
+	if (bus >= HW_SIM_I2C_BUSES || addr >= HW_SIM_I2C_ADDRS)
+		return -EINVAL;
+
+	pthread_mutex_lock(&lock);
+	if (buses[bus].expanders[addr].written)
+		ret = buses[bus].expanders[addr].output;
+	else
+		ret = -ENODATA;
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
+
+/* the lock is held by the caller */
+static struct hw_sim_line *hw_sim_gpio_find(unsigned int chip, unsigned int line,
+					    bool create)
+{
+	struct hw_sim_line *free_line = NULL;
+	int i;
+
+	for (i = 0; i < HW_SIM_GPIO_LINES; ++i) {
+		if (!lines[i].used) {
+			if (!free_line)
+				free_line = &lines[i];
+		} else if (lines[i].chip == chip && lines[i].line == line) {
+			return &lines[i];
+		}
+	}
+
+	if (!create || !free_line)
+		return NULL;
+
+	memset(free_line, 0, sizeof(*free_line));
+	free_line->used = true;
+	free_line->chip = chip;
+	free_line->line = line;
+	/* inputs idle high on their pull-ups */
+	free_line->level = 1;
+	free_line->fd = -1;
+
+	return free_line;
+}
+
+static struct hw_sim_line *hw_sim_gpio_find_fd(int fd)
+{
+	int i;
+
+	for (i = 0; i < HW_SIM_GPIO_LINES; ++i) {
+		if (lines[i].used && lines[i].fd == fd)
+			return &lines[i];
+	}
+
+	return NULL;
+}
+
+static int hw_sim_gpio_open(struct gpio_input *in, unsigned int chip,
+			    unsigned int line, enum gpio_edge edge,
+			    unsigned int debounce_us)
+{
+	int ret = 0;
+	struct hw_sim_line *l;
+	unsigned int us;
+
+	pthread_mutex_lock(&lock);
+
+	us = conf.gpio_latency_us;
+	l = hw_sim_gpio_find(chip, line, true);
+	if (!l) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	if (l->fd >= 0) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	ret = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ret < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	l->fd = ret;
+	l->edge = edge;
+	l->head = 0;
+	l->count = 0;
+
+	in->fd = l->fd;
+	in->events = EPOLLIN;
+	in->debounced = false;
+	in->level = l->level;
+	ret = 0;
+out:
+	stats.delay_us += us;
+	pthread_mutex_unlock(&lock);
+
+	hw_sim_delay(us);
+
+	return ret;
+}
+
+static int hw_sim_gpio_read(struct gpio_input *in, struct gpio_event *evs,
+			    size_t count)
+{
+	int ret = 0;
+	struct hw_sim_line *l;
+	eventfd_t pending;
+	unsigned int us;
+
+	pthread_mutex_lock(&lock);
+
+	us = conf.gpio_latency_us;
+	l = hw_sim_gpio_find_fd(in->fd);
+	if (!l) {
+		ret = -EBADF;
+		goto out;
+	}
+
+	eventfd_read(l->fd, &pending);
+
+	while ((size_t)ret < count && l->count) {
+		evs[ret++] = l->queue[l->head];
+		l->head = (l->head + 1) % HW_SIM_GPIO_QUEUE;
+		--l->count;
+	}
+
+	/* events left for the next read keep the fd readable */
+	if (l->count)
+		eventfd_write(l->fd, 1);
+out:
+	stats.delay_us += us;
+	pthread_mutex_unlock(&lock);
+
+	hw_sim_delay(us);
+
+	return ret;
+}
+
+static void hw_sim_gpio_close(struct gpio_input *in)
+{
+	struct hw_sim_line *l;
+
+	pthread_mutex_lock(&lock);
+
+	l = hw_sim_gpio_find_fd(in->fd);
+	if (l) {
+		l->fd = -1;
+		l->count = 0;
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	close(in->fd);
+}
+
+static const struct hw_gpio_ops hw_sim_gpio_ops = {
+	.name = "sim",
+	.open = hw_sim_gpio_open,
+	.read = hw_sim_gpio_read,
+	.close = hw_sim_gpio_close,
+};
+
+int hw_sim_gpio_set(unsigned int chip, unsigned int line, int value)
+{
+	int ret = 0;
+	struct hw_sim_line *l;
+	struct gpio_event *ev;
+
+	value = !!value;
+
+	pthread_mutex_lock(&lock);
+
+	l = hw_sim_gpio_find(chip, line, true);
+	if (!l) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	if (l->level == value)
+		goto out;
+
+	l->level = value;
+
+	if (l->fd < 0 || !(l->edge & (value ? GPIO_EDGE_RISING : GPIO_EDGE_FALLING)))
+		goto out;
+
+	/* a full queue loses its oldest event like the kernel fifo */
+	if (l->count == HW_SIM_GPIO_QUEUE) {
+		l->head = (l->head + 1) % HW_SIM_GPIO_QUEUE;
+		--l->count;
+	}
+
+	ev = &l->queue[(l->head + l->count) % HW_SIM_GPIO_QUEUE];
+	ev->value = value;
+	ev->timestamp_ns = hw_sim_now_ns();
+	++l->count;
+	++stats.gpio_events;
+
+	eventfd_write(l->fd, 1);
+out:
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+/* the lock is held by the caller */
+static struct hw_sim_channel *hw_sim_iio_find(unsigned int device,
+					      const char *channel, bool create)
+{
+	struct hw_sim_channel *free_channel = NULL;
+	int i;
+
+	for (i = 0; i < HW_SIM_IIO_CHANNELS; ++i) {
+		if (!channels[i].used) {
+			if (!free_channel)
+				free_channel = &channels[i];
+		} else if (channels[i].device == device &&
+			   !strcmp(channels[i].name, channel)) {
+			return &channels[i];
+		}
+	}
+
+	if (!create || !free_channel || strlen(channel) >= HW_SIM_IIO_NAME_MAX)
+		return NULL;
+
+	free_channel->used = true;
+	free_channel->device = device;
+	strcpy(free_channel->name, channel);
+
+	return free_channel;
+}
+
+/* a channel is its index, the values are processed ones */
+static int hw_sim_iio_open(struct hw_iio_channel *ch, unsigned int device,
+			   const char *channel)
+{
+	int ret = 0;
+	struct hw_sim_channel *c;
+
+	pthread_mutex_lock(&lock);
+
+	c = hw_sim_iio_find(device, channel, false);
+	if (c)
+		ch->fd = c - channels;
+	else
+		ret = -ENOENT;
+
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
+
+static int hw_sim_iio_read(struct hw_iio_channel *ch, int64_t *raw)
+{
+	int ret = 0;
+	struct hw_sim_channel *c = &channels[ch->fd];
+	unsigned int us;
+
+	pthread_mutex_lock(&lock);
+
+	us = conf.iio_latency_us;
+	if (!c->used) {
+		ret = -ENODEV;
+	} else if (hw_sim_fails()) {
+		ret = hw_sim_error();
+	} else {
+		*raw = c->value * HW_FIXED_ONE;
+		++stats.iio_reads;
+	}
+	stats.delay_us += us;
+
+	pthread_mutex_unlock(&lock);
+
+	hw_sim_delay(us);
+
+	return ret;
+}
+
+static void hw_sim_iio_close(struct hw_iio_channel *ch)
+{
+}
+
+/* the trigger is a timerfd, each expiry is a scan of the current values */
+static int hw_sim_iio_buffer_open(struct hw_iio_buffer *buf,
+				  const char *const *names, unsigned int hz)
+{
+	int ret = 0;
+	struct itimerspec its;
+	unsigned int i;
+
+	pthread_mutex_lock(&lock);
+
+	for (i = 0; i < buf->count; ++i) {
+		struct hw_sim_channel *c = hw_sim_iio_find(buf->device, names[i], false);
+
+		if (!c) {
+			ret = -ENOTSUP;
+			goto out;
+		}
+
+		buf->channels[i].index = c - channels;
+	}
+
+	ret = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (ret < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	buf->fd = ret;
+
+	its.it_interval.tv_sec = 1 / hz;
+	its.it_interval.tv_nsec = (1000000000ULL / hz) % 1000000000;
+	its.it_value = its.it_interval;
+
+	ret = timerfd_settime(buf->fd, 0, &its, NULL);
+	if (ret < 0) {
+		ret = -errno;
+		close(buf->fd);
+		buf->fd = -1;
+	}
+out:
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+static int hw_sim_iio_buffer_read(struct hw_iio_buffer *buf, int64_t *raw,
+				  size_t scans)
+{
+	int ret = 0;
+	uint64_t expired = 0;
+	unsigned int us;
+	size_t s;
+	unsigned int c;
+
+	if (read(buf->fd, &expired, sizeof(expired)) < 0)
+		return errno == EAGAIN ? 0 : -errno;
+
+	/* scans beyond the room of the reader are lost like on an overrun */
+	if (expired > scans)
+		expired = scans;
+
+	pthread_mutex_lock(&lock);
+
+	us = conf.iio_latency_us;
+	if (hw_sim_fails()) {
+		ret = hw_sim_error();
+		goto out;
+	}
+
+	for (s = 0; s < expired; ++s) {
+		for (c = 0; c < buf->count; ++c)
+			raw[s * buf->count + c] = HW_FIXED_ONE *
+				channels[buf->channels[c].index].value;
+	}
+
+	stats.iio_reads += expired;
+	ret = expired;
+out:
+	stats.delay_us += us;
+	pthread_mutex_unlock(&lock);
+
+	hw_sim_delay(us);
+
+	return ret;
+}
+
+static void hw_sim_iio_buffer_close(struct hw_iio_buffer *buf)
+{
+	close(buf->fd);
+}
+
+static const struct hw_iio_ops hw_sim_iio_ops = {
+	.open = hw_sim_iio_open,
+	.read = hw_sim_iio_read,
+	.close = hw_sim_iio_close,
+	.buffer_open = hw_sim_iio_buffer_open,
+	.buffer_read = hw_sim_iio_buffer_read,
+	.buffer_close = hw_sim_iio_buffer_close,
+};
+
+int hw_sim_iio_set(unsigned int device, const char *channel, int value)
+{
+	int ret = 0;
+	struct hw_sim_channel *c;
+
+	pthread_mutex_lock(&lock);
+
+	c = hw_sim_iio_find(device, channel, true);
+	if (c)
+		c->value = value;
+	else
+		ret = -ENOSPC;
+
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
+
+const struct hw_backend hw_sim_backend = {
+	.name = "sim",
+	.i2c = &hw_sim_i2c_ops,
+	.gpio = { &hw_sim_gpio_ops },
+	.iio = &hw_sim_iio_ops,
+};
+
+void hw_sim_setup(const struct hw_sim_conf *c)
+{
+	int i;
+
+	pthread_mutex_lock(&lock);
+
+	if (c)
+		conf = *c;
+	else
+		memset(&conf, 0, sizeof(conf));
+
+	memset(&stats, 0, sizeof(stats));
+	fail_next = 0;
+
+	hw_sim_i2c_reset();
+
+	/* open lines keep their fd */
+	for (i = 0; i < HW_SIM_GPIO_LINES; ++i) {
+		if (lines[i].used && lines[i].fd < 0)
+			lines[i].used = false;
+	}
+
+	memset(channels, 0, sizeof(channels));
+
+	pthread_mutex_unlock(&lock);
+
+	/* the dht of the weather station */
+	hw_sim_iio_set(0, "temp", 21000);
+	hw_sim_iio_set(0, "humidityrelative", 50000);
+
+	log_dbg("hw sim: i2c %u kHz latency i2c %u us gpio %u us iio %u us fail %u ppm",
+		conf.i2c_khz, conf.i2c_latency_us, conf.gpio_latency_us,
+		conf.iio_latency_us, conf.fail_ppm);
+}
+
+void hw_sim_fail_next(unsigned int count)
+{
+	pthread_mutex_lock(&lock);
+	fail_next = count;
+	pthread_mutex_unlock(&lock);
+}
+
+void hw_sim_get_stats(struct hw_sim_stats *s)
+{
+	pthread_mutex_lock(&lock);
+	*s = stats;
+	pthread_mutex_unlock(&lock);
+}
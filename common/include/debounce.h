@@ -0,0 +1,71 @@
+/*
+ * debounce.h
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __DEBOUNCE_H__
+#define __DEBOUNCE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Software debounce of digital inputs driven by timestamped levels. A level
+ * becomes stable once no other level was seen for the settle time of its
+ * line. Nothing sleeps: the owner feeds levels with debounce_input() and
+ * calls debounce_poll() when the returned deadline has passed.
+ */
+
+/* prev is -1 for the first stable level of a line, timestamp_ns is its edge */
+typedef void (*debounce_cb)(unsigned int line, int prev, int level,
+			    uint64_t timestamp_ns, void *obj);
+
+struct debounce_line {
+	uint64_t settle_ns;
+	uint64_t since_ns;
+	int stable;
+	int pending;
+	int armed;
+};
+
+struct debounce {
+	unsigned int count;
+	struct debounce_line *lines;
+	debounce_cb cb;
+	void *obj;
+};
+
+int debounce_init(struct debounce *db, unsigned int count, debounce_cb cb, void *obj);
+void debounce_destroy(struct debounce *db);
+int debounce_line_setup(struct debounce *db, unsigned int line, unsigned int settle_ms);
+
+/* level of line known without an edge, the next change is reported from it */
+int debounce_line_seed(struct debounce *db, unsigned int line, int level);
+
+/* level seen on line at timestamp_ns (CLOCK_MONOTONIC) */
+int debounce_input(struct debounce *db, unsigned int line, int level,
+		   uint64_t timestamp_ns);
+
+/*
+ * Reports the levels settled until now_ns and returns the ns until the next
+ * line settles, -1 when none is pending.
+ */
+int64_t debounce_poll(struct debounce *db, uint64_t now_ns);
+
+#endif /*__DEBOUNCE_H__*/
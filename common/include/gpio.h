@@ -0,0 +1,83 @@
+/*
+ * gpio.h
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __GPIO_H__
+#define __GPIO_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+struct hw_gpio_ops;
+
+/* sysfs gpios of the board */
+int gpio_export(int gpio);
+int gpio_set_direction(int gpio, const char *direction);
+int gpio_set_edge(int gpio, const char *edge);
+
+/*
+ * Exports gpio as input raising edge events ("rising", "falling", "both")
+ * and returns its value fd, to be watched for EPOLLPRI | EPOLLERR.
+ */
+int gpio_open_input(int gpio, const char *edge);
+
+/* reads the value ('0' or '1'), which acknowledges a pending edge */
+int gpio_read(int fd, char *value);
+
+enum gpio_edge {
+	GPIO_EDGE_RISING = 0x1,
+	GPIO_EDGE_FALLING = 0x2,
+	GPIO_EDGE_BOTH = GPIO_EDGE_RISING | GPIO_EDGE_FALLING,
+};
+
+/* level after an edge, timestamp_ns is CLOCK_MONOTONIC */
+struct gpio_event {
+	int value;
+	uint64_t timestamp_ns;
+};
+
+/*
+ * Input line raising edge events. It is requested as line of
+ * /dev/gpiochip<chip> with the kernel debouncing it, without the
+ * character device the sysfs gpio of the same number is used.
+ * Watch fd for events, debounced tells whether the kernel debounces.
+ * level is the level read when the line was opened, -1 if unknown.
+ * The hardware backend decides which of its gpio ops serves the line.
+ */
+struct gpio_input {
+	int fd;
+	uint32_t events;
+	bool debounced;
+	int level;
+	const struct hw_gpio_ops *ops;
+};
+
+int gpio_input_open(struct gpio_input *in, unsigned int chip, unsigned int line,
+		    enum gpio_edge edge, unsigned int debounce_us);
+void gpio_input_close(struct gpio_input *in);
+
+/*
+ * Returns the count of events read to evs, pending edges are consumed.
+ * sysfs inputs report their current level as one event.
+ */
+int gpio_input_read(struct gpio_input *in, struct gpio_event *evs, size_t count);
+
+#endif /*__GPIO_H__*/
@@ -23,23 +23,151 @@
 #define __GPIOEX_H__
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
 
-#define GPIOEX_TAP		0x00000001
-#define GPIOEX_YARD_LEFT	0x00000002
-#define GPIOEX_YARD_RIGHT	0x00000004
-#define GPIOEX_YARD_FRONT	0x00000008
-#define GPIOEX_YARD_BACK	0x00000010
-#define GPIOEX_DROPPIPE_PUMP	0x00000020
-#define GPIOEX_BARREL		0x00000040
-#define GPIOEX_LIGHT_TREE	0x00000080
-#define GPIOEX_LIGHT_HOUSE	0x00000100
-#define GPIOEX_LIGHT_TAP	0x00000200
+/* bitmap of output ids */
+typedef uint64_t gpioex_mask_t;
+
+#define GPIOEX_MAX_OUTPUTS	64
+#define GPIOEX_NAME_MAX		32
+
+/* i2c buses 0 to GPIOEX_BUS_COUNT - 1 may hold expanders */
+#define GPIOEX_BUS_COUNT	2
+
+#define GPIOEX_OUTPUT(__id)	((gpioex_mask_t)1 << (__id))
+
+/* ids of the built-in outputs, a configured output with one of their names keeps it */
+enum gpioex_output_id {
+	GPIOEX_ID_TAP = 0,
+	GPIOEX_ID_YARD_LEFT,
+	GPIOEX_ID_YARD_RIGHT,
+	GPIOEX_ID_YARD_FRONT,
+	GPIOEX_ID_YARD_BACK,
+	GPIOEX_ID_DROPPIPE_PUMP,
+	GPIOEX_ID_BARREL,
+	GPIOEX_ID_LIGHT_TREE,
+	GPIOEX_ID_LIGHT_HOUSE,
+	GPIOEX_ID_LIGHT_TAP,
+	GPIOEX_ID_PUMP,
+	GPIOEX_ID_COUNT,
+};
+
+#define GPIOEX_TAP		GPIOEX_OUTPUT(GPIOEX_ID_TAP)
+#define GPIOEX_YARD_LEFT	GPIOEX_OUTPUT(GPIOEX_ID_YARD_LEFT)
+#define GPIOEX_YARD_RIGHT	GPIOEX_OUTPUT(GPIOEX_ID_YARD_RIGHT)
+#define GPIOEX_YARD_FRONT	GPIOEX_OUTPUT(GPIOEX_ID_YARD_FRONT)
+#define GPIOEX_YARD_BACK	GPIOEX_OUTPUT(GPIOEX_ID_YARD_BACK)
+#define GPIOEX_DROPPIPE_PUMP	GPIOEX_OUTPUT(GPIOEX_ID_DROPPIPE_PUMP)
+#define GPIOEX_BARREL		GPIOEX_OUTPUT(GPIOEX_ID_BARREL)
+#define GPIOEX_LIGHT_TREE	GPIOEX_OUTPUT(GPIOEX_ID_LIGHT_TREE)
+#define GPIOEX_LIGHT_HOUSE	GPIOEX_OUTPUT(GPIOEX_ID_LIGHT_HOUSE)
+#define GPIOEX_LIGHT_TAP	GPIOEX_OUTPUT(GPIOEX_ID_LIGHT_TAP)
+#define GPIOEX_PUMP		GPIOEX_OUTPUT(GPIOEX_ID_PUMP)
 
 #define GPIOEX_YARD	(GPIOEX_YARD_LEFT | GPIOEX_YARD_RIGHT | \
 			 GPIOEX_YARD_FRONT | GPIOEX_YARD_BACK)
 
-int gpioex_init(void);
-int gpioex_set(uint32_t gpio, int value);
+/* outputs turned off by gpioex_set(gpio), one yard zone closes the others */
+#define GPIOEX_SET_CLEAR(__gpio) \
+	((__gpio) | (((__gpio) & GPIOEX_YARD) ? GPIOEX_YARD : 0))
+
+/*
+ * One relay of the output map. An output with interlock names the output
+ * that has to run while it is on, like the pump feeding a valve. Such
+ * interlock outputs are switched by gpioex only: they stop before the
+ * last of their outputs turns off and start after the first turned on.
+ */
+struct gpioex_output {
+	const char *name;
+	uint8_t bus;
+	uint8_t addr;
+	uint8_t bit;
+	bool active_low;
+	const char *interlock;
+};
+
+/*
+ * i2c bus usage, a transfer is one byte written or read. syscalls_saved
+ * compares against an open, ioctl, transfer and close per byte.
+ */
+struct gpioex_stats {
+	uint64_t transfers;
+	uint64_t syscalls;
+	uint64_t opens;
+	uint64_t closes;
+	uint64_t addr_switches;
+	uint64_t syscalls_saved;
+	uint64_t verify_mismatches;
+};
+
+/* without outputs the built-in map of the garden is used */
+int gpioex_init(const struct gpioex_output *outputs, size_t count);
+int gpioex_output_id(const char *name);
+/* NULL for an id without output */
+const char *gpioex_output_name(int id);
+int gpioex_set(gpioex_mask_t gpio, int value);
+
+/*
+ * Switches all outputs to state, a bitmap of the outputs to turn on.
+ * Only changed expanders are written and interlocks are enforced once.
+ * changed (may be NULL) returns the outputs that were switched.
+ */
+int gpioex_apply(gpioex_mask_t state, gpioex_mask_t *changed);
+int gpioex_get(gpioex_mask_t *state);
+
+/* turns the outputs in clear off and those in set on, the others are kept */
+int gpioex_update(gpioex_mask_t clear, gpioex_mask_t set, gpioex_mask_t *changed);
 int gpioex_get_barrel_level(void);
 
+/* CLOCK_MONOTONIC time of a sample */
+struct gpioex_sample {
+	int value;
+	uint64_t time_ms;
+};
+
+/* last valid barrel level without taking a lock, -ENODATA before the first */
+int gpioex_get_barrel_snapshot(struct gpioex_sample *sample);
+
+/* outputs on after the last switch without taking a lock or the bus */
+gpioex_mask_t gpioex_get_state_snapshot(void);
+
+/*
+ * gpio of the open-drain INT line of the barrel expander, -1 without.
+ * INT goes low on an input change and is released by reading the expander.
+ * The barrel expander is the only one with inputs, the INT lines of the
+ * output expanders never fire, so there is one line and not one per
+ * expander.
+ */
+void gpioex_set_barrel_irq(int gpio);
+int gpioex_get_barrel_irq(void);
+void gpioex_get_stats(struct gpioex_stats *stats);
+
+/* reads the outputs back, returns the count of restored expanders */
+int gpioex_verify(void);
+
+/*
+ * Bus worker. Once started the requests below are queued to a thread doing
+ * the i2c transfers and their callbacks are run by gpioex_worker_complete()
+ * when gpioex_worker_fd() gets readable. Without the worker a request is
+ * done and its callback run before the submit returns. The worker is
+ * stopped by its owner, the shared stop leaves it running so requests of
+ * the shutdown are still done.
+ *
+ * ret is what the synchronous call returned, changed the switched outputs
+ * of an update.
+ */
+typedef void (*gpioex_done_cb)(int ret, gpioex_mask_t changed, void *obj);
+
+int gpioex_worker_start(void);
+void gpioex_worker_stop(void);
+int gpioex_worker_fd(void);
+void gpioex_worker_complete(void);
+
+int gpioex_submit_update(gpioex_mask_t clear, gpioex_mask_t set,
+			 gpioex_done_cb cb, void *obj);
+int gpioex_submit_set(gpioex_mask_t gpio, int value, gpioex_done_cb cb, void *obj);
+int gpioex_submit_barrel_level(gpioex_done_cb cb, void *obj);
+int gpioex_submit_verify(gpioex_done_cb cb, void *obj);
+
 #endif /*__GPIOEX_H__*/
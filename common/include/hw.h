@@ -0,0 +1,174 @@
+/*
+ * hw.h
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __HW_H__
+#define __HW_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <linux/i2c.h>
+#include <gpio.h>
+
+/*
+ * Device access of gardenctl. A backend bundles the operations of each
+ * kind of device, the linux backend goes to the kernel interfaces while
+ * the simulated one keeps the devices in memory. Operations return the
+ * count of bytes or messages done or a negative errno.
+ */
+
+/* i2c-dev bus of the PCF8574 expanders, a handle per bus */
+struct hw_i2c_ops {
+	int (*open)(unsigned int bus);
+	void (*close)(int handle);
+	int (*set_addr)(int handle, uint8_t addr);
+	/* reads one byte from the current address */
+	int (*read)(int handle, uint8_t *value);
+	/* transfers all msgs as one transaction, returns the count done */
+	int (*rdwr)(int handle, struct i2c_msg *msgs, int count);
+};
+
+/* edge events of an input line, see gpio_input_open() */
+struct hw_gpio_ops {
+	const char *name;
+	int (*open)(struct gpio_input *in, unsigned int chip, unsigned int line,
+		    enum gpio_edge edge, unsigned int debounce_us);
+	int (*read)(struct gpio_input *in, struct gpio_event *evs, size_t count);
+	void (*close)(struct gpio_input *in);
+};
+
+/*
+ * Channel of iio:device<device>, opened once and read per sample. Its
+ * processed value is (raw + offset) * scale in milli units, scale and
+ * offset are read when it is opened. Values are fixed point in micro units.
+ */
+#define HW_FIXED_ONE 1000000LL
+
+struct hw_iio_channel {
+	int fd;
+	int64_t scale;
+	int64_t offset;
+};
+
+#define HW_IIO_BUFFER_CHANNELS	4
+#define HW_IIO_BUFFER_SCANS	16
+
+/* place of a channel in the scans of a buffer */
+struct hw_iio_scan_channel {
+	unsigned int index;
+	unsigned int offset;
+	unsigned int bytes;
+	unsigned int bits;
+	unsigned int shift;
+	bool is_signed;
+	bool big_endian;
+	int64_t scale;
+	int64_t offset_raw;
+};
+
+/*
+ * Buffered capture of channels of a device, sampled by a trigger at hz.
+ * Watch fd for EPOLLIN, a scan holds one sample of every channel.
+ */
+struct hw_iio_buffer {
+	int fd;
+	unsigned int device;
+	unsigned int count;
+	size_t scan_bytes;
+	struct hw_iio_scan_channel channels[HW_IIO_BUFFER_CHANNELS];
+};
+
+struct hw_iio_ops {
+	int (*open)(struct hw_iio_channel *ch, unsigned int device, const char *channel);
+	int (*read)(struct hw_iio_channel *ch, int64_t *raw);
+	void (*close)(struct hw_iio_channel *ch);
+	/* NULL without buffer support */
+	int (*buffer_open)(struct hw_iio_buffer *buf, const char *const *channels,
+			   unsigned int hz);
+	/* raw values of up to scans scans, channel after channel */
+	int (*buffer_read)(struct hw_iio_buffer *buf, int64_t *raw, size_t scans);
+	void (*buffer_close)(struct hw_iio_buffer *buf);
+};
+
+#define HW_GPIO_OPS_MAX 2
+
+struct hw_backend {
+	const char *name;
+	const struct hw_i2c_ops *i2c;
+	/* tried in order until one opens the line */
+	const struct hw_gpio_ops *gpio[HW_GPIO_OPS_MAX];
+	const struct hw_iio_ops *iio;
+};
+
+extern const struct hw_i2c_ops hw_i2c_dev_ops;
+extern const struct hw_gpio_ops hw_gpio_cdev_ops;
+extern const struct hw_gpio_ops hw_gpio_sysfs_ops;
+extern const struct hw_iio_ops hw_iio_sysfs_ops;
+
+extern const struct hw_backend hw_linux_backend;
+extern const struct hw_backend hw_sim_backend;
+
+/* NULL for an unknown name */
+const struct hw_backend *hw_backend_by_name(const char *name);
+
+/* selects the backend of all devices, set before they are opened */
+void hw_set_backend(const struct hw_backend *backend);
+const struct hw_backend *hw_get_backend(void);
+
+int hw_i2c_open(unsigned int bus);
+void hw_i2c_close(int handle);
+int hw_i2c_set_addr(int handle, uint8_t addr);
+int hw_i2c_read(int handle, uint8_t *value);
+int hw_i2c_rdwr(int handle, struct i2c_msg *msgs, int count);
+
+int hw_iio_open(struct hw_iio_channel *ch, unsigned int device,
+		const char *channel);
+/* processed value in milli units */
+int hw_iio_read(struct hw_iio_channel *ch, int *value);
+void hw_iio_close(struct hw_iio_channel *ch);
+
+/* -ENOTSUP when the device has no buffer, one-shot reads are left then */
+int hw_iio_buffer_open(struct hw_iio_buffer *buf, unsigned int device,
+		       const char *const *channels, unsigned int count,
+		       unsigned int hz);
+/*
+ * Reads the pending scans to values, count values per scan in the order
+ * of the channels opened, in milli units. Returns the count of scans.
+ */
+int hw_iio_buffer_read(struct hw_iio_buffer *buf, int *values, size_t scans);
+void hw_iio_buffer_close(struct hw_iio_buffer *buf);
+
+/*
+ * Parses the decimal number at the start of buf, which needs no NUL.
+ * Digits past the sixth decimal are dropped.
+ */
+int hw_parse_fixed(const char *buf, size_t len, int64_t *micro);
+
+/*
+ * Scan decoding of the sysfs buffers: the type of a channel from its
+ * scan_elements, the offsets of the channels in a scan and the raw value
+ * of a channel in one.
+ */
+int hw_iio_scan_type(struct hw_iio_scan_channel *ch, const char *type);
+int hw_iio_scan_layout(struct hw_iio_buffer *buf);
+int64_t hw_iio_scan_value(const struct hw_iio_scan_channel *ch,
+			  const uint8_t *scan);
+
+#endif /*__HW_H__*/
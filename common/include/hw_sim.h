@@ -0,0 +1,76 @@
+/*
+ * hw_sim.h
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __HW_SIM_H__
+#define __HW_SIM_H__
+
+#include <stdint.h>
+#include <hw.h>
+
+/*
+ * In-memory devices of hw_sim_backend, for running gardenctl on machines
+ * without the garden hardware. Every address of the i2c buses answers as
+ * a PCF8574, gpio lines are driven by hw_sim_gpio_set() and iio channels
+ * by hw_sim_iio_set(). The calls may come from any thread, the devices
+ * are set up by hw_sim_setup() before the backend is selected.
+ */
+struct hw_sim_conf {
+	/* i2c clock, transfers take as long as on the wire, 0 is instant */
+	unsigned int i2c_khz;
+	/* added to each operation */
+	unsigned int i2c_latency_us;
+	unsigned int gpio_latency_us;
+	unsigned int iio_latency_us;
+	/* operations failing with -fail_errno, in parts per million */
+	unsigned int fail_ppm;
+	int fail_errno;
+	unsigned int seed;
+};
+
+struct hw_sim_stats {
+	uint64_t i2c_msgs;
+	uint64_t i2c_bytes;
+	uint64_t gpio_events;
+	uint64_t iio_reads;
+	uint64_t failures;
+	/* time the operations were delayed */
+	uint64_t delay_us;
+};
+
+/* resets all devices, conf NULL for no delays and failures */
+void hw_sim_setup(const struct hw_sim_conf *conf);
+
+/* fails the next count operations regardless of fail_ppm */
+void hw_sim_fail_next(unsigned int count);
+
+/* levels the pins of an expander are pulled to, 0xFF by default */
+void hw_sim_i2c_set_input(unsigned int bus, uint8_t addr, uint8_t value);
+/* last value written to an expander, -ENODATA before the first write */
+int hw_sim_i2c_get_output(unsigned int bus, uint8_t addr);
+
+/* changes the level of a line, an open input gets an edge event */
+int hw_sim_gpio_set(unsigned int chip, unsigned int line, int value);
+
+int hw_sim_iio_set(unsigned int device, const char *channel, int value);
+
+void hw_sim_get_stats(struct hw_sim_stats *stats);
+
+#endif /*__HW_SIM_H__*/
@@ -0,0 +1,90 @@
+/*
+ * mpsc.h
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __MPSC_H__
+#define __MPSC_H__
+
+#include <stddef.h>
+
+/*
+ * Intrusive lock-free queue, any thread may push, one thread pops.
+ * Embed the node in the queued struct and cast back from it.
+ */
+struct mpsc_node {
+	struct mpsc_node *next;
+};
+
+struct mpsc_queue {
+	struct mpsc_node *head;
+	struct mpsc_node *tail;
+	struct mpsc_node stub;
+};
+
+static inline void mpsc_init(struct mpsc_queue *q)
+{
+	q->stub.next = NULL;
+	q->head = &q->stub;
+	q->tail = &q->stub;
+}
+
+static inline void mpsc_push(struct mpsc_queue *q, struct mpsc_node *node)
+{
+	struct mpsc_node *prev;
+
+	node->next = NULL;
+	prev = __atomic_exchange_n(&q->head, node, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+/* NULL when empty or while a push is half done, its producer wakes us again */
+static inline struct mpsc_node *mpsc_pop(struct mpsc_queue *q)
+{
+	struct mpsc_node *tail = q->tail;
+	struct mpsc_node *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	if (tail == &q->stub) {
+		if (!next)
+			return NULL;
+		q->tail = next;
+		tail = next;
+		next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	}
+
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+
+	if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	mpsc_push(q, &q->stub);
+
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+
+	return NULL;
+}
+
+#endif /*__MPSC_H__*/
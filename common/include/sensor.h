@@ -0,0 +1,72 @@
+/*
+ * sensor.h
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __SENSOR_H__
+#define __SENSOR_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * last, min, max and mean are of the samples since sensor_reset(), ewma of
+ * all samples and median of the last window samples.
+ */
+struct sensor_aggregate {
+	uint32_t count;
+	double last;
+	double min;
+	double max;
+	double mean;
+	double ewma;
+	double median;
+};
+
+/*
+ * Samples of one sensor channel. The ring keeps the last window samples in
+ * arrival order and sorted side by side in one allocation, a sample costs
+ * a binary search and a short memmove for the median.
+ */
+struct sensor {
+	unsigned int window;
+	unsigned int head;
+	unsigned int fill;
+	double *ring;
+	double *sorted;
+	double alpha;
+	double ewma;
+	uint64_t total;
+	uint32_t count;
+	double last;
+	double min;
+	double max;
+	double sum;
+};
+
+/* alpha is the weight of a new sample in the ewma, between 0 and 1 */
+int sensor_init(struct sensor *sensor, unsigned int window, double alpha);
+void sensor_destroy(struct sensor *sensor);
+int sensor_add(struct sensor *sensor, double value);
+/* -ENODATA before the first sample */
+int sensor_get(const struct sensor *sensor, struct sensor_aggregate *agg);
+/* starts a new interval, the window and ewma are kept */
+void sensor_reset(struct sensor *sensor);
+
+#endif /*__SENSOR_H__*/
@@ -0,0 +1,48 @@
+/*
+ * stop.h
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __STOP_H__
+#define __STOP_H__
+
+#include <stdbool.h>
+
+/*
+ * Shutdown request shared by the core and all workers. It is backed by an
+ * eventfd which stays readable once requested, so it can be added to any
+ * poll or epoll set and wakes every waiter at once.
+ */
+struct stop {
+	int fd;
+};
+
+int stop_init(struct stop *stop);
+void stop_destroy(struct stop *stop);
+
+/* async-signal-safe */
+void stop_request(struct stop *stop);
+bool stop_requested(const struct stop *stop);
+
+static inline int stop_fd(const struct stop *stop)
+{
+	return stop->fd;
+}
+
+#endif /*__STOP_H__*/
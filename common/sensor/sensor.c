@@ -0,0 +1,146 @@
+/*
+ * sensor.c
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <sensor.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+int sensor_init(struct sensor *sensor, unsigned int window, double alpha)
+{
+	memset(sensor, 0, sizeof(*sensor));
+
+	if (!window || !(alpha > 0.0 && alpha <= 1.0))
+		return -EINVAL;
+
+	sensor->ring = calloc(2 * window, sizeof(*sensor->ring));
+	if (!sensor->ring)
+		return -ENOMEM;
+
+	sensor->sorted = sensor->ring + window;
+	sensor->window = window;
+	sensor->alpha = alpha;
+
+	return 0;
+}
+
+void sensor_destroy(struct sensor *sensor)
+{
+	free(sensor->ring);
+	sensor->ring = NULL;
+	sensor->sorted = NULL;
+	sensor->window = 0;
+}
+
+/* first of sorted not less than value */
+static unsigned int sensor_lower_bound(const struct sensor *sensor, double value)
+{
+	unsigned int lo = 0;
+	unsigned int hi = sensor->fill;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (sensor->sorted[mid] < value)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+int sensor_add(struct sensor *sensor, double value)
+{
+	unsigned int i;
+
+	/* NaN has no place in the order */
+	if (value != value)
+		return -EINVAL;
+
+	if (sensor->fill == sensor->window) {
+		i = sensor_lower_bound(sensor, sensor->ring[sensor->head]);
+		memmove(&sensor->sorted[i], &sensor->sorted[i + 1],
+			(sensor->fill - i - 1) * sizeof(*sensor->sorted));
+		--sensor->fill;
+	}
+
+	sensor->ring[sensor->head] = value;
+	sensor->head = (sensor->head + 1) % sensor->window;
+
+	i = sensor_lower_bound(sensor, value);
+	memmove(&sensor->sorted[i + 1], &sensor->sorted[i],
+		(sensor->fill - i) * sizeof(*sensor->sorted));
+	sensor->sorted[i] = value;
+	++sensor->fill;
+
+	if (sensor->total)
+		sensor->ewma += sensor->alpha * (value - sensor->ewma);
+	else
+		sensor->ewma = value;
+	++sensor->total;
+
+	if (!sensor->count || value < sensor->min)
+		sensor->min = value;
+	if (!sensor->count || value > sensor->max)
+		sensor->max = value;
+	sensor->sum += value;
+	sensor->last = value;
+	++sensor->count;
+
+	return 0;
+}
+
+int sensor_get(const struct sensor *sensor, struct sensor_aggregate *agg)
+{
+	unsigned int mid = sensor->fill / 2;
+
+	if (!sensor->total)
+		return -ENODATA;
+
+	agg->count = sensor->count;
+	agg->last = sensor->last;
+	agg->ewma = sensor->ewma;
+
+	if (sensor->fill % 2)
+		agg->median = sensor->sorted[mid];
+	else
+		agg->median = (sensor->sorted[mid - 1] + sensor->sorted[mid]) / 2;
+
+	/* an interval without samples still has the last one */
+	if (sensor->count) {
+		agg->min = sensor->min;
+		agg->max = sensor->max;
+		agg->mean = sensor->sum / sensor->count;
+	} else {
+		agg->min = sensor->last;
+		agg->max = sensor->last;
+		agg->mean = sensor->last;
+	}
+
+	return 0;
+}
+
+void sensor_reset(struct sensor *sensor)
+{
+	sensor->count = 0;
+	sensor->sum = 0.0;
+}
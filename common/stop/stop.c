@@ -0,0 +1,66 @@
+/*
+ * stop.c
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stop.h>
+#include <errno.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "logging.h"
+
+int stop_init(struct stop *stop)
+{
+	int ret = 0;
+
+	stop->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (stop->fd < 0) {
+		ret = -errno;
+		log_err("create stop event failed (%d) %s", ret, strerror(-ret));
+	}
+
+	return ret;
+}
+
+void stop_destroy(struct stop *stop)
+{
+	if (stop->fd >= 0)
+		close(stop->fd);
+	stop->fd = -1;
+}
+
+void stop_request(struct stop *stop)
+{
+	int err = errno;
+
+	/* the event is never read, so the counter only grows */
+	eventfd_write(stop->fd, 1);
+
+	errno = err;
+}
+
+bool stop_requested(const struct stop *stop)
+{
+	struct pollfd pfd = { .fd = stop->fd, .events = POLLIN };
+
+	return poll(&pfd, 1, 0) > 0;
+}
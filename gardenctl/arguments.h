@@ -24,6 +24,13 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <hw_sim.h>
+
+struct gpioex_output;
+struct input_conf;
+struct sensor_conf;
+struct publish_rule;
 
 struct arguments {
 	const char *app_name;
@@ -37,7 +44,43 @@ struct arguments {
 		const char *user;
 		const char *pass;
 		const char *passfile;
+		/* retained online/offline with the last will, "" disables it */
+		const char *status_topic;
 	} mqtt;
+	struct {
+		/* seconds between output read-backs, 0 disables them */
+		unsigned int verify_interval;
+		/* gpio of the barrel expander INT line, -1 polls the level */
+		int barrel_irq_gpio;
+		/* relay map, without outputs the built-in one is used */
+		struct gpioex_output *outputs;
+		size_t output_count;
+	} gpioex;
+	struct {
+		/* name of the device backend, "linux" or "sim" */
+		const char *backend;
+		struct hw_sim_conf sim;
+	} hw;
+	/* gpio inputs published by the core, without inputs the tap button */
+	struct input_conf *inputs;
+	size_t input_count;
+	/* overrides of the sensor defaults of the modules */
+	struct sensor_conf *sensors;
+	size_t sensor_count;
+	/* coalescing and rate limits of published topics */
+	struct publish_rule *publish_rules;
+	size_t publish_rule_count;
+	struct {
+		/* ring file of the messages of a broker outage, NULL loses them */
+		const char *file;
+		unsigned int size_kb;
+	} spool;
+	struct {
+		/* directory of the sensor history, NULL records nothing */
+		const char *dir;
+		/* segment files kept per sensor */
+		unsigned int segments;
+	} history;
 };
 
 #endif /*__ARGUMENTS_H__*/
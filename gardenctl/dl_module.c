@@ -108,20 +108,22 @@ void dlm_destroy(dlm_head_t *head)
 
 		if (dlm->dl_handler)
 			dlclose(dlm->dl_handler);
+		if (dlm->routes)
+			free(dlm->routes);
 		LIST_REMOVE(dlm, dl_modules);
 		free(dlm);
 	}
 }
 
 int dlm_mod_init(dlm_head_t *head, const char *conf_file,
-		 struct mosquitto *mosq)
+		 struct mosquitto *mosq, struct garden_core *core)
 {
 	int ret = 0;
 	dlm_t *dlm = NULL;
 
 	for (dlm = head->lh_first; dlm != NULL; dlm = dlm->dl_modules.le_next) {
 		if (dlm->garden && dlm->garden->init) {
-			ret = dlm->garden->init(dlm->garden, conf_file, mosq);
+			ret = dlm->garden->init(dlm->garden, conf_file, mosq, core);
 			if (ret < 0)
 				break;
 		}
@@ -130,36 +132,118 @@ int dlm_mod_init(dlm_head_t *head, const char *conf_file,
 	return ret;
 }
 
-int dlm_mod_subscribe(dlm_head_t *head)
+static size_t dlm_subscription_count(const struct garden_module *garden)
+{
+	size_t count = 0;
+
+	if (garden && garden->subscriptions)
+		while (garden->subscriptions[count].topic)
+			++count;
+
+	return count;
+}
+
+static int dlm_sub_qos(const struct garden_subscription *sub, dlm_qos_cb cb,
+		       void *obj)
+{
+	return cb ? cb(sub->topic, sub->qos, obj) : sub->qos;
+}
+
+int dlm_mod_subscribe(dlm_head_t *head, struct mosquitto *mosq, dlm_qos_cb cb,
+		      void *obj)
 {
 	int ret = 0;
+	int qos;
+	size_t count = 0;
+	char **topics = NULL;
 
 	dlm_t *dlm = NULL;
 
-	for (dlm = head->lh_first; dlm != NULL; dlm = dlm->dl_modules.le_next) {
-		if (dlm->garden && dlm->garden->subscribe) {
-			ret = dlm->garden->subscribe(dlm->garden);
-			if (ret)
-				break;
+	for (dlm = head->lh_first; dlm != NULL; dlm = dlm->dl_modules.le_next)
+		count += dlm_subscription_count(dlm->garden);
+
+	if (!count)
+		goto out;
+
+	topics = calloc(count, sizeof(char*));
+	if (!topics) {
+		log_err("allocate subscription list failed");
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* one request per QoS level instead of one per topic */
+	for (qos = 0; qos <= 2; ++qos) {
+		const struct garden_subscription *sub;
+		int n = 0;
+
+		for (dlm = head->lh_first; dlm != NULL; dlm = dlm->dl_modules.le_next) {
+			if (!dlm->garden || !dlm->garden->subscriptions)
+				continue;
+
+			for (sub = dlm->garden->subscriptions; sub->topic; ++sub)
+				if (dlm_sub_qos(sub, cb, obj) == qos)
+					topics[n++] = (char*)sub->topic;
 		}
+
+		if (!n)
+			continue;
+
+		ret = mosquitto_subscribe_multiple(mosq, NULL, n, topics, qos, 0, NULL);
+		if (ret != MOSQ_ERR_SUCCESS) {
+			log_err("subscribe %d topics with qos %d failed (%d) %s",
+				n, qos, ret, mosquitto_strerror(ret));
+			break;
+		}
+
+		log_dbg("subscribe %d topics with qos %d", n, qos);
 	}
 
+	free(topics);
+out:
 	return ret;
 }
 
-int dlm_mod_message(dlm_head_t *head, const struct mosquitto_message *message)
+int dlm_mod_routes(dlm_head_t *head, struct topic_tree *routes)
 {
 	int ret = 0;
+	size_t i, count;
 
 	dlm_t *dlm = NULL;
 
 	for (dlm = head->lh_first; dlm != NULL; dlm = dlm->dl_modules.le_next) {
-		if (dlm->garden && dlm->garden->message) {
-			ret = dlm->garden->message(dlm->garden, message);
-			if (ret)
-				break;
+		count = dlm_subscription_count(dlm->garden);
+		if (!count)
+			continue;
+
+		dlm->routes = calloc(count, sizeof(struct dlm_route));
+		if (!dlm->routes) {
+			log_err("allocate routes failed");
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		for (i = 0; i < count; ++i) {
+			const struct garden_subscription *sub = &dlm->garden->subscriptions[i];
+
+			if (sub->qos < 0 || sub->qos > 2 || !sub->handler) {
+				log_err("invalid subscription for %s", sub->topic);
+				ret = -EINVAL;
+				goto out;
+			}
+
+			dlm->routes[i].garden = dlm->garden;
+			dlm->routes[i].sub = sub;
+
+			ret = topic_tree_add(routes, sub->topic, &dlm->routes[i]);
+			if (ret) {
+				log_err("add route for %s failed (%d) %s",
+					sub->topic, ret, strerror(-ret));
+				goto out;
+			}
 		}
 	}
 
+out:
 	return ret;
 }
@@ -23,11 +23,18 @@
 #define __DL_MODULE_H__
 
 #include "garden_module.h"
+#include "topic_tree.h"
 #include <sys/queue.h>
 
+struct dlm_route {
+	struct garden_module *garden;
+	const struct garden_subscription *sub;
+};
+
 typedef struct dl_module {
 	void *dl_handler;
 	struct garden_module *garden;
+	struct dlm_route *routes;
 	void (*destroy_garden_module)(struct garden_module*);
 	LIST_ENTRY(dl_module) dl_modules;
 } dlm_t;
@@ -37,8 +44,13 @@ typedef LIST_HEAD (dl_module_s, dl_module) dlm_head_t;
 int dlm_create(dlm_head_t *head, const char *filename);
 void dlm_destroy(dlm_head_t *head);
 
-int dlm_mod_init(dlm_head_t *head, const char *conf_file, struct mosquitto *mosq);
-int dlm_mod_subscribe(dlm_head_t *head);
-int dlm_mod_message(dlm_head_t *head, const struct mosquitto_message *message);
+int dlm_mod_init(dlm_head_t *head, const char *conf_file, struct mosquitto *mosq,
+		 struct garden_core *core);
+/* qos (may be NULL) returns the qos to subscribe topic with */
+typedef int (*dlm_qos_cb)(const char *topic, int qos, void *obj);
+
+int dlm_mod_subscribe(dlm_head_t *head, struct mosquitto *mosq, dlm_qos_cb qos,
+		      void *obj);
+int dlm_mod_routes(dlm_head_t *head, struct topic_tree *routes);
 
 #endif /*__DL_MODULE_H__*/
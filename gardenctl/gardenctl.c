@@ -34,18 +34,29 @@
 #include <linux/limits.h>
 #include <confuse.h>
 #include <gpioex.h>
+#include <hw.h>
+#include <stop.h>
 
 #include "arguments.h"
 #include "dl_module.h"
 #include "mqtt.h"
+#include "input.h"
+#include "sensors.h"
+#include "publish.h"
+#include "status.h"
+#include "topic_tree.h"
 #include "garden_common.h"
 
+static struct stop stop;
+
 static int run(struct arguments *args)
 {
 	int ret = EXIT_SUCCESS;
 	DIR *d = opendir(args->moddir);
 	struct dirent *dir = NULL;
 	dlm_head_t dlm_head;
+	struct gpioex_stats stats;
+	struct hw_sim_stats sim_stats;
 
 	log_dbg("modules directory: %s", args->moddir);
 
@@ -71,7 +82,24 @@ static int run(struct arguments *args)
 		}
 	}
 
-	ret = mqtt_run(&dlm_head, args);
+	ret = mqtt_run(&dlm_head, args, &stop);
+
+	gpioex_get_stats(&stats);
+	log_dbg("i2c transfers: %llu opens: %llu address switches: %llu syscalls saved: %llu",
+		(unsigned long long)stats.transfers, (unsigned long long)stats.opens,
+		(unsigned long long)stats.addr_switches,
+		(unsigned long long)stats.syscalls_saved);
+
+	if (hw_get_backend() == &hw_sim_backend) {
+		hw_sim_get_stats(&sim_stats);
+		log_dbg("hw sim: i2c messages: %llu bytes: %llu gpio events: %llu iio reads: %llu failures: %llu delay: %llu us",
+			(unsigned long long)sim_stats.i2c_msgs,
+			(unsigned long long)sim_stats.i2c_bytes,
+			(unsigned long long)sim_stats.gpio_events,
+			(unsigned long long)sim_stats.iio_reads,
+			(unsigned long long)sim_stats.failures,
+			(unsigned long long)sim_stats.delay_us);
+	}
 
 out_remove_dl_modules:
 	dlm_destroy(&dlm_head);
@@ -119,14 +147,45 @@ static void args_set_default(int argc, char *argv[], struct arguments *args)
 	memset(args, 0, sizeof(struct arguments));
 	args->app_name = argv[0];
 	args->daemonize = true;
+	args->gpioex.barrel_irq_gpio = -1;
 }
 
 static void args_free(struct arguments *args)
 {
+	size_t i;
+
 	free((void*)args->mqtt.host);
 	free((void*)args->mqtt.user);
 	free((void*)args->mqtt.pass);
 	free((void*)args->mqtt.passfile);
+	free((void*)args->mqtt.status_topic);
+	free((void*)args->hw.backend);
+	free((void*)args->history.dir);
+	free((void*)args->spool.file);
+
+	for (i = 0; i < args->gpioex.output_count; ++i) {
+		free((void*)args->gpioex.outputs[i].name);
+		free((void*)args->gpioex.outputs[i].interlock);
+	}
+	free(args->gpioex.outputs);
+
+	for (i = 0; i < args->input_count; ++i) {
+		free((void*)args->inputs[i].name);
+		free((void*)args->inputs[i].topic);
+		free((void*)args->inputs[i].payload_low);
+		free((void*)args->inputs[i].payload_high);
+	}
+	free(args->inputs);
+
+	for (i = 0; i < args->sensor_count; ++i) {
+		free((void*)args->sensors[i].name);
+		free((void*)args->sensors[i].topic);
+	}
+	free(args->sensors);
+
+	for (i = 0; i < args->publish_rule_count; ++i)
+		free((void*)args->publish_rules[i].filter);
+	free(args->publish_rules);
 }
 
 static void usage(const char *app_name)
@@ -181,11 +240,278 @@ static int conf_valid_mqtt_passfile(cfg_t *cfg, cfg_opt_t *opt)
 	return ret;
 }
 
+static int conf_valid_interval(cfg_t *cfg, cfg_opt_t *opt)
+{
+	int ret = 0;
+	long interval = cfg_opt_getnint(opt, 0);
+
+	if (interval < 0 || interval > 86400) {
+		cfg_error(cfg, "invalid interval %ld it has to be between 0 and 86400\n",
+			  interval);
+		ret = -1;
+	}
+
+	return ret;
+}
+
+static int conf_valid_backend(cfg_t *cfg, cfg_opt_t *opt)
+{
+	int ret = 0;
+	const char *name = cfg_opt_getnstr(opt, 0);
+
+	if (!hw_backend_by_name(name)) {
+		cfg_error(cfg, "unknown hardware backend %s\n", name);
+		ret = -1;
+	}
+
+	return ret;
+}
+
+static void conf_set_hw(cfg_t *cfg_hw, struct arguments *args)
+{
+	cfg_t *cfg_sim = cfg_getsec(cfg_hw, "sim");
+	struct hw_sim_conf *sim = &args->hw.sim;
+
+	args->hw.backend = strdup(cfg_getstr(cfg_hw, "backend"));
+
+	sim->i2c_khz = cfg_getint(cfg_sim, "i2c_khz");
+	sim->i2c_latency_us = cfg_getint(cfg_sim, "i2c_latency_us");
+	sim->gpio_latency_us = cfg_getint(cfg_sim, "gpio_latency_us");
+	sim->iio_latency_us = cfg_getint(cfg_sim, "iio_latency_us");
+	sim->fail_ppm = cfg_getint(cfg_sim, "fail_ppm");
+	sim->fail_errno = cfg_getint(cfg_sim, "fail_errno");
+	sim->seed = cfg_getint(cfg_sim, "seed");
+}
+
+static int conf_valid_range(cfg_t *cfg, cfg_opt_t *opt, long min, long max)
+{
+	int ret = 0;
+	long value = cfg_opt_getnint(opt, 0);
+
+	if (value < min || value > max) {
+		cfg_error(cfg, "invalid %s %ld it has to be between %ld and %ld\n",
+			  opt->name, value, min, max);
+		ret = -1;
+	}
+
+	return ret;
+}
+
+static int conf_valid_output_bus(cfg_t *cfg, cfg_opt_t *opt)
+{
+	return conf_valid_range(cfg, opt, 0, GPIOEX_BUS_COUNT - 1);
+}
+
+/* 7 bit addresses without the reserved ones */
+static int conf_valid_output_address(cfg_t *cfg, cfg_opt_t *opt)
+{
+	return conf_valid_range(cfg, opt, 0x03, 0x77);
+}
+
+static int conf_valid_output_bit(cfg_t *cfg, cfg_opt_t *opt)
+{
+	return conf_valid_range(cfg, opt, 0, 7);
+}
+
+static int conf_set_gpioex_outputs(cfg_t *cfg_gpioex, struct arguments *args)
+{
+	int ret = 0;
+	unsigned int count = cfg_size(cfg_gpioex, "output");
+	unsigned int i;
+
+	if (!count)
+		goto out;
+
+	args->gpioex.outputs = calloc(count, sizeof(*args->gpioex.outputs));
+	if (!args->gpioex.outputs) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < count; ++i) {
+		cfg_t *cfg_output = cfg_getnsec(cfg_gpioex, "output", i);
+		struct gpioex_output *output = &args->gpioex.outputs[i];
+		const char *interlock = cfg_getstr(cfg_output, "interlock");
+
+		output->name = strdup(cfg_title(cfg_output));
+		output->bus = (uint8_t)cfg_getint(cfg_output, "bus");
+		output->addr = (uint8_t)cfg_getint(cfg_output, "address");
+		output->bit = (uint8_t)cfg_getint(cfg_output, "bit");
+		output->active_low = cfg_getbool(cfg_output, "active_low");
+		output->interlock = interlock[0] ? strdup(interlock) : NULL;
+
+		args->gpioex.output_count++;
+	}
+out:
+	return ret;
+}
+
+static char *conf_strdup_nonempty(const char *str)
+{
+	return str && str[0] ? strdup(str) : NULL;
+}
+
+static int conf_set_inputs(cfg_t *cfg, struct arguments *args)
+{
+	int ret = 0;
+	unsigned int count = cfg_size(cfg, "input");
+	unsigned int i;
+
+	if (!count)
+		goto out;
+
+	args->inputs = calloc(count, sizeof(*args->inputs));
+	if (!args->inputs) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < count; ++i) {
+		cfg_t *cfg_input = cfg_getnsec(cfg, "input", i);
+		struct input_conf *input = &args->inputs[i];
+
+		if (!cfg_getstr(cfg_input, "topic")[0]) {
+			log_err("input %s has no topic", cfg_title(cfg_input));
+			ret = -EINVAL;
+			goto out;
+		}
+
+		input->name = strdup(cfg_title(cfg_input));
+		input->chip = (unsigned int)cfg_getint(cfg_input, "chip");
+		input->line = (unsigned int)cfg_getint(cfg_input, "gpio");
+		input->debounce_ms = (unsigned int)cfg_getint(cfg_input, "debounce_ms");
+		input->topic = strdup(cfg_getstr(cfg_input, "topic"));
+		input->payload_low = conf_strdup_nonempty(cfg_getstr(cfg_input, "payload_low"));
+		input->payload_high = conf_strdup_nonempty(cfg_getstr(cfg_input, "payload_high"));
+
+		args->input_count++;
+	}
+out:
+	return ret;
+}
+
+static int conf_valid_aggregate(cfg_t *cfg, cfg_opt_t *opt)
+{
+	int ret = 0;
+	const char *name = cfg_opt_getnstr(opt, 0);
+
+	if (name[0] && sensors_aggregate_by_name(name) < 0) {
+		cfg_error(cfg, "unknown aggregate %s\n", name);
+		ret = -1;
+	}
+
+	return ret;
+}
+
+static int conf_set_sensors(cfg_t *cfg, struct arguments *args)
+{
+	int ret = 0;
+	unsigned int count = cfg_size(cfg, "sensor");
+	unsigned int i;
+
+	if (!count)
+		goto out;
+
+	args->sensors = calloc(count, sizeof(*args->sensors));
+	if (!args->sensors) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < count; ++i) {
+		cfg_t *cfg_sensor = cfg_getnsec(cfg, "sensor", i);
+		struct sensor_conf *sensor = &args->sensors[i];
+		const char *aggregate = cfg_getstr(cfg_sensor, "aggregate");
+
+		sensor->name = strdup(cfg_title(cfg_sensor));
+		sensor->topic = conf_strdup_nonempty(cfg_getstr(cfg_sensor, "topic"));
+		sensor->window = cfg_getint(cfg_sensor, "window");
+		sensor->interval_sec = cfg_getint(cfg_sensor, "interval");
+		sensor->deadband = cfg_getfloat(cfg_sensor, "deadband");
+		sensor->ewma_alpha = cfg_getfloat(cfg_sensor, "ewma_alpha");
+		sensor->aggregate = aggregate[0] ? sensors_aggregate_by_name(aggregate) : -1;
+		sensor->decimals = cfg_getint(cfg_sensor, "decimals");
+
+		args->sensor_count++;
+	}
+out:
+	return ret;
+}
+
+static int conf_valid_priority(cfg_t *cfg, cfg_opt_t *opt)
+{
+	int ret = 0;
+	const char *name = cfg_opt_getnstr(opt, 0);
+
+	if (strcmp(name, "normal") && strcmp(name, "high")) {
+		cfg_error(cfg, "unknown priority %s\n", name);
+		ret = -1;
+	}
+
+	return ret;
+}
+
+static int conf_valid_qos(cfg_t *cfg, cfg_opt_t *opt)
+{
+	int ret = 0;
+	long qos = cfg_opt_getnint(opt, 0);
+
+	if (qos < PUBLISH_QOS_KEEP || qos > 2) {
+		cfg_error(cfg, "invalid qos %ld it has to be between 0 and 2\n", qos);
+		ret = -1;
+	}
+
+	return ret;
+}
+
+static int conf_set_publish_rules(cfg_t *cfg, struct arguments *args)
+{
+	int ret = 0;
+	unsigned int count = cfg_size(cfg, "publish");
+	unsigned int i;
+
+	if (!count)
+		goto out;
+
+	args->publish_rules = calloc(count, sizeof(*args->publish_rules));
+	if (!args->publish_rules) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < count; ++i) {
+		cfg_t *cfg_rule = cfg_getnsec(cfg, "publish", i);
+		struct publish_rule *rule = &args->publish_rules[i];
+
+		if (!topic_filter_is_valid(cfg_title(cfg_rule))) {
+			log_err("invalid publish topic filter %s", cfg_title(cfg_rule));
+			ret = -EINVAL;
+			goto out;
+		}
+
+		rule->filter = strdup(cfg_title(cfg_rule));
+		rule->coalesce_ms = cfg_getint(cfg_rule, "coalesce_ms");
+		rule->min_interval_ms = cfg_getint(cfg_rule, "min_interval_ms");
+		rule->high = !strcmp(cfg_getstr(cfg_rule, "priority"), "high");
+		rule->qos = cfg_getint(cfg_rule, "qos");
+		rule->retain = cfg_getbool(cfg_rule, "retain");
+		rule->expiry_sec = cfg_getint(cfg_rule, "expiry_sec");
+
+		args->publish_rule_count++;
+	}
+out:
+	return ret;
+}
+
 static int conf_set_args_from_conf_file(struct arguments *args)
 {
 	int ret = 0;
 	cfg_t *cfg;
 	cfg_t *cfg_mqtt = NULL;
+	cfg_t *cfg_gpioex = NULL;
+	cfg_t *cfg_hw = NULL;
+	cfg_t *cfg_history = NULL;
+	cfg_t *cfg_spool = NULL;
 
 	cfg_opt_t mqtt_opts[] = {
 		CFG_STR("host", "localhost", CFGF_NONE),
@@ -193,12 +519,107 @@ static int conf_set_args_from_conf_file(struct arguments *args)
 		CFG_STR("user", "", CFGF_NONE),
 		CFG_STR("password", "", CFGF_NONE),
 		CFG_STR("passfile", "", CFGF_NONE),
+		CFG_STR("status_topic", STATUS_TOPIC_DEFAULT, CFGF_NONE),
+		CFG_END()
+	};
+
+	/* output "name" { bus = 1 address = 0x22 bit = 3 interlock = "pump" } */
+	cfg_opt_t output_opts[] = {
+		CFG_INT("bus", 1, CFGF_NONE),
+		CFG_INT("address", 0, CFGF_NONE),
+		CFG_INT("bit", 0, CFGF_NONE),
+		CFG_BOOL("active_low", cfg_true, CFGF_NONE),
+		CFG_STR("interlock", "", CFGF_NONE),
+		CFG_END()
+	};
+
+	/* barrel_irq_gpio is the INT line of the barrel expander, the only one with inputs */
+	cfg_opt_t gpioex_opts[] = {
+		CFG_INT("verify_interval", 0, CFGF_NONE),
+		CFG_INT("barrel_irq_gpio", -1, CFGF_NONE),
+		CFG_SEC("output", output_opts, CFGF_MULTI | CFGF_TITLE),
+		CFG_END()
+	};
+
+	/* simulated devices, with the timing of a 100 kHz bus by default */
+	cfg_opt_t sim_opts[] = {
+		CFG_INT("i2c_khz", 100, CFGF_NONE),
+		CFG_INT("i2c_latency_us", 0, CFGF_NONE),
+		CFG_INT("gpio_latency_us", 0, CFGF_NONE),
+		CFG_INT("iio_latency_us", 0, CFGF_NONE),
+		CFG_INT("fail_ppm", 0, CFGF_NONE),
+		CFG_INT("fail_errno", EIO, CFGF_NONE),
+		CFG_INT("seed", 1, CFGF_NONE),
+		CFG_END()
+	};
+
+	cfg_opt_t hw_opts[] = {
+		CFG_STR("backend", "linux", CFGF_NONE),
+		CFG_SEC("sim", sim_opts, CFGF_NONE),
+		CFG_END()
+	};
+
+	/* input "name" { gpio = 26 topic = "/garden/sensor/tap" payload_low = "pushed" } */
+	cfg_opt_t input_opts[] = {
+		CFG_INT("chip", 0, CFGF_NONE),
+		CFG_INT("gpio", 0, CFGF_NONE),
+		CFG_INT("debounce_ms", 20, CFGF_NONE),
+		CFG_STR("topic", "", CFGF_NONE),
+		CFG_STR("payload_low", "", CFGF_NONE),
+		CFG_STR("payload_high", "", CFGF_NONE),
+		CFG_END()
+	};
+
+	/* sensor "temperature" { interval = 300 aggregate = "median" }, unset keeps the module defaults */
+	cfg_opt_t sensor_opts[] = {
+		CFG_STR("topic", "", CFGF_NONE),
+		CFG_INT("window", -1, CFGF_NONE),
+		CFG_INT("interval", -1, CFGF_NONE),
+		CFG_FLOAT("deadband", -1, CFGF_NONE),
+		CFG_FLOAT("ewma_alpha", -1, CFGF_NONE),
+		CFG_STR("aggregate", "", CFGF_NONE),
+		CFG_INT("decimals", -1, CFGF_NONE),
+		CFG_END()
+	};
+
+	/* history { dir = "/var/lib/gardenctl/history" }, without dir nothing is recorded */
+	cfg_opt_t history_opts[] = {
+		CFG_STR("dir", "", CFGF_NONE),
+		CFG_INT("segments", 16, CFGF_NONE),
+		CFG_END()
+	};
+
+	/*
+	 * publish "/garden/sensor/#" { coalesce_ms = 500 min_interval_ms = 5000 priority = "normal"
+	 *			       qos = 0 retain = false expiry_sec = 600 }, qos -1 keeps the one asked for
+	 */
+	cfg_opt_t publish_opts[] = {
+		CFG_INT("coalesce_ms", 0, CFGF_NONE),
+		CFG_INT("min_interval_ms", 0, CFGF_NONE),
+		CFG_STR("priority", "normal", CFGF_NONE),
+		CFG_INT("qos", PUBLISH_QOS_KEEP, CFGF_NONE),
+		CFG_BOOL("retain", cfg_false, CFGF_NONE),
+		CFG_INT("expiry_sec", 0, CFGF_NONE),
+		CFG_END()
+	};
+
+	/* spool { file = "/var/lib/gardenctl/spool" size_kb = 256 }, without file an outage loses messages */
+	cfg_opt_t spool_opts[] = {
+		CFG_STR("file", "", CFGF_NONE),
+		CFG_INT("size_kb", 256, CFGF_NONE),
 		CFG_END()
 	};
 
 	cfg_opt_t opts[] = {
 		CFG_INT("loglevel", -1, CFGF_NONE),
 		CFG_SEC("mqtt", mqtt_opts, CFGF_NONE),
+		CFG_SEC("gpioex", gpioex_opts, CFGF_NONE),
+		CFG_SEC("input", input_opts, CFGF_MULTI | CFGF_TITLE),
+		CFG_SEC("hardware", hw_opts, CFGF_NONE),
+		CFG_SEC("sensor", sensor_opts, CFGF_MULTI | CFGF_TITLE),
+		CFG_SEC("history", history_opts, CFGF_NONE),
+		CFG_SEC("spool", spool_opts, CFGF_NONE),
+		CFG_SEC("publish", publish_opts, CFGF_MULTI | CFGF_TITLE),
 		CFG_END()
 	};
 
@@ -206,6 +627,15 @@ static int conf_set_args_from_conf_file(struct arguments *args)
 
 	cfg_set_validate_func(cfg, "loglevel", conf_valid_loglevel);
 	cfg_set_validate_func(cfg, "mqtt|passfile", conf_valid_mqtt_passfile);
+	cfg_set_validate_func(cfg, "gpioex|verify_interval", conf_valid_interval);
+	cfg_set_validate_func(cfg, "gpioex|output|bus", conf_valid_output_bus);
+	cfg_set_validate_func(cfg, "gpioex|output|address", conf_valid_output_address);
+	cfg_set_validate_func(cfg, "gpioex|output|bit", conf_valid_output_bit);
+	cfg_set_validate_func(cfg, "hardware|backend", conf_valid_backend);
+	cfg_set_validate_func(cfg, "sensor|aggregate", conf_valid_aggregate);
+	cfg_set_validate_func(cfg, "publish|priority", conf_valid_priority);
+	cfg_set_validate_func(cfg, "publish|qos", conf_valid_qos);
+	cfg_set_validate_func(cfg, "publish|expiry_sec", conf_valid_interval);
 
 	switch (cfg_parse(cfg, args->conf_file)) {
 	case CFG_FILE_ERROR:
@@ -232,8 +662,53 @@ static int conf_set_args_from_conf_file(struct arguments *args)
 		args->mqtt.user = strdup(cfg_getstr(cfg_mqtt, "user"));
 		args->mqtt.pass = strdup(cfg_getstr(cfg_mqtt, "password"));
 		args->mqtt.passfile = strdup(cfg_getstr(cfg_mqtt, "passfile"));
+		args->mqtt.status_topic = strdup(cfg_getstr(cfg_mqtt, "status_topic"));
+	}
+
+	if (cfg_size(cfg, "gpioex") >= 0)
+		cfg_gpioex = cfg_getnsec(cfg, "gpioex", 0);
+
+	if (cfg_gpioex) {
+		args->gpioex.verify_interval = cfg_getint(cfg_gpioex, "verify_interval");
+		args->gpioex.barrel_irq_gpio = cfg_getint(cfg_gpioex, "barrel_irq_gpio");
+
+		ret = conf_set_gpioex_outputs(cfg_gpioex, args);
+		if (ret)
+			goto out;
+	}
+
+	if (cfg_size(cfg, "hardware") >= 0)
+		cfg_hw = cfg_getnsec(cfg, "hardware", 0);
+
+	if (cfg_hw)
+		conf_set_hw(cfg_hw, args);
+
+	if (cfg_size(cfg, "history") >= 0)
+		cfg_history = cfg_getnsec(cfg, "history", 0);
+
+	if (cfg_history) {
+		args->history.dir = conf_strdup_nonempty(cfg_getstr(cfg_history, "dir"));
+		args->history.segments = cfg_getint(cfg_history, "segments");
 	}
 
+	if (cfg_size(cfg, "spool") >= 0)
+		cfg_spool = cfg_getnsec(cfg, "spool", 0);
+
+	if (cfg_spool) {
+		args->spool.file = conf_strdup_nonempty(cfg_getstr(cfg_spool, "file"));
+		args->spool.size_kb = cfg_getint(cfg_spool, "size_kb");
+	}
+
+	ret = conf_set_inputs(cfg, args);
+	if (ret)
+		goto out;
+
+	ret = conf_set_sensors(cfg, args);
+	if (ret)
+		goto out;
+
+	ret = conf_set_publish_rules(cfg, args);
+
 out:
 	cfg_free(cfg);
 
@@ -255,6 +730,7 @@ static int cmdline_handler(int argc, char *argv[])
 	struct arguments args;
 	int c;
 	int long_optind = 0;
+	const struct hw_backend *backend;
 
 	args_set_default(argc, argv, &args);
 
@@ -331,8 +807,9 @@ static int cmdline_handler(int argc, char *argv[])
 
 	create_pidfile(args.pidfile);
 
+	/* a missing configuration file is ignored, an invalid one is not */
 	ret = conf_set_args_from_conf_file(&args);
-	if (ret == EINVAL)
+	if (ret < 0 && ret != -ENOENT)
 		exit(EXIT_FAILURE);
 
 	if (args.mqtt.passfile) {
@@ -347,10 +824,17 @@ static int cmdline_handler(int argc, char *argv[])
 	log_info("initialization done");
 	log_dbg("app name: %s PID: %d", args.app_name, getpid());
 
-	ret = gpioex_init();
+	backend = hw_backend_by_name(args.hw.backend);
+	if (backend == &hw_sim_backend)
+		hw_sim_setup(&args.hw.sim);
+	hw_set_backend(backend);
+
+	ret = gpioex_init(args.gpioex.outputs, args.gpioex.output_count);
 	if (ret)
 		exit(EXIT_FAILURE);
 
+	gpioex_set_barrel_irq(args.gpioex.barrel_irq_gpio);
+
 	ret = run(&args);
 
 	args_free(&args);
@@ -360,21 +844,24 @@ static int cmdline_handler(int argc, char *argv[])
 
 static void sig_handler(int signo)
 {
-	switch (signo) {
-	case SIGTERM:
-		mqtt_quit();
-		log_dbg("Exit gardenctl");
-		break;
-	}
+	stop_request(&stop);
 }
 
 static int init_signal(void)
 {
 	int ret = EXIT_SUCCESS;
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sig_handler;
+	sigemptyset(&sa.sa_mask);
 
-	if (signal(SIGTERM, sig_handler) == SIG_ERR) {
+	if (sigaction(SIGTERM, &sa, NULL) < 0) {
 		log_err("catch signal SIGTERM failed (%d) %s", errno, strerror(errno));
 		ret = EXIT_FAILURE;
+	} else if (sigaction(SIGINT, &sa, NULL) < 0) {
+		log_err("catch signal SIGINT failed (%d) %s", errno, strerror(errno));
+		ret = EXIT_FAILURE;
 	}
 
 	return ret;
@@ -382,8 +869,18 @@ static int init_signal(void)
 
 int main(int argc, char *argv[])
 {
-	if (init_signal())
+	int ret = 0;
+
+	if (stop_init(&stop))
 		return EXIT_FAILURE;
 
-	return cmdline_handler(argc, argv);
+	if (init_signal()) {
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	ret = cmdline_handler(argc, argv);
+out:
+	stop_destroy(&stop);
+	return ret;
 }
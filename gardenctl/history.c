@@ -0,0 +1,248 @@
+/*
+ * history.c
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "history.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include "logging.h"
+
+#define HISTORY_DEFAULT_SEC (24 * 60 * 60)
+/* times of a request still in ms with the last one of a second added */
+#define HISTORY_SEC_MAX (INT64_MAX / 1000 - 1)
+/* [time,value], the values are below 2^63 of the series decimals */
+#define HISTORY_POINT_LEN 64
+
+static int64_t history_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int history_init(struct history *history, struct mosquitto *mosq,
+		 struct publisher *pub, const char *dir, unsigned int segments)
+{
+	int ret = 0;
+
+	memset(history, 0, sizeof(*history));
+	history->mosq = mosq;
+	history->pub = pub;
+
+	if (!dir || !dir[0])
+		goto out;
+
+	ret = tsdb_open(&history->db, dir, segments);
+	if (ret)
+		goto out;
+
+	history->enabled = true;
+
+	log_dbg("history in %s, %u segments of %d kB per sensor", dir,
+		history->db.segments, TSDB_SEGMENT_SIZE / 1024);
+out:
+	return ret;
+}
+
+void history_destroy(struct history *history)
+{
+	if (history->enabled)
+		tsdb_close(&history->db);
+
+	history->enabled = false;
+}
+
+int history_series(struct history *history, const char *name, int decimals)
+{
+	int ret = 0;
+
+	if (!history->enabled)
+		return -ENODEV;
+
+	if (decimals > TSDB_DECIMALS_MAX)
+		decimals = TSDB_DECIMALS_MAX;
+
+	ret = tsdb_series(&history->db, name, decimals);
+	if (ret < 0)
+		log_err("open history of %s failed (%d) %s", name, ret, strerror(-ret));
+
+	return ret;
+}
+
+void history_record(struct history *history, int series, double value)
+{
+	int ret = 0;
+
+	if (!history->enabled || series < 0)
+		return;
+
+	ret = tsdb_append(&history->db, series, history_now_ms(), value);
+	if (ret)
+		log_err("record history of %s failed (%d) %s",
+			history->db.series[series].name, ret, strerror(-ret));
+}
+
+int history_subscribe(struct history *history)
+{
+	int ret = 0;
+
+	if (!history->enabled)
+		return 0;
+
+	ret = mosquitto_subscribe(history->mosq, NULL, HISTORY_TOPIC_GET,
+				  publisher_qos(history->pub, HISTORY_TOPIC_GET, 1));
+	if (ret != MOSQ_ERR_SUCCESS)
+		log_err("subscribe %s failed (%d) %s", HISTORY_TOPIC_GET, ret,
+			mosquitto_strerror(ret));
+
+	return ret;
+}
+
+static void history_publish(struct history *history, const char *name,
+			    const char *payload)
+{
+	int ret = 0;
+	char topic[128];
+
+	snprintf(topic, sizeof(topic), "%s/%s", HISTORY_TOPIC, name);
+
+	ret = publisher_publish(history->pub, topic, payload, strlen(payload), 1, 0);
+	if (ret)
+		log_err("publish history of %s failed (%d) %s", name, ret,
+			strerror(-ret));
+}
+
+static int history_answer(struct history *history, int series, int64_t from,
+			  int64_t to, int64_t step)
+{
+	int ret = 0;
+	struct tsdb_point *points;
+	char *buf = NULL;
+	size_t size, len;
+	int decimals = tsdb_decimals(&history->db, series);
+	int i, n;
+
+	points = calloc(HISTORY_POINTS_MAX, sizeof(*points));
+	if (!points) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	n = tsdb_query(&history->db, series, from * 1000, to * 1000 + 999,
+		       step * 1000, points, HISTORY_POINTS_MAX);
+	if (n < 0) {
+		ret = n;
+		goto out;
+	}
+
+	size = 128 + (size_t)n * HISTORY_POINT_LEN;
+	buf = malloc(size);
+	if (!buf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	len = snprintf(buf, size, "{\"from\":%" PRId64 ",\"to\":%" PRId64
+		       ",\"step\":%" PRId64 ",\"points\":[", from, to, step);
+
+	for (i = 0; i < n; ++i)
+		len += snprintf(buf + len, size - len, "%s[%" PRId64 ",%.*f]",
+				i ? "," : "", points[i].time_ms / 1000, decimals,
+				points[i].value);
+
+	/* the client continues after the last point */
+	snprintf(buf + len, size - len, "]%s}",
+		 n == HISTORY_POINTS_MAX ? ",\"truncated\":true" : "");
+
+	history_publish(history, history->db.series[series].name, buf);
+out:
+	free(buf);
+	free(points);
+	return ret;
+}
+
+bool history_handle(struct history *history, const struct mosquitto_message *message)
+{
+	int ret = 0;
+	char req[128];
+	char name[TSDB_NAME_MAX];
+	long long from = -HISTORY_DEFAULT_SEC;
+	long long to = 0;
+	long long step = 0;
+	int64_t now;
+	int series;
+
+	if (!history->enabled || strcmp(message->topic, HISTORY_TOPIC_GET))
+		return false;
+
+	if (message->payloadlen <= 0 || message->payloadlen >= (int)sizeof(req)) {
+		log_dbg("invalid history request");
+		return true;
+	}
+
+	memcpy(req, message->payload, message->payloadlen);
+	req[message->payloadlen] = '\0';
+
+	if (sscanf(req, "%31s %lld %lld %lld", name, &from, &to, &step) < 1) {
+		log_dbg("invalid history request %s", req);
+		return true;
+	}
+
+	series = tsdb_find(&history->db, name);
+	if (series < 0) {
+		log_dbg("no history of %s", name);
+		return true;
+	}
+
+	if (from < -HISTORY_SEC_MAX || from > HISTORY_SEC_MAX ||
+	    to < -HISTORY_SEC_MAX || to > HISTORY_SEC_MAX || step > HISTORY_SEC_MAX) {
+		log_dbg("history range out of bounds %s", req);
+		return true;
+	}
+
+	now = history_now_ms() / 1000;
+	if (from <= 0)
+		from += now;
+	if (to <= 0)
+		to += now;
+
+	/* nothing is recorded before the epoch, the buckets count from there */
+	if (from < 0)
+		from = 0;
+
+	if (from > to || step < 0) {
+		log_dbg("invalid history range %s", req);
+		return true;
+	}
+
+	ret = history_answer(history, series, from, to, step);
+	if (ret)
+		log_err("answer history request %s failed (%d) %s", req, ret,
+			strerror(-ret));
+
+	return true;
+}
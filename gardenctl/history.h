@@ -0,0 +1,61 @@
+/*
+ * history.h
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __HISTORY_H__
+#define __HISTORY_H__
+
+#include <stdbool.h>
+#include <mosquitto.h>
+#include "tsdb.h"
+#include "publish.h"
+
+/*
+ * A request "<sensor> [from [to [step]]]" to HISTORY_TOPIC_GET is answered
+ * on HISTORY_TOPIC/<sensor> with the points as JSON. Times are unix seconds,
+ * from and to not above 0 are relative to now. The default is the last day
+ * without downsampling.
+ */
+#define HISTORY_TOPIC_GET "/garden/history/get"
+#define HISTORY_TOPIC "/garden/history"
+#define HISTORY_POINTS_MAX 512
+
+/* published sensor values kept on disk */
+struct history {
+	struct mosquitto *mosq;
+	struct publisher *pub;
+	bool enabled;
+	struct tsdb db;
+};
+
+/* without dir nothing is recorded */
+int history_init(struct history *history, struct mosquitto *mosq,
+		 struct publisher *pub, const char *dir, unsigned int segments);
+void history_destroy(struct history *history);
+
+/* id of the series to record to, negative without history */
+int history_series(struct history *history, const char *name, int decimals);
+void history_record(struct history *history, int series, double value);
+
+int history_subscribe(struct history *history);
+/* true for a request, which is answered then */
+bool history_handle(struct history *history, const struct mosquitto_message *message);
+
+#endif /*__HISTORY_H__*/
@@ -0,0 +1,209 @@
+/*
+ * input.c
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "input.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "logging.h"
+
+/* the tap button of the garden, used when no input is configured */
+static const struct input_conf default_inputs[] = {
+	{
+		.name = "tap",
+		.chip = 0,
+		.line = 26,
+		.debounce_ms = 20,
+		.topic = "/garden/sensor/tap",
+		.payload_low = "pushed",
+	},
+};
+
+#define INPUT_DEFAULT_COUNT (sizeof(default_inputs) / sizeof(default_inputs[0]))
+
+static uint64_t input_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void input_on_settled(unsigned int id, int prev, int level,
+			     uint64_t timestamp_ns, void *obj)
+{
+	struct inputs *inputs = (struct inputs*)obj;
+	const struct input_conf *conf = inputs->lines[id].conf;
+	const char *payload = level ? conf->payload_high : conf->payload_low;
+	int ret = 0;
+
+	log_dbg("input %s: %d -> %d, edge %llu us ago", conf->name, prev, level,
+		(unsigned long long)(input_now_ns() - timestamp_ns) / 1000);
+
+	/* without the level read at start the first one is no change */
+	if (prev < 0 || !payload)
+		return;
+
+	/* a push is an event, it is not merged with the next one */
+	ret = publisher_publish(inputs->pub, conf->topic, payload, strlen(payload),
+				2, GARDEN_PUBLISH_HIGH);
+	if (ret)
+		log_err("publish input %s failed (%d) %s", conf->name, ret,
+			strerror(-ret));
+}
+
+static void inputs_poll(struct inputs *inputs)
+{
+	int64_t next = debounce_poll(&inputs->db, input_now_ns());
+
+	if (next >= 0)
+		reactor_timer_mod(inputs->reactor, inputs->timer,
+				  next / 1000000 + 1, 0);
+}
+
+static void input_on_timer(void *obj)
+{
+	inputs_poll((struct inputs*)obj);
+}
+
+static void input_on_event(int fd, uint32_t events, void *obj)
+{
+	struct input_line *line = (struct input_line*)obj;
+	struct inputs *inputs = line->inputs;
+	unsigned int id = line - inputs->lines;
+	struct gpio_event evs[8];
+	int ret, i;
+
+	/* reading acknowledges the edge */
+	ret = gpio_input_read(&line->gpio, evs, 8);
+
+	for (i = 0; i < ret; ++i)
+		debounce_input(&inputs->db, id, evs[i].value, evs[i].timestamp_ns);
+
+	inputs_poll(inputs);
+}
+
+static int input_line_open(struct inputs *inputs, struct input_line *line)
+{
+	int ret = 0;
+	const struct input_conf *conf = line->conf;
+	unsigned int id = line - inputs->lines;
+
+	ret = gpio_input_open(&line->gpio, conf->chip, conf->line, GPIO_EDGE_BOTH,
+			      conf->debounce_ms * 1000);
+	if (ret)
+		goto out;
+
+	/* kernel debounced events are stable as they come */
+	debounce_line_setup(&inputs->db, id,
+			    line->gpio.debounced ? 0 : conf->debounce_ms);
+
+	/* the first edge after the start is a change from this level */
+	if (line->gpio.level >= 0)
+		debounce_line_seed(&inputs->db, id, line->gpio.level);
+
+	ret = reactor_add(inputs->reactor, line->gpio.fd, line->gpio.events,
+			  input_on_event, line);
+	if (ret)
+		gpio_input_close(&line->gpio);
+out:
+	return ret;
+}
+
+int inputs_init(struct inputs *inputs, struct reactor *reactor,
+		struct publisher *pub, const struct input_conf *conf, size_t count)
+{
+	int ret = 0;
+	size_t i;
+
+	memset(inputs, 0, sizeof(*inputs));
+	inputs->reactor = reactor;
+	inputs->pub = pub;
+	inputs->timer = -1;
+
+	if (!conf) {
+		conf = default_inputs;
+		count = INPUT_DEFAULT_COUNT;
+	}
+
+	inputs->lines = calloc(count, sizeof(*inputs->lines));
+	if (!inputs->lines) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	inputs->count = count;
+	for (i = 0; i < count; ++i) {
+		inputs->lines[i].inputs = inputs;
+		inputs->lines[i].conf = &conf[i];
+		inputs->lines[i].gpio.fd = -1;
+	}
+
+	ret = debounce_init(&inputs->db, count, input_on_settled, inputs);
+	if (ret)
+		goto out;
+
+	ret = reactor_timer_add(reactor, 0, 0, input_on_timer, inputs);
+	if (ret < 0)
+		goto out;
+
+	inputs->timer = ret;
+	ret = 0;
+
+	/* a missing line costs its input only */
+	for (i = 0; i < count; ++i) {
+		if (input_line_open(inputs, &inputs->lines[i]))
+			log_err("input %s on gpio %u disabled", conf[i].name,
+				conf[i].line);
+		else
+			log_dbg("input %s on gpio %u published to %s", conf[i].name,
+				conf[i].line, conf[i].topic);
+	}
+out:
+	if (ret)
+		inputs_destroy(inputs);
+	return ret;
+}
+
+void inputs_destroy(struct inputs *inputs)
+{
+	size_t i;
+
+	for (i = 0; i < inputs->count; ++i) {
+		struct input_line *line = &inputs->lines[i];
+
+		if (line->gpio.fd < 0)
+			continue;
+
+		reactor_del(inputs->reactor, line->gpio.fd);
+		gpio_input_close(&line->gpio);
+	}
+
+	if (inputs->timer >= 0)
+		reactor_timer_del(inputs->reactor, inputs->timer);
+
+	debounce_destroy(&inputs->db);
+	free(inputs->lines);
+	inputs->lines = NULL;
+	inputs->count = 0;
+}
@@ -0,0 +1,67 @@
+/*
+ * input.h
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __INPUT_H__
+#define __INPUT_H__
+
+#include <stddef.h>
+#include <gpio.h>
+#include <debounce.h>
+#include "reactor.h"
+#include "publish.h"
+
+/*
+ * A gpio line published to topic. payload_low or payload_high is sent when
+ * the line settled on that level after a change, NULL sends nothing.
+ */
+struct input_conf {
+	const char *name;
+	unsigned int chip;
+	unsigned int line;
+	unsigned int debounce_ms;
+	const char *topic;
+	const char *payload_low;
+	const char *payload_high;
+};
+
+struct inputs;
+
+struct input_line {
+	struct inputs *inputs;
+	const struct input_conf *conf;
+	struct gpio_input gpio;
+};
+
+/* all input lines of the core, served by the reactor with one debounce timer */
+struct inputs {
+	struct reactor *reactor;
+	struct publisher *pub;
+	size_t count;
+	struct input_line *lines;
+	struct debounce db;
+	int timer;
+};
+
+int inputs_init(struct inputs *inputs, struct reactor *reactor,
+		struct publisher *pub, const struct input_conf *conf, size_t count);
+void inputs_destroy(struct inputs *inputs);
+
+#endif /*__INPUT_H__*/
@@ -25,14 +25,204 @@
 #include <mosquitto.h>
 
 #include "logging.h"
+#include "gpioex.h"
+
+#define MQTT_KEEPALIVE_SEC 30
+#define MQTT_MISC_INTERVAL_MS (MQTT_KEEPALIVE_SEC * 1000 / 4)
+#define MQTT_RECONNECT_DELAY_MS 1000
+#define MQTT_QUIT_TIMEOUT_MS 1000
 
 static struct mqtt mqtt;
 
+static void mqtt_on_socket(int fd, uint32_t events, void *obj)
+{
+	struct mqtt *mqtt = (struct mqtt*)obj;
+	int ret = MOSQ_ERR_SUCCESS;
+
+	/* errors close the socket and end up in mqtt_on_disconnect */
+	if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+		ret = mosquitto_loop_read(mqtt->mosq, 1);
+
+	if (ret == MOSQ_ERR_SUCCESS && (events & EPOLLOUT))
+		ret = mosquitto_loop_write(mqtt->mosq, 1);
+
+	if (ret != MOSQ_ERR_SUCCESS)
+		log_dbg("MQTT socket handling failed (%d) %s", ret,
+			mosquitto_strerror(ret));
+}
+
+static int mqtt_watch_socket(struct mqtt *mqtt)
+{
+	int ret = 0;
+
+	mqtt->sock = mosquitto_socket(mqtt->mosq);
+	if (mqtt->sock < 0)
+		return -ENOTCONN;
+
+	mqtt->sock_events = EPOLLIN;
+	ret = reactor_add(&mqtt->reactor, mqtt->sock, mqtt->sock_events,
+			  mqtt_on_socket, mqtt);
+	if (ret)
+		mqtt->sock = -1;
+
+	return ret;
+}
+
+static void mqtt_unwatch_socket(struct mqtt *mqtt)
+{
+	if (mqtt->sock >= 0)
+		reactor_del(&mqtt->reactor, mqtt->sock);
+	mqtt->sock = -1;
+}
+
+/* called before the loop sleeps, data queued by callbacks wants EPOLLOUT */
+static void mqtt_on_prepare(void *obj)
+{
+	struct mqtt *mqtt = (struct mqtt*)obj;
+	uint32_t events = EPOLLIN;
+
+	/* the messages of this round go out together, confirmations first */
+	publisher_flush(&mqtt->publisher, false);
+
+	if (mqtt->sock < 0)
+		return;
+
+	if (mosquitto_want_write(mqtt->mosq))
+		events |= EPOLLOUT;
+
+	if (events != mqtt->sock_events &&
+	    !reactor_mod(&mqtt->reactor, mqtt->sock, events))
+		mqtt->sock_events = events;
+}
+
+static void mqtt_on_misc_timer(void *obj)
+{
+	struct mqtt *mqtt = (struct mqtt*)obj;
+
+	if (mqtt->sock >= 0)
+		mosquitto_loop_misc(mqtt->mosq);
+}
+
+static void mqtt_on_reconnect_timer(void *obj)
+{
+	struct mqtt *mqtt = (struct mqtt*)obj;
+	int ret = 0;
+
+	/* the broker did not confirm the disconnect in time */
+	if (mqtt->quit) {
+		reactor_stop(&mqtt->reactor);
+		return;
+	}
+
+	log_dbg("MQTT reconnect");
+
+	ret = mosquitto_reconnect(mqtt->mosq);
+	if (ret == MOSQ_ERR_SUCCESS)
+		ret = mqtt_watch_socket(mqtt);
+
+	if (ret) {
+		log_err("reconnect to mqtt broker failed (%d) %s", ret,
+			mosquitto_strerror(ret));
+		reactor_timer_mod(&mqtt->reactor, mqtt->reconnect_timer,
+				  MQTT_RECONNECT_DELAY_MS, 0);
+	}
+}
+
+static void mqtt_on_disconnect(struct mosquitto *mosq, void *obj, int result)
+{
+	struct mqtt *mqtt = (struct mqtt*)obj;
+
+	mqtt->state = MQTT_STATE_DISCONNECTED;
+	publisher_set_connected(&mqtt->publisher, false);
+	mqtt_unwatch_socket(mqtt);
+
+	if (mqtt->quit) {
+		reactor_stop(&mqtt->reactor);
+		return;
+	}
+
+	log_err("MQTT connection lost (%d) %s", result, mosquitto_strerror(result));
+
+	reactor_timer_mod(&mqtt->reactor, mqtt->reconnect_timer,
+			  MQTT_RECONNECT_DELAY_MS, 0);
+}
+
+static void mqtt_on_verify_done(int ret, gpioex_mask_t changed, void *obj)
+{
+	if (ret < 0)
+		log_err("verify gpio expanders failed (%d) %s", ret, strerror(-ret));
+}
+
+static void mqtt_on_verify_timer(void *obj)
+{
+	int ret = gpioex_submit_verify(mqtt_on_verify_done, obj);
+
+	if (ret < 0)
+		log_err("queue gpio expander verify failed (%d) %s", ret, strerror(-ret));
+}
+
+static void mqtt_on_gpioex_done(int fd, uint32_t events, void *obj)
+{
+	struct mqtt *mqtt = (struct mqtt*)obj;
+
+	gpioex_worker_complete();
+
+	/* the modules switched outputs, their state is retained */
+	status_outputs(&mqtt->status);
+}
+
+/*
+ * Queued switches are done and their callbacks run while the sensors and
+ * the publisher still exist, later requests are done right away.
+ */
+static void mqtt_stop_worker(struct mqtt *mqtt)
+{
+	if (gpioex_worker_fd() >= 0)
+		reactor_del(&mqtt->reactor, gpioex_worker_fd());
+
+	gpioex_worker_stop();
+	status_outputs(&mqtt->status);
+}
+
+static void mqtt_on_stop(int fd, uint32_t events, void *obj)
+{
+	struct mqtt *mqtt = (struct mqtt*)obj;
+
+	log_dbg("Exit gardenctl");
+
+	/* the stop event stays readable */
+	reactor_del(&mqtt->reactor, fd);
+	mqtt->quit = 1;
+
+	mqtt_stop_worker(mqtt);
+
+	if (mqtt->state != MQTT_STATE_CONNECTED) {
+		/* held updates go to the spool instead of being lost */
+		publisher_flush(&mqtt->publisher, true);
+		reactor_stop(&mqtt->reactor);
+		return;
+	}
+
+	/* coalesced updates go out ahead of the disconnect */
+	status_offline(&mqtt->status);
+	publisher_flush(&mqtt->publisher, true);
+
+	/* mqtt_on_disconnect stops the loop once the broker got the disconnect */
+	mosquitto_disconnect(mqtt->mosq);
+	reactor_timer_mod(&mqtt->reactor, mqtt->reconnect_timer,
+			  MQTT_QUIT_TIMEOUT_MS, 0);
+}
+
 static void mqtt_on_log(struct mosquitto *mosq, void *obj, int level, const char *str)
 {
 	log_dbg("MQTT: %s", str);
 }
 
+static int mqtt_subscribe_qos(const char *topic, int qos, void *obj)
+{
+	return publisher_qos((struct publisher*)obj, topic, qos);
+}
+
 static void mqtt_on_connect(struct mosquitto *mosq, void *obj, int result)
 {
 	struct mqtt *mqtt = (struct mqtt*)obj;
@@ -44,16 +234,28 @@ static void mqtt_on_connect(struct mosquitto *mosq, void *obj, int result)
 	}
 
 	mqtt->state = MQTT_STATE_CONNECTED;
+	publisher_set_connected(&mqtt->publisher, true);
+	status_online(&mqtt->status);
 
 	log_dbg("MQTT client connected");
 
-	err = dlm_mod_subscribe(mqtt->dlm_head);
+	err = dlm_mod_subscribe(mqtt->dlm_head, mosq, mqtt_subscribe_qos,
+				&mqtt->publisher);
+	if (!err)
+		err = history_subscribe(&mqtt->history);
 	if (err) {
-		log_err("subscribtion failed (%d) %s", err, strerror(err));
+		log_err("subscribtion failed (%d)", err);
 		mosquitto_disconnect(mosq);
 	}
 }
 
+static void mqtt_on_publish(struct mosquitto *mosq, void *obj, int mid)
+{
+	struct mqtt *mqtt = (struct mqtt*)obj;
+
+	publisher_on_published(&mqtt->publisher, mid);
+}
+
 static void mqtt_on_subscribe(struct mosquitto *mosq, void *obj, int mid,
 			      int qos_count, const int *granted_qos)
 {
@@ -64,6 +266,14 @@ static void mqtt_on_subscribe(struct mosquitto *mosq, void *obj, int mid,
 		log_dbg("MQTT subscribed (mid %d): [%d] %d", mid, i, granted_qos[i]);
 }
 
+static int mqtt_route_message(void *obj, void *ctx)
+{
+	struct dlm_route *route = (struct dlm_route*)obj;
+	const struct mosquitto_message *message = ctx;
+
+	return route->sub->handler(route->garden, message);
+}
+
 static void mqtt_on_message(struct mosquitto *mosq, void *obj,
 			    const struct mosquitto_message *message)
 {
@@ -72,16 +282,42 @@ static void mqtt_on_message(struct mosquitto *mosq, void *obj,
 
 	log_dbg("MQTT [%s] message received:\n %s", message->topic, message->payload);
 
-	err = dlm_mod_message(mqtt->dlm_head, message);
-	if (err)
+	if (history_handle(&mqtt->history, message))
+		return;
+
+	err = topic_tree_match(&mqtt->routes, message->topic, mqtt_route_message,
+			       (void*)message);
+	if (err < 0)
 		log_err("handle message failed");
+	else if (!err)
+		log_dbg("MQTT no route for %s", message->topic);
+}
+
+static int mqtt_core_sensor_add(struct garden_core *core,
+				const struct garden_sensor *sensor)
+{
+	return sensors_add(&mqtt.sensors, sensor);
 }
 
-int mqtt_run(dlm_head_t *dlm_head, struct arguments *args)
+static int mqtt_core_sensor_push(struct garden_core *core, int sensor, double value)
+{
+	return sensors_push(&mqtt.sensors, sensor, value);
+}
+
+static int mqtt_core_publish(struct garden_core *core, const char *topic,
+			     const void *payload, size_t len, int qos,
+			     unsigned int flags)
+{
+	return publisher_publish(&mqtt.publisher, topic, payload, len, qos, flags);
+}
+
+int mqtt_run(dlm_head_t *dlm_head, struct arguments *args, struct stop *stop)
 {
 	int ret = 0;
 
 	memset(&mqtt, 0, sizeof(struct mqtt));
+	mqtt.sock = -1;
+	mqtt.stop = stop;
 
 	ret = mosquitto_lib_init();
 	if (ret != MOSQ_ERR_SUCCESS)
@@ -96,21 +332,95 @@ int mqtt_run(dlm_head_t *dlm_head, struct arguments *args)
 
 	log_dbg("MQTT client created");
 
+	ret = reactor_init(&mqtt.reactor);
+	if (ret)
+		goto out_destroy;
+
+	mqtt.reactor.core.stop = stop;
+
+	ret = reactor_add(&mqtt.reactor, stop_fd(stop), EPOLLIN, mqtt_on_stop, &mqtt);
+	if (ret)
+		goto out_reactor;
+
+	/* i2c transfers leave the loop, their results come back as events */
+	ret = gpioex_worker_start();
+	if (ret)
+		goto out_reactor;
+
+	ret = reactor_add(&mqtt.reactor, gpioex_worker_fd(), EPOLLIN,
+			  mqtt_on_gpioex_done, &mqtt);
+	if (ret)
+		goto out_worker;
+
+	/* without the spool messages of an outage are lost */
+	if (args->spool.file) {
+		ret = spool_open(&mqtt.spool, args->spool.file, args->spool.size_kb * 1024);
+		if (ret)
+			log_err("open spool %s failed (%d) %s", args->spool.file, ret,
+				strerror(-ret));
+	}
+
+	ret = publisher_init(&mqtt.publisher, &mqtt.reactor, mqtt.mosq,
+			     mqtt.spool.hdr ? &mqtt.spool : NULL,
+			     args->publish_rules, args->publish_rule_count);
+	if (ret)
+		goto out_spool;
+
+	mqtt.reactor.core.publish = mqtt_core_publish;
+
+	/* inputs are published on their own, a missing line does not stop us */
+	ret = inputs_init(&mqtt.inputs, &mqtt.reactor, &mqtt.publisher, args->inputs,
+			  args->input_count);
+	if (ret)
+		goto out_publisher;
+
+	/* sensors are still published without their history */
+	ret = history_init(&mqtt.history, mqtt.mosq, &mqtt.publisher,
+			   args->history.dir, args->history.segments);
+	if (ret)
+		log_err("open history failed (%d) %s", ret, strerror(-ret));
+
+	/* modules add their sensors from init */
+	ret = sensors_init(&mqtt.sensors, &mqtt.reactor, &mqtt.publisher,
+			   &mqtt.history, args->sensors, args->sensor_count);
+	if (ret)
+		goto out_history;
+
+	mqtt.reactor.core.sensor_add = mqtt_core_sensor_add;
+	mqtt.reactor.core.sensor_push = mqtt_core_sensor_push;
+
 	mqtt.dlm_head = dlm_head;
 
-	ret = dlm_mod_init(dlm_head, args->conf_file, mqtt.mosq);
+	ret = dlm_mod_init(dlm_head, args->conf_file, mqtt.mosq,
+			   &mqtt.reactor.core);
 	if (ret < 0) {
 		log_err("initiate modules failed (%d) %s", ret, strerror(ret));
-		goto out_destroy;
+		goto out_sensors;
 	}
 
-	//TODO: set last will if neseccary
+	ret = topic_tree_init(&mqtt.routes);
+	if (ret)
+		goto out_sensors;
+
+	ret = dlm_mod_routes(dlm_head, &mqtt.routes);
+	if (ret)
+		goto out_routes;
+
+	log_dbg("MQTT %zu routes created", mqtt.routes.count);
+
+	/* the last will is part of the connect */
+	ret = status_init(&mqtt.status, mqtt.mosq, &mqtt.publisher,
+			  args->mqtt.status_topic);
+	if (ret)
+		log_err("publish status failed (%d) %s", ret, strerror(-ret));
+
+	status_outputs(&mqtt.status);
 
 	ret = mosquitto_username_pw_set(mqtt.mosq, args->mqtt.user, args->mqtt.pass);
 	if (ret != MOSQ_ERR_SUCCESS) {
 		log_err("set mosquitto username and passowrd failed (%d) %s", ret,
 			strerror(ret));
-		goto out_destroy;
+		goto out_routes;
 	}
 
 	log_dbg("MQTT set host: %s port: %d", args->mqtt.host, args->mqtt.port);
@@ -118,23 +428,77 @@ int mqtt_run(dlm_head_t *dlm_head, struct arguments *args)
 
 	mosquitto_log_callback_set(mqtt.mosq, mqtt_on_log);
 	mosquitto_connect_callback_set(mqtt.mosq, mqtt_on_connect);
+	mosquitto_disconnect_callback_set(mqtt.mosq, mqtt_on_disconnect);
 	mosquitto_subscribe_callback_set(mqtt.mosq, mqtt_on_subscribe);
+	mosquitto_publish_callback_set(mqtt.mosq, mqtt_on_publish);
 	mosquitto_message_callback_set(mqtt.mosq, mqtt_on_message);
 
+	ret = reactor_timer_add(&mqtt.reactor, 0, MQTT_MISC_INTERVAL_MS,
+				mqtt_on_misc_timer, &mqtt);
+	if (ret < 0)
+		goto out_routes;
+	mqtt.misc_timer = ret;
+
+	ret = reactor_timer_add(&mqtt.reactor, 0, 0, mqtt_on_reconnect_timer,
+				&mqtt);
+	if (ret < 0)
+		goto out_routes;
+	mqtt.reconnect_timer = ret;
+
+	if (args->gpioex.verify_interval) {
+		ret = reactor_timer_add(&mqtt.reactor, 0,
+					args->gpioex.verify_interval * 1000,
+					mqtt_on_verify_timer, &mqtt);
+		if (ret < 0)
+			goto out_routes;
+	}
+
+	reactor_set_prepare(&mqtt.reactor, mqtt_on_prepare, &mqtt);
+
 	log_dbg("MQTT client iniated");
 
-	ret = mosquitto_connect(mqtt.mosq, args->mqtt.host, args->mqtt.port, 30);
-	if (ret != MOSQ_ERR_SUCCESS) {
-		log_err("connect to mqtt broker failed (%d) %s", ret, strerror(ret));
-		goto out_destroy;
+	/* a broker away at start is retried, the spool keeps what comes meanwhile */
+	ret = mosquitto_connect(mqtt.mosq, args->mqtt.host, args->mqtt.port,
+				MQTT_KEEPALIVE_SEC);
+	if (ret == MOSQ_ERR_SUCCESS)
+		ret = mqtt_watch_socket(&mqtt);
+
+	if (ret) {
+		log_err("connect to mqtt broker failed (%d) %s", ret,
+			ret < 0 ? strerror(-ret) : mosquitto_strerror(ret));
+		reactor_timer_mod(&mqtt.reactor, mqtt.reconnect_timer,
+				  MQTT_RECONNECT_DELAY_MS, 0);
 	}
 
-	mosquitto_loop_forever(mqtt.mosq, -1, 1);
+	ret = reactor_run(&mqtt.reactor);
+
+	/* also when the loop ended on an error */
+	mqtt_stop_worker(&mqtt);
+
+	if (mqtt.state == MQTT_STATE_CONNECTED) {
+		mosquitto_disconnect(mqtt.mosq);
+		mosquitto_loop_write(mqtt.mosq, 1);
+	}
 
 	mqtt.state = MQTT_STATE_DISCONNECTED;
 
 	log_dbg("MQTT client disconnected");
 
+out_routes:
+	topic_tree_destroy(&mqtt.routes);
+out_sensors:
+	sensors_destroy(&mqtt.sensors);
+out_history:
+	history_destroy(&mqtt.history);
+	inputs_destroy(&mqtt.inputs);
+out_publisher:
+	publisher_destroy(&mqtt.publisher);
+out_spool:
+	spool_close(&mqtt.spool);
+out_worker:
+	gpioex_worker_stop();
+out_reactor:
+	reactor_destroy(&mqtt.reactor);
 out_destroy:
 	mosquitto_destroy(mqtt.mosq);
 	log_dbg("MQTT client destroied");
@@ -143,9 +507,3 @@ out_cleanup:
 out:
 	return ret;
 }
-
-void mqtt_quit(void)
-{
-	if (mqtt.state == MQTT_STATE_CONNECTED)
-		mosquitto_disconnect(mqtt.mosq);
-}
@@ -23,7 +23,13 @@
 #define __MQTT_H__
 
 #include <mosquitto.h>
+#include <stop.h>
 #include "dl_module.h"
+#include "reactor.h"
+#include "publish.h"
+#include "status.h"
+#include "input.h"
+#include "sensors.h"
 #include "arguments.h"
 
 enum mqtt_state {
@@ -34,10 +40,23 @@ enum mqtt_state {
 struct mqtt {
 	struct mosquitto *mosq;
 	dlm_head_t *dlm_head;
+	struct topic_tree routes;
+	struct reactor reactor;
+	struct inputs inputs;
+	struct spool spool;
+	struct publisher publisher;
+	struct status status;
+	struct history history;
+	struct sensors sensors;
+	int sock;
+	uint32_t sock_events;
+	int misc_timer;
+	int reconnect_timer;
 	enum mqtt_state state;
+	struct stop *stop;
+	int quit;
 };
 
-int mqtt_run(dlm_head_t* dlm_head, struct arguments *args);
-void mqtt_quit(void);
+int mqtt_run(dlm_head_t* dlm_head, struct arguments *args, struct stop *stop);
 
 #endif /*__MQTT_H__*/
@@ -0,0 +1,621 @@
+/*
+ * publish.c
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "publish.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "logging.h"
+
+/*
+ * Bursts of sensor jitter become one message, a lost sample is replaced by
+ * the next one. A button push is an event and keeps its qos.
+ */
+static const struct publish_rule default_rules[] = {
+	{
+		.filter = "/garden/sensor/tap",
+		.qos = PUBLISH_QOS_KEEP,
+	},
+	{
+		.filter = "/garden/sensor/#",
+		.coalesce_ms = 500,
+		.qos = 0,
+	},
+};
+
+#define PUBLISH_DEFAULT_RULES (sizeof(default_rules) / sizeof(default_rules[0]))
+
+struct publish_msg {
+	struct mpsc_node node;
+	size_t len;
+	int qos;
+	unsigned int flags;
+	char *payload;
+	char topic[];
+};
+
+static uint64_t publish_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct publish_msg *publish_msg_new(const char *topic, const void *payload,
+					   size_t len, int qos, unsigned int flags)
+{
+	size_t topic_len = strlen(topic) + 1;
+	struct publish_msg *msg = malloc(sizeof(*msg) + topic_len + len);
+
+	if (!msg)
+		return NULL;
+
+	msg->len = len;
+	msg->qos = qos;
+	msg->flags = flags;
+	memcpy(msg->topic, topic, topic_len);
+	msg->payload = msg->topic + topic_len;
+	memcpy(msg->payload, payload, len);
+
+	return msg;
+}
+
+static void publish_spool(struct publisher *pub, const struct publish_msg *msg)
+{
+	int ret = spool_append(pub->spool, msg->topic, msg->payload, msg->len,
+			       msg->qos, msg->flags);
+
+	if (ret) {
+		log_err("spool %s failed (%d) %s", msg->topic, ret, strerror(-ret));
+		++pub->stats.failed;
+	} else {
+		++pub->stats.spooled;
+	}
+}
+
+/* false when the message went to the spool */
+static bool publish_send(struct publisher *pub, const struct publish_msg *msg)
+{
+	int ret = 0;
+
+	/* in order behind the spooled messages */
+	if (pub->spool && !(msg->flags & GARDEN_PUBLISH_LIVE) &&
+	    (!pub->connected || !spool_is_empty(pub->spool))) {
+		publish_spool(pub, msg);
+		return false;
+	}
+
+	ret = mosquitto_publish(pub->mosq, NULL, msg->topic, msg->len, msg->payload,
+				msg->qos, msg->flags & GARDEN_PUBLISH_RETAIN);
+	if (ret == MOSQ_ERR_NO_CONN && pub->spool &&
+	    !(msg->flags & GARDEN_PUBLISH_LIVE)) {
+		publish_spool(pub, msg);
+		return false;
+	}
+
+	if (ret) {
+		log_err("publish %s failed (%d) %s", msg->topic, ret,
+			mosquitto_strerror(ret));
+		++pub->stats.failed;
+	} else {
+		++pub->stats.sent;
+	}
+
+	return true;
+}
+
+/* the first rule of the configuration matching */
+static int publish_rule_match(void *obj, void *ctx)
+{
+	const struct publish_rule *rule = (const struct publish_rule*)obj;
+	const struct publish_rule **best = (const struct publish_rule**)ctx;
+
+	if (!*best || rule < *best)
+		*best = rule;
+
+	return 0;
+}
+
+static const struct publish_rule *publish_rule_find(struct publisher *pub,
+						     const char *topic)
+{
+	const struct publish_rule *rule = NULL;
+
+	topic_tree_match(&pub->rules, topic, publish_rule_match, &rule);
+
+	return rule;
+}
+
+int publisher_qos(struct publisher *pub, const char *topic, int qos)
+{
+	const struct publish_rule *rule = publish_rule_find(pub, topic);
+
+	if (rule && rule->qos != PUBLISH_QOS_KEEP)
+		qos = rule->qos;
+
+	return qos;
+}
+
+static struct publish_topic *publish_topic_get(struct publisher *pub,
+					       const char *topic)
+{
+	struct publish_topic *t;
+	size_t i;
+
+	for (i = 0; i < pub->count; ++i) {
+		if (!strcmp(pub->topics[i].topic, topic))
+			return &pub->topics[i];
+	}
+
+	if (pub->count == pub->size) {
+		size_t size = pub->size ? 2 * pub->size : 16;
+
+		t = realloc(pub->topics, size * sizeof(*t));
+		if (!t)
+			return NULL;
+
+		pub->topics = t;
+		pub->size = size;
+	}
+
+	t = &pub->topics[pub->count];
+	memset(t, 0, sizeof(*t));
+
+	t->topic = strdup(topic);
+	if (!t->topic)
+		return NULL;
+
+	t->rule = publish_rule_find(pub, topic);
+	++pub->count;
+
+	return t;
+}
+
+static bool publish_topic_is_high(const struct publish_topic *t)
+{
+	return (t->msg->flags & GARDEN_PUBLISH_HIGH) || (t->rule && t->rule->high);
+}
+
+/* not coalesced and not limited, sent as they come */
+static bool publish_topic_is_direct(const struct publish_topic *t)
+{
+	if (!t->rule)
+		return true;
+
+	if (t->rule->min_interval_ms)
+		return false;
+
+	return publish_topic_is_high(t) || !t->rule->coalesce_ms;
+}
+
+static bool publish_topic_is_expired(const struct publish_topic *t, uint64_t now)
+{
+	return t->rule && t->rule->expiry_sec &&
+	       now - t->queued_ms >= (uint64_t)t->rule->expiry_sec * 1000;
+}
+
+static uint64_t publish_topic_due(const struct publish_topic *t)
+{
+	uint64_t due = t->queued_ms;
+
+	if (t->rule && !publish_topic_is_high(t))
+		due += t->rule->coalesce_ms;
+
+	if (t->rule && t->sent && t->sent_ms + t->rule->min_interval_ms > due)
+		due = t->sent_ms + t->rule->min_interval_ms;
+
+	return due;
+}
+
+/*
+ * A retained message is kept to be sent again after a reconnect, a spooled
+ * one is delivered by the spool.
+ */
+static void publish_topic_send(struct publisher *pub, struct publish_topic *t,
+			       uint64_t now)
+{
+	struct publish_msg *msg = t->msg;
+	bool sent;
+
+	t->msg = NULL;
+	t->sent = true;
+	t->sent_ms = now;
+	sent = publish_send(pub, msg);
+
+	free(t->retained);
+	t->retained = NULL;
+
+	if (sent && (msg->flags & GARDEN_PUBLISH_RETAIN))
+		t->retained = msg;
+	else
+		free(msg);
+}
+
+/* sent now, or to the spool in its place */
+static bool publish_topic_can_send(const struct publisher *pub,
+				   const struct publish_topic *t)
+{
+	return pub->connected ||
+	       (pub->spool && !(t->msg->flags & GARDEN_PUBLISH_LIVE));
+}
+
+static void publish_merge(struct publisher *pub, struct publish_msg *msg)
+{
+	struct publish_topic *t = publish_topic_get(pub, msg->topic);
+
+	++pub->stats.queued;
+
+	if (!t) {
+		log_err("queue %s failed (%d) %s", msg->topic, -ENOMEM,
+			strerror(ENOMEM));
+		++pub->stats.failed;
+		free(msg);
+		return;
+	}
+
+	if (t->msg) {
+		free(t->msg);
+		++pub->stats.coalesced;
+	} else {
+		t->queued_ms = publish_now_ms();
+	}
+
+	/* the rule decides once, a spooled message keeps it */
+	if (t->rule) {
+		if (t->rule->qos != PUBLISH_QOS_KEEP)
+			msg->qos = t->rule->qos;
+		if (t->rule->retain)
+			msg->flags |= GARDEN_PUBLISH_RETAIN;
+	}
+
+	t->msg = msg;
+
+	if (publish_topic_can_send(pub, t) && publish_topic_is_direct(t)) {
+		publish_topic_send(pub, t, t->queued_ms);
+		return;
+	}
+
+	pub->dirty = true;
+}
+
+static void publish_on_queue(int fd, uint32_t events, void *obj)
+{
+	struct publisher *pub = (struct publisher*)obj;
+	struct mpsc_node *node;
+	eventfd_t count;
+
+	eventfd_read(pub->fd, &count);
+
+	while ((node = mpsc_pop(&pub->queue)))
+		publish_merge(pub, (struct publish_msg*)node);
+}
+
+static void publish_on_timer(void *obj)
+{
+	publisher_flush((struct publisher*)obj, false);
+}
+
+static void publish_release(struct publisher *pub)
+{
+	struct publish_inflight *in;
+
+	while (pub->inflight_count) {
+		in = &pub->inflight[pub->inflight_head];
+		if (!in->done)
+			break;
+
+		spool_release(pub->spool, in->end);
+		pub->inflight_head = (pub->inflight_head + 1) % PUBLISH_INFLIGHT_MAX;
+		--pub->inflight_count;
+	}
+}
+
+static bool publish_spooled_is_expired(struct publisher *pub,
+				       const struct spool_msg *msg, time_t now)
+{
+	const struct publish_rule *rule = publish_rule_find(pub, msg->topic);
+
+	return rule && rule->expiry_sec && now - msg->time >= rule->expiry_sec;
+}
+
+/* the next spooled messages, as many as the broker has not acknowledged yet */
+static void publish_replay(struct publisher *pub)
+{
+	struct publish_inflight *in;
+	struct spool_msg *msg;
+	time_t now = time(NULL);
+	bool expired;
+	int ret, mid;
+
+	while (pub->inflight_count < PUBLISH_INFLIGHT_MAX &&
+	       spool_has_next(pub->spool)) {
+		if (spool_next(pub->spool, &msg))
+			break;
+
+		mid = -1;
+		ret = MOSQ_ERR_SUCCESS;
+		expired = publish_spooled_is_expired(pub, msg, now);
+		if (!expired)
+			ret = mosquitto_publish(pub->mosq, &mid, msg->topic, msg->len,
+						msg->payload, msg->qos,
+						msg->flags & GARDEN_PUBLISH_RETAIN);
+		if (ret == MOSQ_ERR_NO_CONN) {
+			spool_rewind(pub->spool, msg->pos);
+			free(msg);
+			break;
+		}
+
+		/*
+		 * mosquitto resends qos 1 and 2 after a reconnect, their ack
+		 * releases them from the spool. qos 0 is done once handed over
+		 * and a message mosquitto refuses would block the spool forever.
+		 */
+		in = &pub->inflight[(pub->inflight_head + pub->inflight_count) %
+				    PUBLISH_INFLIGHT_MAX];
+		in->mid = mid;
+		in->end = msg->end;
+		in->done = expired || ret != MOSQ_ERR_SUCCESS || !msg->qos;
+		++pub->inflight_count;
+
+		if (expired) {
+			++pub->stats.expired;
+		} else if (ret) {
+			log_err("publish spooled %s failed (%d) %s", msg->topic, ret,
+				mosquitto_strerror(ret));
+			++pub->stats.failed;
+		} else {
+			++pub->stats.replayed;
+		}
+
+		free(msg);
+	}
+
+	publish_release(pub);
+}
+
+void publisher_on_published(struct publisher *pub, int mid)
+{
+	unsigned int i;
+
+	for (i = 0; i < pub->inflight_count; ++i) {
+		struct publish_inflight *in =
+			&pub->inflight[(pub->inflight_head + i) % PUBLISH_INFLIGHT_MAX];
+
+		if (in->mid == mid && !in->done) {
+			in->done = true;
+			break;
+		}
+	}
+
+	publish_release(pub);
+}
+
+void publisher_flush(struct publisher *pub, bool force)
+{
+	uint64_t now = publish_now_ms();
+	uint64_t next = UINT64_MAX;
+	struct publish_topic *t;
+	int high;
+	size_t i;
+
+	if (!pub->connected && !pub->spool)
+		return;
+
+	if (pub->connected && pub->spool)
+		publish_replay(pub);
+
+	if (!force && !pub->dirty && now < pub->next_ms)
+		return;
+
+	pub->dirty = false;
+
+	/* confirmations do not wait behind telemetry */
+	for (high = 1; high >= 0; --high) {
+		for (i = 0; i < pub->count; ++i) {
+			uint64_t due;
+
+			t = &pub->topics[i];
+			if (!t->msg || publish_topic_is_high(t) != high ||
+			    !publish_topic_can_send(pub, t))
+				continue;
+
+			/* stale state is worse than none */
+			if (publish_topic_is_expired(t, now)) {
+				free(t->msg);
+				t->msg = NULL;
+				++pub->stats.expired;
+				continue;
+			}
+
+			due = publish_topic_due(t);
+			if (!force && due > now) {
+				if (due < next)
+					next = due;
+				continue;
+			}
+
+			publish_topic_send(pub, t, now);
+		}
+	}
+
+	pub->next_ms = next;
+	if (next != UINT64_MAX)
+		reactor_timer_mod(pub->reactor, pub->timer, next - now, 0);
+}
+
+void publisher_set_connected(struct publisher *pub, bool connected)
+{
+	uint64_t now = publish_now_ms();
+	struct publish_topic *t;
+	size_t i;
+
+	/* the broker may have lost the retained state, it goes out in one round */
+	if (connected && !pub->connected) {
+		for (i = 0; i < pub->count; ++i) {
+			t = &pub->topics[i];
+			if (!t->retained || t->msg)
+				continue;
+
+			t->msg = t->retained;
+			t->retained = NULL;
+			t->queued_ms = now;
+			t->sent = false;
+			++pub->stats.republished;
+		}
+	}
+
+	pub->connected = connected;
+	pub->dirty = true;
+}
+
+int publisher_publish(struct publisher *pub, const char *topic,
+		      const void *payload, size_t len, int qos, unsigned int flags)
+{
+	struct publish_msg *msg;
+
+	if (pub->fd < 0)
+		return -ENOTCONN;
+
+	msg = publish_msg_new(topic, payload, len, qos, flags);
+	if (!msg)
+		return -ENOMEM;
+
+	if (pthread_equal(pthread_self(), pub->thread)) {
+		publish_merge(pub, msg);
+		return 0;
+	}
+
+	mpsc_push(&pub->queue, &msg->node);
+	eventfd_write(pub->fd, 1);
+
+	return 0;
+}
+
+int publisher_init(struct publisher *pub, struct reactor *reactor,
+		   struct mosquitto *mosq, struct spool *spool,
+		   const struct publish_rule *rules, size_t count)
+{
+	int ret = 0;
+	size_t i;
+
+	memset(pub, 0, sizeof(*pub));
+	pub->reactor = reactor;
+	pub->mosq = mosq;
+	pub->spool = spool;
+	pub->thread = pthread_self();
+	pub->fd = -1;
+	pub->timer = -1;
+	pub->next_ms = UINT64_MAX;
+	mpsc_init(&pub->queue);
+
+	if (!count) {
+		rules = default_rules;
+		count = PUBLISH_DEFAULT_RULES;
+	}
+
+	ret = topic_tree_init(&pub->rules);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < count; ++i) {
+		ret = topic_tree_add(&pub->rules, rules[i].filter, (void*)&rules[i]);
+		if (ret) {
+			log_err("add publish rule %s failed (%d) %s", rules[i].filter,
+				ret, strerror(-ret));
+			goto out_rules;
+		}
+	}
+
+	ret = reactor_timer_add(reactor, 0, 0, publish_on_timer, pub);
+	if (ret < 0)
+		goto out_rules;
+	pub->timer = ret;
+
+	pub->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (pub->fd < 0) {
+		ret = -errno;
+		log_err("create publish event failed (%d) %s", ret, strerror(-ret));
+		goto out_timer;
+	}
+
+	ret = reactor_add(reactor, pub->fd, EPOLLIN, publish_on_queue, pub);
+	if (ret)
+		goto out_fd;
+
+	goto out;
+
+out_fd:
+	close(pub->fd);
+	pub->fd = -1;
+out_timer:
+	reactor_timer_del(reactor, pub->timer);
+out_rules:
+	topic_tree_destroy(&pub->rules);
+out:
+	return ret;
+}
+
+void publisher_destroy(struct publisher *pub)
+{
+	struct mpsc_node *node;
+	size_t i;
+
+	if (pub->fd < 0)
+		return;
+
+	log_dbg("published %llu of %llu messages, %llu coalesced, %llu spooled, "
+		"%llu replayed, %llu republished, %llu expired, %llu failed",
+		(unsigned long long)pub->stats.sent,
+		(unsigned long long)pub->stats.queued,
+		(unsigned long long)pub->stats.coalesced,
+		(unsigned long long)pub->stats.spooled,
+		(unsigned long long)pub->stats.replayed,
+		(unsigned long long)pub->stats.republished,
+		(unsigned long long)pub->stats.expired,
+		(unsigned long long)pub->stats.failed);
+
+	reactor_del(pub->reactor, pub->fd);
+	reactor_timer_del(pub->reactor, pub->timer);
+	close(pub->fd);
+	pub->fd = -1;
+
+	while ((node = mpsc_pop(&pub->queue)))
+		free(node);
+
+	for (i = 0; i < pub->count; ++i) {
+		free(pub->topics[i].topic);
+		free(pub->topics[i].msg);
+		free(pub->topics[i].retained);
+	}
+
+	free(pub->topics);
+	pub->topics = NULL;
+	pub->count = 0;
+	pub->size = 0;
+
+	topic_tree_destroy(&pub->rules);
+}
@@ -0,0 +1,149 @@
+/*
+ * publish.h
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __PUBLISH_H__
+#define __PUBLISH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <mosquitto.h>
+#include <mpsc.h>
+#include "reactor.h"
+#include "topic_tree.h"
+#include "spool.h"
+
+/* spooled messages sent and not acknowledged by the broker */
+#define PUBLISH_INFLIGHT_MAX 16
+
+/* qos of a rule that keeps the one of the publisher */
+#define PUBLISH_QOS_KEEP -1
+
+/*
+ * Publish rule of the topics matching filter, the first matching rule of
+ * the configuration applies. Updates of a topic within coalesce_ms after
+ * the first one are merged into the last of them, a topic is sent at most
+ * every min_interval_ms. high topics skip the coalescing and go out ahead
+ * of the others.
+ *
+ * qos replaces the one of the publisher and of a subscription to the
+ * topics, retain adds GARDEN_PUBLISH_RETAIN. A message not sent within
+ * expiry_sec, pending or spooled, is dropped. 0 keeps it forever.
+ */
+struct publish_rule {
+	const char *filter;
+	unsigned int coalesce_ms;
+	unsigned int min_interval_ms;
+	bool high;
+	int qos;
+	bool retain;
+	unsigned int expiry_sec;
+};
+
+struct publish_msg;
+
+struct publish_topic {
+	char *topic;
+	const struct publish_rule *rule;
+	/* latest update not sent yet */
+	struct publish_msg *msg;
+	/* last retained message sent, again after a reconnect */
+	struct publish_msg *retained;
+	uint64_t queued_ms;
+	uint64_t sent_ms;
+	bool sent;
+};
+
+struct publish_inflight {
+	int mid;
+	uint64_t end;
+	bool done;
+};
+
+struct publish_stats {
+	uint64_t queued;
+	uint64_t sent;
+	uint64_t coalesced;
+	uint64_t spooled;
+	uint64_t replayed;
+	uint64_t republished;
+	uint64_t expired;
+	uint64_t failed;
+};
+
+/*
+ * Outbound messages of the core and the modules. Any thread may publish,
+ * messages of other threads are passed through a lock-free queue to the
+ * thread of the reactor which alone talks to mosquitto. With a spool the
+ * messages of a disconnect go to disk and are sent in order once the
+ * broker is back, newer ones queue behind them until the spool is empty.
+ */
+struct publisher {
+	struct reactor *reactor;
+	struct mosquitto *mosq;
+	pthread_t thread;
+	struct mpsc_queue queue;
+	int fd;
+	int timer;
+	struct topic_tree rules;
+	struct publish_topic *topics;
+	size_t count;
+	size_t size;
+	bool connected;
+	/* NULL keeps only the latest update of a topic while disconnected */
+	struct spool *spool;
+	struct publish_inflight inflight[PUBLISH_INFLIGHT_MAX];
+	unsigned int inflight_head;
+	unsigned int inflight_count;
+	/* updates not looked at by publisher_flush() yet */
+	bool dirty;
+	uint64_t next_ms;
+	struct publish_stats stats;
+};
+
+/* without rules the sensor topics are coalesced for a short while */
+int publisher_init(struct publisher *pub, struct reactor *reactor,
+		   struct mosquitto *mosq, struct spool *spool,
+		   const struct publish_rule *rules, size_t count);
+void publisher_destroy(struct publisher *pub);
+
+/* flags are GARDEN_PUBLISH_*, payload is copied */
+int publisher_publish(struct publisher *pub, const char *topic,
+		      const void *payload, size_t len, int qos, unsigned int flags);
+
+/* the qos of topic after the rules, qos is the one asked for */
+int publisher_qos(struct publisher *pub, const char *topic, int qos);
+
+/* sends the due messages, force sends all pending ones */
+void publisher_flush(struct publisher *pub, bool force);
+
+/*
+ * Nothing is sent while disconnected. Spooled messages stay in the spool
+ * until the broker acknowledged them, after a restart they are sent again.
+ * On a connect the last retained message of every topic is sent again.
+ */
+void publisher_set_connected(struct publisher *pub, bool connected);
+
+/* the broker acknowledged message mid */
+void publisher_on_published(struct publisher *pub, int mid);
+
+#endif /*__PUBLISH_H__*/
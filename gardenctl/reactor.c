@@ -0,0 +1,382 @@
+/*
+ * reactor.c
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "reactor.h"
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/timerfd.h>
+
+#include "logging.h"
+
+#define REACTOR_MAX_EVENTS 16
+
+#define reactor_of(__core) \
+	((struct reactor*)((char*)(__core) - offsetof(struct reactor, core)))
+
+struct reactor_watch {
+	int fd;
+	uint32_t events;
+	garden_fd_cb_t cb;
+	void *obj;
+	LIST_ENTRY(reactor_watch) watches;
+};
+
+static struct reactor_watch *reactor_find(struct reactor *reactor, int fd)
+{
+	struct reactor_watch *watch;
+
+	for (watch = reactor->watches.lh_first; watch != NULL;
+	     watch = watch->watches.le_next) {
+		if (watch->fd == fd)
+			return watch;
+	}
+
+	return NULL;
+}
+
+int reactor_add(struct reactor *reactor, int fd, uint32_t events,
+		garden_fd_cb_t cb, void *obj)
+{
+	int ret = 0;
+	struct epoll_event ev;
+	struct reactor_watch *w;
+
+	if (fd < 0 || !cb) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (reactor_find(reactor, fd)) {
+		log_err("fd %d already watched", fd);
+		ret = -EEXIST;
+		goto out;
+	}
+
+	w = calloc(1, sizeof(*w));
+	if (!w) {
+		log_err("allocate watch for fd %d failed", fd);
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	w->fd = fd;
+	w->events = events;
+	w->cb = cb;
+	w->obj = obj;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = w;
+
+	if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		ret = -errno;
+		log_err("watch fd %d failed (%d) %s", fd, errno, strerror(errno));
+		free(w);
+		goto out;
+	}
+
+	LIST_INSERT_HEAD(&reactor->watches, w, watches);
+out:
+	return ret;
+}
+
+int reactor_mod(struct reactor *reactor, int fd, uint32_t events)
+{
+	struct epoll_event ev;
+	struct reactor_watch *watch = reactor_find(reactor, fd);
+	int ret;
+
+	if (!watch)
+		return -ENOENT;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = watch;
+
+	if (epoll_ctl(reactor->epfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+		ret = -errno;
+		log_err("modify watch of fd %d failed (%d) %s", fd, ret,
+			strerror(-ret));
+		return ret;
+	}
+
+	watch->events = events;
+
+	return 0;
+}
+
+int reactor_del(struct reactor *reactor, int fd)
+{
+	struct reactor_watch *watch = reactor_find(reactor, fd);
+
+	if (!watch)
+		return -ENOENT;
+
+	/* a closed fd has already left the epoll set */
+	if (epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, fd, NULL) < 0 &&
+	    errno != EBADF && errno != ENOENT)
+		log_err("remove watch of fd %d failed (%d) %s", fd, errno,
+			strerror(errno));
+
+	/* events of the current round may still point to the watch */
+	LIST_REMOVE(watch, watches);
+	watch->cb = NULL;
+	LIST_INSERT_HEAD(&reactor->released, watch, watches);
+
+	return 0;
+}
+
+static void reactor_release(struct reactor *reactor)
+{
+	while (reactor->released.lh_first != NULL) {
+		struct reactor_watch *watch = reactor->released.lh_first;
+
+		LIST_REMOVE(watch, watches);
+		free(watch);
+	}
+}
+
+static uint64_t reactor_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void reactor_on_timer(int fd, uint32_t events, void *obj)
+{
+	struct reactor *reactor = (struct reactor*)obj;
+	uint64_t expirations;
+
+	/* nothing to read if the timer was rearmed meanwhile */
+	if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return;
+
+	reactor->timerfd_deadline = 0;
+	timer_heap_expire(&reactor->timers, reactor_now());
+}
+
+/* arms the timerfd on the earliest deadline, if it changed */
+static void reactor_timer_arm(struct reactor *reactor)
+{
+	struct itimerspec its;
+	uint64_t deadline = 0;
+
+	if (timer_heap_next(&reactor->timers, &deadline))
+		deadline = 0;
+
+	if (deadline == reactor->timerfd_deadline)
+		return;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = deadline / 1000000000ULL;
+	its.it_value.tv_nsec = deadline % 1000000000ULL;
+
+	if (timerfd_settime(reactor->timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		log_err("set timer failed (%d) %s", errno, strerror(errno));
+		return;
+	}
+
+	reactor->timerfd_deadline = deadline;
+}
+
+int reactor_timer_add(struct reactor *reactor, unsigned int delay_ms,
+		      unsigned int interval_ms, garden_timer_cb_t cb, void *obj)
+{
+	return timer_heap_add(&reactor->timers, reactor_now(), delay_ms,
+			      interval_ms, cb, obj);
+}
+
+int reactor_timer_mod(struct reactor *reactor, int timer, unsigned int delay_ms,
+		      unsigned int interval_ms)
+{
+	return timer_heap_mod(&reactor->timers, reactor_now(), timer, delay_ms,
+			      interval_ms);
+}
+
+int reactor_timer_del(struct reactor *reactor, int timer)
+{
+	return timer_heap_del(&reactor->timers, timer);
+}
+
+int reactor_timer_stats(struct reactor *reactor, int timer,
+			struct garden_timer_stats *stats)
+{
+	return timer_heap_stats(&reactor->timers, timer, stats);
+}
+
+static int reactor_core_watch(struct garden_core *core, int fd, uint32_t events,
+			      garden_fd_cb_t cb, void *obj)
+{
+	return reactor_add(reactor_of(core), fd, events, cb, obj);
+}
+
+static int reactor_core_unwatch(struct garden_core *core, int fd)
+{
+	return reactor_del(reactor_of(core), fd);
+}
+
+static int reactor_core_timer_add(struct garden_core *core, unsigned int delay_ms,
+				  unsigned int interval_ms, garden_timer_cb_t cb,
+				  void *obj)
+{
+	return reactor_timer_add(reactor_of(core), delay_ms, interval_ms, cb, obj);
+}
+
+static int reactor_core_timer_mod(struct garden_core *core, int timer,
+				  unsigned int delay_ms, unsigned int interval_ms)
+{
+	return reactor_timer_mod(reactor_of(core), timer, delay_ms, interval_ms);
+}
+
+static int reactor_core_timer_del(struct garden_core *core, int timer)
+{
+	return reactor_timer_del(reactor_of(core), timer);
+}
+
+static int reactor_core_timer_stats(struct garden_core *core, int timer,
+				    struct garden_timer_stats *stats)
+{
+	return reactor_timer_stats(reactor_of(core), timer, stats);
+}
+
+int reactor_init(struct reactor *reactor)
+{
+	int ret = 0;
+
+	memset(reactor, 0, sizeof(*reactor));
+
+	LIST_INIT(&reactor->watches);
+	LIST_INIT(&reactor->released);
+	timer_heap_init(&reactor->timers);
+	reactor->timerfd = -1;
+
+	reactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (reactor->epfd < 0) {
+		ret = -errno;
+		log_err("create epoll instance failed (%d) %s", errno,
+			strerror(errno));
+		goto out;
+	}
+
+	reactor->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (reactor->timerfd < 0) {
+		ret = -errno;
+		log_err("create timer failed (%d) %s", errno, strerror(errno));
+		goto out_close;
+	}
+
+	ret = reactor_add(reactor, reactor->timerfd, EPOLLIN, reactor_on_timer,
+			  reactor);
+	if (ret)
+		goto out_close;
+
+	reactor->core.watch = reactor_core_watch;
+	reactor->core.unwatch = reactor_core_unwatch;
+	reactor->core.timer_add = reactor_core_timer_add;
+	reactor->core.timer_mod = reactor_core_timer_mod;
+	reactor->core.timer_del = reactor_core_timer_del;
+	reactor->core.timer_stats = reactor_core_timer_stats;
+
+	return 0;
+
+out_close:
+	reactor_destroy(reactor);
+out:
+	return ret;
+}
+
+void reactor_destroy(struct reactor *reactor)
+{
+	while (reactor->watches.lh_first != NULL) {
+		struct reactor_watch *watch = reactor->watches.lh_first;
+
+		LIST_REMOVE(watch, watches);
+		free(watch);
+	}
+
+	reactor_release(reactor);
+	timer_heap_destroy(&reactor->timers);
+
+	if (reactor->timerfd >= 0)
+		close(reactor->timerfd);
+	reactor->timerfd = -1;
+
+	if (reactor->epfd >= 0)
+		close(reactor->epfd);
+	reactor->epfd = -1;
+}
+
+void reactor_set_prepare(struct reactor *reactor, reactor_prepare_t prepare,
+			 void *obj)
+{
+	reactor->prepare = prepare;
+	reactor->prepare_obj = obj;
+}
+
+int reactor_run(struct reactor *reactor)
+{
+	int ret = 0;
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+
+	reactor->running = 1;
+
+	while (reactor->running) {
+		int i, n;
+
+		if (reactor->prepare)
+			reactor->prepare(reactor->prepare_obj);
+
+		reactor_timer_arm(reactor);
+
+		n = epoll_wait(reactor->epfd, events, REACTOR_MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			log_err("wait for events failed (%d) %s", errno,
+				strerror(errno));
+			break;
+		}
+
+		for (i = 0; i < n; ++i) {
+			struct reactor_watch *watch = events[i].data.ptr;
+
+			if (watch->cb)
+				watch->cb(watch->fd, events[i].events, watch->obj);
+		}
+
+		reactor_release(reactor);
+	}
+
+	return ret;
+}
+
+void reactor_stop(struct reactor *reactor)
+{
+	reactor->running = 0;
+}
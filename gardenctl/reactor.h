@@ -0,0 +1,77 @@
+/*
+ * reactor.h
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __REACTOR_H__
+#define __REACTOR_H__
+
+#include <signal.h>
+#include <stdint.h>
+#include <sys/queue.h>
+#include <sys/epoll.h>
+#include "garden_module.h"
+#include "timer.h"
+
+struct reactor_watch;
+
+typedef void (*reactor_prepare_t)(void *obj);
+
+/*
+ * Single epoll based event loop of gardenctl. It serves file descriptors
+ * and timers of the core and of all modules from one thread. All timers
+ * share one timerfd armed on the earliest absolute deadline.
+ */
+struct reactor {
+	int epfd;
+	volatile sig_atomic_t running;
+	LIST_HEAD(, reactor_watch) watches;
+	LIST_HEAD(, reactor_watch) released;
+	struct timer_heap timers;
+	int timerfd;
+	uint64_t timerfd_deadline;
+	reactor_prepare_t prepare;
+	void *prepare_obj;
+	struct garden_core core;
+};
+
+int reactor_init(struct reactor *reactor);
+void reactor_destroy(struct reactor *reactor);
+
+int reactor_add(struct reactor *reactor, int fd, uint32_t events,
+		garden_fd_cb_t cb, void *obj);
+int reactor_mod(struct reactor *reactor, int fd, uint32_t events);
+int reactor_del(struct reactor *reactor, int fd);
+
+int reactor_timer_add(struct reactor *reactor, unsigned int delay_ms,
+		      unsigned int interval_ms, garden_timer_cb_t cb, void *obj);
+int reactor_timer_mod(struct reactor *reactor, int timer, unsigned int delay_ms,
+		      unsigned int interval_ms);
+int reactor_timer_del(struct reactor *reactor, int timer);
+int reactor_timer_stats(struct reactor *reactor, int timer,
+			struct garden_timer_stats *stats);
+
+/* prepare is called before the loop goes to sleep */
+void reactor_set_prepare(struct reactor *reactor, reactor_prepare_t prepare,
+			 void *obj);
+
+int reactor_run(struct reactor *reactor);
+void reactor_stop(struct reactor *reactor);
+
+#endif /*__REACTOR_H__*/
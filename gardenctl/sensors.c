@@ -0,0 +1,272 @@
+/*
+ * sensors.c
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "sensors.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "logging.h"
+
+static const char *const aggregate_names[] = {
+	[GARDEN_AGGREGATE_LAST] = "last",
+	[GARDEN_AGGREGATE_MIN] = "min",
+	[GARDEN_AGGREGATE_MAX] = "max",
+	[GARDEN_AGGREGATE_MEAN] = "mean",
+	[GARDEN_AGGREGATE_EWMA] = "ewma",
+	[GARDEN_AGGREGATE_MEDIAN] = "median",
+};
+
+#define AGGREGATE_COUNT (sizeof(aggregate_names) / sizeof(aggregate_names[0]))
+
+int sensors_aggregate_by_name(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < AGGREGATE_COUNT; ++i) {
+		if (!strcmp(name, aggregate_names[i]))
+			return i;
+	}
+
+	return -1;
+}
+
+static double sensors_aggregate(const struct sensor_aggregate *agg,
+				enum garden_aggregate aggregate)
+{
+	switch (aggregate) {
+	case GARDEN_AGGREGATE_MIN:
+		return agg->min;
+	case GARDEN_AGGREGATE_MAX:
+		return agg->max;
+	case GARDEN_AGGREGATE_MEAN:
+		return agg->mean;
+	case GARDEN_AGGREGATE_EWMA:
+		return agg->ewma;
+	case GARDEN_AGGREGATE_MEDIAN:
+		return agg->median;
+	default:
+		return agg->last;
+	}
+}
+
+static void sensors_publish(struct sensor_channel *ch, const char *topic,
+			    const char *payload, unsigned int flags)
+{
+	int ret = 0;
+
+	/* periodic telemetry, a publish rule may still raise the qos */
+	ret = publisher_publish(ch->sensors->pub, topic, payload, strlen(payload), 0,
+				flags);
+	if (ret)
+		log_err("publish sensor %s failed (%d) %s", ch->conf.name, ret,
+			strerror(-ret));
+}
+
+static void sensors_publish_value(struct sensor_channel *ch,
+				  const struct sensor_aggregate *agg)
+{
+	double value = sensors_aggregate(agg, ch->conf.aggregate);
+	char buf[32];
+
+	snprintf(buf, sizeof(buf), "%.*f", ch->conf.decimals, value);
+	/* a new client gets the current value without waiting for the next */
+	sensors_publish(ch, ch->conf.topic, buf, GARDEN_PUBLISH_RETAIN);
+
+	ch->published = true;
+	ch->published_value = value;
+
+	history_record(ch->sensors->history, ch->series, value);
+}
+
+static void sensors_publish_stats(struct sensor_channel *ch,
+				  const struct sensor_aggregate *agg)
+{
+	char topic[256];
+	char buf[256];
+	int d = ch->conf.decimals;
+
+	snprintf(topic, sizeof(topic), "%s/stats", ch->conf.topic);
+	snprintf(buf, sizeof(buf),
+		 "{\"count\":%u,\"last\":%.*f,\"min\":%.*f,\"max\":%.*f,"
+		 "\"mean\":%.*f,\"ewma\":%.*f,\"median\":%.*f}",
+		 agg->count, d, agg->last, d, agg->min, d, agg->max, d, agg->mean,
+		 d, agg->ewma, d, agg->median);
+
+	sensors_publish(ch, topic, buf, 0);
+}
+
+static void sensors_on_interval(void *obj)
+{
+	struct sensor_channel *ch = (struct sensor_channel*)obj;
+	struct sensor_aggregate agg;
+
+	if (sensor_get(&ch->sensor, &agg))
+		return;
+
+	sensors_publish_value(ch, &agg);
+	sensors_publish_stats(ch, &agg);
+	sensor_reset(&ch->sensor);
+}
+
+int sensors_init(struct sensors *sensors, struct reactor *reactor,
+		 struct publisher *pub, struct history *history,
+		 const struct sensor_conf *conf, size_t count)
+{
+	memset(sensors, 0, sizeof(*sensors));
+	sensors->reactor = reactor;
+	sensors->pub = pub;
+	sensors->history = history;
+	sensors->conf = conf;
+	sensors->conf_count = count;
+
+	return 0;
+}
+
+void sensors_destroy(struct sensors *sensors)
+{
+	unsigned int i;
+
+	for (i = 0; i < sensors->count; ++i) {
+		struct sensor_channel *ch = &sensors->channels[i];
+
+		if (ch->timer >= 0)
+			reactor_timer_del(sensors->reactor, ch->timer);
+		sensor_destroy(&ch->sensor);
+	}
+
+	sensors->count = 0;
+}
+
+static void sensors_apply_conf(struct sensors *sensors, struct garden_sensor *sensor)
+{
+	const struct sensor_conf *conf = NULL;
+	size_t i;
+
+	for (i = 0; i < sensors->conf_count; ++i) {
+		if (!strcmp(sensors->conf[i].name, sensor->name))
+			conf = &sensors->conf[i];
+	}
+
+	if (!conf)
+		return;
+
+	if (conf->topic)
+		sensor->topic = conf->topic;
+	if (conf->window >= 0)
+		sensor->window = conf->window;
+	if (conf->interval_sec >= 0)
+		sensor->interval_sec = conf->interval_sec;
+	if (conf->deadband >= 0)
+		sensor->deadband = conf->deadband;
+	if (conf->ewma_alpha >= 0)
+		sensor->ewma_alpha = conf->ewma_alpha;
+	if (conf->aggregate >= 0)
+		sensor->aggregate = conf->aggregate;
+	if (conf->decimals >= 0)
+		sensor->decimals = conf->decimals;
+}
+
+int sensors_add(struct sensors *sensors, const struct garden_sensor *sensor)
+{
+	int ret = 0;
+	struct sensor_channel *ch;
+
+	if (!sensor->name || !sensor->topic ||
+	    (unsigned int)sensor->aggregate >= AGGREGATE_COUNT) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (sensors->count >= SENSORS_MAX) {
+		log_err("too many sensors for %s", sensor->name);
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	ch = &sensors->channels[sensors->count];
+	memset(ch, 0, sizeof(*ch));
+	ch->sensors = sensors;
+	ch->conf = *sensor;
+	ch->timer = -1;
+
+	sensors_apply_conf(sensors, &ch->conf);
+
+	ret = sensor_init(&ch->sensor, ch->conf.window, ch->conf.ewma_alpha);
+	if (ret) {
+		log_err("invalid sensor %s (%d) %s", ch->conf.name, ret, strerror(-ret));
+		goto out;
+	}
+
+	if (ch->conf.interval_sec) {
+		ret = reactor_timer_add(sensors->reactor, ch->conf.interval_sec * 1000,
+					ch->conf.interval_sec * 1000,
+					sensors_on_interval, ch);
+		if (ret < 0) {
+			sensor_destroy(&ch->sensor);
+			goto out;
+		}
+
+		ch->timer = ret;
+	}
+
+	ch->series = history_series(sensors->history, ch->conf.name, ch->conf.decimals);
+
+	log_dbg("sensor %s: %s of %u samples to %s every %u s, deadband %g",
+		ch->conf.name, aggregate_names[ch->conf.aggregate], ch->conf.window,
+		ch->conf.topic, ch->conf.interval_sec, ch->conf.deadband);
+
+	ret = sensors->count++;
+out:
+	return ret;
+}
+
+int sensors_push(struct sensors *sensors, int id, double value)
+{
+	int ret = 0;
+	struct sensor_channel *ch;
+	struct sensor_aggregate agg;
+	double moved;
+
+	if (id < 0 || (unsigned int)id >= sensors->count)
+		return -EINVAL;
+
+	ch = &sensors->channels[id];
+
+	ret = sensor_add(&ch->sensor, value);
+	if (ret)
+		return ret;
+
+	sensor_get(&ch->sensor, &agg);
+
+	/* the first value goes out right away, later ones by the policy */
+	if (ch->published && ch->conf.interval_sec) {
+		if (!(ch->conf.deadband > 0))
+			return 0;
+
+		moved = sensors_aggregate(&agg, ch->conf.aggregate) - ch->published_value;
+		if (moved < ch->conf.deadband && -moved < ch->conf.deadband)
+			return 0;
+	}
+
+	sensors_publish_value(ch, &agg);
+
+	return 0;
+}
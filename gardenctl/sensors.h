@@ -0,0 +1,82 @@
+/*
+ * sensors.h
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __SENSORS_H__
+#define __SENSORS_H__
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <garden_module.h>
+#include <sensor.h>
+#include "reactor.h"
+#include "history.h"
+#include "publish.h"
+
+#define SENSORS_MAX 16
+
+/* sensor section of the configuration, negative values keep the defaults */
+struct sensor_conf {
+	const char *name;
+	const char *topic;
+	int window;
+	int interval_sec;
+	double deadband;
+	double ewma_alpha;
+	int aggregate;
+	int decimals;
+};
+
+struct sensors;
+
+struct sensor_channel {
+	struct sensors *sensors;
+	struct garden_sensor conf;
+	struct sensor sensor;
+	int timer;
+	int series;
+	bool published;
+	double published_value;
+};
+
+/* sensor channels of the modules, published by the core */
+struct sensors {
+	struct reactor *reactor;
+	struct publisher *pub;
+	struct history *history;
+	const struct sensor_conf *conf;
+	size_t conf_count;
+	unsigned int count;
+	struct sensor_channel channels[SENSORS_MAX];
+};
+
+/* published values are recorded to history */
+int sensors_init(struct sensors *sensors, struct reactor *reactor,
+		 struct publisher *pub, struct history *history,
+		 const struct sensor_conf *conf, size_t count);
+void sensors_destroy(struct sensors *sensors);
+
+int sensors_add(struct sensors *sensors, const struct garden_sensor *sensor);
+int sensors_push(struct sensors *sensors, int id, double value);
+
+/* -1 for an unknown name */
+int sensors_aggregate_by_name(const char *name);
+
+#endif /*__SENSORS_H__*/
@@ -0,0 +1,341 @@
+/*
+ * spool.c
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "spool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "logging.h"
+
+#define SPOOL_MAGIC 0x4c4f5053
+#define SPOOL_VERSION 2
+#define SPOOL_SIZE_MIN 4096
+
+struct spool_record {
+	uint32_t crc;
+	/* bytes of topic and payload */
+	uint32_t len;
+	uint16_t topic_len;
+	uint8_t qos;
+	uint8_t flags;
+	/* seconds since the epoch */
+	uint32_t time;
+};
+
+/* crc covers the record from len on */
+#define SPOOL_CRC_OFFSET offsetof(struct spool_record, len)
+
+static const uint32_t crc_table[16] = {
+	0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+	0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+	0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+	0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+};
+
+uint32_t spool_crc32(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = (const uint8_t*)buf;
+
+	crc = ~crc;
+
+	while (len--) {
+		crc ^= *p++;
+		crc = (crc >> 4) ^ crc_table[crc & 0xf];
+		crc = (crc >> 4) ^ crc_table[crc & 0xf];
+	}
+
+	return ~crc;
+}
+
+static size_t spool_first(const struct spool *spool, uint64_t pos, size_t len)
+{
+	size_t left = spool->hdr->size - pos % spool->hdr->size;
+
+	return left < len ? left : len;
+}
+
+static void spool_put(struct spool *spool, uint64_t pos, const void *buf, size_t len)
+{
+	size_t first = spool_first(spool, pos, len);
+
+	memcpy(spool->ring + pos % spool->hdr->size, buf, first);
+	memcpy(spool->ring, (const uint8_t*)buf + first, len - first);
+}
+
+static void spool_get(const struct spool *spool, uint64_t pos, void *buf, size_t len)
+{
+	size_t first = spool_first(spool, pos, len);
+
+	memcpy(buf, spool->ring + pos % spool->hdr->size, first);
+	memcpy((uint8_t*)buf + first, spool->ring, len - first);
+}
+
+static uint32_t spool_crc_ring(const struct spool *spool, uint32_t crc,
+			       uint64_t pos, size_t len)
+{
+	size_t first = spool_first(spool, pos, len);
+
+	crc = spool_crc32(crc, spool->ring + pos % spool->hdr->size, first);
+
+	return spool_crc32(crc, spool->ring, len - first);
+}
+
+/* size of the record at pos, negative when it is torn */
+static int64_t spool_check(const struct spool *spool, uint64_t pos)
+{
+	struct spool_record rec;
+	uint64_t left = spool->hdr->head - pos;
+	uint32_t crc;
+
+	if (left < sizeof(rec))
+		return -EINVAL;
+
+	spool_get(spool, pos, &rec, sizeof(rec));
+
+	if (rec.len > left - sizeof(rec) || !rec.topic_len || rec.topic_len > rec.len)
+		return -EINVAL;
+
+	crc = spool_crc32(0, (uint8_t*)&rec + SPOOL_CRC_OFFSET,
+			  sizeof(rec) - SPOOL_CRC_OFFSET);
+	crc = spool_crc_ring(spool, crc, pos + sizeof(rec), rec.len);
+	if (crc != rec.crc)
+		return -EINVAL;
+
+	return sizeof(rec) + rec.len;
+}
+
+static void spool_recover(struct spool *spool)
+{
+	struct spool_header *hdr = spool->hdr;
+	uint64_t pos = hdr->tail;
+	unsigned int count = 0;
+	int64_t len;
+
+	while (pos < hdr->head) {
+		len = spool_check(spool, pos);
+		if (len < 0) {
+			log_err("spool torn, %llu bytes dropped",
+				(unsigned long long)(hdr->head - pos));
+			hdr->head = pos;
+			break;
+		}
+
+		pos += len;
+		++count;
+	}
+
+	if (count)
+		log_info("spool has %u messages to send", count);
+}
+
+static void spool_reset(struct spool_header *hdr, size_t size)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->magic = SPOOL_MAGIC;
+	hdr->version = SPOOL_VERSION;
+	hdr->size = size;
+}
+
+int spool_open(struct spool *spool, const char *path, size_t size)
+{
+	int ret = 0;
+	int fd;
+	struct stat st;
+	struct spool_header *hdr;
+	size_t total = sizeof(*hdr) + size;
+	bool fresh;
+	void *map;
+
+	memset(spool, 0, sizeof(*spool));
+
+	if (size < SPOOL_SIZE_MIN || size > UINT32_MAX) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	if (fstat(fd, &st)) {
+		ret = -errno;
+		goto out_close;
+	}
+
+	fresh = (size_t)st.st_size != total;
+	if (fresh && ftruncate(fd, total)) {
+		ret = -errno;
+		goto out_close;
+	}
+
+	map = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		ret = -errno;
+		goto out_close;
+	}
+
+	hdr = (struct spool_header*)map;
+	spool->hdr = hdr;
+	spool->ring = (uint8_t*)map + sizeof(*hdr);
+
+	if (fresh || hdr->magic != SPOOL_MAGIC || hdr->version != SPOOL_VERSION ||
+	    hdr->size != size || hdr->head < hdr->tail ||
+	    hdr->head - hdr->tail > size) {
+		if (!fresh)
+			log_warn("spool %s is broken, started over", path);
+		spool_reset(hdr, size);
+	} else {
+		spool_recover(spool);
+	}
+
+	spool->read = hdr->tail;
+
+out_close:
+	/* the mapping keeps the file */
+	close(fd);
+out:
+	return ret;
+}
+
+void spool_close(struct spool *spool)
+{
+	if (!spool->hdr)
+		return;
+
+	msync(spool->hdr, sizeof(*spool->hdr) + spool->hdr->size, MS_SYNC);
+	munmap(spool->hdr, sizeof(*spool->hdr) + spool->hdr->size);
+	spool->hdr = NULL;
+	spool->ring = NULL;
+}
+
+static void spool_drop(struct spool *spool)
+{
+	struct spool_header *hdr = spool->hdr;
+	struct spool_record rec;
+
+	spool_get(spool, hdr->tail, &rec, sizeof(rec));
+	hdr->tail += sizeof(rec) + rec.len;
+	++hdr->dropped;
+
+	if (spool->read < hdr->tail)
+		spool->read = hdr->tail;
+}
+
+int spool_append(struct spool *spool, const char *topic, const void *payload,
+		 size_t len, int qos, unsigned int flags)
+{
+	struct spool_header *hdr = spool->hdr;
+	struct spool_record rec;
+	size_t topic_len = strlen(topic);
+	size_t need = sizeof(rec) + topic_len + len;
+
+	if (!topic_len || topic_len > UINT16_MAX || need > hdr->size)
+		return -EMSGSIZE;
+
+	/* the oldest telemetry goes first */
+	while (hdr->size - (hdr->head - hdr->tail) < need)
+		spool_drop(spool);
+
+	rec.len = topic_len + len;
+	rec.topic_len = topic_len;
+	rec.qos = qos;
+	rec.flags = flags;
+	rec.time = time(NULL);
+	rec.crc = spool_crc32(0, (uint8_t*)&rec + SPOOL_CRC_OFFSET,
+			      sizeof(rec) - SPOOL_CRC_OFFSET);
+	rec.crc = spool_crc32(rec.crc, topic, topic_len);
+	rec.crc = spool_crc32(rec.crc, payload, len);
+
+	spool_put(spool, hdr->head, &rec, sizeof(rec));
+	spool_put(spool, hdr->head + sizeof(rec), topic, topic_len);
+	spool_put(spool, hdr->head + sizeof(rec) + topic_len, payload, len);
+
+	/* the record is complete before head covers it */
+	hdr->head += need;
+
+	return 0;
+}
+
+int spool_next(struct spool *spool, struct spool_msg **msg)
+{
+	struct spool_record rec;
+	struct spool_msg *m;
+	uint64_t pos = spool->read;
+
+	if (pos >= spool->hdr->head)
+		return -ENODATA;
+
+	spool_get(spool, pos, &rec, sizeof(rec));
+
+	/* the topic gets its NUL */
+	m = malloc(sizeof(*m) + rec.len + 1);
+	if (!m)
+		return -ENOMEM;
+
+	pos += sizeof(rec);
+	spool_get(spool, pos, m->data, rec.topic_len);
+	m->data[rec.topic_len] = '\0';
+	spool_get(spool, pos + rec.topic_len, m->data + rec.topic_len + 1,
+		  rec.len - rec.topic_len);
+
+	m->topic = m->data;
+	m->payload = m->data + rec.topic_len + 1;
+	m->len = rec.len - rec.topic_len;
+	m->qos = rec.qos;
+	m->flags = rec.flags;
+	m->time = rec.time;
+	m->pos = spool->read;
+	m->end = pos + rec.len;
+
+	spool->read = m->end;
+	*msg = m;
+
+	return 0;
+}
+
+void spool_release(struct spool *spool, uint64_t end)
+{
+	if (end > spool->hdr->tail && end <= spool->hdr->head)
+		spool->hdr->tail = end;
+}
+
+void spool_rewind(struct spool *spool, uint64_t pos)
+{
+	if (pos >= spool->hdr->tail && pos < spool->read)
+		spool->read = pos;
+}
+
+bool spool_is_empty(const struct spool *spool)
+{
+	return spool->hdr->head == spool->hdr->tail;
+}
+
+bool spool_has_next(const struct spool *spool)
+{
+	return spool->read < spool->hdr->head;
+}
@@ -0,0 +1,88 @@
+/*
+ * spool.h
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __SPOOL_H__
+#define __SPOOL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+/*
+ * Outbound messages kept in an mmapped ring file while the broker is away.
+ * head and tail are byte positions counting up from the creation of the
+ * file, a record may wrap around the end of the ring. Every record carries
+ * a crc32, a torn record found on open ends the spool there. When full the
+ * oldest records are dropped.
+ */
+struct spool_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	uint32_t reserved;
+	uint64_t head;
+	uint64_t tail;
+	uint64_t dropped;
+};
+
+struct spool {
+	struct spool_header *hdr;
+	uint8_t *ring;
+	/* next record to send, between tail and head */
+	uint64_t read;
+};
+
+/* a record taken by spool_next(), freed by the caller */
+struct spool_msg {
+	const char *topic;
+	const void *payload;
+	size_t len;
+	int qos;
+	unsigned int flags;
+	/* wall clock of the append */
+	time_t time;
+	/* position of the record and after it */
+	uint64_t pos;
+	uint64_t end;
+	char data[];
+};
+
+/* an existing file of another size is started over */
+int spool_open(struct spool *spool, const char *path, size_t size);
+void spool_close(struct spool *spool);
+
+int spool_append(struct spool *spool, const char *topic, const void *payload,
+		 size_t len, int qos, unsigned int flags);
+
+/* -ENODATA once all records are taken */
+int spool_next(struct spool *spool, struct spool_msg **msg);
+/* the records up to end are delivered */
+void spool_release(struct spool *spool, uint64_t end);
+/* the records from pos on are taken again */
+void spool_rewind(struct spool *spool, uint64_t pos);
+
+bool spool_is_empty(const struct spool *spool);
+bool spool_has_next(const struct spool *spool);
+
+uint32_t spool_crc32(uint32_t crc, const void *buf, size_t len);
+
+#endif /*__SPOOL_H__*/
@@ -0,0 +1,109 @@
+/*
+ * status.c
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "status.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "logging.h"
+
+#define STATUS_QOS 1
+
+static void status_publish(struct status *status, const char *topic,
+			   const char *payload, unsigned int flags)
+{
+	int ret = publisher_publish(status->pub, topic, payload, strlen(payload),
+				    STATUS_QOS, GARDEN_PUBLISH_RETAIN | flags);
+
+	if (ret)
+		log_err("publish %s failed (%d) %s", topic, ret, strerror(-ret));
+}
+
+int status_init(struct status *status, struct mosquitto *mosq,
+		struct publisher *pub, const char *topic)
+{
+	int ret = 0;
+
+	memset(status, 0, sizeof(*status));
+	status->mosq = mosq;
+	status->pub = pub;
+
+	if (!topic)
+		topic = STATUS_TOPIC_DEFAULT;
+
+	if (!topic[0])
+		goto out;
+
+	ret = mosquitto_will_set(mosq, topic, strlen(STATUS_OFFLINE), STATUS_OFFLINE,
+				 STATUS_QOS, true);
+	if (ret != MOSQ_ERR_SUCCESS) {
+		log_err("set last will on %s failed (%d) %s", topic, ret,
+			mosquitto_strerror(ret));
+		ret = -EINVAL;
+		goto out;
+	}
+
+	status->topic = topic;
+out:
+	return ret;
+}
+
+void status_online(struct status *status)
+{
+	if (status->topic)
+		status_publish(status, status->topic, STATUS_ONLINE,
+			       GARDEN_PUBLISH_HIGH | GARDEN_PUBLISH_LIVE);
+}
+
+void status_outputs(struct status *status)
+{
+	gpioex_mask_t state = gpioex_get_state_snapshot();
+	gpioex_mask_t changed = status->published ? state ^ status->outputs : ~0ULL;
+	char topic[sizeof(STATUS_OUTPUT_PREFIX) + GPIOEX_NAME_MAX + 1];
+	const char *name;
+	int id;
+
+	for (id = 0; id < GPIOEX_MAX_OUTPUTS && changed; ++id) {
+		if (!(changed & GPIOEX_OUTPUT(id)))
+			continue;
+
+		changed &= ~GPIOEX_OUTPUT(id);
+
+		name = gpioex_output_name(id);
+		if (!name)
+			continue;
+
+		snprintf(topic, sizeof(topic), "%s/%s", STATUS_OUTPUT_PREFIX, name);
+		status_publish(status, topic,
+			       (state & GPIOEX_OUTPUT(id)) ? "on" : "off", 0);
+	}
+
+	status->outputs = state;
+	status->published = true;
+}
+
+void status_offline(struct status *status)
+{
+	if (status->topic)
+		status_publish(status, status->topic, STATUS_OFFLINE,
+			       GARDEN_PUBLISH_HIGH | GARDEN_PUBLISH_LIVE);
+}
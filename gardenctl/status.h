@@ -0,0 +1,66 @@
+/*
+ * status.h
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __STATUS_H__
+#define __STATUS_H__
+
+#include <stdbool.h>
+#include <mosquitto.h>
+#include <gpioex.h>
+#include "publish.h"
+
+#define STATUS_TOPIC_DEFAULT "/garden/status"
+/* an output is published as <prefix>/<name> with on or off */
+#define STATUS_OUTPUT_PREFIX "/garden/state"
+
+#define STATUS_ONLINE "online"
+#define STATUS_OFFLINE "offline"
+
+/*
+ * Retained state of gardenctl, a client subscribing gets it at once. The
+ * status topic is online while connected, the broker sets it offline by
+ * the last will when the connection is lost. Status messages never wait
+ * in the spool behind older ones.
+ */
+struct status {
+	struct mosquitto *mosq;
+	struct publisher *pub;
+	/* NULL without a status topic */
+	const char *topic;
+	/* outputs as last published */
+	gpioex_mask_t outputs;
+	bool published;
+};
+
+/* before the connect, an empty topic leaves out the status and the will */
+int status_init(struct status *status, struct mosquitto *mosq,
+		struct publisher *pub, const char *topic);
+
+/* on every connect, the last will may have replaced online meanwhile */
+void status_online(struct status *status);
+
+/* publishes the outputs switched since the last call */
+void status_outputs(struct status *status);
+
+/* a clean disconnect does not send the last will */
+void status_offline(struct status *status);
+
+#endif /*__STATUS_H__*/
@@ -0,0 +1,307 @@
+/*
+ * timer.c
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "timer.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "logging.h"
+
+#define TIMER_UNQUEUED ((size_t)-1)
+#define TIMER_HEAP_MIN_SIZE 8
+
+struct timer_job {
+	int id;
+	uint64_t deadline;
+	uint64_t interval;
+	size_t index;
+	garden_timer_cb_t cb;
+	void *obj;
+	struct garden_timer_stats stats;
+	uint64_t lateness_sum_us;
+	LIST_ENTRY(timer_job) jobs;
+};
+
+static struct timer_job *timer_find(struct timer_heap *timers, int id)
+{
+	struct timer_job *job;
+
+	for (job = timers->jobs.lh_first; job != NULL; job = job->jobs.le_next) {
+		if (job->id == id)
+			return job;
+	}
+
+	return NULL;
+}
+
+static void timer_heap_set(struct timer_heap *timers, size_t index,
+			   struct timer_job *job)
+{
+	timers->heap[index] = job;
+	job->index = index;
+}
+
+static void timer_heap_up(struct timer_heap *timers, size_t index)
+{
+	struct timer_job *job = timers->heap[index];
+
+	while (index > 0) {
+		size_t parent = (index - 1) / 2;
+
+		if (timers->heap[parent]->deadline <= job->deadline)
+			break;
+
+		timer_heap_set(timers, index, timers->heap[parent]);
+		index = parent;
+	}
+
+	timer_heap_set(timers, index, job);
+}
+
+static void timer_heap_down(struct timer_heap *timers, size_t index)
+{
+	struct timer_job *job = timers->heap[index];
+
+	for (;;) {
+		size_t child = 2 * index + 1;
+
+		if (child >= timers->count)
+			break;
+
+		if (child + 1 < timers->count &&
+		    timers->heap[child + 1]->deadline < timers->heap[child]->deadline)
+			++child;
+
+		if (job->deadline <= timers->heap[child]->deadline)
+			break;
+
+		timer_heap_set(timers, index, timers->heap[child]);
+		index = child;
+	}
+
+	timer_heap_set(timers, index, job);
+}
+
+static void timer_heap_remove(struct timer_heap *timers, struct timer_job *job)
+{
+	size_t index = job->index;
+	struct timer_job *last;
+
+	if (index == TIMER_UNQUEUED)
+		return;
+
+	job->index = TIMER_UNQUEUED;
+	last = timers->heap[--timers->count];
+	if (last == job)
+		return;
+
+	timer_heap_set(timers, index, last);
+	if (index > 0 && timers->heap[(index - 1) / 2]->deadline > last->deadline)
+		timer_heap_up(timers, index);
+	else
+		timer_heap_down(timers, index);
+}
+
+static void timer_heap_insert(struct timer_heap *timers, struct timer_job *job)
+{
+	/* the heap always has room for all jobs, see timer_heap_add */
+	timer_heap_set(timers, timers->count++, job);
+	timer_heap_up(timers, job->index);
+}
+
+static void timer_job_arm(struct timer_heap *timers, struct timer_job *job,
+			  uint64_t now, unsigned int delay_ms,
+			  unsigned int interval_ms)
+{
+	timer_heap_remove(timers, job);
+
+	if (!delay_ms)
+		delay_ms = interval_ms;
+
+	job->interval = interval_ms * TIMER_NSEC_PER_MSEC;
+
+	if (!delay_ms)
+		return;
+
+	job->deadline = now + delay_ms * TIMER_NSEC_PER_MSEC;
+	timer_heap_insert(timers, job);
+}
+
+int timer_heap_init(struct timer_heap *timers)
+{
+	memset(timers, 0, sizeof(*timers));
+	LIST_INIT(&timers->jobs);
+
+	return 0;
+}
+
+void timer_heap_destroy(struct timer_heap *timers)
+{
+	while (timers->jobs.lh_first != NULL) {
+		struct timer_job *job = timers->jobs.lh_first;
+
+		LIST_REMOVE(job, jobs);
+		free(job);
+	}
+
+	free(timers->heap);
+	timers->heap = NULL;
+	timers->count = 0;
+	timers->size = 0;
+}
+
+int timer_heap_add(struct timer_heap *timers, uint64_t now,
+		   unsigned int delay_ms, unsigned int interval_ms,
+		   garden_timer_cb_t cb, void *obj)
+{
+	int ret = 0;
+	struct timer_job *job;
+
+	if (!cb || timers->next_id < 0) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	job = calloc(1, sizeof(*job));
+	if (!job) {
+		log_err("allocate timer job failed");
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* grow while adding, so rescheduling never has to allocate */
+	if (timers->count == timers->size) {
+		size_t size = timers->size ? timers->size * 2 : TIMER_HEAP_MIN_SIZE;
+		struct timer_job **heap = realloc(timers->heap, size * sizeof(*heap));
+
+		if (!heap) {
+			log_err("grow timer heap to %zu jobs failed", size);
+			free(job);
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		timers->heap = heap;
+		timers->size = size;
+	}
+
+	job->id = timers->next_id++;
+	job->index = TIMER_UNQUEUED;
+	job->cb = cb;
+	job->obj = obj;
+
+	LIST_INSERT_HEAD(&timers->jobs, job, jobs);
+
+	timer_job_arm(timers, job, now, delay_ms, interval_ms);
+
+	ret = job->id;
+out:
+	return ret;
+}
+
+int timer_heap_mod(struct timer_heap *timers, uint64_t now, int id,
+		   unsigned int delay_ms, unsigned int interval_ms)
+{
+	struct timer_job *job = timer_find(timers, id);
+
+	if (!job)
+		return -ENOENT;
+
+	timer_job_arm(timers, job, now, delay_ms, interval_ms);
+
+	return 0;
+}
+
+int timer_heap_del(struct timer_heap *timers, int id)
+{
+	struct timer_job *job = timer_find(timers, id);
+
+	if (!job)
+		return -ENOENT;
+
+	timer_heap_remove(timers, job);
+	LIST_REMOVE(job, jobs);
+	free(job);
+
+	return 0;
+}
+
+int timer_heap_stats(struct timer_heap *timers, int id,
+		     struct garden_timer_stats *stats)
+{
+	struct timer_job *job = timer_find(timers, id);
+
+	if (!job)
+		return -ENOENT;
+
+	*stats = job->stats;
+	if (job->stats.runs)
+		stats->lateness_mean_us = job->lateness_sum_us / job->stats.runs;
+
+	return 0;
+}
+
+int timer_heap_next(struct timer_heap *timers, uint64_t *deadline)
+{
+	if (!timers->count)
+		return -ENOENT;
+
+	*deadline = timers->heap[0]->deadline;
+
+	return 0;
+}
+
+int timer_heap_expire(struct timer_heap *timers, uint64_t now)
+{
+	int ret = 0;
+
+	while (timers->count && timers->heap[0]->deadline <= now) {
+		struct timer_job *job = timers->heap[0];
+		uint64_t lateness_us = (now - job->deadline) / 1000;
+
+		if (lateness_us > UINT32_MAX)
+			lateness_us = UINT32_MAX;
+
+		job->stats.runs++;
+		job->stats.lateness_last_us = lateness_us;
+		job->lateness_sum_us += lateness_us;
+		if (lateness_us > job->stats.lateness_max_us)
+			job->stats.lateness_max_us = lateness_us;
+
+		timer_heap_remove(timers, job);
+
+		if (job->interval) {
+			uint64_t missed = (now - job->deadline) / job->interval;
+
+			/* skip runs that are already over instead of catching up */
+			job->stats.overruns += missed;
+			job->deadline += (missed + 1) * job->interval;
+			timer_heap_insert(timers, job);
+		}
+
+		/* the callback may modify or delete any job including its own */
+		job->cb(job->obj);
+		++ret;
+	}
+
+	return ret;
+}
@@ -0,0 +1,67 @@
+/*
+ * timer.h
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/queue.h>
+#include "garden_module.h"
+
+#define TIMER_NSEC_PER_MSEC 1000000ULL
+
+struct timer_job;
+
+/*
+ * Min-heap of timer jobs ordered by their absolute CLOCK_MONOTONIC deadline
+ * in ns. Periodic jobs are rescheduled from their previous deadline, so the
+ * time spent in callbacks never shifts later runs. All functions take the
+ * current time to keep the heap independent of the clock.
+ */
+struct timer_heap {
+	struct timer_job **heap;
+	size_t count;
+	size_t size;
+	int next_id;
+	LIST_HEAD(, timer_job) jobs;
+};
+
+int timer_heap_init(struct timer_heap *timers);
+void timer_heap_destroy(struct timer_heap *timers);
+
+/* returns the id of the new job */
+int timer_heap_add(struct timer_heap *timers, uint64_t now,
+		   unsigned int delay_ms, unsigned int interval_ms,
+		   garden_timer_cb_t cb, void *obj);
+int timer_heap_mod(struct timer_heap *timers, uint64_t now, int id,
+		   unsigned int delay_ms, unsigned int interval_ms);
+int timer_heap_del(struct timer_heap *timers, int id);
+int timer_heap_stats(struct timer_heap *timers, int id,
+		     struct garden_timer_stats *stats);
+
+/* earliest deadline, -ENOENT if no job is armed */
+int timer_heap_next(struct timer_heap *timers, uint64_t *deadline);
+
+/* runs all jobs due at now and returns their count */
+int timer_heap_expire(struct timer_heap *timers, uint64_t now);
+
+#endif /*__TIMER_H__*/
@@ -0,0 +1,305 @@
+/*
+ * topic_tree.c
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "topic_tree.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/queue.h>
+#include "logging.h"
+
+#define TOPIC_MAX_LEN 65535
+
+struct topic_entry {
+	void *obj;
+	TAILQ_ENTRY(topic_entry) entries;
+};
+
+struct topic_node {
+	char *level;
+	size_t level_len;
+	struct topic_node *plus;
+	struct topic_node *hash;
+	LIST_HEAD(, topic_node) children;
+	LIST_ENTRY(topic_node) siblings;
+	TAILQ_HEAD(, topic_entry) entries;
+};
+
+static struct topic_node *topic_node_create(const char *level, size_t len)
+{
+	struct topic_node *node = calloc(1, sizeof(*node));
+
+	if (!node)
+		return NULL;
+
+	node->level = strndup(level, len);
+	if (!node->level) {
+		free(node);
+		return NULL;
+	}
+
+	node->level_len = len;
+	LIST_INIT(&node->children);
+	TAILQ_INIT(&node->entries);
+
+	return node;
+}
+
+static void topic_node_destroy(struct topic_node *node)
+{
+	if (!node)
+		return;
+
+	while (node->children.lh_first != NULL) {
+		struct topic_node *child = node->children.lh_first;
+
+		LIST_REMOVE(child, siblings);
+		topic_node_destroy(child);
+	}
+
+	while (node->entries.tqh_first != NULL) {
+		struct topic_entry *entry = node->entries.tqh_first;
+
+		TAILQ_REMOVE(&node->entries, entry, entries);
+		free(entry);
+	}
+
+	topic_node_destroy(node->plus);
+	topic_node_destroy(node->hash);
+	free(node->level);
+	free(node);
+}
+
+static struct topic_node *topic_node_find(struct topic_node *node,
+					  const char *level, size_t len)
+{
+	struct topic_node *child;
+
+	for (child = node->children.lh_first; child != NULL;
+	     child = child->siblings.le_next) {
+		if (child->level_len == len &&
+		    strncmp(child->level, level, len) == 0)
+			return child;
+	}
+
+	return NULL;
+}
+
+static struct topic_node *topic_node_get(struct topic_node *node,
+					 const char *level, size_t len)
+{
+	struct topic_node *child;
+
+	if (len == 1 && *level == '+') {
+		if (!node->plus)
+			node->plus = topic_node_create(level, len);
+		return node->plus;
+	}
+
+	if (len == 1 && *level == '#') {
+		if (!node->hash)
+			node->hash = topic_node_create(level, len);
+		return node->hash;
+	}
+
+	child = topic_node_find(node, level, len);
+	if (!child) {
+		child = topic_node_create(level, len);
+		if (child)
+			LIST_INSERT_HEAD(&node->children, child, siblings);
+	}
+
+	return child;
+}
+
+int topic_filter_is_valid(const char *filter)
+{
+	const char *level = filter;
+
+	if (!filter || !*filter || strlen(filter) > TOPIC_MAX_LEN)
+		return 0;
+
+	while (level) {
+		const char *end = strchr(level, '/');
+		size_t len = end ? (size_t)(end - level) : strlen(level);
+
+		if (memchr(level, '+', len) && len != 1)
+			return 0;
+
+		if (memchr(level, '#', len) && (len != 1 || end))
+			return 0;
+
+		level = end ? end + 1 : NULL;
+	}
+
+	return 1;
+}
+
+int topic_tree_init(struct topic_tree *tree)
+{
+	if (!tree)
+		return -EINVAL;
+
+	tree->count = 0;
+	tree->root = topic_node_create("", 0);
+	if (!tree->root) {
+		log_err("allocate topic tree failed");
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void topic_tree_destroy(struct topic_tree *tree)
+{
+	if (tree) {
+		topic_node_destroy(tree->root);
+		tree->root = NULL;
+		tree->count = 0;
+	}
+}
+
+int topic_tree_add(struct topic_tree *tree, const char *filter, void *obj)
+{
+	int ret = 0;
+	const char *level = filter;
+	struct topic_node *node;
+	struct topic_entry *entry;
+
+	if (!tree || !tree->root) {
+		log_err("invalid topic tree");
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (!topic_filter_is_valid(filter)) {
+		log_err("invalid topic filter %s", filter ? : "(null)");
+		ret = -EINVAL;
+		goto out;
+	}
+
+	node = tree->root;
+	while (level) {
+		const char *end = strchr(level, '/');
+		size_t len = end ? (size_t)(end - level) : strlen(level);
+
+		node = topic_node_get(node, level, len);
+		if (!node) {
+			log_err("allocate topic node for %s failed", filter);
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		level = end ? end + 1 : NULL;
+	}
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry) {
+		log_err("allocate topic entry for %s failed", filter);
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	entry->obj = obj;
+	TAILQ_INSERT_TAIL(&node->entries, entry, entries);
+	tree->count++;
+
+out:
+	return ret;
+}
+
+static int topic_node_dispatch(struct topic_node *node, topic_tree_cb_t cb,
+			       void *ctx)
+{
+	int ret = 0;
+	int count = 0;
+	struct topic_entry *entry;
+
+	for (entry = node->entries.tqh_first; entry != NULL;
+	     entry = entry->entries.tqe_next) {
+		ret = cb(entry->obj, ctx);
+		if (ret < 0)
+			return ret;
+		count++;
+	}
+
+	return count;
+}
+
+/*
+ * level points to the not yet consumed part of the topic or is NULL if the
+ * topic ends at node. Topics starting with '$' are not matched by wildcards
+ * on the first level.
+ */
+static int topic_node_match(struct topic_node *node, const char *level,
+			    int first, topic_tree_cb_t cb, void *ctx)
+{
+	int ret = 0;
+	int count = 0;
+	int wildcards = !(first && *level == '$');
+	const char *end;
+	const char *next;
+	size_t len;
+	struct topic_node *child;
+
+	/* "a/#" matches "a" as well as everything below */
+	if (node->hash && wildcards) {
+		ret = topic_node_dispatch(node->hash, cb, ctx);
+		if (ret < 0)
+			return ret;
+		count += ret;
+	}
+
+	if (!level) {
+		ret = topic_node_dispatch(node, cb, ctx);
+		return (ret < 0) ? ret : count + ret;
+	}
+
+	end = strchr(level, '/');
+	len = end ? (size_t)(end - level) : strlen(level);
+	next = end ? end + 1 : NULL;
+
+	child = topic_node_find(node, level, len);
+	if (child) {
+		ret = topic_node_match(child, next, 0, cb, ctx);
+		if (ret < 0)
+			return ret;
+		count += ret;
+	}
+
+	if (node->plus && wildcards) {
+		ret = topic_node_match(node->plus, next, 0, cb, ctx);
+		if (ret < 0)
+			return ret;
+		count += ret;
+	}
+
+	return count;
+}
+
+int topic_tree_match(struct topic_tree *tree, const char *topic,
+		     topic_tree_cb_t cb, void *ctx)
+{
+	if (!tree || !tree->root || !topic || !cb)
+		return -EINVAL;
+
+	return topic_node_match(tree->root, topic, 1, cb, ctx);
+}
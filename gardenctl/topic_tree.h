@@ -0,0 +1,55 @@
+/*
+ * topic_tree.h
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __TOPIC_TREE_H__
+#define __TOPIC_TREE_H__
+
+#include <stddef.h>
+
+struct topic_node;
+
+/*
+ * Trie over the levels of MQTT topic filters. Every node stands for one
+ * topic level, "+" and "#" levels are kept aside from the plain children so
+ * a topic is matched with a single walk over its levels.
+ */
+struct topic_tree {
+	struct topic_node *root;
+	size_t count;
+};
+
+typedef int (*topic_tree_cb_t)(void *obj, void *ctx);
+
+int topic_tree_init(struct topic_tree *tree);
+void topic_tree_destroy(struct topic_tree *tree);
+
+int topic_tree_add(struct topic_tree *tree, const char *filter, void *obj);
+
+/*
+ * Call cb for every object whose filter matches topic. Returns the number of
+ * matches or the first negative value returned by cb.
+ */
+int topic_tree_match(struct topic_tree *tree, const char *topic,
+		     topic_tree_cb_t cb, void *ctx);
+
+int topic_filter_is_valid(const char *filter);
+
+#endif /*__TOPIC_TREE_H__*/
@@ -0,0 +1,648 @@
+/*
+ * tsdb.c
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "tsdb.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+#include "logging.h"
+
+#define TSDB_MAGIC 0x42445354
+#define TSDB_VERSION 1
+#define TSDB_SEGMENTS_MIN 2
+/* two varints of at most 10 bytes */
+#define TSDB_RECORD_MAX 20
+#define TSDB_VARINT_MAX 10
+
+/* small deltas of either sign give short varints */
+static uint64_t tsdb_zigzag(int64_t value)
+{
+	return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t tsdb_unzigzag(uint64_t value)
+{
+	return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+size_t tsdb_put_varint(uint8_t *buf, uint64_t value)
+{
+	size_t len = 0;
+
+	while (value >= 0x80) {
+		buf[len++] = (uint8_t)value | 0x80;
+		value >>= 7;
+	}
+	buf[len++] = (uint8_t)value;
+
+	return len;
+}
+
+int tsdb_get_varint(const uint8_t *buf, size_t len, uint64_t *value)
+{
+	uint64_t v = 0;
+	size_t i;
+
+	for (i = 0; i < len && i < TSDB_VARINT_MAX; ++i) {
+		v |= (uint64_t)(buf[i] & 0x7f) << (7 * i);
+		if (!(buf[i] & 0x80)) {
+			*value = v;
+			return i + 1;
+		}
+	}
+
+	return -EINVAL;
+}
+
+static size_t tsdb_put_record(uint8_t *buf, int64_t dt, int64_t dv)
+{
+	size_t len = tsdb_put_varint(buf, tsdb_zigzag(dt));
+
+	return len + tsdb_put_varint(buf + len, tsdb_zigzag(dv));
+}
+
+static int64_t tsdb_scale(int decimals)
+{
+	int64_t scale = 1;
+
+	while (decimals-- > 0)
+		scale *= 10;
+
+	return scale;
+}
+
+static int tsdb_to_fixed(double value, int decimals, int64_t *fixed)
+{
+	double v = value * tsdb_scale(decimals);
+
+	/* NaN fails here as well */
+	if (!(v > -9.2e18 && v < 9.2e18))
+		return -ERANGE;
+
+	*fixed = (int64_t)(v < 0 ? v - 0.5 : v + 0.5);
+
+	return 0;
+}
+
+static uint8_t *tsdb_block(const struct tsdb_header *hdr, unsigned int block)
+{
+	return (uint8_t*)hdr + (block + 1) * TSDB_BLOCK_SIZE;
+}
+
+/* walks the records of one block */
+struct tsdb_cursor {
+	const uint8_t *data;
+	size_t bytes;
+	size_t pos;
+	int64_t time_ms;
+	int64_t value;
+};
+
+static void tsdb_cursor_init(struct tsdb_cursor *c, const struct tsdb_header *hdr,
+			     unsigned int block)
+{
+	c->data = tsdb_block(hdr, block);
+	c->bytes = hdr->index[block].bytes;
+	if (c->bytes > TSDB_BLOCK_SIZE)
+		c->bytes = TSDB_BLOCK_SIZE;
+	c->pos = 0;
+	c->time_ms = hdr->index[block].first_ms;
+	c->value = 0;
+}
+
+/* 1 for the next record, 0 at the end and negative for a torn record */
+static int tsdb_cursor_next(struct tsdb_cursor *c)
+{
+	uint64_t dt, dv;
+	int len, len_v;
+
+	if (c->pos >= c->bytes)
+		return 0;
+
+	len = tsdb_get_varint(c->data + c->pos, c->bytes - c->pos, &dt);
+	if (len < 0)
+		return len;
+
+	len_v = tsdb_get_varint(c->data + c->pos + len, c->bytes - c->pos - len, &dv);
+	if (len_v < 0)
+		return len_v;
+
+	c->pos += len + len_v;
+	c->time_ms += tsdb_unzigzag(dt);
+	c->value += tsdb_unzigzag(dv);
+
+	return 1;
+}
+
+static int tsdb_path(const struct tsdb *db, const struct tsdb_series *s,
+		     uint32_t seq, char *path, size_t len)
+{
+	int ret = snprintf(path, len, "%s/%s.%08u.tsdb", db->dir, s->name,
+			   (unsigned int)seq);
+
+	return (ret < 0 || (size_t)ret >= len) ? -ENAMETOOLONG : 0;
+}
+
+static void tsdb_unmap(struct tsdb_header *hdr)
+{
+	munmap(hdr, TSDB_SEGMENT_SIZE);
+}
+
+static int tsdb_map(const char *path, int flags, struct tsdb_header **hdr)
+{
+	int ret = 0;
+	int fd;
+	struct stat st;
+	void *map;
+	int prot = PROT_READ;
+
+	if ((flags & O_ACCMODE) != O_RDONLY)
+		prot |= PROT_WRITE;
+
+	fd = open(path, flags | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	/* a new segment is sparse until its blocks are written */
+	if (flags & O_CREAT) {
+		if (ftruncate(fd, TSDB_SEGMENT_SIZE))
+			ret = -errno;
+	} else if (fstat(fd, &st)) {
+		ret = -errno;
+	} else if (st.st_size < TSDB_SEGMENT_SIZE) {
+		ret = -EINVAL;
+	}
+	if (ret)
+		goto out_close;
+
+	map = mmap(NULL, TSDB_SEGMENT_SIZE, prot, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		ret = -errno;
+		goto out_close;
+	}
+
+	*hdr = (struct tsdb_header*)map;
+
+	if (!(flags & O_CREAT) &&
+	    ((*hdr)->magic != TSDB_MAGIC || (*hdr)->version != TSDB_VERSION ||
+	     (*hdr)->blocks > TSDB_SEGMENT_BLOCKS ||
+	     (*hdr)->decimals > TSDB_DECIMALS_MAX)) {
+		tsdb_unmap(*hdr);
+		ret = -EINVAL;
+	}
+
+out_close:
+	/* the mapping keeps the file */
+	close(fd);
+out:
+	return ret;
+}
+
+int tsdb_open(struct tsdb *db, const char *dir, unsigned int segments)
+{
+	int ret = 0;
+
+	memset(db, 0, sizeof(*db));
+
+	if (mkdir(dir, 0755) && errno != EEXIST) {
+		ret = -errno;
+		log_err("create %s failed (%d) %s", dir, ret, strerror(-ret));
+		goto out;
+	}
+
+	db->dir = strdup(dir);
+	if (!db->dir) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	db->segments = segments < TSDB_SEGMENTS_MIN ? TSDB_SEGMENTS_MIN : segments;
+out:
+	return ret;
+}
+
+void tsdb_close(struct tsdb *db)
+{
+	unsigned int i;
+
+	for (i = 0; i < db->count; ++i) {
+		struct tsdb_series *s = &db->series[i];
+
+		if (s->tail) {
+			msync(s->tail, TSDB_SEGMENT_SIZE, MS_SYNC);
+			tsdb_unmap(s->tail);
+			s->tail = NULL;
+		}
+	}
+
+	free(db->dir);
+	db->dir = NULL;
+	db->count = 0;
+}
+
+/* finds the first and last segment of a series, none leaves last < first */
+static int tsdb_scan(struct tsdb *db, struct tsdb_series *s)
+{
+	DIR *dir;
+	struct dirent *de;
+	size_t len = strlen(s->name);
+
+	s->first_seq = 1;
+	s->last_seq = 0;
+
+	dir = opendir(db->dir);
+	if (!dir)
+		return -errno;
+
+	while ((de = readdir(dir))) {
+		const char *num = de->d_name + len + 1;
+		char *end;
+		unsigned long seq;
+
+		if (strncmp(de->d_name, s->name, len) || de->d_name[len] != '.')
+			continue;
+
+		seq = strtoul(num, &end, 10);
+		if (end == num || strcmp(end, ".tsdb") || !seq || seq > UINT32_MAX)
+			continue;
+
+		if (s->last_seq < s->first_seq) {
+			s->first_seq = seq;
+			s->last_seq = seq;
+		} else if (seq < s->first_seq) {
+			s->first_seq = seq;
+		} else if (seq > s->last_seq) {
+			s->last_seq = seq;
+		}
+	}
+
+	closedir(dir);
+
+	return 0;
+}
+
+/* continues the last segment, records torn by a crash are dropped */
+static int tsdb_resume(struct tsdb *db, struct tsdb_series *s)
+{
+	int ret = 0;
+	char path[PATH_MAX];
+	struct tsdb_header *hdr;
+	struct tsdb_cursor c;
+	size_t bytes = 0;
+	uint16_t count = 0;
+	unsigned int block;
+
+	ret = tsdb_path(db, s, s->last_seq, path, sizeof(path));
+	if (ret)
+		goto out;
+
+	ret = tsdb_map(path, O_RDWR, &hdr);
+	if (ret)
+		goto out;
+
+	/* other decimals start a new segment */
+	if (hdr->decimals != (uint32_t)s->decimals) {
+		tsdb_unmap(hdr);
+		goto out;
+	}
+
+	if (hdr->blocks) {
+		block = hdr->blocks - 1;
+		tsdb_cursor_init(&c, hdr, block);
+
+		while (tsdb_cursor_next(&c) > 0) {
+			bytes = c.pos;
+			++count;
+		}
+
+		hdr->index[block].bytes = bytes;
+		hdr->index[block].count = count;
+		s->prev_ms = c.time_ms;
+		s->prev_value = c.value;
+	}
+
+	s->tail = hdr;
+out:
+	return ret;
+}
+
+int tsdb_find(const struct tsdb *db, const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < db->count; ++i) {
+		if (!strcmp(db->series[i].name, name))
+			return i;
+	}
+
+	return -ENOENT;
+}
+
+int tsdb_series(struct tsdb *db, const char *name, int decimals)
+{
+	int ret = 0;
+	struct tsdb_series *s;
+
+	if (!name || !name[0] || name[0] == '.' || strchr(name, '/') ||
+	    strlen(name) >= TSDB_NAME_MAX || decimals < 0 ||
+	    decimals > TSDB_DECIMALS_MAX) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ret = tsdb_find(db, name);
+	if (ret >= 0)
+		goto out;
+
+	if (db->count >= TSDB_SERIES_MAX) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	s = &db->series[db->count];
+	memset(s, 0, sizeof(*s));
+	strcpy(s->name, name);
+	s->decimals = decimals;
+
+	ret = tsdb_scan(db, s);
+	if (ret)
+		goto out;
+
+	/* a broken last segment is kept for the queries, records go to a new one */
+	if (s->last_seq >= s->first_seq) {
+		ret = tsdb_resume(db, s);
+		if (ret)
+			log_err("resume series %s failed (%d) %s", name, ret,
+				strerror(-ret));
+	}
+
+	ret = db->count++;
+out:
+	return ret;
+}
+
+int tsdb_decimals(const struct tsdb *db, int id)
+{
+	if (id < 0 || (unsigned int)id >= db->count)
+		return -EINVAL;
+
+	return db->series[id].decimals;
+}
+
+static int tsdb_new_segment(struct tsdb *db, struct tsdb_series *s)
+{
+	int ret = 0;
+	char path[PATH_MAX];
+	struct tsdb_header *hdr;
+	uint32_t seq = s->last_seq + 1;
+
+	ret = tsdb_path(db, s, seq, path, sizeof(path));
+	if (ret)
+		goto out;
+
+	ret = tsdb_map(path, O_RDWR | O_CREAT | O_TRUNC, &hdr);
+	if (ret) {
+		log_err("create segment %s failed (%d) %s", path, ret, strerror(-ret));
+		goto out;
+	}
+
+	hdr->magic = TSDB_MAGIC;
+	hdr->version = TSDB_VERSION;
+	hdr->decimals = s->decimals;
+	hdr->blocks = 0;
+
+	if (s->tail) {
+		msync(s->tail, TSDB_SEGMENT_SIZE, MS_ASYNC);
+		tsdb_unmap(s->tail);
+	}
+
+	s->tail = hdr;
+	if (s->last_seq < s->first_seq)
+		s->first_seq = seq;
+	s->last_seq = seq;
+
+	while (s->last_seq - s->first_seq >= db->segments) {
+		if (!tsdb_path(db, s, s->first_seq, path, sizeof(path)) &&
+		    unlink(path) && errno != ENOENT)
+			log_err("remove segment %s failed (%d) %s", path, errno,
+				strerror(errno));
+		++s->first_seq;
+	}
+out:
+	return ret;
+}
+
+static int tsdb_next_block(struct tsdb *db, struct tsdb_series *s, int64_t time_ms)
+{
+	int ret = 0;
+	struct tsdb_index *idx;
+
+	if (!s->tail || s->tail->blocks >= TSDB_SEGMENT_BLOCKS) {
+		ret = tsdb_new_segment(db, s);
+		if (ret)
+			goto out;
+	}
+
+	idx = &s->tail->index[s->tail->blocks];
+	idx->first_ms = time_ms;
+	idx->count = 0;
+	idx->bytes = 0;
+	++s->tail->blocks;
+
+	s->prev_ms = time_ms;
+	s->prev_value = 0;
+out:
+	return ret;
+}
+
+int tsdb_append(struct tsdb *db, int id, int64_t time_ms, double value)
+{
+	int ret = 0;
+	struct tsdb_series *s;
+	struct tsdb_index *idx;
+	uint8_t rec[TSDB_RECORD_MAX];
+	int64_t fixed;
+	size_t len;
+
+	if (id < 0 || (unsigned int)id >= db->count)
+		return -EINVAL;
+
+	s = &db->series[id];
+
+	ret = tsdb_to_fixed(value, s->decimals, &fixed);
+	if (ret)
+		return ret;
+
+	if (s->tail && s->tail->blocks) {
+		idx = &s->tail->index[s->tail->blocks - 1];
+		len = tsdb_put_record(rec, time_ms - s->prev_ms, fixed - s->prev_value);
+		if (idx->bytes + len <= TSDB_BLOCK_SIZE && idx->count < UINT16_MAX)
+			goto write;
+
+		/* a full block goes to the card, the rest waits for writeback */
+		msync(s->tail, TSDB_SEGMENT_SIZE, MS_ASYNC);
+	}
+
+	ret = tsdb_next_block(db, s, time_ms);
+	if (ret)
+		return ret;
+
+	idx = &s->tail->index[s->tail->blocks - 1];
+	len = tsdb_put_record(rec, 0, fixed);
+write:
+	memcpy(tsdb_block(s->tail, s->tail->blocks - 1) + idx->bytes, rec, len);
+	idx->bytes += len;
+	idx->count++;
+
+	s->prev_ms = time_ms;
+	s->prev_value = fixed;
+
+	return 0;
+}
+
+struct tsdb_query {
+	int64_t from_ms;
+	int64_t step_ms;
+	struct tsdb_point *points;
+	size_t count;
+	size_t n;
+	int64_t bucket;
+	double sum;
+	unsigned int samples;
+};
+
+/* returns 1 once the points are full */
+static int tsdb_query_flush(struct tsdb_query *q)
+{
+	if (!q->samples)
+		return 0;
+
+	q->points[q->n].time_ms = q->bucket;
+	q->points[q->n].value = q->sum / q->samples;
+	q->sum = 0.0;
+	q->samples = 0;
+
+	return ++q->n >= q->count;
+}
+
+static int tsdb_query_add(struct tsdb_query *q, int64_t time_ms, double value)
+{
+	int64_t bucket;
+
+	if (q->step_ms <= 0) {
+		q->points[q->n].time_ms = time_ms;
+		q->points[q->n].value = value;
+		return ++q->n >= q->count;
+	}
+
+	bucket = q->from_ms + (time_ms - q->from_ms) / q->step_ms * q->step_ms;
+	if (q->samples && bucket != q->bucket && tsdb_query_flush(q))
+		return 1;
+
+	q->bucket = bucket;
+	q->sum += value;
+	++q->samples;
+
+	return 0;
+}
+
+/* returns 1 at the end of the range or once the points are full */
+static int tsdb_query_segment(struct tsdb_query *q, const struct tsdb_header *hdr,
+			      int64_t to_ms)
+{
+	double scale = tsdb_scale(hdr->decimals);
+	struct tsdb_cursor c;
+	unsigned int block;
+
+	for (block = 0; block < hdr->blocks; ++block) {
+		if (hdr->index[block].first_ms > to_ms)
+			return 1;
+
+		/* the records of a block are not newer than the next block */
+		if (block + 1 < hdr->blocks && hdr->index[block + 1].first_ms < q->from_ms)
+			continue;
+
+		tsdb_cursor_init(&c, hdr, block);
+
+		while (tsdb_cursor_next(&c) > 0) {
+			if (c.time_ms < q->from_ms)
+				continue;
+			if (c.time_ms > to_ms)
+				return 1;
+			if (tsdb_query_add(q, c.time_ms, c.value / scale))
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+int tsdb_query(struct tsdb *db, int id, int64_t from_ms, int64_t to_ms,
+	       int64_t step_ms, struct tsdb_point *points, size_t count)
+{
+	struct tsdb_series *s;
+	struct tsdb_query q;
+	struct tsdb_header *hdr;
+	char path[PATH_MAX];
+	uint32_t seq;
+	int done = 0;
+
+	if (id < 0 || (unsigned int)id >= db->count || from_ms > to_ms)
+		return -EINVAL;
+
+	s = &db->series[id];
+
+	memset(&q, 0, sizeof(q));
+	q.from_ms = from_ms;
+	q.step_ms = step_ms;
+	q.points = points;
+	q.count = count;
+
+	for (seq = s->first_seq; !done && count && seq <= s->last_seq; ++seq) {
+		if (s->tail && seq == s->last_seq) {
+			done = tsdb_query_segment(&q, s->tail, to_ms);
+			continue;
+		}
+
+		/* segments of a crash or a full card may be missing */
+		if (tsdb_path(db, s, seq, path, sizeof(path)) ||
+		    tsdb_map(path, O_RDONLY, &hdr))
+			continue;
+
+		done = tsdb_query_segment(&q, hdr, to_ms);
+		tsdb_unmap(hdr);
+	}
+
+	if (q.n < count)
+		tsdb_query_flush(&q);
+
+	return q.n;
+}
@@ -0,0 +1,108 @@
+/*
+ * tsdb.h
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __TSDB_H__
+#define __TSDB_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Append-only time-series store. Each series is a chain of mmapped
+ * segment files <dir>/<name>.<seq>.tsdb of fixed size. The first block of a
+ * segment is its header with an index of the data blocks, a data block holds
+ * records of zigzag varint deltas of the time and the value to the previous
+ * record of the block. Values are kept as integers of the series decimals.
+ * Records are expected in time order, the oldest segments are dropped once
+ * a series has more than segments of them.
+ */
+#define TSDB_BLOCK_SIZE 1024
+#define TSDB_SEGMENT_BLOCKS 63
+#define TSDB_SEGMENT_SIZE ((TSDB_SEGMENT_BLOCKS + 1) * TSDB_BLOCK_SIZE)
+
+#define TSDB_SERIES_MAX 16
+#define TSDB_NAME_MAX 32
+#define TSDB_DECIMALS_MAX 9
+
+struct tsdb_index {
+	int64_t first_ms;
+	uint16_t count;
+	uint16_t bytes;
+	uint32_t reserved;
+};
+
+struct tsdb_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t blocks;
+	uint32_t decimals;
+	uint32_t reserved;
+	struct tsdb_index index[TSDB_SEGMENT_BLOCKS];
+};
+
+struct tsdb_series {
+	char name[TSDB_NAME_MAX];
+	int decimals;
+	uint32_t first_seq;
+	uint32_t last_seq;
+	/* last segment, NULL before the first record */
+	struct tsdb_header *tail;
+	int64_t prev_ms;
+	int64_t prev_value;
+};
+
+struct tsdb {
+	char *dir;
+	unsigned int segments;
+	unsigned int count;
+	struct tsdb_series series[TSDB_SERIES_MAX];
+};
+
+struct tsdb_point {
+	int64_t time_ms;
+	double value;
+};
+
+/* dir is created if missing, a series keeps at least two segments */
+int tsdb_open(struct tsdb *db, const char *dir, unsigned int segments);
+void tsdb_close(struct tsdb *db);
+
+/* returns the id of the series, existing segments are continued */
+int tsdb_series(struct tsdb *db, const char *name, int decimals);
+/* -ENOENT for a series not opened */
+int tsdb_find(const struct tsdb *db, const char *name);
+int tsdb_decimals(const struct tsdb *db, int id);
+int tsdb_append(struct tsdb *db, int id, int64_t time_ms, double value);
+
+/*
+ * Returns the count of points between from_ms and to_ms, oldest first.
+ * With step_ms the points are the means of step_ms wide buckets starting
+ * at from_ms, stamped with the start of their bucket. At most count points
+ * are returned.
+ */
+int tsdb_query(struct tsdb *db, int id, int64_t from_ms, int64_t to_ms,
+	       int64_t step_ms, struct tsdb_point *points, size_t count);
+
+/* the record codec, exported for the tests */
+size_t tsdb_put_varint(uint8_t *buf, uint64_t value);
+int tsdb_get_varint(const uint8_t *buf, size_t len, uint64_t *value);
+
+#endif /*__TSDB_H__*/
@@ -22,14 +22,119 @@
 #ifndef __GARDEN_MODULE_H__
 #define __GARDEN_MODULE_H__
 
+#include <stdint.h>
+#include <stddef.h>
 #include <mosquitto.h>
 
+struct garden_module;
+struct stop;
+
+typedef void (*garden_fd_cb_t)(int fd, uint32_t events, void *obj);
+typedef void (*garden_timer_cb_t)(void *obj);
+
+/*
+ * Jitter statistics of a timer. Lateness is the delay between the deadline
+ * and the start of the callback, overruns count periods skipped because a
+ * run started more than one interval late.
+ */
+struct garden_timer_stats {
+	uint64_t runs;
+	uint64_t overruns;
+	uint32_t lateness_last_us;
+	uint32_t lateness_max_us;
+	uint32_t lateness_mean_us;
+};
+
+enum garden_aggregate {
+	GARDEN_AGGREGATE_LAST = 0,
+	GARDEN_AGGREGATE_MIN,
+	GARDEN_AGGREGATE_MAX,
+	GARDEN_AGGREGATE_MEAN,
+	GARDEN_AGGREGATE_EWMA,
+	GARDEN_AGGREGATE_MEDIAN,
+};
+
+/*
+ * Sensor channel kept by the core. Samples are aggregated over a window
+ * of samples and over intervals of interval_sec. topic gets the aggregate
+ * every interval and in between once it moved by deadband, a deadband of
+ * 0 waits for the interval. Without interval every sample is published.
+ * topic/stats gets all aggregates of an interval as JSON. A sensor section
+ * of the configuration with the same name overrides these defaults.
+ */
+/* sent ahead of the other messages and never coalesced, for confirmations */
+#define GARDEN_PUBLISH_HIGH 0x1
+/* the broker keeps the message for new subscribers */
+#define GARDEN_PUBLISH_RETAIN 0x2
+/* never spooled, waits for the connection and not behind the spool */
+#define GARDEN_PUBLISH_LIVE 0x4
+
+struct garden_sensor {
+	const char *name;
+	const char *topic;
+	unsigned int window;
+	unsigned int interval_sec;
+	double deadband;
+	double ewma_alpha;
+	enum garden_aggregate aggregate;
+	int decimals;
+};
+
+/*
+ * Services of the gardenctl core event loop. fd events are EPOLL* flags.
+ * Timers fire after delay_ms and then every interval_ms on fixed deadlines,
+ * a timer with delay_ms and interval_ms both 0 is disarmed. All callbacks run in the
+ * thread handling MQTT. Worker threads of modules wait on stop (see stop.h)
+ * to terminate without delay.
+ *
+ * publish may be called from any thread, the core sends the messages from
+ * its own. Updates of a topic are coalesced and rate limited by the publish
+ * rules of the configuration.
+ */
+struct garden_core {
+	int (*watch)(struct garden_core*, int fd, uint32_t events,
+		     garden_fd_cb_t cb, void *obj);
+	int (*unwatch)(struct garden_core*, int fd);
+	int (*timer_add)(struct garden_core*, unsigned int delay_ms,
+			 unsigned int interval_ms, garden_timer_cb_t cb, void *obj);
+	int (*timer_mod)(struct garden_core*, int timer, unsigned int delay_ms,
+			 unsigned int interval_ms);
+	int (*timer_del)(struct garden_core*, int timer);
+	int (*timer_stats)(struct garden_core*, int timer,
+			   struct garden_timer_stats *stats);
+	/* returns the id of the sensor to push its samples to */
+	int (*sensor_add)(struct garden_core*, const struct garden_sensor *sensor);
+	int (*sensor_push)(struct garden_core*, int sensor, double value);
+	/* flags are GARDEN_PUBLISH_*, payload is copied */
+	int (*publish)(struct garden_core*, const char *topic, const void *payload,
+		       size_t len, int qos, unsigned int flags);
+
+	struct stop *stop;
+};
+
+/*
+ * Static table entry describing one topic filter of a module. The core
+ * subscribes all filters on connect and routes matching messages to handler.
+ */
+struct garden_subscription {
+	const char *topic;
+	int qos;
+	int (*handler)(struct garden_module*, const struct mosquitto_message *);
+};
+
+#define GARDEN_SUBSCRIPTION(__topic, __qos, __handler) \
+	{ (__topic), (__qos), (__handler) }
+#define GARDEN_SUBSCRIPTION_END() { NULL, 0, NULL }
+
 struct garden_module {
-	int (*init)(struct garden_module*, const char *conf_file, struct mosquitto*);
-	int (*subscribe)(struct garden_module*);
-	int (*message)(struct garden_module*, const struct mosquitto_message *);
+	int (*init)(struct garden_module*, const char *conf_file, struct mosquitto*,
+		    struct garden_core*);
+
+	/* terminated by GARDEN_SUBSCRIPTION_END() */
+	const struct garden_subscription *subscriptions;
 
 	struct mosquitto *mosq;
+	struct garden_core *core;
 	void *data;
 };
 
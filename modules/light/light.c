@@ -28,90 +28,62 @@
 #include <logging.h>
 #include <gpioex.h>
 
-enum topics {
-	TOPIC_LIGHT_TREE,
-	TOPIC_LIGHT_HOUSE,
-	TOPIC_LIGHT_TAP,
-	MAX_TOPICS,
-};
-
-struct light {
-	const char *topics[MAX_TOPICS];
-};
-
 static int gm_init(struct garden_module *gm, const char *conf_file,
-		   struct mosquitto* mosq)
+		   struct mosquitto* mosq, struct garden_core *core)
 {
-	int ret = 0;
-	struct light *data = NULL;
-
 	gm->mosq = mosq;
-	gm->data = malloc(sizeof(struct light));
-
-	if (!gm->data) {
-		log_err("allocation for light data failed");
-		ret = -ENOMEM;
-		goto out;
-	}
-
-	data = (struct light*)gm->data;
+	gm->core = core;
 
-	data->topics[TOPIC_LIGHT_TREE] = "/garden/light/tree";
-	data->topics[TOPIC_LIGHT_HOUSE] = "/garden/light/house";
-	data->topics[TOPIC_LIGHT_TAP] = "/garden/light/tap";
-out:
-	return ret;
+	return 0;
 }
 
-static int gm_subscribe(struct garden_module *gm)
+static void gm_on_light_switched(int ret, gpioex_mask_t changed, void *obj)
 {
-	int ret = 0;
-	struct light *data = (struct light*)gm->data;
-
-	if (data) {
-		int i = 0;
-		for (i = 0; i < MAX_TOPICS; ++i) {
-			ret = mosquitto_subscribe(gm->mosq, NULL, data->topics[i], 2);
-			if (ret) {
-				log_err("subscribe %s failed (%d) %s", data->topics[i],
-					ret, mosquitto_strerror(ret));
-				break;
-			}
-		}
-	}
-	return ret;
+	if (ret < 0)
+		log_err("light: switch failed (%d) %s", ret, strerror(-ret));
 }
 
-#define IF_TOPIC_SET_GPIOEX(__topic, __gpioex, __out, __ret) \
-	if (strcmp(data->topics[TOPIC_LIGHT_ ## __topic], message->topic) == 0) { \
-		__ret = payload_on_off_to_int(message->payload); \
-		if (__ret < 0) goto __out; \
-		__ret = gpioex_set(GPIOEX_LIGHT_ ## __gpioex, __ret); \
-	}
-
-static int gm_message(struct garden_module *gm, const struct mosquitto_message *message)
+static int gm_set_light(gpioex_mask_t gpio, const struct mosquitto_message *message)
 {
 	int ret = 0;
-	struct light *data;
 
 	log_dbg("light: handle message - topic: %s", message->topic);
 	log_dbg("light: message content: %s", message->payload);
 
-	data = gm->data;
-
-	if (!data) {
-		ret = -EINVAL;
+	ret = payload_on_off_to_int(message->payload);
+	if (ret < 0)
 		goto out;
-	}
-
-	IF_TOPIC_SET_GPIOEX(TREE, TREE, out, ret);
-	IF_TOPIC_SET_GPIOEX(HOUSE, HOUSE, out, ret);
-	IF_TOPIC_SET_GPIOEX(TAP, TAP, out, ret);
 
+	ret = gpioex_submit_set(gpio, ret, gm_on_light_switched, NULL);
 out:
 	return ret;
 }
 
+static int gm_message_tree(struct garden_module *gm,
+			   const struct mosquitto_message *message)
+{
+	return gm_set_light(GPIOEX_LIGHT_TREE, message);
+}
+
+static int gm_message_house(struct garden_module *gm,
+			    const struct mosquitto_message *message)
+{
+	return gm_set_light(GPIOEX_LIGHT_HOUSE, message);
+}
+
+static int gm_message_tap(struct garden_module *gm,
+			  const struct mosquitto_message *message)
+{
+	return gm_set_light(GPIOEX_LIGHT_TAP, message);
+}
+
+static const struct garden_subscription gm_subscriptions[] = {
+	GARDEN_SUBSCRIPTION("/garden/light/tree", 2, gm_message_tree),
+	GARDEN_SUBSCRIPTION("/garden/light/house", 2, gm_message_house),
+	GARDEN_SUBSCRIPTION("/garden/light/tap", 2, gm_message_tap),
+	GARDEN_SUBSCRIPTION_END()
+};
+
 struct garden_module *create_garden_module(enum loglevel loglevel)
 {
 	struct garden_module *module = malloc(sizeof(*module));
@@ -119,8 +91,7 @@ struct garden_module *create_garden_module(enum loglevel loglevel)
 	if (module) {
 		memset(module, 0, sizeof(*module));
 		module->init = gm_init;
-		module->subscribe = gm_subscribe;
-		module->message = gm_message;
+		module->subscriptions = gm_subscriptions;
 
 		max_loglevel = loglevel;
 	}
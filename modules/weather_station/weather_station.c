@@ -24,166 +24,319 @@
 #include <config.h>
 #include <string.h>
 #include <errno.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <pthread.h>
 #include <garden_module.h>
 #include <garden_common.h>
 #include <logging.h>
 #include <gpioex.h>
+#include <hw.h>
+#include <stop.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #define INTERVAL_SEC 30
-#define PUBLISH_INT 10
+#define STATS_INT 10
+
+/* channels of the dht on iio:device0 */
+#define DHT_IIO_DEVICE 0
 
-#define DHT_TEMP_FILENAME "/sys/bus/iio/devices/iio:device0/in_temp_input"
-#define DHT_HUMREL_FILENAME "/sys/bus/iio/devices/iio:device0/in_humidityrelative_input"
+/* samples averaged per interval when the device has a buffer */
+#define DHT_BUFFER_HZ 1
 
-enum thread_state {
-	THREAD_STATE_STOPPED,
-	THREAD_STATE_RUNNING,
+enum dht_scan {
+	DHT_SCAN_TEMP = 0,
+	DHT_SCAN_HUMREL,
+	DHT_SCAN_COUNT,
+};
+
+static const char *const dht_scan_channels[DHT_SCAN_COUNT] = {
+	[DHT_SCAN_TEMP] = "temp",
+	[DHT_SCAN_HUMREL] = "humidityrelative",
+};
+
+/* the median of 10 samples drops the jitter of the dht */
+static const struct garden_sensor dht_sensors[DHT_SCAN_COUNT] = {
+	[DHT_SCAN_TEMP] = {
+		.name = "temperature",
+		.topic = "/garden/sensor/temperature",
+		.window = 10,
+		.interval_sec = 300,
+		.deadband = 0.5,
+		.ewma_alpha = 0.2,
+		.aggregate = GARDEN_AGGREGATE_MEDIAN,
+		.decimals = 1,
+	},
+	[DHT_SCAN_HUMREL] = {
+		.name = "humidity",
+		.topic = "/garden/sensor/humidity",
+		.window = 10,
+		.interval_sec = 300,
+		.deadband = 2.0,
+		.ewma_alpha = 0.2,
+		.aggregate = GARDEN_AGGREGATE_MEDIAN,
+		.decimals = 1,
+	},
 };
 
 struct weather_station {
+	int timer;
+	int sensors[DHT_SCAN_COUNT];
+	struct hw_iio_channel dht_ch[DHT_SCAN_COUNT];
+	struct hw_iio_buffer dht_buf;
+	/* sums of the scans since the last sample, in milli units */
+	int64_t dht_sum[DHT_SCAN_COUNT];
+	uint32_t dht_scans;
+	uint32_t period;
+	/*
+	 * One-shot reads take the dht several ms each, they are done by the
+	 * worker. The timer starts a read with req_fd, the worker hands the
+	 * values back with done_fd and clears dht_pending.
+	 */
 	pthread_t thread;
-	pthread_mutex_t lock;
-	enum thread_state thread_state;
+	int worker;
+	int quit;
+	int req_fd;
+	int done_fd;
+	int dht_pending;
+	int dht_ret[DHT_SCAN_COUNT];
+	double dht_value[DHT_SCAN_COUNT];
 };
 
-static int get_dht_temp(double *temp)
+/* channels stay open, one missing at start is retried per sample */
+static int get_dht_value(struct hw_iio_channel *ch, const char *channel,
+			 double *value)
 {
 	int ret = 0;
-	int fd;
-	char buffer[20] = { 0 };
+	int milli;
 
-	*temp = 0.0;
-
-	ret = open(DHT_TEMP_FILENAME, O_RDONLY);
-	if (ret < 0)
-		goto out;
+	*value = 0.0;
 
-	fd = ret;
+	if (ch->fd < 0) {
+		ret = hw_iio_open(ch, DHT_IIO_DEVICE, channel);
+		if (ret < 0)
+			goto out;
+	}
 
-	ret = read(fd, buffer, sizeof(buffer));
+	ret = hw_iio_read(ch, &milli);
 	if (ret < 0)
-		goto out_close;
+		goto out;
 
-	*temp = atoi(buffer);
-	*temp /= 1000;
+	*value = milli;
+	*value /= 1000;
 
-	log_dbg("dht temp: %.1f", *temp);
-out_close:
-	close(fd);
+	log_dbg("dht %s: %.1f", channel, *value);
 out:
 	return ret;
 }
 
-static int get_dht_hum(double *hum)
+static void dht_read(struct weather_station *data)
 {
-	int ret = 0;
-	int fd;
-	char buffer[20] = { 0 };
+	int i;
 
-	*hum = 0.0;
+	for (i = 0; i < DHT_SCAN_COUNT; ++i)
+		data->dht_ret[i] = get_dht_value(&data->dht_ch[i], dht_scan_channels[i],
+						 &data->dht_value[i]);
+}
 
-	ret = open(DHT_HUMREL_FILENAME, O_RDONLY);
-	if (ret < 0)
+static void *dht_worker_run(void *arg)
+{
+	struct garden_module *gm = (struct garden_module*)arg;
+	struct weather_station *data = (struct weather_station*)gm->data;
+	struct pollfd pfd[2] = {
+		{ .fd = data->req_fd, .events = POLLIN },
+		{ .fd = gm->core->stop ? stop_fd(gm->core->stop) : -1, .events = POLLIN },
+	};
+	eventfd_t count;
+
+	for (;;) {
+		if (poll(pfd, 2, -1) < 0 && errno != EINTR) {
+			log_err("wait for dht request failed (%d) %s", errno, strerror(errno));
+			break;
+		}
+
+		if (pfd[1].revents || __atomic_load_n(&data->quit, __ATOMIC_ACQUIRE))
+			break;
+
+		if (!pfd[0].revents)
+			continue;
+
+		eventfd_read(data->req_fd, &count);
+
+		dht_read(data);
+		__atomic_store_n(&data->dht_pending, 0, __ATOMIC_RELEASE);
+		eventfd_write(data->done_fd, 1);
+	}
+
+	return NULL;
+}
+
+static int dht_worker_start(struct garden_module *gm)
+{
+	struct weather_station *data = (struct weather_station*)gm->data;
+	int ret = 0;
+
+	data->req_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (data->req_fd < 0) {
+		ret = -errno;
+		log_err("create dht request event failed (%d) %s", ret, strerror(-ret));
 		goto out;
+	}
 
-	fd = ret;
+	data->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (data->done_fd < 0) {
+		ret = -errno;
+		log_err("create dht done event failed (%d) %s", ret, strerror(-ret));
+		goto out_req_fd;
+	}
 
-	ret = read(fd, buffer, sizeof(buffer));
-	if (ret < 0)
-		goto out_close;
+	ret = pthread_create(&data->thread, NULL, dht_worker_run, gm);
+	if (ret) {
+		log_err("create dht worker failed (%d) %s", ret, strerror(ret));
+		ret = -ret;
+		goto out_done_fd;
+	}
 
-	*hum = atoi(buffer);
-	*hum /= 1000;
+	data->worker = 1;
+	goto out;
 
-	log_dbg("dht hum: %.1f", *hum);
-out_close:
-	close(fd);
+out_done_fd:
+	close(data->done_fd);
+	data->done_fd = -1;
+out_req_fd:
+	close(data->req_fd);
+	data->req_fd = -1;
 out:
 	return ret;
 }
 
-static void* gm_thread_run(void *obj)
+/* a read in progress is finished first */
+static void dht_worker_stop(struct weather_station *data)
+{
+	if (data->worker) {
+		__atomic_store_n(&data->quit, 1, __ATOMIC_RELEASE);
+		eventfd_write(data->req_fd, 1);
+		pthread_join(data->thread, NULL);
+		data->worker = 0;
+	}
+
+	if (data->req_fd >= 0)
+		close(data->req_fd);
+	if (data->done_fd >= 0)
+		close(data->done_fd);
+	data->req_fd = -1;
+	data->done_fd = -1;
+}
+
+static void dht_push(struct garden_module *gm)
 {
-	struct garden_module *gm = (struct garden_module*)obj;
 	struct weather_station *data = (struct weather_station*)gm->data;
-	enum thread_state state;
-	double dht_temp = 0;
-	double dht_hum = 0;
-	uint32_t period = 0;
+	int i;
 
-	state = data->thread_state = THREAD_STATE_RUNNING;
+	for (i = 0; i < DHT_SCAN_COUNT; ++i) {
+		if (!data->dht_ret[i] && data->sensors[i] >= 0)
+			gm->core->sensor_push(gm->core, data->sensors[i],
+					      data->dht_value[i]);
+	}
+}
 
-	while (state == THREAD_STATE_RUNNING) {
-		int ret = 0;
-		double curr_dht_temp, curr_dht_hum;
+static void gm_on_dht_done(int fd, uint32_t events, void *obj)
+{
+	struct garden_module *gm = (struct garden_module*)obj;
+	struct weather_station *data = (struct weather_station*)gm->data;
+	eventfd_t count;
 
-		ret = get_dht_temp(&curr_dht_temp);
-		if (ret >= 0 && (dht_temp != curr_dht_temp || !(period % PUBLISH_INT))) {
-			char buf[10] = { 0 };
-			dht_temp = curr_dht_temp;
+	eventfd_read(fd, &count);
 
-			sprintf(buf, "%.1f", dht_temp);
+	if (!__atomic_load_n(&data->dht_pending, __ATOMIC_ACQUIRE))
+		dht_push(gm);
+}
 
-			ret = mosquitto_publish(gm->mosq, NULL, "/garden/sensor/temperature",
-						strlen(buf), buf, 2, false);
-			if (ret < 0)
-				log_err("publish dht temperature failed (%d) %s", ret,
-					mosquitto_strerror(ret));
-		}
+/* mean of the buffered scans */
+static int get_dht_mean(struct weather_station *data, enum dht_scan scan,
+			double *value)
+{
+	*value = 0.0;
 
-		ret = get_dht_hum(&curr_dht_hum);
-		if (ret >= 0 && (dht_hum != curr_dht_hum || !(period % PUBLISH_INT))) {
-			char buf[10] = { 0 };
-			dht_hum = curr_dht_hum;
+	if (!data->dht_scans)
+		return -ENODATA;
 
-			sprintf(buf, "%.1f", dht_hum);
+	*value = (double)data->dht_sum[scan] / data->dht_scans / 1000;
 
-			ret = mosquitto_publish(gm->mosq, NULL, "/garden/sensor/humidity",
-						strlen(buf), buf, 2, false);
-			if (ret < 0)
-				log_err("publish dht humidity failed (%d) %s", ret,
-					mosquitto_strerror(ret));
-		}
+	log_dbg("dht %s: %.1f of %u scans", dht_scan_channels[scan], *value,
+		data->dht_scans);
 
-		sleep(INTERVAL_SEC);
-		pthread_mutex_lock(&data->lock);
-		state = data->thread_state;
-		pthread_mutex_unlock(&data->lock);
+	return 0;
+}
 
-		++period;
-	}
+static void gm_on_dht_buffer(int fd, uint32_t events, void *obj)
+{
+	struct garden_module *gm = (struct garden_module*)obj;
+	struct weather_station *data = (struct weather_station*)gm->data;
+	int values[HW_IIO_BUFFER_SCANS * DHT_SCAN_COUNT];
+	int ret, i, j;
 
-	log_dbg("exit weather station thread");
+	do {
+		ret = hw_iio_buffer_read(&data->dht_buf, values, HW_IIO_BUFFER_SCANS);
 
-	return NULL;
+		for (i = 0; i < ret; ++i) {
+			for (j = 0; j < DHT_SCAN_COUNT; ++j)
+				data->dht_sum[j] += values[i * DHT_SCAN_COUNT + j];
+			++data->dht_scans;
+		}
+	} while (ret == HW_IIO_BUFFER_SCANS);
+
+	if (ret < 0)
+		log_dbg("read dht buffer failed (%d) %s", ret, strerror(-ret));
 }
 
-static void gm_thread_stop(struct weather_station* data)
+/* the core publishes the aggregates of the sensors */
+static void gm_on_timer(void *obj)
 {
-	int ret = 0;
+	struct garden_module *gm = (struct garden_module*)obj;
+	struct weather_station *data = (struct weather_station*)gm->data;
+	int i;
+
+	if (data->dht_buf.fd >= 0) {
+		for (i = 0; i < DHT_SCAN_COUNT; ++i)
+			data->dht_ret[i] = get_dht_mean(data, i, &data->dht_value[i]);
+
+		memset(data->dht_sum, 0, sizeof(data->dht_sum));
+		data->dht_scans = 0;
+		dht_push(gm);
+	} else if (!data->worker) {
+		dht_read(data);
+		dht_push(gm);
+	} else if (__atomic_load_n(&data->dht_pending, __ATOMIC_ACQUIRE)) {
+		log_dbg("weather station: dht read still pending, sample skipped");
+	} else {
+		__atomic_store_n(&data->dht_pending, 1, __ATOMIC_RELAXED);
+		eventfd_write(data->req_fd, 1);
+	}
 
-	if (data) {
-		log_dbg("stopping weather station thread");
-		pthread_mutex_lock(&data->lock);
-		data->thread_state = THREAD_STATE_STOPPED;
-		pthread_mutex_unlock(&data->lock);
+	if (!(data->period % STATS_INT)) {
+		struct garden_timer_stats stats;
 
-		pthread_join(data->thread, NULL);
-		log_dbg("stopped weather station thread");
+		if (!gm->core->timer_stats(gm->core, data->timer, &stats))
+			log_dbg("weather station sampling late %u us (max %u us, mean %u us, overruns %llu)",
+				stats.lateness_last_us, stats.lateness_max_us,
+				stats.lateness_mean_us, (unsigned long long)stats.overruns);
 	}
+
+	++data->period;
 }
 
 static int gm_init(struct garden_module *gm, const char *conf_file,
-		   struct mosquitto* mosq)
+		   struct mosquitto* mosq, struct garden_core *core)
 {
 	int ret = 0;
 	struct weather_station *data = NULL;
+	int i;
 
 	gm->mosq = mosq;
-	gm->data = malloc(sizeof(struct weather_station));
+	gm->core = core;
+	gm->data = calloc(1, sizeof(struct weather_station));
 
 	if (!gm->data) {
 		log_err("allocation for weather station data failed");
@@ -192,18 +345,58 @@ static int gm_init(struct garden_module *gm, const char *conf_file,
 	}
 
 	data = (struct weather_station*)gm->data;
+	data->req_fd = -1;
+	data->done_fd = -1;
 
-	ret = pthread_mutex_init(&data->lock, NULL);
-	if (ret) {
-		log_err("initiate weather station lock failed (%d) %s", ret, strerror(ret));
-		goto out;
+	for (i = 0; i < DHT_SCAN_COUNT; ++i) {
+		data->dht_ch[i].fd = -1;
+
+		data->sensors[i] = core->sensor_add(core, &dht_sensors[i]);
+		if (data->sensors[i] < 0)
+			log_err("add sensor %s failed (%d) %s", dht_sensors[i].name,
+				data->sensors[i], strerror(-data->sensors[i]));
 	}
 
-	ret = pthread_create(&data->thread, NULL, &gm_thread_run, gm);
-	if (ret) {
-		log_err("create weather station thread failed (%d) %s", ret, strerror(ret));
+	/* a buffered device is sampled by its trigger, no one-shot read blocks */
+	ret = hw_iio_buffer_open(&data->dht_buf, DHT_IIO_DEVICE, dht_scan_channels,
+				 DHT_SCAN_COUNT, DHT_BUFFER_HZ);
+	if (!ret) {
+		ret = core->watch(core, data->dht_buf.fd, EPOLLIN, gm_on_dht_buffer, gm);
+		if (ret) {
+			log_err("watch dht buffer failed (%d) %s", ret, strerror(-ret));
+			hw_iio_buffer_close(&data->dht_buf);
+		} else {
+			log_dbg("weather station: dht buffered at %u Hz", DHT_BUFFER_HZ);
+		}
+	} else if (ret != -ENOTSUP) {
+		log_err("open dht buffer failed (%d) %s", ret, strerror(-ret));
+	}
+
+	for (i = 0; data->dht_buf.fd < 0 && i < DHT_SCAN_COUNT; ++i) {
+		ret = hw_iio_open(&data->dht_ch[i], DHT_IIO_DEVICE, dht_scan_channels[i]);
+		if (ret)
+			log_err("open dht %s failed (%d) %s", dht_scan_channels[i], ret,
+				strerror(-ret));
+	}
+
+	/* without the worker the reads block the loop but still sample */
+	if (data->dht_buf.fd < 0 && !dht_worker_start(gm)) {
+		ret = core->watch(core, data->done_fd, EPOLLIN, gm_on_dht_done, gm);
+		if (ret) {
+			log_err("watch dht worker failed (%d) %s", ret, strerror(-ret));
+			dht_worker_stop(data);
+		}
+	}
+
+	/* first sample right away, then every INTERVAL_SEC */
+	ret = core->timer_add(core, 1, INTERVAL_SEC * 1000, gm_on_timer, gm);
+	if (ret < 0) {
+		log_err("create weather station timer failed (%d) %s", ret, strerror(-ret));
 		goto out;
 	}
+
+	data->timer = ret;
+	ret = 0;
 out:
 	return ret;
 }
@@ -225,7 +418,16 @@ struct garden_module *create_garden_module(enum loglevel loglevel)
 void destroy_garden_module(struct garden_module *module)
 {
 	if (module) {
-		gm_thread_stop(module->data);
+		struct weather_station *data = (struct weather_station*)module->data;
+
+		if (data) {
+			int i;
+
+			dht_worker_stop(data);
+			hw_iio_buffer_close(&data->dht_buf);
+			for (i = 0; i < DHT_SCAN_COUNT; ++i)
+				hw_iio_close(&data->dht_ch[i]);
+		}
 		if (module->data)
 			free(module->data);
 		free(module);
@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <poll.h>
 
 #include <stdarg.h>
 #include <stddef.h>
@@ -34,6 +35,12 @@
 #include "garden_common.h"
 #include "logging.h"
 #include "gpioex.h"
+#include "stop.h"
+#include "debounce.h"
+#include "gpio.h"
+#include "hw.h"
+#include "hw_sim.h"
+#include "sensor.h"
 
 static void test_payload2int(void **state)
 {
@@ -71,74 +78,285 @@ static void test_logging(void **state)
 	/*TODO: check max fmt size limit*/
 }
 
+#define ADDR_BARREL_LVL	0x20
+#define ADDR_230V	0x21
+#define ADDR_24V	0x22
+#define ADDR_12V	0x23
+
+static const struct mock_i2c_msg init_msgs[] = {
+	{ ADDR_230V, 0xFF }, { ADDR_24V, 0xFF }, { ADDR_12V, 0xFF },
+};
+
+#define INIT_MSGS (sizeof(init_msgs) / sizeof(init_msgs[0]))
+
 static void test_gpioex_init(void **state)
 {
 	uint8_t val = 0xFF;
-	int fd;
+	struct gpioex_stats stats;
 
-	for (fd = 3; fd < 6; ++fd)
-		mock_i2c_prepare_write(fd, 0, &val, sizeof(val), sizeof(val));
-	assert_null(gpioex_init());
+	/* all expanders are disabled by one transaction */
+	mock_i2c_reset();
+	mock_i2c_prepare_rdwr(3, init_msgs, INIT_MSGS, INIT_MSGS);
+	assert_null(gpioex_init(NULL, 0));
 
-	/* Check open failed */
-	mock_i2c_prepare_write(-ENODEV, 0, NULL, 0, 0);
-	assert_int_equal(gpioex_init(), -ENODEV);
+	gpioex_get_stats(&stats);
+	assert_int_equal(stats.opens, 1);
+	assert_int_equal(stats.addr_switches, 0);
+	assert_int_equal(stats.transfers, 3);
+	assert_int_equal(stats.syscalls, 2);
+	assert_int_equal(stats.syscalls_saved, 10);
 
-	/* Check ioctl failed */
-	mock_i2c_prepare_write(3, -EINVAL, NULL, 0, 0);
-	assert_int_equal(gpioex_init(), -EINVAL);
+	assert_string_equal(gpioex_output_name(GPIOEX_ID_YARD_LEFT), "yard_left");
+	assert_null(gpioex_output_name(GPIOEX_ID_COUNT));
+	assert_null(gpioex_output_name(-1));
 
-	/* Check write 0 */
-	mock_i2c_prepare_write(3, 0, &val, sizeof(val), 0);
-	assert_int_equal(gpioex_init(), -EIO);
+	/* Check open failed */
+	mock_i2c_reset();
+	mock_i2c_prepare_rdwr(-ENODEV, init_msgs, INIT_MSGS, 0);
+	assert_int_equal(gpioex_init(NULL, 0), -ENODEV);
 
-	/* Check write failed */
-	mock_i2c_prepare_write(3, 0, &val, sizeof(val), -ENOSPC);
-	assert_int_equal(gpioex_init(), -ENOSPC);
+	/* Check ioctl failed */
+	mock_i2c_prepare_rdwr(3, init_msgs, INIT_MSGS, -ENOSPC);
+	assert_int_equal(gpioex_init(NULL, 0), -ENOSPC);
+
+	/* Check partial write */
+	mock_i2c_reset();
+	mock_i2c_prepare_rdwr(3, init_msgs, INIT_MSGS, 2);
+	assert_int_equal(gpioex_init(NULL, 0), -EIO);
+
+	/* reads switch the address only when it changes */
+	mock_i2c_prepare_read(ADDR_BARREL_LVL, 3, 0, (char*)&val, 1);
+	mock_i2c_prepare_read(ADDR_BARREL_LVL, 3, 0, (char*)&val, 1);
+	assert_int_equal(gpioex_get_barrel_level(), 0xFF);
+	assert_int_equal(gpioex_get_barrel_level(), 0xFF);
 }
 
-#define GPIOEX_VAL(_name, _sv, _rv) { \
-		start_ ## _name = (uint8_t)(_sv); \
-		result_ ## _name = (uint8_t)(_rv); \
+#define GPIOEX_TX(...) do { \
+		static const struct mock_i2c_msg msgs[] = { __VA_ARGS__ }; \
+		int n = sizeof(msgs) / sizeof(msgs[0]); \
+		mock_i2c_prepare_rdwr(3, msgs, n, n); \
 } while (0)
 
 void test_gpioex_set(void **state)
 {
-	int i, j;
-	uint8_t start_24v;
-	uint8_t result_24v;
-	uint8_t start_230v;
-	uint8_t result_230v;
-
-	/* Check tap on/off */
-	for (i = 0; i < 256; ++i) {
-		for (j = 0; j < 256; ++j) {
-			GPIOEX_VAL(24v, i, i & 0xF7);
-			GPIOEX_VAL(230v, j, j & 0x7F);
-
-			mock_i2c_prepare_read(3, 0, &start_24v, 1);
-			mock_i2c_prepare_write(3, 0, &result_24v, 1, 1);
-			mock_i2c_prepare_read(3, 0, &start_230v, 1);
-			mock_i2c_prepare_write(3, 0, &result_230v, 1, 1);
-			assert_null(gpioex_set(GPIOEX_TAP, 1));
-
-			GPIOEX_VAL(24v, i, i | 0x08);
-			mock_i2c_prepare_read(3, 0, &start_24v, 1);
-			if (((i | 0x08) & 0xFC) == 0xFC) {
-				GPIOEX_VAL(230v, j, j | 0x80);
-				mock_i2c_prepare_read(3, 0, &start_230v, 1);
-				mock_i2c_prepare_write(3, 0, &result_230v, 1, 1);
-				mock_i2c_prepare_write(3, 0, &result_24v, 1, 1);
-			} else {
-				GPIOEX_VAL(230v, j, j & 0x7F);
-				mock_i2c_prepare_write(3, 0, &result_24v, 1, 1);
-				mock_i2c_prepare_read(3, 0, &start_230v, 1);
-				mock_i2c_prepare_write(3, 0, &result_230v, 1, 1);
-			}
-
-			assert_null(gpioex_set(GPIOEX_TAP, 0));
-		}
-	}
+	static const uint8_t val12v = 0x7F;
+	static const struct mock_i2c_msg light_tap = { ADDR_12V, 0x5F };
+
+	mock_i2c_reset();
+	mock_i2c_prepare_rdwr(3, init_msgs, INIT_MSGS, INIT_MSGS);
+	assert_null(gpioex_init(NULL, 0));
+
+	/* every command is one transaction, the pump follows the valves */
+	GPIOEX_TX({ ADDR_24V, 0xF7 }, { ADDR_230V, 0x7F });
+	assert_null(gpioex_set(GPIOEX_TAP, 1));
+
+	/* unchanged expanders are not written */
+	GPIOEX_TX({ ADDR_24V, 0xE7 });
+	assert_null(gpioex_set(GPIOEX_YARD_LEFT, 1));
+
+	GPIOEX_TX({ ADDR_230V, 0x77 });
+	assert_null(gpioex_set(GPIOEX_LIGHT_TREE, 1));
+
+	/* the pump stops before all valves close */
+	GPIOEX_TX({ ADDR_230V, 0xF7 }, { ADDR_24V, 0xFF });
+	assert_null(gpioex_set(GPIOEX_TAP | GPIOEX_YARD, 0));
+
+	GPIOEX_TX({ ADDR_12V, 0x7F });
+	assert_null(gpioex_set(GPIOEX_DROPPIPE_PUMP, 1));
+
+	/* relays of several expanders share the transaction */
+	GPIOEX_TX({ ADDR_24V, 0xF7 }, { ADDR_12V, 0x5F }, { ADDR_230V, 0x73 });
+	assert_null(gpioex_set(GPIOEX_TAP | GPIOEX_LIGHT_HOUSE | GPIOEX_LIGHT_TAP, 1));
+
+	GPIOEX_TX({ ADDR_230V, 0xFF }, { ADDR_24V, 0xFF }, { ADDR_12V, 0x7F });
+	assert_null(gpioex_set(GPIOEX_TAP | GPIOEX_LIGHT_HOUSE | GPIOEX_LIGHT_TAP |
+			       GPIOEX_LIGHT_TREE, 0));
+
+	/* after a failed write the state is read back from the expander */
+	mock_i2c_prepare_rdwr(3, &light_tap, 1, 0);
+	assert_int_equal(gpioex_set(GPIOEX_LIGHT_TAP, 1), -EIO);
+
+	mock_i2c_prepare_read(ADDR_12V, 3, 0, (const char*)&val12v, 1);
+	GPIOEX_TX({ ADDR_12V, 0x5F });
+	assert_null(gpioex_set(GPIOEX_LIGHT_TAP, 1));
+}
+
+static void test_gpioex_apply(void **state)
+{
+	gpioex_mask_t changed;
+	gpioex_mask_t curr;
+
+	mock_i2c_reset();
+	mock_i2c_prepare_rdwr(3, init_msgs, INIT_MSGS, INIT_MSGS);
+	assert_null(gpioex_init(NULL, 0));
+
+	GPIOEX_TX({ ADDR_24V, 0xE7 }, { ADDR_230V, 0x7F });
+	assert_null(gpioex_apply(GPIOEX_TAP | GPIOEX_YARD_LEFT, &changed));
+	assert_int_equal(changed, GPIOEX_TAP | GPIOEX_YARD_LEFT | GPIOEX_PUMP);
+
+	/* switching zones keeps the pump running */
+	GPIOEX_TX({ ADDR_24V, 0xB7 });
+	assert_null(gpioex_apply(GPIOEX_TAP | GPIOEX_YARD_FRONT, &changed));
+	assert_int_equal(changed, GPIOEX_YARD_LEFT | GPIOEX_YARD_FRONT);
+
+	/* nothing to do, nothing written */
+	assert_null(gpioex_apply(GPIOEX_TAP | GPIOEX_YARD_FRONT, &changed));
+	assert_int_equal(changed, 0);
+
+	GPIOEX_TX({ ADDR_230V, 0xFF }, { ADDR_24V, 0xFF }, { ADDR_12V, 0xDF });
+	assert_null(gpioex_apply(GPIOEX_LIGHT_TAP, &changed));
+	assert_int_equal(changed, GPIOEX_TAP | GPIOEX_YARD_FRONT | GPIOEX_LIGHT_TAP |
+			 GPIOEX_PUMP);
+
+	assert_null(gpioex_get(&curr));
+	assert_int_equal(curr, GPIOEX_LIGHT_TAP);
+	assert_int_equal(gpioex_get_state_snapshot(), GPIOEX_LIGHT_TAP);
+
+	assert_int_equal(gpioex_apply(0x80000000, NULL), -EINVAL);
+	assert_int_equal(gpioex_get_state_snapshot(), GPIOEX_LIGHT_TAP);
+}
+
+static void test_gpioex_map(void **state)
+{
+	static const struct gpioex_output outputs[] = {
+		{ "pump",	1, 0x24, 0, true,  NULL },
+		{ "valve_a",	1, 0x25, 0, false, "pump" },
+		{ "valve_b",	1, 0x25, 1, false, "pump" },
+		{ "light",	1, 0x24, 4, false, NULL },
+	};
+	static const struct gpioex_output twice[] = {
+		{ "valve_a",	1, 0x25, 0, false, NULL },
+		{ "valve_b",	1, 0x25, 0, false, NULL },
+	};
+	static const struct gpioex_output unknown[] = {
+		{ "valve_a",	1, 0x25, 0, false, "pump" },
+	};
+	gpioex_mask_t valve_a, light, pump;
+	gpioex_mask_t changed;
+
+	/* active high outputs are low when off */
+	mock_i2c_reset();
+	GPIOEX_TX({ 0x24, 0xEF }, { 0x25, 0xFC });
+	assert_null(gpioex_init(outputs, 4));
+
+	/* known names keep their id, new ones follow */
+	assert_int_equal(gpioex_output_id("pump"), GPIOEX_ID_PUMP);
+	assert_int_equal(gpioex_output_id("valve_a"), GPIOEX_ID_COUNT);
+	assert_int_equal(gpioex_output_id("light"), GPIOEX_ID_COUNT + 2);
+	assert_int_equal(gpioex_output_id("tap"), -ENOENT);
+
+	valve_a = GPIOEX_OUTPUT(gpioex_output_id("valve_a"));
+	light = GPIOEX_OUTPUT(gpioex_output_id("light"));
+	pump = GPIOEX_OUTPUT(GPIOEX_ID_PUMP);
+
+	/* the interlock starts after its members, together with the light */
+	GPIOEX_TX({ 0x25, 0xFD }, { 0x24, 0xFE });
+	assert_null(gpioex_apply(valve_a | light, &changed));
+	assert_int_equal(changed, valve_a | light | pump);
+
+	/* and stops before them */
+	GPIOEX_TX({ 0x24, 0xFF }, { 0x25, 0xFC });
+	assert_null(gpioex_apply(light, &changed));
+	assert_int_equal(changed, valve_a | pump);
+
+	assert_int_equal(gpioex_apply(GPIOEX_TAP, NULL), -EINVAL);
+
+	assert_int_equal(gpioex_init(twice, 2), -EINVAL);
+	assert_int_equal(gpioex_init(unknown, 1), -EINVAL);
+}
+
+struct gpioex_done {
+	int calls;
+	int ret;
+	gpioex_mask_t changed;
+};
+
+static void on_gpioex_done(int ret, gpioex_mask_t changed, void *obj)
+{
+	struct gpioex_done *done = (struct gpioex_done*)obj;
+
+	done->calls++;
+	done->ret = ret;
+	done->changed = changed;
+}
+
+static void test_gpioex_worker(void **state)
+{
+	struct gpioex_done done = { 0 };
+	struct pollfd pfd;
+
+	mock_i2c_reset();
+	mock_i2c_prepare_rdwr(3, init_msgs, INIT_MSGS, INIT_MSGS);
+	assert_null(gpioex_init(NULL, 0));
+
+	/* without the worker the request is done right away */
+	GPIOEX_TX({ ADDR_12V, 0xDF });
+	assert_null(gpioex_submit_set(GPIOEX_LIGHT_TAP, 1, on_gpioex_done, &done));
+	assert_int_equal(done.calls, 1);
+	assert_int_equal(done.ret, 0);
+	assert_int_equal(done.changed, GPIOEX_LIGHT_TAP);
+
+	assert_null(gpioex_worker_start());
+
+	GPIOEX_TX({ ADDR_24V, 0xEF }, { ADDR_230V, 0x7F });
+	assert_null(gpioex_submit_update(GPIOEX_YARD, GPIOEX_YARD_LEFT,
+					 on_gpioex_done, &done));
+
+	pfd.fd = gpioex_worker_fd();
+	pfd.events = POLLIN;
+	assert_int_equal(poll(&pfd, 1, 1000), 1);
+
+	/* callbacks run on the thread completing them */
+	gpioex_worker_complete();
+	assert_int_equal(done.calls, 2);
+	assert_int_equal(done.ret, 0);
+	assert_int_equal(done.changed, GPIOEX_YARD_LEFT | GPIOEX_PUMP);
+
+	/* pending requests are finished by stop */
+	GPIOEX_TX({ ADDR_230V, 0xFF }, { ADDR_24V, 0xFF });
+	assert_null(gpioex_submit_set(GPIOEX_YARD_LEFT, 0, on_gpioex_done, &done));
+	gpioex_worker_stop();
+	assert_int_equal(done.calls, 3);
+	assert_int_equal(done.changed, GPIOEX_YARD_LEFT | GPIOEX_PUMP);
+}
+
+static void test_gpioex_verify(void **state)
+{
+	static const uint8_t val230v = 0x7F;
+	static const uint8_t val24v = 0xF7;
+	static const uint8_t val24v_drift = 0xFF;
+	static const uint8_t val12v = 0xFF;
+	struct gpioex_stats stats;
+	uint64_t mismatches;
+
+	mock_i2c_reset();
+	mock_i2c_prepare_rdwr(3, init_msgs, INIT_MSGS, INIT_MSGS);
+	assert_null(gpioex_init(NULL, 0));
+
+	GPIOEX_TX({ ADDR_24V, 0xF7 }, { ADDR_230V, 0x7F });
+	assert_null(gpioex_set(GPIOEX_TAP, 1));
+
+	mock_i2c_prepare_read(ADDR_230V, 3, 0, (const char*)&val230v, 1);
+	mock_i2c_prepare_read(ADDR_24V, 3, 0, (const char*)&val24v, 1);
+	mock_i2c_prepare_read(ADDR_12V, 3, 0, (const char*)&val12v, 1);
+	assert_int_equal(gpioex_verify(), 0);
+
+	gpioex_get_stats(&stats);
+	mismatches = stats.verify_mismatches;
+
+	/* a drifted expander gets the commanded state again */
+	mock_i2c_prepare_read(ADDR_230V, 3, 0, (const char*)&val230v, 1);
+	mock_i2c_prepare_read(ADDR_24V, 3, 0, (const char*)&val24v_drift, 1);
+	GPIOEX_TX({ ADDR_24V, 0xF7 });
+	mock_i2c_prepare_read(ADDR_12V, 3, 0, (const char*)&val12v, 1);
+	assert_int_equal(gpioex_verify(), 1);
+
+	gpioex_get_stats(&stats);
+	assert_int_equal(stats.verify_mismatches, mismatches + 1);
+
+	/* read errors are reported */
+	mock_i2c_prepare_read(ADDR_230V, 3, 0, (const char*)&val230v, -EINVAL);
+	assert_int_equal(gpioex_verify(), -EINVAL);
 }
 
 static int is_valid_barrel_lvl(uint8_t val)
@@ -156,10 +374,11 @@ static int is_valid_barrel_lvl(uint8_t val)
 static void test_gpioex_get_barrel_level(void **state)
 {
 	char barrel_lvl = 0xFF;
+	struct gpioex_sample sample;
 	int i;
 
 	for (i = 0; i <= 16; ++i) {
-		mock_i2c_prepare_read(3, 0, &barrel_lvl, 1);
+		mock_i2c_prepare_read(ADDR_BARREL_LVL, 3, 0, &barrel_lvl, 1);
 		assert_int_equal(gpioex_get_barrel_level(), (unsigned char)barrel_lvl);
 
 		if (i == 0)
@@ -171,30 +390,389 @@ static void test_gpioex_get_barrel_level(void **state)
 	}
 
 	for (i = 0; i <= 255; ++i) {
-		mock_i2c_prepare_read(3, 0, (char*)&i, 1);
+		mock_i2c_prepare_read(ADDR_BARREL_LVL, 3, 0, (char*)&i, 1);
 		if (is_valid_barrel_lvl((uint8_t)i))
 			assert_int_equal(gpioex_get_barrel_level(), i);
 		else
 			assert_int_equal(gpioex_get_barrel_level(), -EINVAL);
 	}
 
-	/* Check open failed */
-	mock_i2c_prepare_read(-ENODEV, 0, NULL, 0);
+	/* invalid values leave the last valid sample */
+	assert_null(gpioex_get_barrel_snapshot(&sample));
+	assert_int_equal(sample.value, 0xFF);
+
+	/* Check open failed, a failed init leaves the bus to be opened lazily */
+	mock_i2c_reset();
+	mock_i2c_prepare_rdwr(-ENODEV, init_msgs, INIT_MSGS, 0);
+	assert_int_equal(gpioex_init(NULL, 0), -ENODEV);
+	assert_int_equal(gpioex_get_barrel_snapshot(&sample), -ENODATA);
+	mock_i2c_prepare_read(ADDR_BARREL_LVL, -ENODEV, 0, NULL, 0);
 	assert_int_equal(gpioex_get_barrel_level(), -ENODEV);
 
 	/* Check ioctl failed */
-	mock_i2c_prepare_read(3, -EINVAL, NULL, 0);
+	mock_i2c_prepare_read(ADDR_BARREL_LVL, 3, -EINVAL, NULL, 0);
 	assert_int_equal(gpioex_get_barrel_level(), -EINVAL);
 
 	/* Check read 0 */
-	mock_i2c_prepare_read(3, 0, &barrel_lvl, 0);
+	mock_i2c_prepare_read(ADDR_BARREL_LVL, 3, 0, &barrel_lvl, 0);
 	assert_int_equal(gpioex_get_barrel_level(), -EIO);
 
 	/* Check read failed */
-	mock_i2c_prepare_read(3, 0, &barrel_lvl, -EINVAL);
+	mock_i2c_prepare_read(ADDR_BARREL_LVL, 3, 0, &barrel_lvl, -EINVAL);
 	assert_int_equal(gpioex_get_barrel_level(), -EINVAL);
 }
 
+struct debounce_report {
+	int calls;
+	unsigned int line;
+	int prev;
+	int level;
+	uint64_t timestamp_ns;
+};
+
+static void on_debounce(unsigned int line, int prev, int level,
+			uint64_t timestamp_ns, void *obj)
+{
+	struct debounce_report *r = (struct debounce_report*)obj;
+
+	r->calls++;
+	r->line = line;
+	r->prev = prev;
+	r->level = level;
+	r->timestamp_ns = timestamp_ns;
+}
+
+#define MS(__ms) ((__ms) * 1000000ULL)
+
+static void test_debounce(void **state)
+{
+	struct debounce db;
+	struct debounce_report r = { 0 };
+
+	assert_null(debounce_init(&db, 2, on_debounce, &r));
+	assert_null(debounce_line_setup(&db, 0, 50));
+	assert_null(debounce_line_setup(&db, 1, 10));
+	assert_int_equal(debounce_line_setup(&db, 2, 10), -EINVAL);
+	assert_int_equal(debounce_input(&db, 2, 1, 0), -EINVAL);
+
+	assert_int_equal(debounce_poll(&db, 0), -1);
+
+	/* the first level settles after the settle time */
+	assert_null(debounce_input(&db, 0, 1, MS(100)));
+	assert_int_equal(debounce_poll(&db, MS(120)), MS(30));
+	assert_int_equal(r.calls, 0);
+	assert_int_equal(debounce_poll(&db, MS(150)), -1);
+	assert_int_equal(r.calls, 1);
+	assert_int_equal(r.prev, -1);
+	assert_int_equal(r.level, 1);
+	assert_int_equal(r.timestamp_ns, MS(100));
+
+	/* bouncing restarts the settle time, repeated levels don't */
+	assert_null(debounce_input(&db, 0, 0, MS(200)));
+	assert_null(debounce_input(&db, 0, 1, MS(205)));
+	assert_null(debounce_input(&db, 0, 0, MS(210)));
+	assert_null(debounce_input(&db, 0, 0, MS(230)));
+	assert_int_equal(debounce_poll(&db, MS(255)), MS(5));
+	assert_int_equal(debounce_poll(&db, MS(260)), -1);
+	assert_int_equal(r.calls, 2);
+	assert_int_equal(r.prev, 1);
+	assert_int_equal(r.level, 0);
+	assert_int_equal(r.timestamp_ns, MS(210));
+
+	/* a glitch back to the stable level is dropped */
+	assert_null(debounce_input(&db, 0, 1, MS(300)));
+	assert_null(debounce_input(&db, 0, 0, MS(310)));
+	assert_int_equal(debounce_poll(&db, MS(400)), -1);
+	assert_int_equal(r.calls, 2);
+
+	/* lines settle on their own times */
+	assert_null(debounce_input(&db, 0, 1, MS(500)));
+	assert_null(debounce_input(&db, 1, 1, MS(500)));
+	assert_int_equal(debounce_poll(&db, MS(505)), MS(5));
+	assert_int_equal(debounce_poll(&db, MS(510)), MS(40));
+	assert_int_equal(r.calls, 3);
+	assert_int_equal(r.line, 1);
+	assert_int_equal(debounce_poll(&db, MS(550)), -1);
+	assert_int_equal(r.calls, 4);
+	assert_int_equal(r.line, 0);
+
+	debounce_destroy(&db);
+}
+
+static void test_debounce_seed(void **state)
+{
+	struct debounce db;
+	struct debounce_report r = { 0 };
+
+	assert_null(debounce_init(&db, 1, on_debounce, &r));
+	assert_null(debounce_line_setup(&db, 0, 10));
+	assert_int_equal(debounce_line_seed(&db, 1, 1), -EINVAL);
+
+	/* the first edge is a change from the seeded level */
+	assert_null(debounce_line_seed(&db, 0, 1));
+	assert_null(debounce_input(&db, 0, 0, MS(100)));
+	assert_int_equal(debounce_poll(&db, MS(110)), -1);
+	assert_int_equal(r.calls, 1);
+	assert_int_equal(r.prev, 1);
+	assert_int_equal(r.level, 0);
+
+	/* a level pending at the seed and equal to it is no change */
+	assert_null(debounce_input(&db, 0, 1, MS(200)));
+	assert_null(debounce_line_seed(&db, 0, 1));
+	assert_int_equal(debounce_poll(&db, MS(300)), -1);
+	assert_int_equal(r.calls, 1);
+
+	debounce_destroy(&db);
+}
+
+static void test_stop(void **state)
+{
+	struct stop stop;
+
+	assert_null(stop_init(&stop));
+	assert_true(stop_fd(&stop) >= 0);
+
+	assert_false(stop_requested(&stop));
+
+	stop_request(&stop);
+	stop_request(&stop);
+
+	/* requests are never consumed, every waiter sees them */
+	assert_true(stop_requested(&stop));
+	assert_true(stop_requested(&stop));
+
+	stop_destroy(&stop);
+	assert_int_equal(stop_fd(&stop), -1);
+}
+
+static void test_hw_sim(void **state)
+{
+	struct hw_sim_stats stats;
+	struct gpio_input in;
+	struct gpio_event ev;
+	struct hw_iio_channel ch;
+	int value;
+
+	hw_sim_setup(NULL);
+	hw_set_backend(&hw_sim_backend);
+
+	/* the outputs end up in the simulated expanders */
+	assert_null(gpioex_init(NULL, 0));
+	assert_null(gpioex_set(GPIOEX_LIGHT_TREE, 1));
+	assert_int_equal(hw_sim_i2c_get_output(1, 0x21), 0xF7);
+	assert_int_equal(hw_sim_i2c_get_output(1, 0x24), -ENODATA);
+
+	/* an injected failure leaves the expander as it was */
+	hw_sim_fail_next(1);
+	assert_true(gpioex_set(GPIOEX_LIGHT_HOUSE, 1) < 0);
+	assert_int_equal(hw_sim_i2c_get_output(1, 0x21), 0xF7);
+
+	assert_null(hw_iio_open(&ch, 0, "temp"));
+	assert_null(hw_iio_read(&ch, &value));
+	assert_int_equal(value, 21000);
+	assert_null(hw_sim_iio_set(0, "temp", 23500));
+	assert_null(hw_iio_read(&ch, &value));
+	assert_int_equal(value, 23500);
+	hw_iio_close(&ch);
+	assert_int_equal(hw_iio_read(&ch, &value), -EBADF);
+	assert_int_equal(hw_iio_open(&ch, 1, "temp"), -ENOENT);
+
+	/* lines idle high, edges are queued for the reader */
+	assert_null(gpio_input_open(&in, 0, 26, GPIO_EDGE_FALLING, 0));
+	assert_true(in.fd >= 0);
+	assert_int_equal(gpio_input_read(&in, &ev, 1), 0);
+	assert_null(hw_sim_gpio_set(0, 26, 0));
+	assert_null(hw_sim_gpio_set(0, 26, 1));
+	assert_int_equal(gpio_input_read(&in, &ev, 1), 1);
+	assert_int_equal(ev.value, 0);
+	assert_int_equal(gpio_input_read(&in, &ev, 1), 0);
+	gpio_input_close(&in);
+
+	hw_sim_get_stats(&stats);
+	assert_true(stats.i2c_msgs > 0);
+	assert_int_equal(stats.failures, 1);
+	assert_int_equal(stats.gpio_events, 1);
+	assert_int_equal(stats.iio_reads, 2);
+
+	hw_set_backend(&hw_linux_backend);
+}
+
+static void test_hw_parse_fixed(void **state)
+{
+	int64_t v;
+
+	assert_null(hw_parse_fixed("23500\n", 6, &v));
+	assert_int_equal(v, 23500 * HW_FIXED_ONE);
+	assert_null(hw_parse_fixed("-0.0625", 7, &v));
+	assert_int_equal(v, -62500);
+	assert_null(hw_parse_fixed("1.2345678", 9, &v));
+	assert_int_equal(v, 1234567);
+
+	/* the length bounds the number, no NUL needed */
+	assert_null(hw_parse_fixed("12345", 3, &v));
+	assert_int_equal(v, 123 * HW_FIXED_ONE);
+
+	assert_int_equal(hw_parse_fixed("", 0, &v), -EINVAL);
+	assert_int_equal(hw_parse_fixed("-\n", 2, &v), -EINVAL);
+	assert_int_equal(hw_parse_fixed("99999999999999999999", 20, &v), -ERANGE);
+}
+
+static void test_hw_iio_scan_type(void **state)
+{
+	static const struct {
+		const char *type;
+		int ret;
+		struct hw_iio_scan_channel ch;
+	} types[] = {
+		{ "le:s12/16>>4\n", 0, { .bytes = 2, .bits = 12, .shift = 4, .is_signed = true } },
+		{ "be:u10/16>>6", 0, { .bytes = 2, .bits = 10, .shift = 6, .big_endian = true } },
+		{ "le:u8/8", 0, { .bytes = 1, .bits = 8 } },
+		{ "be:s24/32>>0", 0, { .bytes = 4, .bits = 24, .is_signed = true, .big_endian = true } },
+		{ "le:s64/64", 0, { .bytes = 8, .bits = 64, .is_signed = true } },
+		{ "le:s12/12", -EINVAL },
+		{ "le:s17/16", -EINVAL },
+		{ "le:u0/16", -EINVAL },
+		{ "le:u64/128", -EINVAL },
+		{ "s12/16", -EINVAL },
+	};
+	struct hw_iio_scan_channel ch;
+	size_t i;
+
+	for (i = 0; i < sizeof(types) / sizeof(types[0]); ++i) {
+		memset(&ch, 0, sizeof(ch));
+		assert_int_equal(hw_iio_scan_type(&ch, types[i].type), types[i].ret);
+		if (types[i].ret)
+			continue;
+
+		assert_int_equal(ch.bytes, types[i].ch.bytes);
+		assert_int_equal(ch.bits, types[i].ch.bits);
+		assert_int_equal(ch.shift, types[i].ch.shift);
+		assert_int_equal(ch.is_signed, types[i].ch.is_signed);
+		assert_int_equal(ch.big_endian, types[i].ch.big_endian);
+	}
+}
+
+static void test_hw_iio_scan_layout(void **state)
+{
+	static const struct {
+		unsigned int count;
+		unsigned int index[HW_IIO_BUFFER_CHANNELS];
+		unsigned int bytes[HW_IIO_BUFFER_CHANNELS];
+		unsigned int offset[HW_IIO_BUFFER_CHANNELS];
+		size_t scan_bytes;
+	} layouts[] = {
+		{ 2, { 0, 1 }, { 2, 2 }, { 0, 2 }, 4 },
+		/* stored by index, not in the order opened */
+		{ 2, { 1, 0 }, { 2, 2 }, { 2, 0 }, 4 },
+		/* padded to the size of each channel and the scan to the largest */
+		{ 3, { 1, 0, 2 }, { 2, 1, 8 }, { 2, 0, 8 }, 16 },
+		{ 3, { 0, 1, 2 }, { 4, 1, 1 }, { 0, 4, 5 }, 8 },
+		{ 4, { 0, 1, 2, 3 }, { 1, 8, 1, 8 }, { 0, 8, 16, 24 }, 32 },
+	};
+	struct hw_iio_buffer buf;
+	size_t i;
+	unsigned int c;
+
+	for (i = 0; i < sizeof(layouts) / sizeof(layouts[0]); ++i) {
+		memset(&buf, 0, sizeof(buf));
+		buf.count = layouts[i].count;
+		for (c = 0; c < buf.count; ++c) {
+			buf.channels[c].index = layouts[i].index[c];
+			buf.channels[c].bytes = layouts[i].bytes[c];
+		}
+
+		assert_null(hw_iio_scan_layout(&buf));
+		assert_int_equal(buf.scan_bytes, layouts[i].scan_bytes);
+		for (c = 0; c < buf.count; ++c)
+			assert_int_equal(buf.channels[c].offset, layouts[i].offset[c]);
+	}
+}
+
+static void test_hw_iio_scan_value(void **state)
+{
+	static const struct {
+		const char *type;
+		unsigned int offset;
+		uint8_t scan[8];
+		int64_t value;
+	} values[] = {
+		{ "le:u16/16", 0, { 0x34, 0x12 }, 0x1234 },
+		{ "be:u16/16", 0, { 0x12, 0x34 }, 0x1234 },
+		{ "le:s12/16>>4", 0, { 0xF0, 0xFF }, -1 },
+		{ "be:s12/16>>4", 0, { 0x80, 0x00 }, -2048 },
+		{ "be:s12/16>>4", 0, { 0x7F, 0xF0 }, 2047 },
+		{ "be:u10/16>>6", 0, { 0xFF, 0xC0 }, 1023 },
+		/* the padding bits above the value are dropped */
+		{ "le:u12/16", 0, { 0xFF, 0xFF }, 0xFFF },
+		{ "le:s12/16", 0, { 0x00, 0xF0 }, 0 },
+		{ "le:s32/32", 0, { 0xFE, 0xFF, 0xFF, 0xFF }, -2 },
+		{ "be:s24/32", 0, { 0x00, 0x80, 0x00, 0x00 }, -8388608 },
+		{ "le:s64/64", 0, { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF }, -1 },
+		{ "le:u64/64", 0, { 0x01, 0, 0, 0, 0, 0, 0, 0x80 }, (int64_t)0x8000000000000001ULL },
+		{ "le:u16/16", 2, { 0xAA, 0xAA, 0x01, 0x00 }, 1 },
+		{ "le:s8/8", 3, { 0x7F, 0x7F, 0x7F, 0x80 }, -128 },
+	};
+	struct hw_iio_scan_channel ch;
+	size_t i;
+
+	for (i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+		memset(&ch, 0, sizeof(ch));
+		assert_null(hw_iio_scan_type(&ch, values[i].type));
+		ch.offset = values[i].offset;
+
+		assert_int_equal(hw_iio_scan_value(&ch, values[i].scan), values[i].value);
+	}
+}
+
+static void test_sensor(void **state)
+{
+	struct sensor sensor;
+	struct sensor_aggregate agg;
+	const double samples[] = { 20.0, 35.0, 21.0, 19.0, 22.0 };
+	size_t i;
+
+	assert_int_equal(sensor_init(&sensor, 0, 0.5), -EINVAL);
+	assert_int_equal(sensor_init(&sensor, 3, 0.0), -EINVAL);
+
+	assert_null(sensor_init(&sensor, 3, 0.5));
+	assert_int_equal(sensor_get(&sensor, &agg), -ENODATA);
+	assert_int_equal(sensor_add(&sensor, 0.0 / 0.0), -EINVAL);
+	assert_int_equal(sensor_get(&sensor, &agg), -ENODATA);
+
+	for (i = 0; i < 3; ++i)
+		assert_null(sensor_add(&sensor, samples[i]));
+
+	/* the spike does not move the median */
+	assert_null(sensor_get(&sensor, &agg));
+	assert_int_equal(agg.count, 3);
+	assert_true(agg.median == 21.0);
+	assert_true(agg.min == 20.0);
+	assert_true(agg.max == 35.0);
+	assert_true(agg.mean > 25.33 && agg.mean < 25.34);
+	assert_true(agg.ewma == 24.25);
+
+	/* the window slides, 20 and 35 drop out */
+	for (; i < 5; ++i)
+		assert_null(sensor_add(&sensor, samples[i]));
+
+	assert_null(sensor_get(&sensor, &agg));
+	assert_true(agg.median == 21.0);
+	assert_true(agg.last == 22.0);
+
+	/* a new interval keeps the last sample until the next one */
+	sensor_reset(&sensor);
+	assert_null(sensor_get(&sensor, &agg));
+	assert_int_equal(agg.count, 0);
+	assert_true(agg.min == 22.0 && agg.max == 22.0 && agg.mean == 22.0);
+	assert_null(sensor_add(&sensor, 18.0));
+	assert_null(sensor_get(&sensor, &agg));
+	assert_int_equal(agg.count, 1);
+	assert_true(agg.min == 18.0);
+	assert_true(agg.median == 19.0);
+
+	sensor_destroy(&sensor);
+}
+
 int main(void)
 {
 	const struct CMUnitTest tests[] = {
@@ -202,7 +780,20 @@ int main(void)
 		cmocka_unit_test(test_logging),
 		cmocka_unit_test(test_gpioex_init),
 		cmocka_unit_test(test_gpioex_set),
+		cmocka_unit_test(test_gpioex_apply),
+		cmocka_unit_test(test_gpioex_map),
+		cmocka_unit_test(test_gpioex_worker),
+		cmocka_unit_test(test_gpioex_verify),
 		cmocka_unit_test(test_gpioex_get_barrel_level),
+		cmocka_unit_test(test_stop),
+		cmocka_unit_test(test_debounce),
+		cmocka_unit_test(test_debounce_seed),
+		cmocka_unit_test(test_hw_sim),
+		cmocka_unit_test(test_hw_parse_fixed),
+		cmocka_unit_test(test_hw_iio_scan_type),
+		cmocka_unit_test(test_hw_iio_scan_layout),
+		cmocka_unit_test(test_hw_iio_scan_value),
+		cmocka_unit_test(test_sensor),
 	};
 
 	return cmocka_run_group_tests(tests, NULL, NULL);
@@ -45,6 +45,132 @@ static void mock_destroy_garden_module(struct garden_module* module)
 
 }
 
+/* topics of a request joined by blanks */
+int mosquitto_subscribe_multiple(struct mosquitto *mosq, int *mid, int sub_count,
+				 char *const *const sub, int qos, int options,
+				 const mosquitto_property *properties)
+{
+	char topics[256] = "";
+	int i;
+
+	for (i = 0; i < sub_count; ++i) {
+		if (i)
+			strcat(topics, " ");
+		strcat(topics, sub[i]);
+	}
+
+	check_expected(qos);
+	check_expected(sub_count);
+	check_expected(topics);
+
+	return mock_type(int);
+}
+
+const char *mosquitto_strerror(int mosq_errno)
+{
+	return "mock";
+}
+
+static void mock_subscribe(int qos, int count, const char *topics, int ret)
+{
+	expect_value(mosquitto_subscribe_multiple, qos, qos);
+	expect_value(mosquitto_subscribe_multiple, sub_count, count);
+	expect_string(mosquitto_subscribe_multiple, topics, topics);
+	will_return(mosquitto_subscribe_multiple, ret);
+}
+
+static int handle_light(struct garden_module *gm, const struct mosquitto_message *msg)
+{
+	const char *topic = msg->topic;
+
+	check_expected(topic);
+
+	return 0;
+}
+
+static int handle_tap(struct garden_module *gm, const struct mosquitto_message *msg)
+{
+	const char *topic = msg->topic;
+
+	check_expected(topic);
+
+	return 0;
+}
+
+static const struct garden_subscription light_subs[] = {
+	GARDEN_SUBSCRIPTION("/garden/light/set", 1, handle_light),
+	GARDEN_SUBSCRIPTION("/garden/light/get", 0, handle_light),
+	GARDEN_SUBSCRIPTION_END(),
+};
+
+static const struct garden_subscription tap_subs[] = {
+	GARDEN_SUBSCRIPTION("/garden/+/set", 1, handle_tap),
+	GARDEN_SUBSCRIPTION("/garden/tap/reset", 2, handle_tap),
+	GARDEN_SUBSCRIPTION_END(),
+};
+
+static const struct garden_subscription invalid_subs[] = {
+	GARDEN_SUBSCRIPTION("/garden/invalid", 3, handle_tap),
+	GARDEN_SUBSCRIPTION_END(),
+};
+
+#define MOD_COUNT 3
+
+/* light, tap and a module without subscriptions in this order */
+struct mods {
+	dlm_head_t head;
+	dlm_t dlm[MOD_COUNT];
+	struct garden_module gm[MOD_COUNT];
+};
+
+static void mods_setup(struct mods *mods, const struct garden_subscription *first)
+{
+	int i;
+
+	memset(mods, 0, sizeof(*mods));
+	LIST_INIT(&mods->head);
+
+	mods->gm[0].subscriptions = first;
+	mods->gm[1].subscriptions = tap_subs;
+
+	for (i = MOD_COUNT - 1; i >= 0; --i) {
+		mods->dlm[i].garden = &mods->gm[i];
+		LIST_INSERT_HEAD(&mods->head, &mods->dlm[i], dl_modules);
+	}
+}
+
+static void mods_free_routes(struct mods *mods)
+{
+	int i;
+
+	for (i = 0; i < MOD_COUNT; ++i)
+		free(mods->dlm[i].routes);
+}
+
+static int qos_zero(const char *topic, int qos, void *obj)
+{
+	int *calls = (int*)obj;
+
+	++*calls;
+
+	return 0;
+}
+
+static int route_message(void *obj, void *ctx)
+{
+	struct dlm_route *route = (struct dlm_route*)obj;
+	const struct mosquitto_message *message = ctx;
+
+	return route->sub->handler(route->garden, message);
+}
+
+static int route(struct topic_tree *routes, const char *topic)
+{
+	struct mosquitto_message message = { .topic = (char*)topic };
+
+	return topic_tree_match(routes, topic, route_message, &message);
+}
+
 static void test_dl_create(void **state)
 {
 	dlm_head_t dlm_head;
@@ -125,10 +251,81 @@ static void test_dl_mod_init(void **state)
 
 static void test_dl_mod_subscribe(void **state)
 {
+	struct mods mods;
+	dlm_head_t empty;
+	int calls = 0;
+
+	LIST_INIT(&empty);
+	assert_int_equal(dlm_mod_subscribe(&empty, NULL, NULL, NULL), 0);
+
+	mods_setup(&mods, light_subs);
+
+	/* one request per qos level, the topics of all modules in it */
+	mock_calloc(sizeof(char*), 4 * sizeof(char*));
+	mock_subscribe(0, 1, "/garden/light/get", MOSQ_ERR_SUCCESS);
+	mock_subscribe(1, 2, "/garden/light/set /garden/+/set", MOSQ_ERR_SUCCESS);
+	mock_subscribe(2, 1, "/garden/tap/reset", MOSQ_ERR_SUCCESS);
+	assert_int_equal(dlm_mod_subscribe(&mods.head, NULL, NULL, NULL), 0);
+
+	/* the callback picks the qos, levels without topics are skipped */
+	mock_calloc(sizeof(char*), 4 * sizeof(char*));
+	mock_subscribe(0, 4, "/garden/light/set /garden/light/get /garden/+/set /garden/tap/reset",
+		       MOSQ_ERR_SUCCESS);
+	assert_int_equal(dlm_mod_subscribe(&mods.head, NULL, qos_zero, &calls), 0);
+	assert_int_equal(calls, 3 * 4);
+
+	/* the first failed request ends the subscribe */
+	mock_calloc(sizeof(char*), 4 * sizeof(char*));
+	mock_subscribe(0, 1, "/garden/light/get", MOSQ_ERR_NO_CONN);
+	assert_int_equal(dlm_mod_subscribe(&mods.head, NULL, NULL, NULL),
+			 MOSQ_ERR_NO_CONN);
+
+	mock_calloc(sizeof(char*), 0);
+	assert_int_equal(dlm_mod_subscribe(&mods.head, NULL, NULL, NULL), -ENOMEM);
 }
 
 static void test_dl_mod_message(void **state)
 {
+	struct topic_tree routes;
+	struct mods mods;
+
+	mock_malloc_passthrough(1);
+
+	mods_setup(&mods, light_subs);
+	assert_null(topic_tree_init(&routes));
+	assert_null(dlm_mod_routes(&mods.head, &routes));
+	assert_int_equal(routes.count, 4);
+
+	/* every module whose filter matches gets the message */
+	expect_string(handle_light, topic, "/garden/light/set");
+	expect_string(handle_tap, topic, "/garden/light/set");
+	assert_int_equal(route(&routes, "/garden/light/set"), 2);
+
+	expect_string(handle_tap, topic, "/garden/tap/set");
+	assert_int_equal(route(&routes, "/garden/tap/set"), 1);
+
+	expect_string(handle_light, topic, "/garden/light/get");
+	assert_int_equal(route(&routes, "/garden/light/get"), 1);
+
+	expect_string(handle_tap, topic, "/garden/tap/reset");
+	assert_int_equal(route(&routes, "/garden/tap/reset"), 1);
+
+	assert_int_equal(route(&routes, "/garden/light"), 0);
+	assert_int_equal(route(&routes, "/garden/tap/set/now"), 0);
+
+	topic_tree_destroy(&routes);
+	mods_free_routes(&mods);
+
+	/* a subscription with an invalid qos is no route */
+	mods_setup(&mods, invalid_subs);
+	assert_null(topic_tree_init(&routes));
+	assert_int_equal(dlm_mod_routes(&mods.head, &routes), -EINVAL);
+	assert_int_equal(routes.count, 0);
+
+	topic_tree_destroy(&routes);
+	mods_free_routes(&mods);
+
+	mock_malloc_passthrough(0);
 }
 
 int main(void)
@@ -0,0 +1,138 @@
+/*
+ * check_gardenctl_input.c
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <hw.h>
+#include <hw_sim.h>
+#include <input.h>
+
+#include "mock_mosquitto.h"
+
+#define TAP_LINE 26
+
+static const struct input_conf tap = {
+	.name = "tap",
+	.chip = 0,
+	.line = TAP_LINE,
+	.debounce_ms = 1,
+	.topic = "/garden/sensor/tap",
+	.payload_low = "pushed",
+	.payload_high = "released",
+};
+
+struct input_ctx {
+	struct reactor reactor;
+	struct publisher pub;
+	struct inputs inputs;
+};
+
+static int setup_inputs(void **state)
+{
+	struct input_ctx *ctx = calloc(1, sizeof(*ctx));
+
+	hw_sim_setup(NULL);
+	hw_set_backend(&hw_sim_backend);
+
+	if (!ctx || reactor_init(&ctx->reactor))
+		return -1;
+
+	if (publisher_init(&ctx->pub, &ctx->reactor, NULL, NULL, NULL, 0))
+		return -1;
+
+	publisher_set_connected(&ctx->pub, true);
+	mock_mqtt_reset();
+	*state = ctx;
+
+	return 0;
+}
+
+static int teardown_inputs(void **state)
+{
+	struct input_ctx *ctx = (struct input_ctx*)*state;
+
+	inputs_destroy(&ctx->inputs);
+	publisher_destroy(&ctx->pub);
+	reactor_destroy(&ctx->reactor);
+	hw_set_backend(&hw_linux_backend);
+	free(ctx);
+
+	return 0;
+}
+
+static void test_input_first_edge(void **state)
+{
+	struct input_ctx *ctx = (struct input_ctx*)*state;
+
+	/* the button is released at start, that is no change to publish */
+	assert_null(hw_sim_gpio_set(0, TAP_LINE, 1));
+	assert_null(inputs_init(&ctx->inputs, &ctx->reactor, &ctx->pub, &tap, 1));
+	assert_int_equal(ctx->inputs.lines[0].gpio.level, 1);
+	mock_run_ms(&ctx->reactor, 10);
+	assert_int_equal(mock_mqtt_sent_count, 0);
+
+	/* the first push after the start is published */
+	assert_null(hw_sim_gpio_set(0, TAP_LINE, 0));
+	mock_run_ms(&ctx->reactor, 20);
+	assert_int_equal(mock_mqtt_sent_count, 1);
+	assert_string_equal(mock_mqtt_sent[0].topic, "/garden/sensor/tap");
+	assert_string_equal(mock_mqtt_sent[0].payload, "pushed");
+
+	assert_null(hw_sim_gpio_set(0, TAP_LINE, 1));
+	mock_run_ms(&ctx->reactor, 20);
+	assert_int_equal(mock_mqtt_sent_count, 2);
+	assert_string_equal(mock_mqtt_sent[1].payload, "released");
+}
+
+static void test_input_pushed_at_start(void **state)
+{
+	struct input_ctx *ctx = (struct input_ctx*)*state;
+
+	/* held down while starting, the release is the first change */
+	assert_null(hw_sim_gpio_set(0, TAP_LINE, 0));
+	assert_null(inputs_init(&ctx->inputs, &ctx->reactor, &ctx->pub, &tap, 1));
+	assert_int_equal(ctx->inputs.lines[0].gpio.level, 0);
+
+	assert_null(hw_sim_gpio_set(0, TAP_LINE, 1));
+	mock_run_ms(&ctx->reactor, 20);
+	assert_int_equal(mock_mqtt_sent_count, 1);
+	assert_string_equal(mock_mqtt_sent[0].payload, "released");
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(test_input_first_edge, setup_inputs,
+						teardown_inputs),
+		cmocka_unit_test_setup_teardown(test_input_pushed_at_start, setup_inputs,
+						teardown_inputs),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,434 @@
+/*
+ * check_gardenctl_publish.c
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <publish.h>
+
+#include "mock_mosquitto.h"
+
+#define THREAD_MSGS 100
+
+static const struct publish_rule rules[] = {
+	{ .filter = "/garden/sensor/#", .coalesce_ms = 50, .qos = PUBLISH_QOS_KEEP },
+	{ .filter = "/garden/limit", .min_interval_ms = 100, .qos = PUBLISH_QOS_KEEP },
+	{ .filter = "/garden/ack", .coalesce_ms = 50, .high = true,
+	  .qos = PUBLISH_QOS_KEEP },
+	{ .filter = "/garden/telemetry/#", .qos = 0, .retain = true, .expiry_sec = 1 },
+};
+
+#define RULE_COUNT (sizeof(rules) / sizeof(rules[0]))
+
+struct publish_ctx {
+	struct reactor reactor;
+	struct publisher pub;
+	struct spool spool;
+	char path[32];
+};
+
+static int setup_ctx(void **state, bool spooled)
+{
+	struct publish_ctx *ctx = calloc(1, sizeof(*ctx));
+	int fd;
+
+	if (!ctx || reactor_init(&ctx->reactor))
+		return -1;
+
+	if (spooled) {
+		strcpy(ctx->path, "/tmp/check_spool.XXXXXX");
+		fd = mkstemp(ctx->path);
+		if (fd < 0)
+			return -1;
+		close(fd);
+
+		if (spool_open(&ctx->spool, ctx->path, 4096))
+			return -1;
+	}
+
+	if (publisher_init(&ctx->pub, &ctx->reactor, NULL,
+			   spooled ? &ctx->spool : NULL, rules, RULE_COUNT))
+		return -1;
+
+	mock_mqtt_reset();
+	*state = ctx;
+
+	return 0;
+}
+
+static int setup_publisher(void **state)
+{
+	return setup_ctx(state, false);
+}
+
+static int setup_spooled(void **state)
+{
+	return setup_ctx(state, true);
+}
+
+static int teardown_publisher(void **state)
+{
+	struct publish_ctx *ctx = (struct publish_ctx*)*state;
+
+	publisher_destroy(&ctx->pub);
+	spool_close(&ctx->spool);
+	if (ctx->path[0])
+		unlink(ctx->path);
+	reactor_destroy(&ctx->reactor);
+	free(ctx);
+
+	return 0;
+}
+
+static void sleep_ms(unsigned int ms)
+{
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+
+	nanosleep(&ts, NULL);
+}
+
+static void publish_str(struct publisher *pub, const char *topic,
+			const char *payload, unsigned int flags)
+{
+	assert_null(publisher_publish(pub, topic, payload, strlen(payload), 2, flags));
+}
+
+static void test_publish_direct(void **state)
+{
+	struct publish_ctx *ctx = (struct publish_ctx*)*state;
+	struct publisher *pub = &ctx->pub;
+
+	/* only the latest update waits for the connection */
+	publish_str(pub, "/garden/light", "on", 0);
+	publish_str(pub, "/garden/light", "off", 0);
+	publisher_flush(pub, false);
+	assert_int_equal(mock_mqtt_sent_count, 0);
+
+	publisher_set_connected(pub, true);
+	publisher_flush(pub, false);
+	assert_int_equal(mock_mqtt_sent_count, 1);
+	assert_string_equal(mock_mqtt_sent[0].payload, "off");
+	assert_int_equal(mock_mqtt_sent[0].qos, 2);
+
+	/* topics without a rule go out as they come */
+	publish_str(pub, "/garden/light", "on", 0);
+	publish_str(pub, "/garden/light", "off", 0);
+	assert_int_equal(mock_mqtt_sent_count, 3);
+	assert_string_equal(mock_mqtt_sent[2].payload, "off");
+
+	assert_true(pub->stats.queued == 4);
+	assert_true(pub->stats.coalesced == 1);
+}
+
+static void test_publish_coalesce(void **state)
+{
+	struct publish_ctx *ctx = (struct publish_ctx*)*state;
+	struct publisher *pub = &ctx->pub;
+
+	publisher_set_connected(pub, true);
+
+	publish_str(pub, "/garden/sensor/temperature", "21.0", 0);
+	publish_str(pub, "/garden/sensor/temperature", "21.4", 0);
+	publish_str(pub, "/garden/sensor/temperature", "21.2", 0);
+	publisher_flush(pub, false);
+	assert_int_equal(mock_mqtt_sent_count, 0);
+
+	/* high messages skip the window */
+	publish_str(pub, "/garden/sensor/temperature", "x", GARDEN_PUBLISH_HIGH);
+	assert_int_equal(mock_mqtt_sent_count, 1);
+	assert_string_equal(mock_mqtt_sent[0].payload, "x");
+
+	publish_str(pub, "/garden/sensor/humidity", "50", 0);
+	publish_str(pub, "/garden/sensor/humidity", "51", 0);
+	sleep_ms(60);
+	publisher_flush(pub, false);
+	assert_int_equal(mock_mqtt_sent_count, 2);
+	assert_string_equal(mock_mqtt_sent[1].topic, "/garden/sensor/humidity");
+	assert_string_equal(mock_mqtt_sent[1].payload, "51");
+}
+
+static void test_publish_rate_limit(void **state)
+{
+	struct publish_ctx *ctx = (struct publish_ctx*)*state;
+	struct publisher *pub = &ctx->pub;
+
+	publisher_set_connected(pub, true);
+
+	publish_str(pub, "/garden/limit", "1", 0);
+	publisher_flush(pub, false);
+	assert_int_equal(mock_mqtt_sent_count, 1);
+
+	publish_str(pub, "/garden/limit", "2", 0);
+	publish_str(pub, "/garden/limit", "3", 0);
+	publisher_flush(pub, false);
+	assert_int_equal(mock_mqtt_sent_count, 1);
+
+	sleep_ms(110);
+	publisher_flush(pub, false);
+	assert_int_equal(mock_mqtt_sent_count, 2);
+	assert_string_equal(mock_mqtt_sent[1].payload, "3");
+}
+
+static void test_publish_priority(void **state)
+{
+	struct publish_ctx *ctx = (struct publish_ctx*)*state;
+	struct publisher *pub = &ctx->pub;
+
+	publish_str(pub, "/garden/sensor/barrel", "50.0", 0);
+	publish_str(pub, "/garden/ack", "done", 0);
+	publish_str(pub, "/garden/sensor/tap", "pushed", 0);
+
+	/* the confirmation goes out first after the reconnect */
+	publisher_set_connected(pub, true);
+	publisher_flush(pub, true);
+	assert_int_equal(mock_mqtt_sent_count, 3);
+	assert_string_equal(mock_mqtt_sent[0].topic, "/garden/ack");
+	assert_string_equal(mock_mqtt_sent[1].topic, "/garden/sensor/barrel");
+	assert_string_equal(mock_mqtt_sent[2].topic, "/garden/sensor/tap");
+}
+
+static void *publish_thread(void *arg)
+{
+	struct publisher *pub = (struct publisher*)arg;
+	char buf[16];
+	int i;
+
+	for (i = 0; i < THREAD_MSGS; ++i) {
+		snprintf(buf, sizeof(buf), "%d", i);
+		publisher_publish(pub, "/garden/thread", buf, strlen(buf), 1, 0);
+	}
+
+	return NULL;
+}
+
+static void test_publish_thread(void **state)
+{
+	struct publish_ctx *ctx = (struct publish_ctx*)*state;
+	pthread_t thread;
+	char buf[16];
+	int i;
+
+	publisher_set_connected(&ctx->pub, true);
+
+	assert_null(pthread_create(&thread, NULL, publish_thread, &ctx->pub));
+	pthread_join(thread, NULL);
+	assert_int_equal(mock_mqtt_sent_count, 0);
+
+	/* the loop takes them from the queue in order */
+	mock_run_ms(&ctx->reactor, 20);
+
+	assert_int_equal(mock_mqtt_sent_count, THREAD_MSGS);
+	for (i = 0; i < THREAD_MSGS; ++i) {
+		snprintf(buf, sizeof(buf), "%d", i);
+		assert_string_equal(mock_mqtt_sent[i].payload, buf);
+		assert_int_equal(mock_mqtt_sent[i].qos, 1);
+	}
+}
+
+static void test_publish_spool(void **state)
+{
+	struct publish_ctx *ctx = (struct publish_ctx*)*state;
+	struct publisher *pub = &ctx->pub;
+	int i;
+
+	/* every event of the outage is kept, in order */
+	for (i = 0; i < 20; ++i)
+		publish_str(pub, "/garden/sensor/tap", "pushed", GARDEN_PUBLISH_HIGH);
+	publish_str(pub, "/garden/light", "on", 0);
+	assert_int_equal(mock_mqtt_sent_count, 0);
+	assert_true(pub->stats.spooled == 21);
+
+	/* the first ones are sent, the others wait for their acks */
+	publisher_set_connected(pub, true);
+	publisher_flush(pub, false);
+	assert_int_equal(mock_mqtt_sent_count, PUBLISH_INFLIGHT_MAX);
+
+	/* newer messages queue behind the spool */
+	publish_str(pub, "/garden/light", "off", 0);
+	assert_int_equal(mock_mqtt_sent_count, PUBLISH_INFLIGHT_MAX);
+
+	for (i = 0; i < PUBLISH_INFLIGHT_MAX; ++i)
+		publisher_on_published(pub, i);
+	publisher_flush(pub, false);
+	assert_int_equal(mock_mqtt_sent_count, 22);
+
+	for (i = 0; i < 20; ++i)
+		assert_string_equal(mock_mqtt_sent[i].topic, "/garden/sensor/tap");
+	assert_string_equal(mock_mqtt_sent[20].payload, "on");
+	assert_string_equal(mock_mqtt_sent[21].payload, "off");
+
+	for (i = PUBLISH_INFLIGHT_MAX; i < 22; ++i)
+		publisher_on_published(pub, i);
+	assert_true(spool_is_empty(&ctx->spool));
+
+	/* an empty spool is passed by */
+	publish_str(pub, "/garden/light", "on", 0);
+	assert_int_equal(mock_mqtt_sent_count, 23);
+
+	/* a message the broker lost on the way is spooled */
+	mock_mqtt_broker_down = 1;
+	publish_str(pub, "/garden/light", "off", 0);
+	assert_false(spool_is_empty(&ctx->spool));
+	publisher_flush(pub, false);
+	mock_mqtt_broker_down = 0;
+	publisher_flush(pub, false);
+	assert_int_equal(mock_mqtt_sent_count, 24);
+	assert_string_equal(mock_mqtt_sent[23].payload, "off");
+	assert_true(pub->stats.replayed == 23);
+}
+
+static void test_publish_retained(void **state)
+{
+	struct publish_ctx *ctx = (struct publish_ctx*)*state;
+	struct publisher *pub = &ctx->pub;
+
+	publisher_set_connected(pub, true);
+	publish_str(pub, "/garden/state/tap", "on", GARDEN_PUBLISH_RETAIN);
+	publish_str(pub, "/garden/state/tap", "off", GARDEN_PUBLISH_RETAIN);
+	publish_str(pub, "/garden/light", "on", 0);
+	assert_int_equal(mock_mqtt_sent_count, 3);
+	assert_true(mock_mqtt_sent[1].retain);
+	assert_false(mock_mqtt_sent[2].retain);
+
+	/* only the last retained message of a topic comes again */
+	publisher_set_connected(pub, false);
+	publisher_set_connected(pub, true);
+	publisher_flush(pub, false);
+	assert_int_equal(mock_mqtt_sent_count, 4);
+	assert_string_equal(mock_mqtt_sent[3].topic, "/garden/state/tap");
+	assert_string_equal(mock_mqtt_sent[3].payload, "off");
+	assert_true(mock_mqtt_sent[3].retain);
+	assert_true(pub->stats.republished == 1);
+
+	/* a connect without a disconnect is not a new session */
+	publisher_set_connected(pub, true);
+	publisher_flush(pub, false);
+	assert_int_equal(mock_mqtt_sent_count, 4);
+}
+
+static void test_publish_live(void **state)
+{
+	struct publish_ctx *ctx = (struct publish_ctx*)*state;
+	struct publisher *pub = &ctx->pub;
+	unsigned int live = GARDEN_PUBLISH_HIGH | GARDEN_PUBLISH_RETAIN |
+			    GARDEN_PUBLISH_LIVE;
+
+	/* live messages wait for the connection instead of the spool */
+	publish_str(pub, "/garden/status", "online", live);
+	publish_str(pub, "/garden/light", "on", 0);
+	publisher_flush(pub, false);
+	assert_int_equal(mock_mqtt_sent_count, 0);
+	assert_true(pub->stats.spooled == 1);
+
+	publisher_set_connected(pub, true);
+	publisher_flush(pub, false);
+	assert_int_equal(mock_mqtt_sent_count, 2);
+	assert_string_equal(mock_mqtt_sent[0].topic, "/garden/light");
+	assert_string_equal(mock_mqtt_sent[1].topic, "/garden/status");
+	assert_true(mock_mqtt_sent[1].retain);
+
+	/* the light is not acknowledged, the status does not queue behind it */
+	assert_false(spool_is_empty(&ctx->spool));
+	publish_str(pub, "/garden/status", "offline", live);
+	assert_int_equal(mock_mqtt_sent_count, 3);
+	assert_string_equal(mock_mqtt_sent[2].payload, "offline");
+	assert_true(pub->stats.spooled == 1);
+
+	/* sent live, so kept for the next connect */
+	publisher_set_connected(pub, false);
+	publisher_set_connected(pub, true);
+	publisher_flush(pub, false);
+	assert_int_equal(mock_mqtt_sent_count, 4);
+	assert_string_equal(mock_mqtt_sent[3].topic, "/garden/status");
+	assert_string_equal(mock_mqtt_sent[3].payload, "offline");
+}
+
+static void test_publish_policy(void **state)
+{
+	struct publish_ctx *ctx = (struct publish_ctx*)*state;
+	struct publisher *pub = &ctx->pub;
+
+	assert_int_equal(publisher_qos(pub, "/garden/telemetry/soil", 2), 0);
+	assert_int_equal(publisher_qos(pub, "/garden/sensor/tap", 2), 2);
+	assert_int_equal(publisher_qos(pub, "/garden/tap", 1), 1);
+
+	publisher_set_connected(pub, true);
+	publish_str(pub, "/garden/telemetry/soil", "42", 0);
+	publish_str(pub, "/garden/light", "on", 0);
+	assert_int_equal(mock_mqtt_sent_count, 2);
+	assert_int_equal(mock_mqtt_sent[0].qos, 0);
+	assert_true(mock_mqtt_sent[0].retain);
+	assert_int_equal(mock_mqtt_sent[1].qos, 2);
+	assert_false(mock_mqtt_sent[1].retain);
+
+	/* the spooled reading is stale once the broker is back */
+	publisher_set_connected(pub, false);
+	publish_str(pub, "/garden/telemetry/soil", "43", 0);
+	publish_str(pub, "/garden/light", "off", 0);
+	assert_true(pub->stats.spooled == 2);
+
+	sleep_ms(2000);
+	publisher_set_connected(pub, true);
+	publisher_flush(pub, false);
+	assert_int_equal(mock_mqtt_sent_count, 3);
+	assert_string_equal(mock_mqtt_sent[2].topic, "/garden/light");
+	assert_true(pub->stats.expired == 1);
+
+	/* the expired reading does not hold up the spool */
+	publisher_on_published(pub, 2);
+	assert_true(spool_is_empty(&ctx->spool));
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(test_publish_direct, setup_publisher,
+						teardown_publisher),
+		cmocka_unit_test_setup_teardown(test_publish_coalesce, setup_publisher,
+						teardown_publisher),
+		cmocka_unit_test_setup_teardown(test_publish_rate_limit, setup_publisher,
+						teardown_publisher),
+		cmocka_unit_test_setup_teardown(test_publish_priority, setup_publisher,
+						teardown_publisher),
+		cmocka_unit_test_setup_teardown(test_publish_thread, setup_publisher,
+						teardown_publisher),
+		cmocka_unit_test_setup_teardown(test_publish_retained, setup_publisher,
+						teardown_publisher),
+		cmocka_unit_test_setup_teardown(test_publish_live, setup_spooled,
+						teardown_publisher),
+		cmocka_unit_test_setup_teardown(test_publish_policy, setup_spooled,
+						teardown_publisher),
+		cmocka_unit_test_setup_teardown(test_publish_spool, setup_spooled,
+						teardown_publisher),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,281 @@
+/*
+ * check_gardenctl_reactor.c
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <reactor.h>
+
+#include "mock_mosquitto.h"
+
+#define RUNS_MAX 16
+
+struct reactor_ctx {
+	struct reactor reactor;
+	int order[RUNS_MAX];
+	int runs;
+	int timers[2];
+	int fds[2];
+};
+
+struct timer_arg {
+	struct reactor_ctx *ctx;
+	int id;
+};
+
+static void record_run(void *obj)
+{
+	struct timer_arg *arg = (struct timer_arg*)obj;
+
+	if (arg->ctx->runs < RUNS_MAX)
+		arg->ctx->order[arg->ctx->runs] = arg->id;
+	arg->ctx->runs++;
+}
+
+/* the first of both to run deletes the other */
+static void del_other_run(void *obj)
+{
+	struct timer_arg *arg = (struct timer_arg*)obj;
+
+	record_run(obj);
+	assert_null(reactor_timer_del(&arg->ctx->reactor,
+				      arg->ctx->timers[!arg->id]));
+}
+
+static void del_self_run(void *obj)
+{
+	struct timer_arg *arg = (struct timer_arg*)obj;
+
+	record_run(obj);
+	assert_null(reactor_timer_del(&arg->ctx->reactor,
+				      arg->ctx->timers[arg->id]));
+}
+
+static void disarm_run(void *obj)
+{
+	struct timer_arg *arg = (struct timer_arg*)obj;
+
+	record_run(obj);
+	if (arg->ctx->runs == 3)
+		assert_null(reactor_timer_mod(&arg->ctx->reactor,
+					      arg->ctx->timers[arg->id], 0, 0));
+}
+
+static void on_event(int fd, uint32_t events, void *obj)
+{
+	struct reactor_ctx *ctx = (struct reactor_ctx*)obj;
+	eventfd_t count;
+
+	if (events & EPOLLIN)
+		eventfd_read(fd, &count);
+	if (ctx->runs < RUNS_MAX)
+		ctx->order[ctx->runs] = fd;
+	ctx->runs++;
+}
+
+/* the first of both to run unwatches the other, its event is pending */
+static void on_event_del_other(int fd, uint32_t events, void *obj)
+{
+	struct reactor_ctx *ctx = (struct reactor_ctx*)obj;
+
+	on_event(fd, events, obj);
+	assert_null(reactor_del(&ctx->reactor,
+				ctx->fds[fd == ctx->fds[0]]));
+}
+
+static int setup(void **state)
+{
+	struct reactor_ctx *ctx = calloc(1, sizeof(*ctx));
+
+	if (!ctx || reactor_init(&ctx->reactor))
+		return -1;
+
+	ctx->fds[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	ctx->fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ctx->fds[0] < 0 || ctx->fds[1] < 0)
+		return -1;
+
+	*state = ctx;
+
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	struct reactor_ctx *ctx = (struct reactor_ctx*)*state;
+
+	reactor_destroy(&ctx->reactor);
+	close(ctx->fds[0]);
+	close(ctx->fds[1]);
+	free(ctx);
+
+	return 0;
+}
+
+static void test_reactor_timer_order(void **state)
+{
+	struct reactor_ctx *ctx = (struct reactor_ctx*)*state;
+	struct timer_arg args[3] = {
+		{ ctx, 0 }, { ctx, 1 }, { ctx, 2 },
+	};
+
+	assert_int_equal(reactor_timer_add(&ctx->reactor, 10, 0, NULL, NULL), -EINVAL);
+
+	/* the timerfd is armed on the earliest deadline whatever the order added */
+	assert_true(reactor_timer_add(&ctx->reactor, 30, 0, record_run, &args[0]) >= 0);
+	assert_true(reactor_timer_add(&ctx->reactor, 10, 0, record_run, &args[1]) >= 0);
+	assert_true(reactor_timer_add(&ctx->reactor, 20, 0, record_run, &args[2]) >= 0);
+
+	mock_run_ms(&ctx->reactor, 50);
+
+	assert_int_equal(ctx->runs, 3);
+	assert_int_equal(ctx->order[0], 1);
+	assert_int_equal(ctx->order[1], 2);
+	assert_int_equal(ctx->order[2], 0);
+}
+
+static void test_reactor_timer_periodic(void **state)
+{
+	struct reactor_ctx *ctx = (struct reactor_ctx*)*state;
+	struct timer_arg arg = { ctx, 0 };
+	struct garden_timer_stats stats;
+
+	/* re-armed every 10 ms until it disarms itself on the third run */
+	ctx->timers[0] = reactor_timer_add(&ctx->reactor, 10, 10, disarm_run, &arg);
+	assert_true(ctx->timers[0] >= 0);
+
+	mock_run_ms(&ctx->reactor, 80);
+
+	assert_int_equal(ctx->runs, 3);
+	assert_null(reactor_timer_stats(&ctx->reactor, ctx->timers[0], &stats));
+
+	/* armed again it keeps running */
+	assert_null(reactor_timer_mod(&ctx->reactor, ctx->timers[0], 0, 10));
+	mock_run_ms(&ctx->reactor, 35);
+
+	assert_true(ctx->runs >= 5);
+	assert_null(reactor_timer_del(&ctx->reactor, ctx->timers[0]));
+	assert_int_equal(reactor_timer_del(&ctx->reactor, ctx->timers[0]), -ENOENT);
+}
+
+static void test_reactor_timer_del_in_cb(void **state)
+{
+	struct reactor_ctx *ctx = (struct reactor_ctx*)*state;
+	struct timer_arg args[2] = { { ctx, 0 }, { ctx, 1 } };
+
+	/* both expire in the same round, the one deleted does not run */
+	ctx->timers[0] = reactor_timer_add(&ctx->reactor, 10, 0, del_other_run, &args[0]);
+	ctx->timers[1] = reactor_timer_add(&ctx->reactor, 10, 0, del_other_run, &args[1]);
+	assert_true(ctx->timers[0] >= 0 && ctx->timers[1] >= 0);
+
+	mock_run_ms(&ctx->reactor, 30);
+	assert_int_equal(ctx->runs, 1);
+
+	/* a periodic timer deleting itself runs once */
+	ctx->runs = 0;
+	ctx->timers[0] = reactor_timer_add(&ctx->reactor, 5, 5, del_self_run, &args[0]);
+	assert_true(ctx->timers[0] >= 0);
+
+	mock_run_ms(&ctx->reactor, 30);
+	assert_int_equal(ctx->runs, 1);
+}
+
+static void test_reactor_watch(void **state)
+{
+	struct reactor_ctx *ctx = (struct reactor_ctx*)*state;
+
+	assert_int_equal(reactor_add(&ctx->reactor, -1, EPOLLIN, on_event, ctx), -EINVAL);
+	assert_int_equal(reactor_add(&ctx->reactor, ctx->fds[0], EPOLLIN, NULL, ctx),
+			 -EINVAL);
+	assert_int_equal(reactor_mod(&ctx->reactor, ctx->fds[0], EPOLLIN), -ENOENT);
+	assert_int_equal(reactor_del(&ctx->reactor, ctx->fds[0]), -ENOENT);
+
+	assert_null(reactor_add(&ctx->reactor, ctx->fds[0], EPOLLIN, on_event, ctx));
+	assert_int_equal(reactor_add(&ctx->reactor, ctx->fds[0], EPOLLIN, on_event, ctx),
+			 -EEXIST);
+
+	/* nothing to read, no callback */
+	mock_run_ms(&ctx->reactor, 10);
+	assert_int_equal(ctx->runs, 0);
+
+	eventfd_write(ctx->fds[0], 1);
+	mock_run_ms(&ctx->reactor, 10);
+	assert_int_equal(ctx->runs, 1);
+	assert_int_equal(ctx->order[0], ctx->fds[0]);
+
+	/* the events asked for are passed */
+	assert_null(reactor_mod(&ctx->reactor, ctx->fds[0], EPOLLOUT));
+	mock_run_ms(&ctx->reactor, 10);
+	assert_true(ctx->runs > 1);
+
+	/* unwatched it is silent */
+	ctx->runs = 0;
+	assert_null(reactor_del(&ctx->reactor, ctx->fds[0]));
+	eventfd_write(ctx->fds[0], 1);
+	mock_run_ms(&ctx->reactor, 10);
+	assert_int_equal(ctx->runs, 0);
+
+	/* the core services go to the same loop */
+	assert_null(ctx->reactor.core.watch(&ctx->reactor.core, ctx->fds[0], EPOLLIN,
+					    on_event, ctx));
+	mock_run_ms(&ctx->reactor, 10);
+	assert_int_equal(ctx->runs, 1);
+	assert_null(ctx->reactor.core.unwatch(&ctx->reactor.core, ctx->fds[0]));
+}
+
+static void test_reactor_unwatch_in_cb(void **state)
+{
+	struct reactor_ctx *ctx = (struct reactor_ctx*)*state;
+
+	assert_null(reactor_add(&ctx->reactor, ctx->fds[0], EPOLLIN,
+				on_event_del_other, ctx));
+	assert_null(reactor_add(&ctx->reactor, ctx->fds[1], EPOLLIN,
+				on_event_del_other, ctx));
+
+	/* both are ready in the same round, the one unwatched is not called */
+	eventfd_write(ctx->fds[0], 1);
+	eventfd_write(ctx->fds[1], 1);
+	mock_run_ms(&ctx->reactor, 10);
+
+	assert_int_equal(ctx->runs, 1);
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(test_reactor_timer_order, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_reactor_timer_periodic, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_reactor_timer_del_in_cb, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_reactor_watch, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_reactor_unwatch_in_cb, setup, teardown),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
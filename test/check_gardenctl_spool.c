@@ -0,0 +1,211 @@
+/*
+ * check_gardenctl_spool.c
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <spool.h>
+
+#define SPOOL_SIZE 4096
+
+static int setup_file(void **state)
+{
+	char *path = strdup("/tmp/check_spool.XXXXXX");
+	int fd;
+
+	if (!path)
+		return -1;
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		free(path);
+		return -1;
+	}
+
+	close(fd);
+	*state = path;
+
+	return 0;
+}
+
+static int teardown_file(void **state)
+{
+	unlink((char*)*state);
+	free(*state);
+
+	return 0;
+}
+
+static void append(struct spool *spool, int i)
+{
+	char buf[32];
+
+	snprintf(buf, sizeof(buf), "%d", i);
+	assert_null(spool_append(spool, "/garden/sensor/barrel", buf, strlen(buf), 2, 0));
+}
+
+static int next_value(struct spool *spool, uint64_t *end)
+{
+	struct spool_msg *msg;
+	char buf[32];
+
+	assert_null(spool_next(spool, &msg));
+	assert_string_equal(msg->topic, "/garden/sensor/barrel");
+	assert_int_equal(msg->qos, 2);
+	assert_true(msg->len < sizeof(buf));
+
+	memcpy(buf, msg->payload, msg->len);
+	buf[msg->len] = '\0';
+	if (end)
+		*end = msg->end;
+	free(msg);
+
+	return atoi(buf);
+}
+
+static void test_spool_crc32(void **state)
+{
+	assert_true(spool_crc32(0, "123456789", 9) == 0xcbf43926);
+	assert_true(spool_crc32(spool_crc32(0, "1234", 4), "56789", 5) == 0xcbf43926);
+}
+
+static void test_spool_order(void **state)
+{
+	const char *path = (const char*)*state;
+	struct spool spool;
+	struct spool_msg *msg;
+	uint64_t end;
+	int i;
+
+	assert_int_equal(spool_open(&spool, path, 100), -EINVAL);
+	assert_null(spool_open(&spool, path, SPOOL_SIZE));
+	assert_true(spool_is_empty(&spool));
+	assert_int_equal(spool_next(&spool, &msg), -ENODATA);
+
+	for (i = 0; i < 10; ++i)
+		append(&spool, i);
+
+	assert_int_equal(next_value(&spool, &end), 0);
+	assert_int_equal(next_value(&spool, NULL), 1);
+
+	/* taken is not delivered */
+	spool_rewind(&spool, spool.hdr->tail);
+	assert_int_equal(next_value(&spool, &end), 0);
+	spool_release(&spool, end);
+
+	for (i = 1; i < 10; ++i)
+		assert_int_equal(next_value(&spool, &end), i);
+	assert_false(spool_has_next(&spool));
+	assert_false(spool_is_empty(&spool));
+
+	spool_release(&spool, end);
+	assert_true(spool_is_empty(&spool));
+
+	spool_close(&spool);
+}
+
+static void test_spool_wrap(void **state)
+{
+	const char *path = (const char*)*state;
+	struct spool spool;
+	uint64_t end;
+	int i, first;
+
+	assert_null(spool_open(&spool, path, SPOOL_SIZE));
+
+	/* records of about 40 bytes wrap around the ring several times */
+	for (i = 0; i < 1000; ++i) {
+		append(&spool, i);
+		assert_int_equal(next_value(&spool, &end), i);
+		spool_release(&spool, end);
+	}
+	assert_true(spool_is_empty(&spool));
+	assert_true(spool.hdr->dropped == 0);
+
+	/* the oldest records are dropped for the new ones */
+	for (i = 0; i < 1000; ++i)
+		append(&spool, i);
+	assert_true(spool.hdr->dropped > 0);
+
+	first = next_value(&spool, NULL);
+	assert_true(first > 850);
+	for (i = first + 1; i < 1000; ++i)
+		assert_int_equal(next_value(&spool, NULL), i);
+	assert_false(spool_has_next(&spool));
+
+	spool_close(&spool);
+}
+
+static void test_spool_reopen(void **state)
+{
+	const char *path = (const char*)*state;
+	struct spool spool;
+	uint64_t end;
+	int i;
+
+	assert_null(spool_open(&spool, path, SPOOL_SIZE));
+	for (i = 0; i < 5; ++i)
+		append(&spool, i);
+	assert_int_equal(next_value(&spool, &end), 0);
+	spool_release(&spool, end);
+	assert_int_equal(next_value(&spool, NULL), 1);
+	spool_close(&spool);
+
+	/* what was not delivered is taken again */
+	assert_null(spool_open(&spool, path, SPOOL_SIZE));
+	for (i = 1; i < 5; ++i)
+		assert_int_equal(next_value(&spool, NULL), i);
+
+	/* a torn last record is dropped */
+	spool.ring[(spool.hdr->head - 2) % SPOOL_SIZE] ^= 0xff;
+	spool_close(&spool);
+
+	assert_null(spool_open(&spool, path, SPOOL_SIZE));
+	for (i = 1; i < 4; ++i)
+		assert_int_equal(next_value(&spool, NULL), i);
+	assert_false(spool_has_next(&spool));
+	spool_close(&spool);
+
+	/* another size starts over */
+	assert_null(spool_open(&spool, path, 2 * SPOOL_SIZE));
+	assert_true(spool_is_empty(&spool));
+	spool_close(&spool);
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_spool_crc32),
+		cmocka_unit_test_setup_teardown(test_spool_order, setup_file, teardown_file),
+		cmocka_unit_test_setup_teardown(test_spool_wrap, setup_file, teardown_file),
+		cmocka_unit_test_setup_teardown(test_spool_reopen, setup_file, teardown_file),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
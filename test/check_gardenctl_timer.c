@@ -0,0 +1,185 @@
+/*
+ * check_gardenctl_timer.c
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <timer.h>
+
+#define MS(__ms) ((uint64_t)(__ms) * TIMER_NSEC_PER_MSEC)
+
+struct timer_ctx {
+	struct timer_heap *timers;
+	int runs;
+	int del_id;
+};
+
+static void count_run(void *obj)
+{
+	struct timer_ctx *ctx = (struct timer_ctx*)obj;
+
+	ctx->runs++;
+}
+
+static void del_run(void *obj)
+{
+	struct timer_ctx *ctx = (struct timer_ctx*)obj;
+
+	ctx->runs++;
+	timer_heap_del(ctx->timers, ctx->del_id);
+}
+
+static void test_timer_heap_order(void **state)
+{
+	struct timer_heap timers;
+	struct timer_ctx ctx[3];
+	uint64_t deadline;
+
+	memset(ctx, 0, sizeof(ctx));
+
+	assert_null(timer_heap_init(&timers));
+	assert_int_equal(timer_heap_next(&timers, &deadline), -ENOENT);
+	assert_int_equal(timer_heap_add(&timers, 0, 10, 0, NULL, NULL), -EINVAL);
+
+	assert_int_equal(timer_heap_add(&timers, 0, 30, 0, count_run, &ctx[0]), 0);
+	assert_int_equal(timer_heap_add(&timers, 0, 10, 0, count_run, &ctx[1]), 1);
+	assert_int_equal(timer_heap_add(&timers, 0, 20, 0, count_run, &ctx[2]), 2);
+
+	assert_null(timer_heap_next(&timers, &deadline));
+	assert_true(deadline == MS(10));
+
+	assert_int_equal(timer_heap_expire(&timers, MS(9)), 0);
+	assert_int_equal(timer_heap_expire(&timers, MS(20)), 2);
+	assert_int_equal(ctx[1].runs, 1);
+	assert_int_equal(ctx[2].runs, 1);
+	assert_int_equal(ctx[0].runs, 0);
+
+	assert_null(timer_heap_next(&timers, &deadline));
+	assert_true(deadline == MS(30));
+
+	/* one-shot jobs are disarmed after their run */
+	assert_int_equal(timer_heap_expire(&timers, MS(100)), 1);
+	assert_int_equal(timer_heap_next(&timers, &deadline), -ENOENT);
+
+	/* delay and interval 0 disarm, rearming works on the same id */
+	assert_null(timer_heap_mod(&timers, MS(100), 1, 5, 0));
+	assert_null(timer_heap_next(&timers, &deadline));
+	assert_true(deadline == MS(105));
+	assert_null(timer_heap_mod(&timers, MS(100), 1, 0, 0));
+	assert_int_equal(timer_heap_next(&timers, &deadline), -ENOENT);
+
+	assert_null(timer_heap_del(&timers, 0));
+	assert_int_equal(timer_heap_del(&timers, 0), -ENOENT);
+	assert_int_equal(timer_heap_mod(&timers, 0, 0, 1, 0), -ENOENT);
+
+	timer_heap_destroy(&timers);
+}
+
+static void test_timer_heap_periodic(void **state)
+{
+	struct timer_heap timers;
+	struct timer_ctx ctx;
+	struct garden_timer_stats stats;
+	uint64_t deadline;
+	int id;
+
+	memset(&ctx, 0, sizeof(ctx));
+
+	assert_null(timer_heap_init(&timers));
+	id = timer_heap_add(&timers, 0, 0, 100, count_run, &ctx);
+	assert_true(id >= 0);
+
+	/* late runs do not shift later deadlines */
+	assert_int_equal(timer_heap_expire(&timers, MS(103)), 1);
+	assert_null(timer_heap_next(&timers, &deadline));
+	assert_true(deadline == MS(200));
+
+	assert_int_equal(timer_heap_expire(&timers, MS(201)), 1);
+	assert_null(timer_heap_next(&timers, &deadline));
+	assert_true(deadline == MS(300));
+
+	/* more than one interval late skips the missed periods */
+	assert_int_equal(timer_heap_expire(&timers, MS(555)), 1);
+	assert_null(timer_heap_next(&timers, &deadline));
+	assert_true(deadline == MS(600));
+	assert_int_equal(ctx.runs, 3);
+
+	assert_null(timer_heap_stats(&timers, id, &stats));
+	assert_int_equal(stats.runs, 3);
+	assert_int_equal(stats.overruns, 2);
+	assert_int_equal(stats.lateness_last_us, 255000);
+	assert_int_equal(stats.lateness_max_us, 255000);
+	assert_int_equal(stats.lateness_mean_us, 86333);
+
+	assert_int_equal(timer_heap_stats(&timers, id + 1, &stats), -ENOENT);
+
+	timer_heap_destroy(&timers);
+}
+
+static void test_timer_heap_del_in_cb(void **state)
+{
+	struct timer_heap timers;
+	struct timer_ctx ctx[2];
+	uint64_t deadline;
+	int i;
+
+	memset(ctx, 0, sizeof(ctx));
+	ctx[0].timers = &timers;
+	ctx[1].timers = &timers;
+
+	assert_null(timer_heap_init(&timers));
+
+	/* enough jobs to grow the heap */
+	for (i = 0; i < 20; ++i)
+		assert_int_equal(timer_heap_add(&timers, 0, 50 + i, 0, count_run,
+						&ctx[1]), i);
+
+	ctx[0].del_id = timer_heap_add(&timers, 0, 10, 10, del_run, &ctx[0]);
+
+	/* a callback deleting itself and one deleting another job */
+	assert_int_equal(timer_heap_expire(&timers, MS(10)), 1);
+	assert_int_equal(timer_heap_del(&timers, ctx[0].del_id), -ENOENT);
+
+	assert_null(timer_heap_del(&timers, 5));
+	assert_int_equal(timer_heap_expire(&timers, MS(100)), 19);
+	assert_int_equal(ctx[1].runs, 19);
+	assert_int_equal(timer_heap_next(&timers, &deadline), -ENOENT);
+
+	timer_heap_destroy(&timers);
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_timer_heap_order),
+		cmocka_unit_test(test_timer_heap_periodic),
+		cmocka_unit_test(test_timer_heap_del_in_cb),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
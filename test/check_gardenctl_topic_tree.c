@@ -0,0 +1,138 @@
+/*
+ * check_gardenctl_topic_tree.c
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <topic_tree.h>
+
+static int count_match(void *obj, void *ctx)
+{
+	int *hits = (int*)ctx;
+
+	hits[(long)obj]++;
+
+	return 0;
+}
+
+static int fail_match(void *obj, void *ctx)
+{
+	return -EIO;
+}
+
+static void test_topic_filter_valid(void **state)
+{
+	assert_true(topic_filter_is_valid("/garden/tap"));
+	assert_true(topic_filter_is_valid("/garden/+"));
+	assert_true(topic_filter_is_valid("/garden/#"));
+	assert_true(topic_filter_is_valid("+/+/tap"));
+	assert_true(topic_filter_is_valid("#"));
+
+	assert_false(topic_filter_is_valid(NULL));
+	assert_false(topic_filter_is_valid(""));
+	assert_false(topic_filter_is_valid("/garden/ta+"));
+	assert_false(topic_filter_is_valid("/garden/#/tap"));
+	assert_false(topic_filter_is_valid("/garden/tap#"));
+}
+
+static void test_topic_tree_add(void **state)
+{
+	struct topic_tree tree;
+
+	assert_int_equal(topic_tree_add(NULL, "/garden/tap", NULL), -EINVAL);
+
+	assert_null(topic_tree_init(&tree));
+	assert_int_equal(topic_tree_add(&tree, "/garden/#/tap", NULL), -EINVAL);
+	assert_null(topic_tree_add(&tree, "/garden/tap", NULL));
+	assert_null(topic_tree_add(&tree, "/garden/tap", NULL));
+	assert_null(topic_tree_add(&tree, "/garden/+", NULL));
+	assert_int_equal(tree.count, 3);
+
+	topic_tree_destroy(&tree);
+	assert_null(tree.root);
+}
+
+static void test_topic_tree_match(void **state)
+{
+	struct topic_tree tree;
+	int hits[6];
+
+	assert_null(topic_tree_init(&tree));
+	assert_null(topic_tree_add(&tree, "/garden/tap", (void*)0));
+	assert_null(topic_tree_add(&tree, "/garden/water", (void*)1));
+	assert_null(topic_tree_add(&tree, "/garden/light/+", (void*)2));
+	assert_null(topic_tree_add(&tree, "/garden/#", (void*)3));
+	assert_null(topic_tree_add(&tree, "#", (void*)4));
+	assert_null(topic_tree_add(&tree, "garden/tap", (void*)5));
+
+	memset(hits, 0, sizeof(hits));
+	assert_int_equal(topic_tree_match(&tree, "/garden/tap", count_match, hits), 3);
+	assert_int_equal(hits[0], 1);
+	assert_int_equal(hits[1], 0);
+	assert_int_equal(hits[3], 1);
+	assert_int_equal(hits[4], 1);
+	assert_int_equal(hits[5], 0);
+
+	memset(hits, 0, sizeof(hits));
+	assert_int_equal(topic_tree_match(&tree, "/garden/light/tree", count_match, hits), 3);
+	assert_int_equal(hits[2], 1);
+
+	/* "+" covers exactly one level */
+	memset(hits, 0, sizeof(hits));
+	assert_int_equal(topic_tree_match(&tree, "/garden/light/tree/x", count_match, hits), 2);
+	assert_int_equal(hits[2], 0);
+
+	/* "#" matches the parent level as well */
+	memset(hits, 0, sizeof(hits));
+	assert_int_equal(topic_tree_match(&tree, "/garden", count_match, hits), 2);
+	assert_int_equal(hits[3], 1);
+
+	/* wildcards on the first level never match $ topics */
+	memset(hits, 0, sizeof(hits));
+	assert_int_equal(topic_tree_match(&tree, "$SYS/broker", count_match, hits), 0);
+
+	memset(hits, 0, sizeof(hits));
+	assert_int_equal(topic_tree_match(&tree, "garden/tap", count_match, hits), 2);
+	assert_int_equal(hits[5], 1);
+
+	assert_int_equal(topic_tree_match(&tree, "/garden/tap", fail_match, NULL), -EIO);
+	assert_int_equal(topic_tree_match(&tree, NULL, count_match, hits), -EINVAL);
+
+	topic_tree_destroy(&tree);
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_topic_filter_valid),
+		cmocka_unit_test(test_topic_tree_add),
+		cmocka_unit_test(test_topic_tree_match),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,243 @@
+/*
+ * check_gardenctl_tsdb.c
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <tsdb.h>
+
+#define POINTS 1000
+
+static int setup_dir(void **state)
+{
+	char *dir = strdup("/tmp/check_tsdb.XXXXXX");
+
+	if (!dir || !mkdtemp(dir)) {
+		free(dir);
+		return -1;
+	}
+
+	*state = dir;
+
+	return 0;
+}
+
+static int count_files(const char *path)
+{
+	DIR *dir = opendir(path);
+	struct dirent *de;
+	int count = 0;
+
+	if (!dir)
+		return -1;
+
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] != '.')
+			++count;
+	}
+
+	closedir(dir);
+
+	return count;
+}
+
+static int teardown_dir(void **state)
+{
+	char *path = (char*)*state;
+	char file[512];
+	DIR *dir = opendir(path);
+	struct dirent *de;
+
+	while (dir && (de = readdir(dir))) {
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(file, sizeof(file), "%s/%s", path, de->d_name);
+		unlink(file);
+	}
+
+	if (dir)
+		closedir(dir);
+	rmdir(path);
+	free(path);
+
+	return 0;
+}
+
+static double sample(int i)
+{
+	return 20.0 + (i % 10) * 0.1;
+}
+
+static void append_points(struct tsdb *db, int id, int first, int count)
+{
+	int i;
+
+	for (i = first; i < first + count; ++i)
+		assert_null(tsdb_append(db, id, (int64_t)i * 1000, sample(i)));
+}
+
+static void test_tsdb_varint(void **state)
+{
+	const uint64_t values[] = { 0, 1, 127, 128, 300, 1ULL << 35, UINT64_MAX };
+	uint8_t buf[10];
+	uint64_t v;
+	size_t i, len;
+
+	for (i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+		len = tsdb_put_varint(buf, values[i]);
+		assert_int_equal(tsdb_get_varint(buf, len, &v), len);
+		assert_true(v == values[i]);
+	}
+
+	assert_int_equal(tsdb_put_varint(buf, 127), 1);
+	assert_int_equal(tsdb_put_varint(buf, 128), 2);
+	assert_int_equal(tsdb_put_varint(buf, UINT64_MAX), 10);
+
+	/* a torn varint is not taken */
+	assert_int_equal(tsdb_get_varint(buf, 9, &v), -EINVAL);
+}
+
+static void test_tsdb_query(void **state)
+{
+	const char *dir = (const char*)*state;
+	struct tsdb db;
+	struct tsdb_point points[2 * POINTS];
+	int id, i;
+
+	assert_null(tsdb_open(&db, dir, 4));
+	assert_int_equal(tsdb_series(&db, "../temp", 1), -EINVAL);
+	assert_int_equal(tsdb_series(&db, "temp", TSDB_DECIMALS_MAX + 1), -EINVAL);
+	assert_int_equal(tsdb_find(&db, "temp"), -ENOENT);
+
+	id = tsdb_series(&db, "temp", 1);
+	assert_int_equal(id, 0);
+	assert_int_equal(tsdb_series(&db, "temp", 1), id);
+	assert_int_equal(tsdb_find(&db, "temp"), id);
+	assert_int_equal(tsdb_query(&db, id, 0, 1000, 0, points, POINTS), 0);
+	assert_int_equal(tsdb_append(&db, id, 0, 0.0 / 0.0), -ERANGE);
+
+	append_points(&db, id, 0, POINTS);
+
+	/* the records span several blocks */
+	assert_true(db.series[id].tail->blocks > 1);
+
+	assert_int_equal(tsdb_query(&db, id, 0, INT64_MAX, 0, points, 2 * POINTS), POINTS);
+	for (i = 0; i < POINTS; ++i) {
+		assert_true(points[i].time_ms == (int64_t)i * 1000);
+		assert_true(points[i].value > sample(i) - 0.01 &&
+			    points[i].value < sample(i) + 0.01);
+	}
+
+	assert_int_equal(tsdb_query(&db, id, 100000, 199999, 0, points, POINTS), 100);
+	assert_true(points[0].time_ms == 100000);
+	assert_true(points[99].time_ms == 199000);
+
+	/* buckets of 10 samples have the mean of a cycle */
+	assert_int_equal(tsdb_query(&db, id, 500000, 999999, 10000, points, POINTS), 50);
+	for (i = 0; i < 50; ++i) {
+		assert_true(points[i].time_ms == 500000 + (int64_t)i * 10000);
+		assert_true(points[i].value > 20.44 && points[i].value < 20.46);
+	}
+
+	assert_int_equal(tsdb_query(&db, id, 0, INT64_MAX, 0, points, 5), 5);
+	assert_true(points[4].time_ms == 4000);
+	assert_int_equal(tsdb_query(&db, id, 10, 0, 0, points, 5), -EINVAL);
+
+	tsdb_close(&db);
+}
+
+static void test_tsdb_reopen(void **state)
+{
+	const char *dir = (const char*)*state;
+	struct tsdb db;
+	struct tsdb_point points[2 * POINTS];
+	int id;
+
+	assert_null(tsdb_open(&db, dir, 4));
+	id = tsdb_series(&db, "temp", 1);
+	append_points(&db, id, 0, POINTS);
+	tsdb_close(&db);
+
+	/* the last block is continued */
+	assert_null(tsdb_open(&db, dir, 4));
+	id = tsdb_series(&db, "temp", 1);
+	assert_true(id >= 0);
+	append_points(&db, id, POINTS, 10);
+
+	assert_int_equal(tsdb_query(&db, id, 0, INT64_MAX, 0, points, 2 * POINTS),
+			 POINTS + 10);
+	assert_true(points[POINTS + 9].time_ms == (int64_t)(POINTS + 9) * 1000);
+	assert_int_equal(count_files(dir), 1);
+	tsdb_close(&db);
+
+	/* other decimals go to a new segment, the old one is still read */
+	assert_null(tsdb_open(&db, dir, 4));
+	id = tsdb_series(&db, "temp", 2);
+	append_points(&db, id, POINTS + 10, 10);
+	assert_int_equal(count_files(dir), 2);
+	assert_int_equal(tsdb_query(&db, id, 0, INT64_MAX, 0, points, 2 * POINTS),
+			 POINTS + 20);
+	tsdb_close(&db);
+}
+
+static void test_tsdb_retention(void **state)
+{
+	const char *dir = (const char*)*state;
+	struct tsdb db;
+	struct tsdb_point point;
+	int id;
+
+	assert_null(tsdb_open(&db, dir, 2));
+	id = tsdb_series(&db, "barrel", 0);
+
+	/* a segment takes about 21000 records of 3 bytes */
+	append_points(&db, id, 0, 50 * POINTS);
+
+	assert_int_equal(count_files(dir), 2);
+	assert_int_equal(db.series[id].first_seq, 2);
+	assert_int_equal(db.series[id].last_seq, 3);
+
+	assert_int_equal(tsdb_query(&db, id, 0, INT64_MAX, 0, &point, 1), 1);
+	assert_true(point.time_ms > 0);
+
+	tsdb_close(&db);
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_tsdb_varint),
+		cmocka_unit_test_setup_teardown(test_tsdb_query, setup_dir, teardown_dir),
+		cmocka_unit_test_setup_teardown(test_tsdb_reopen, setup_dir, teardown_dir),
+		cmocka_unit_test_setup_teardown(test_tsdb_retention, setup_dir, teardown_dir),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -25,6 +25,7 @@
 #include <errno.h>
 #include <string.h>
 
+#include <linux/i2c.h>
 #include <linux/i2c-dev.h>
 
 #include <stdarg.h>
@@ -36,6 +37,17 @@
 
 #include "garden_common.h"
 
+/* negative mock values are errno values, the syscalls fail like libc */
+static int mock_syscall_ret(int ret)
+{
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+
+	return ret;
+}
+
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wint-to-pointer-cast"
 static int check_pathname(const LargestIntegralType value, const LargestIntegralType data)
@@ -58,7 +70,27 @@ int __wrap_open(const char *pathname, int flags)
 
 	check_expected(pathname);
 
-	return fd;
+	return mock_syscall_ret(fd);
+}
+
+static int mock_i2c_rdwr(struct i2c_rdwr_ioctl_data *data)
+{
+	uint32_t nmsgs = data->nmsgs;
+	uint32_t i;
+
+	check_expected(nmsgs);
+
+	for (i = 0; i < nmsgs; ++i) {
+		uint16_t msg_addr = data->msgs[i].addr;
+		uint8_t msg_value = data->msgs[i].buf[0];
+
+		assert_int_equal(data->msgs[i].flags, 0);
+		assert_int_equal(data->msgs[i].len, 1);
+		check_expected(msg_addr);
+		check_expected(msg_value);
+	}
+
+	return mock_type(int);
 }
 
 int __wrap_ioctl(int fd, unsigned long request, ...)
@@ -67,13 +99,24 @@ int __wrap_ioctl(int fd, unsigned long request, ...)
 
 	check_expected(request);
 
+	if (request == I2C_RDWR) {
+		struct i2c_rdwr_ioctl_data *data;
+
+		va_start(vl, request);
+		data = va_arg(vl, struct i2c_rdwr_ioctl_data*);
+		va_end(vl);
+
+		return mock_syscall_ret(mock_i2c_rdwr(data));
+	}
+
 	va_start(vl, request);
 	uint8_t addr = (uint8_t)va_arg(vl, int);
 	va_end(vl);
 
 	assert_in_range(addr, 0x3, 0x77);
+	check_expected(addr);
 
-	return mock_type(int);
+	return mock_syscall_ret(mock_type(int));
 }
 
 ssize_t __wrap_read(int fd, void *buf, size_t count)
@@ -82,7 +125,7 @@ ssize_t __wrap_read(int fd, void *buf, size_t count)
 
 	check_expected(count);
 	memcpy(buf, data, count);
-	return mock_type(int);
+	return mock_syscall_ret(mock_type(int));
 }
 
 ssize_t __wrap_write(int fd, const void *buf, size_t count)
@@ -98,40 +141,81 @@ int __wrap_close(int fd)
 	return 0;
 }
 
-void mock_i2c_prepare_write(int ret_open, int ret_ioctl, const char *wbuf,
-			    size_t wbuf_size, int ret_write)
+/* bus state the code under test is expected to have cached */
+static int mock_bus_open;
+static int mock_bus_addr = -1;
+
+void mock_i2c_reset(void)
+{
+	mock_bus_open = 0;
+	mock_bus_addr = -1;
+}
+
+static int mock_i2c_prepare_open(int ret_open)
+{
+	if (!mock_bus_open) {
+		will_return(__wrap_open, ret_open);
+		expect_check(__wrap_open, pathname, check_pathname,
+			     strdup("/dev/i2c-[0-1]"));
+		if (ret_open < 0)
+			return ret_open;
+
+		mock_bus_open = 1;
+		mock_bus_addr = -1;
+	}
+
+	return 0;
+}
+
+static int mock_i2c_prepare_bus(uint8_t addr, int ret_open, int ret_ioctl)
 {
-	will_return(__wrap_open, ret_open);
-	expect_check(__wrap_open, pathname, check_pathname,
-		     strdup("/dev/i2c-[0-1]"));
-	if (ret_open < 0)
-		return;
+	int ret = mock_i2c_prepare_open(ret_open);
 
-	expect_value(__wrap_ioctl, request, I2C_SLAVE);
-	will_return(__wrap_ioctl, ret_ioctl);
-	if (ret_ioctl < 0)
-		return;
+	if (ret)
+		return ret;
+
+	if (mock_bus_addr != addr) {
+		expect_value(__wrap_ioctl, request, I2C_SLAVE);
+		expect_value(__wrap_ioctl, addr, addr);
+		will_return(__wrap_ioctl, ret_ioctl);
+		if (ret_ioctl < 0) {
+			mock_bus_addr = -1;
+			return ret_ioctl;
+		}
+
+		mock_bus_addr = addr;
+	}
 
-	expect_value(__wrap_write, count, 1);
-	expect_memory(__wrap_write, buf, wbuf, wbuf_size);
-	will_return(__wrap_write, ret_write);
+	return 0;
 }
 
-void mock_i2c_prepare_read(int ret_open, int ret_ioctl, const char *rbuf,
-			   int ret_read)
+void mock_i2c_prepare_rdwr(int ret_open, const struct mock_i2c_msg *msgs,
+			   int nmsgs, int ret_ioctl)
 {
-	will_return(__wrap_open, ret_open);
-	expect_check(__wrap_open, pathname, check_pathname,
-		     strdup("/dev/i2c-[0-1]"));
-	if (ret_open < 0)
+	int i;
+
+	if (mock_i2c_prepare_open(ret_open))
 		return;
 
-	expect_value(__wrap_ioctl, request, I2C_SLAVE);
-	will_return(__wrap_ioctl, ret_ioctl);
-	if (ret_ioctl < 0)
+	expect_value(__wrap_ioctl, request, I2C_RDWR);
+	expect_value(mock_i2c_rdwr, nmsgs, nmsgs);
+	for (i = 0; i < nmsgs; ++i) {
+		expect_value(mock_i2c_rdwr, msg_addr, msgs[i].addr);
+		expect_value(mock_i2c_rdwr, msg_value, msgs[i].value);
+	}
+	will_return(mock_i2c_rdwr, ret_ioctl);
+}
+
+void mock_i2c_prepare_read(uint8_t addr, int ret_open, int ret_ioctl,
+			   const char *rbuf, int ret_read)
+{
+	if (mock_i2c_prepare_bus(addr, ret_open, ret_ioctl))
 		return;
 
 	expect_value(__wrap_read, count, 1);
 	will_return(__wrap_read, rbuf);
 	will_return(__wrap_read, ret_read);
+
+	if (ret_read <= 0)
+		mock_bus_addr = -1;
 }
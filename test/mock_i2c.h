@@ -22,11 +22,21 @@
 #ifndef __MOCK_I2C_H__
 #define __MOCK_I2C_H__
 
-void mock_i2c_prepare_write(int ret_open, int ret_ioctl, const char *wbuf,
-			    size_t wbuf_size, int ret_write);
+#include <stdint.h>
 
+/* the next prepared access expects the bus to be opened again */
+void mock_i2c_reset(void);
 
-void mock_i2c_prepare_read(int ret_open, int ret_ioctl, const char *rbuf,
-			   int ret_read);
+struct mock_i2c_msg {
+	uint8_t addr;
+	uint8_t value;
+};
+
+/* one I2C_RDWR ioctl writing msgs in order, it returns ret_ioctl */
+void mock_i2c_prepare_rdwr(int ret_open, const struct mock_i2c_msg *msgs,
+			   int nmsgs, int ret_ioctl);
+
+void mock_i2c_prepare_read(uint8_t addr, int ret_open, int ret_ioctl,
+			   const char *rbuf, int ret_read);
 
 #endif /*__MOCK_I2C_H__*/
@@ -30,20 +30,38 @@ void *__real_malloc(size_t size);
 void *__real_calloc(size_t nmemb, size_t size);
 void __real_free(void *ptr);
 
+static int passthrough;
+
+void mock_malloc_passthrough(int enable)
+{
+	passthrough = enable;
+}
+
 void *__wrap_malloc(size_t size)
 {
+	if (passthrough)
+		return __real_malloc(size);
+
 	check_expected(size);
 	return mock_ptr_type(void *);
 }
 
 void *__wrap_calloc(size_t nmemb, size_t size)
 {
+	if (passthrough)
+		return __real_calloc(nmemb, size);
+
 	check_expected(size);
 	return mock_ptr_type(void *);
 }
 
 void __wrap_free(void *ptr)
 {
+	if (passthrough) {
+		__real_free(ptr);
+		return;
+	}
+
 	check_expected_ptr(ptr);
 	__real_free(ptr);
 }
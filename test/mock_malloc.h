@@ -25,5 +25,7 @@
 #include <stdlib.h>
 
 void mock_calloc(size_t exp_size, size_t alloc_size);
+/* allocations of code under test that are not checked, e.g. of a topic tree */
+void mock_malloc_passthrough(int enable);
 
 #endif /*__MOCK_MALLOC_H__*/
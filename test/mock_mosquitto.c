@@ -0,0 +1,83 @@
+/*
+ * mock_mosquitto.c
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <mosquitto.h>
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "mock_mosquitto.h"
+
+struct mock_mqtt_msg mock_mqtt_sent[MOCK_MQTT_SENT_MAX];
+int mock_mqtt_sent_count;
+int mock_mqtt_broker_down;
+
+int mosquitto_publish(struct mosquitto *mosq, int *mid, const char *topic,
+		      int payloadlen, const void *payload, int qos, bool retain)
+{
+	struct mock_mqtt_msg *msg;
+
+	if (mock_mqtt_broker_down)
+		return MOSQ_ERR_NO_CONN;
+
+	if (mid)
+		*mid = mock_mqtt_sent_count;
+
+	if (mock_mqtt_sent_count < MOCK_MQTT_SENT_MAX) {
+		msg = &mock_mqtt_sent[mock_mqtt_sent_count];
+		snprintf(msg->topic, sizeof(msg->topic), "%s", topic);
+		snprintf(msg->payload, sizeof(msg->payload), "%.*s",
+			 payloadlen, (const char*)payload);
+		msg->qos = qos;
+		msg->retain = retain;
+	}
+	++mock_mqtt_sent_count;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+const char *mosquitto_strerror(int mosq_errno)
+{
+	return "mock";
+}
+
+void mock_mqtt_reset(void)
+{
+	mock_mqtt_sent_count = 0;
+	mock_mqtt_broker_down = 0;
+}
+
+static void mock_on_stop(void *obj)
+{
+	reactor_stop((struct reactor*)obj);
+}
+
+void mock_run_ms(struct reactor *reactor, unsigned int ms)
+{
+	int timer = reactor_timer_add(reactor, ms, 0, mock_on_stop, reactor);
+
+	assert_true(timer >= 0);
+	assert_null(reactor_run(reactor));
+	reactor_timer_del(reactor, timer);
+}
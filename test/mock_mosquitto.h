@@ -0,0 +1,48 @@
+/*
+ * mock_mosquitto.h
+ * This file is a part of gardenctl
+ *
+ * Copyright (C) 2018 Andreas Schmidt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __MOCK_MOSQUITTO_H__
+#define __MOCK_MOSQUITTO_H__
+
+#include <stdbool.h>
+
+#include <reactor.h>
+
+#define MOCK_MQTT_SENT_MAX 256
+
+/* messages handed to mosquitto */
+struct mock_mqtt_msg {
+	char topic[64];
+	char payload[16];
+	int qos;
+	bool retain;
+};
+
+extern struct mock_mqtt_msg mock_mqtt_sent[MOCK_MQTT_SENT_MAX];
+extern int mock_mqtt_sent_count;
+/* mosquitto_publish() fails with MOSQ_ERR_NO_CONN while set */
+extern int mock_mqtt_broker_down;
+
+void mock_mqtt_reset(void);
+/* serves the events of ms milliseconds */
+void mock_run_ms(struct reactor *reactor, unsigned int ms);
+
+#endif /*__MOCK_MOSQUITTO_H__*/